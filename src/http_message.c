@@ -1,5 +1,6 @@
 #include <ctype.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "http_message.h"
 
@@ -64,6 +65,42 @@ static int on_header_value(llhttp_t* p, cstr at, size_t l);
  */
 static int on_body(llhttp_t* p, cstr at, size_t l);
 
+/**
+ * @brief Records a borrowed header span for a header field or value.
+ * @param req The HTTP message.
+ * @param at Pointer to the data.
+ * @param l Length of the data.
+ * @param value True for header value, false for header field.
+ */
+static void borrow_header(vws_http_msg* req, cstr at, size_t l, bool value);
+
+/**
+ * @brief Lowercases and null-terminates borrowed headers in place.
+ * @param req The HTTP message.
+ */
+static void terminate_headers(vws_http_msg* req);
+
+/**
+ * @brief Returns the reason phrase for a response status code.
+ * @param status The status code.
+ * @return The reason phrase, empty if the code is not known.
+ */
+static cstr status_reason(uint16_t status);
+
+/**
+ * @brief Parser settings. Every parser shares this one instance.
+ */
+static llhttp_settings_t http_settings =
+{
+    .on_message_begin    = on_message_begin,
+    .on_url              = on_url,
+    .on_header_field     = on_header_field,
+    .on_header_value     = on_header_value,
+    .on_headers_complete = on_headers_complete,
+    .on_body             = on_body,
+    .on_message_complete = on_message_complete
+};
+
 //------------------------------------------------------------------------------
 // HTTP Request
 //------------------------------------------------------------------------------
@@ -107,7 +144,7 @@ vws_http_msg* vws_http_msg_new(int mode)
 {
     vws_http_msg* req     = vws.malloc(sizeof(vws_http_msg));
     req->parser           = vws.malloc(sizeof(llhttp_t));
-    req->settings         = vws.malloc(sizeof(llhttp_settings_t));
+    req->settings         = &http_settings;
     req->url              = vws_buffer_new();
     req->body             = vws_buffer_new();
     req->field            = vws_buffer_new();
@@ -115,16 +152,12 @@ vws_http_msg* vws_http_msg_new(int mode)
     req->headers_complete = false;
     req->done             = false;
     req->headers          = vws_kvs_new(10, false); // Case-insensitive headers
-
-    llhttp_settings_init(req->settings);
-
-    req->settings->on_message_begin     = on_message_begin;
-    req->settings->on_headers_complete  = on_headers_complete;
-    req->settings->on_message_complete  = on_message_complete;
-    req->settings->on_url               = on_url;
-    req->settings->on_header_field      = on_header_field;
-    req->settings->on_header_value      = on_header_value;
-    req->settings->on_body              = on_body;
+    req->borrow           = false;
+    req->spans            = NULL;
+    req->nspans           = 0;
+    req->spans_allocated  = 0;
+    req->origin           = NULL;
+    req->consumed         = 0;
 
     llhttp_init(req->parser, mode, req->settings);
     req->parser->data = req;
@@ -144,11 +177,166 @@ void vws_http_msg_free(vws_http_msg* req)
     vws_buffer_free(req->body);
     vws_buffer_free(req->field);
     vws_buffer_free(req->value);
+    vws.free(req->spans);
     vws.free(req->parser);
-    vws.free(req->settings);
     vws.free(req);
 }
 
+void vws_http_msg_reset(vws_http_msg* req)
+{
+    // Keep buffer storage, except for the body which may be large
+    req->url->size        = 0;
+    req->field->size      = 0;
+    req->value->size      = 0;
+    req->headers_complete = false;
+    req->done             = false;
+    req->nspans           = 0;
+    req->origin           = NULL;
+    req->consumed         = 0;
+
+    vws_buffer_clear(req->body);
+    vws_kvs_clear(req->headers);
+    llhttp_reset(req->parser);
+}
+
+cstr vws_http_msg_header(vws_http_msg* req, cstr name)
+{
+    if (req->borrow == false)
+    {
+        return vws_kvs_get_cstring(req->headers, name);
+    }
+
+    if (req->headers_complete == false)
+    {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < req->nspans; i++)
+    {
+        vws_http_span* span = &req->spans[i];
+        cstr field          = req->origin + span->field;
+        size_t j            = 0;
+
+        // Field names are lowercase
+        while ((field[j] != 0) && (field[j] == tolower((uint8_t)name[j])))
+        {
+            j++;
+        }
+
+        if ((field[j] == 0) && (name[j] == 0))
+        {
+            return req->origin + span->value;
+        }
+    }
+
+    return NULL;
+}
+
+void vws_http_msg_detach(vws_http_msg* req)
+{
+    if (req->borrow == false)
+    {
+        return;
+    }
+
+    if (req->headers_complete == true)
+    {
+        for (size_t i = 0; i < req->nspans; i++)
+        {
+            vws_http_span* span = &req->spans[i];
+            cstr field          = req->origin + span->field;
+            cstr value          = req->origin + span->value;
+
+            vws_kvs_set_cstring(req->headers, field, value);
+        }
+    }
+
+    req->borrow = false;
+    req->nspans = 0;
+    req->origin = NULL;
+}
+
+void borrow_header(vws_http_msg* req, cstr at, size_t l, bool value)
+{
+    // Trailers follow data the caller has already let go of
+    if (req->headers_complete == true)
+    {
+        return;
+    }
+
+    size_t offset       = at - req->origin;
+    vws_http_span* last = NULL;
+
+    if (req->nspans > 0)
+    {
+        last = &req->spans[req->nspans - 1];
+    }
+
+    if (value == true)
+    {
+        // Data split across parse calls arrives in pieces. They are adjacent
+        // as the caller keeps the message contiguous.
+        if (last->value_size == 0)
+        {
+            last->value = offset;
+        }
+
+        last->value_size += l;
+
+        return;
+    }
+
+    // Continuation of the current field name
+    if ( (last != NULL) && (last->value_size == 0) &&
+         (last->field + last->field_size == offset) )
+    {
+        last->field_size += l;
+
+        return;
+    }
+
+    if (req->nspans == req->spans_allocated)
+    {
+        size_t n = (req->spans_allocated == 0) ? 16 : req->spans_allocated * 2;
+
+        req->spans           = vws.realloc(req->spans, n * sizeof(*req->spans));
+        req->spans_allocated = n;
+    }
+
+    last             = &req->spans[req->nspans++];
+    last->field      = offset;
+    last->field_size = l;
+    last->value      = 0;
+    last->value_size = 0;
+}
+
+void terminate_headers(vws_http_msg* req)
+{
+    for (size_t i = 0; i < req->nspans; i++)
+    {
+        vws_http_span* span = &req->spans[i];
+        char* field         = req->origin + span->field;
+
+        for (size_t j = 0; j < span->field_size; j++)
+        {
+            field[j] = tolower((uint8_t)field[j]);
+        }
+
+        // Overwrites the colon. An empty value shares this terminator.
+        field[span->field_size] = 0;
+
+        if (span->value_size == 0)
+        {
+            span->value = span->field + span->field_size;
+        }
+        else
+        {
+            // Overwrites the CR or trailing whitespace
+            req->origin[span->value + span->value_size] = 0;
+        }
+    }
+}
+
 int on_message_begin(llhttp_t* p)
 {
     return 0;
@@ -156,11 +344,19 @@ int on_message_begin(llhttp_t* p)
 
 int on_headers_complete(llhttp_t* p)
 {
-    vws_http_msg* req     = p->data;
-    req->headers_complete = true;
+    vws_http_msg* req = p->data;
 
-    // Process final header, if any.
-    process_header(req);
+    if (req->borrow == true)
+    {
+        terminate_headers(req);
+    }
+    else
+    {
+        // Process final header, if any.
+        process_header(req);
+    }
+
+    req->headers_complete = true;
 
     return 0;
 }
@@ -186,6 +382,13 @@ int on_header_field(llhttp_t* p, cstr at, size_t l)
 {
     vws_http_msg* req = p->data;
 
+    if (req->borrow == true)
+    {
+        borrow_header(req, at, l, false);
+
+        return 0;
+    }
+
     process_header(req);
 
     // Start new field
@@ -197,6 +400,14 @@ int on_header_field(llhttp_t* p, cstr at, size_t l)
 int on_header_value(llhttp_t* p, cstr at, size_t l)
 {
     vws_http_msg* req = p->data;
+
+    if (req->borrow == true)
+    {
+        borrow_header(req, at, l, true);
+
+        return 0;
+    }
+
     vws_buffer_append(req->value, (ucstr)at, l);
 
     return 0;
@@ -212,6 +423,12 @@ int on_body(llhttp_t* p, cstr at, size_t l)
 
 int vws_http_msg_parse(vws_http_msg* req, cstr data, size_t size)
 {
+    // Borrowed headers are located relative to the start of the message
+    if ((req->borrow == true) && (req->headers_complete == false))
+    {
+        req->origin = (char*)data - req->consumed;
+    }
+
     enum llhttp_errno rc = llhttp_execute(req->parser, data, size);
 
     if (rc != HPE_OK)
@@ -248,14 +465,143 @@ int vws_http_msg_parse(vws_http_msg* req, cstr data, size_t size)
         // another request, or data from from UPGRADE, then there can be
         // additional data
 
-        return llhttp_get_error_pos(req->parser) - data;
+        size_t n       = llhttp_get_error_pos(req->parser) - data;
+        req->consumed += n;
+
+        return n;
     }
 
     // The HTTP message is not completely parsed and therefore all data provided
     // was consumed in message parsing.
+    req->consumed += size;
+
     return size;
 }
 
+bool vws_http_msg_keep_alive(vws_http_msg* m)
+{
+    return llhttp_should_keep_alive(m->parser) != 0;
+}
+
+cstr status_reason(uint16_t status)
+{
+    switch (status)
+    {
+        case 100: return "Continue";
+        case 101: return "Switching Protocols";
+        case 200: return "OK";
+        case 201: return "Created";
+        case 202: return "Accepted";
+        case 204: return "No Content";
+        case 206: return "Partial Content";
+        case 301: return "Moved Permanently";
+        case 302: return "Found";
+        case 303: return "See Other";
+        case 304: return "Not Modified";
+        case 307: return "Temporary Redirect";
+        case 308: return "Permanent Redirect";
+        case 400: return "Bad Request";
+        case 401: return "Unauthorized";
+        case 403: return "Forbidden";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 408: return "Request Timeout";
+        case 409: return "Conflict";
+        case 411: return "Length Required";
+        case 412: return "Precondition Failed";
+        case 413: return "Content Too Large";
+        case 414: return "URI Too Long";
+        case 415: return "Unsupported Media Type";
+        case 416: return "Range Not Satisfiable";
+        case 426: return "Upgrade Required";
+        case 429: return "Too Many Requests";
+        case 500: return "Internal Server Error";
+        case 501: return "Not Implemented";
+        case 502: return "Bad Gateway";
+        case 503: return "Service Unavailable";
+        case 504: return "Gateway Timeout";
+        default:  return "";
+    }
+}
+
+void vws_http_response( vws_buffer* b,
+                        uint16_t status,
+                        cstr headers,
+                        ucstr body,
+                        size_t size,
+                        bool close )
+{
+    static const char close_header[] = "Connection: close\r\n";
+
+    cstr reason  = status_reason(status);
+    size_t rsize = strlen(reason);
+    size_t hsize = (headers != NULL) ? strlen(headers) : 0;
+    size_t csize = close ? sizeof(close_header) - 1 : 0;
+
+    // 1xx and 204 responses have no body and must not send Content-Length
+    // (RFC 9110 8.6)
+    bool has_length = (status >= 200) && (status != 204);
+
+    // Content length digits, written backwards
+    char digits[24];
+    size_t dsize  = 0;
+    size_t length = size;
+
+    do
+    {
+        digits[sizeof(digits) - ++dsize] = '0' + (length % 10);
+        length /= 10;
+    }
+    while (length > 0);
+
+    // "HTTP/1.1 200 " reason CRLF "Content-Length: " digits CRLF ... CRLF
+    size_t lsize = has_length ? 16 + dsize + 2 : 0;
+    size_t bsize = ((body != NULL) && has_length) ? size : 0;
+    size_t total = 13 + rsize + 2 + lsize + csize + hsize + 2 + bsize;
+    char* p      = (char*)vws_buffer_reserve(b, total);
+
+    memcpy(p, "HTTP/1.1 ", 9);
+    p[9]  = '0' + (status / 100) % 10;
+    p[10] = '0' + (status / 10) % 10;
+    p[11] = '0' + status % 10;
+    p[12] = ' ';
+    p    += 13;
+
+    memcpy(p, reason, rsize);
+    p += rsize;
+    memcpy(p, "\r\n", 2);
+    p += 2;
+
+    if (has_length == true)
+    {
+        memcpy(p, "Content-Length: ", 16);
+        p += 16;
+        memcpy(p, digits + sizeof(digits) - dsize, dsize);
+        p += dsize;
+        memcpy(p, "\r\n", 2);
+        p += 2;
+    }
+
+    memcpy(p, close_header, csize);
+    p += csize;
+
+    if (hsize > 0)
+    {
+        memcpy(p, headers, hsize);
+        p += hsize;
+    }
+
+    memcpy(p, "\r\n", 2);
+    p += 2;
+
+    if (bsize > 0)
+    {
+        memcpy(p, body, bsize);
+    }
+
+    b->size += total;
+}
+
 uint64_t vws_http_msg_content_length(vws_http_msg* m)
 {
     return m->parser->content_length;
@@ -276,14 +622,14 @@ uint64_t vws_http_msg_errno(vws_http_msg* m)
     return llhttp_get_errno(m->parser);
 }
 
-uint8_t vws_http_msg_status_code(vws_http_msg* m)
+uint16_t vws_http_msg_status_code(vws_http_msg* m)
 {
     return llhttp_get_status_code(m->parser);
 }
 
 cstr vws_http_msg_status_string(vws_http_msg* m)
 {
-    uint8_t code = vws_http_msg_status_code(m);
+    uint16_t code = vws_http_msg_status_code(m);
 
     return (cstr)llhttp_status_name(code);
 }
@@ -8,6 +8,26 @@
 extern "C" {
 #endif
 
+/**
+ * @struct vws_http_span
+ * @brief Location of a header within parsed data, as offsets from the start of
+ *        the message.
+ */
+typedef struct vws_http_span
+{
+    /**< Offset of the field name */
+    size_t field;
+
+    /**< Length of the field name */
+    size_t field_size;
+
+    /**< Offset of the value */
+    size_t value;
+
+    /**< Length of the value */
+    size_t value_size;
+} vws_http_span;
+
 /**
  * @struct vws_http_msg
  * @brief Structure representing an HTTP request
@@ -17,7 +37,7 @@ typedef struct vws_http_msg
     /**< The parser */
     llhttp_t* parser;
 
-    /**< The parser settings */
+    /**< The parser settings. Shared by all messages, do not modify. */
     llhttp_settings_t* settings;
 
     /**< A map storing header fields. */
@@ -40,6 +60,25 @@ typedef struct vws_http_msg
 
     /** Flag indicates a complete message has been parsed. */
     bool done;
+
+    /** Flag to index headers in the parsed data rather than copy them into
+     *  headers. See vws_http_msg_header(). */
+    bool borrow;
+
+    /**< Borrowed header locations */
+    vws_http_span* spans;
+
+    /**< Number of borrowed headers */
+    size_t nspans;
+
+    /**< Capacity of spans */
+    size_t spans_allocated;
+
+    /**< Start of the message in the caller's data, as of the last parse */
+    char* origin;
+
+    /**< Bytes of the message parsed so far */
+    size_t consumed;
 } vws_http_msg;
 
 /**
@@ -65,6 +104,69 @@ int vws_http_msg_parse(vws_http_msg* req, cstr data, size_t size);
  */
 void vws_http_msg_free(vws_http_msg* req);
 
+/**
+ * @brief Resets a message so it can parse another message of the same type,
+ *        keeping its allocations for reuse.
+ * @param req The vws_http_msg instance.
+ */
+void vws_http_msg_reset(vws_http_msg* req);
+
+/**
+ * @brief Looks up a header by name, ignoring case.
+ *
+ * In borrow mode headers are not copied. The caller passes each part of the
+ * message to vws_http_msg_parse() exactly once, and keeps all of it contiguous
+ * and in place, starting at the first byte passed, until done with the
+ * headers. Once headers are complete, field names are lowercased and field
+ * names and values are null-terminated in place, so the data is modified. The
+ * returned value points into that data.
+ *
+ * @param req The vws_http_msg instance.
+ * @param name The header name.
+ * @return The value, or NULL if there is no such header.
+ */
+cstr vws_http_msg_header(vws_http_msg* req, cstr name);
+
+/**
+ * @brief Copies borrowed headers into headers, so the message no longer
+ *        references the parsed data. Does nothing for messages not in borrow
+ *        mode.
+ * @param req The vws_http_msg instance.
+ */
+void vws_http_msg_detach(vws_http_msg* req);
+
+/**
+ * @brief Checks whether the connection may be kept open after this message,
+ *        following the HTTP version and the Connection header. Valid once the
+ *        message is done.
+ * @param m Pointer to the HTTP message.
+ * @return True for keep-alive, false if the connection is to be closed.
+ */
+bool vws_http_msg_keep_alive(vws_http_msg* m);
+
+/**
+ * @brief Serializes an HTTP/1.1 response and appends it to a buffer. The size
+ *        is computed up front, so the buffer grows at most once.
+ *
+ * Content-Length is written and must not be passed in headers, except for 1xx
+ * and 204 responses, which have neither Content-Length nor body. If body is
+ * NULL, only the head is written, for a body sent separately (such as a file)
+ * or not at all (such as a response to HEAD).
+ *
+ * @param b The buffer to append to.
+ * @param status The status code. The reason phrase is derived from it.
+ * @param headers Additional header lines, each terminated by CRLF, or NULL.
+ * @param body The body, or NULL.
+ * @param size The size of the body, written as Content-Length.
+ * @param close If true, adds "Connection: close".
+ */
+void vws_http_response( vws_buffer* b,
+                        uint16_t status,
+                        cstr headers,
+                        ucstr body,
+                        size_t size,
+                        bool close );
+
 /**
  * @brief Get the content length from the HTTP message.
  *
@@ -111,9 +213,9 @@ uint64_t vws_http_msg_errno(vws_http_msg* m);
  * This function retrieves the status code of the HTTP message.
  *
  * @param m Pointer to the HTTP message.
- * @return The status code as an 8-bit unsigned integer.
+ * @return The status code as a 16-bit unsigned integer.
  */
-uint8_t vws_http_msg_status_code(vws_http_msg* m);
+uint16_t vws_http_msg_status_code(vws_http_msg* m);
 
 /**
  * @brief Get the status string of the HTTP message.
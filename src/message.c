@@ -12,13 +12,48 @@
 /**
  * @brief Parses a map from a MessagePack reader.
  *
- * The function reads from the reader and populates the provided map.
+ * The function reads from the reader and populates the provided map. Keys may
+ * be either strings or registered schema ids (see VM_SCHEMA_KEYS).
  *
  * @param reader The MessagePack reader from which to parse the map.
  * @param map The map to populate with parsed key-value pairs.
+ * @param schema Set to true if any schema id keys were encountered.
  * @return True if the parsing was successful, false otherwise.
  */
-static bool msg_parse_map(mpack_reader_t* reader, vws_kvs* map);
+static bool msg_parse_map(mpack_reader_t* reader, vws_kvs* map, bool* schema);
+
+/**
+ * @brief Writes a routing/header map key to a MessagePack writer.
+ *
+ * In VM_MPACK_SCHEMA_FORMAT, registered keys are written as their schema id.
+ * All other keys are written as strings.
+ *
+ * @param writer The MessagePack writer.
+ * @param key The key to write.
+ * @param format The message format.
+ */
+static void msg_write_key(mpack_writer_t* w, cstr key, vrtql_msg_format_t format);
+
+/**
+ * @brief Serializes a message into MessagePack.
+ *
+ * @param msg The message.
+ * @param format The MessagePack format (VM_MPACK_FORMAT or
+ *   VM_MPACK_SCHEMA_FORMAT) to use regardless of msg->format.
+ * @return A buffer containing the serialized message, NULL on error.
+ */
+static vws_buffer* msg_serialize_mpack(vrtql_msg* msg, vrtql_msg_format_t format);
+
+/**
+ * @brief Callback for vrtql_msg_recv() which collects the messages of a batch
+ * envelope as frames so they can be requeued on the connection and returned
+ * in order by subsequent calls.
+ *
+ * @param data The serialized message.
+ * @param size The size of the message.
+ * @param x The frame queue (struct sc_queue_ptr*) being collected.
+ */
+static void msg_batch_collect(ucstr data, size_t size, void* x);
 
 /**
  * @brief Parses content from a MessagePack reader into a buffer.
@@ -31,6 +66,45 @@ static bool msg_parse_map(mpack_reader_t* reader, vws_kvs* map);
  */
 static int32_t msg_parse_content(mpack_reader_t* reader, vws_buffer* buffer);
 
+//------------------------------------------------------------------------------
+// Schema
+//------------------------------------------------------------------------------
+
+#define VM_SCHEMA_MAX_ID 127
+
+#define VM_SCHEMA_KEY_ENTRY(id, key) [id] = key,
+#define VM_SCHEMA_ID_CASE(id, key) if (strcmp(k, key) == 0) { return id; }
+
+/** Schema id to key decode table, generated from VM_SCHEMA_KEYS */
+static cstr schema_keys[VM_SCHEMA_MAX_ID + 1] =
+{
+    VM_SCHEMA_KEYS(VM_SCHEMA_KEY_ENTRY)
+};
+
+uint8_t vrtql_msg_schema_id(cstr k)
+{
+    if (k == NULL)
+    {
+        return 0;
+    }
+
+    // Generated from VM_SCHEMA_KEYS. The table is small enough that a linear
+    // compare is cheaper than hashing the key.
+    VM_SCHEMA_KEYS(VM_SCHEMA_ID_CASE)
+
+    return 0;
+}
+
+cstr vrtql_msg_schema_key(uint64_t id)
+{
+    if (id > VM_SCHEMA_MAX_ID)
+    {
+        return NULL;
+    }
+
+    return schema_keys[id];
+}
+
 //------------------------------------------------------------------------------
 // API functions
 //------------------------------------------------------------------------------
@@ -115,75 +189,80 @@ void vrtql_msg_free(vrtql_msg* msg)
     msg = NULL;
 }
 
-vws_buffer* vrtql_msg_serialize(vrtql_msg* msg)
+vws_buffer* msg_serialize_mpack(vrtql_msg* msg, vrtql_msg_format_t format)
 {
-    if (msg == NULL)
-    {
-        return false;
-    }
+    // Serialize MessagePack
 
-    if (msg->format == VM_MPACK_FORMAT)
-    {
-        // Serialize MessagePack
+    // Buffer to hold data
+    vws_buffer* buffer = vws_buffer_new();
 
-        // Buffer to hold data
-        vws_buffer* buffer = vws_buffer_new();
+    // Initialize writer
 
-        // Initialize writer
+    cstr key; cstr value;
+    mpack_writer_t writer;
+    mpack_writer_init_growable(&writer, (char**)&buffer->data, &buffer->size);
 
-        cstr key; cstr value;
-        mpack_writer_t writer;
-        mpack_writer_init_growable(&writer, (char**)&buffer->data, &buffer->size);
+    // Binary is an array of 3 elements: routing, headers, content.
+    mpack_start_array(&writer, 3);
 
-        // Binary is an array of 3 elements: routing, headers, content.
-        mpack_start_array(&writer, 3);
+    // Generate routing
 
-        // Generate routing
+    mpack_build_map(&writer);
+    for (size_t i = 0; i < msg->routing->used; i++)
+    {
+        msg_write_key(&writer, msg->routing->array[i].key, format);
+        mpack_write_cstr(&writer, msg->routing->array[i].value.data);
+    }
+    mpack_complete_map(&writer);
 
-        mpack_build_map(&writer);
-        for (size_t i = 0; i < msg->routing->used; i++)
-        {
-            mpack_write_cstr(&writer, msg->routing->array[i].key);
-            mpack_write_cstr(&writer, msg->routing->array[i].value.data);
-        }
-        mpack_complete_map(&writer);
+    // Generate headers
 
-        // Generate headers
+    mpack_build_map(&writer);
 
-        mpack_build_map(&writer);
+    for (size_t i = 0; i < msg->headers->used; i++)
+    {
+        msg_write_key(&writer, msg->headers->array[i].key, format);
+        mpack_write_cstr(&writer, msg->headers->array[i].value.data);
+    }
+    mpack_complete_map(&writer);
 
-        for (size_t i = 0; i < msg->headers->used; i++)
-        {
-            mpack_write_cstr(&writer, msg->headers->array[i].key);
-            mpack_write_cstr(&writer, msg->headers->array[i].value.data);
-        }
-        mpack_complete_map(&writer);
+    // Create content
 
-        // Create content
+    int size  = msg->content->size;
+    cstr data = (cstr)msg->content->data;
+    mpack_write_bin(&writer, data, size);
 
-        int size  = msg->content->size;
-        cstr data = (cstr)msg->content->data;
-        mpack_write_bin(&writer, data, size);
+    // Close array
+    mpack_finish_array(&writer);
 
-        // Close array
-        mpack_finish_array(&writer);
+    // Cleanup
 
-        // Cleanup
+    mpack_error_t rc = mpack_writer_destroy(&writer);
 
-        mpack_error_t rc = mpack_writer_destroy(&writer);
+    if (rc != mpack_ok)
+    {
+        char buf[256];
+        cstr text = mpack_error_to_string(rc);
+        snprintf(buf, sizeof(buf), "Encoding errror: %s", text);
+        vws.error(VE_RT, buf);
 
-        if (rc != mpack_ok)
-        {
-            char buf[256];
-            cstr text = mpack_error_to_string(rc);
-            snprintf(buf, sizeof(buf), "Encoding errror: %s", text);
-            vws.error(VE_RT, buf);
+        vws_buffer_free(buffer);
+        return NULL;
+    }
 
-            vws_buffer_free(buffer);
-            return NULL;
-        }
+    return buffer;
+}
 
-        return buffer;
+vws_buffer* vrtql_msg_serialize(vrtql_msg* msg)
+{
+    if (msg == NULL)
+    {
+        return false;
+    }
+
+    if ((msg->format == VM_MPACK_FORMAT) || (msg->format == VM_MPACK_SCHEMA_FORMAT))
+    {
+        return msg_serialize_mpack(msg, msg->format);
     }
 
     if (msg->format == VM_JSON_FORMAT)
@@ -283,6 +362,12 @@ bool vrtql_msg_deserialize(vrtql_msg* msg, ucstr data, size_t length)
     unsigned char magic_number = (unsigned char)(0x90u | 3);
     unsigned char first_byte   = (unsigned char)data[0];
 
+    if (first_byte == VM_BATCH_MAGIC)
+    {
+        vws.error(VE_RT, "Batch envelope: use vrtql_msg_batch_unpack()");
+        return false;
+    }
+
     if (first_byte == magic_number)
     {
         // Deserialize MessagePack
@@ -300,14 +385,16 @@ bool vrtql_msg_deserialize(vrtql_msg* msg, ucstr data, size_t length)
 
         // Parse routing map
 
-        if (msg_parse_map(&reader, msg->routing) == false)
+        bool schema = false;
+
+        if (msg_parse_map(&reader, msg->routing, &schema) == false)
         {
             return false;
         }
 
         // Parse header map
 
-        if (msg_parse_map(&reader, msg->headers) == false)
+        if (msg_parse_map(&reader, msg->headers, &schema) == false)
         {
             return false;
         }
@@ -342,8 +429,8 @@ bool vrtql_msg_deserialize(vrtql_msg* msg, ucstr data, size_t length)
             return false;
         }
 
-        // Record format
-        msg->format = VM_MPACK_FORMAT;
+        // Record format. If the sender used schema ids we reply in kind.
+        msg->format = schema ? VM_MPACK_SCHEMA_FORMAT : VM_MPACK_FORMAT;
     }
     else
     {
@@ -601,35 +688,286 @@ ssize_t vrtql_msg_send(vws_cnx* c, vrtql_msg* msg)
 
 vrtql_msg* vrtql_msg_recv(vws_cnx* c)
 {
-    vws_msg* wsm = vws_msg_recv(c);
+    while (true)
+    {
+        vws_msg* wsm = vws_msg_recv(c);
+
+        if (wsm == NULL)
+        {
+            return NULL;
+        }
+
+        ucstr data  = wsm->data->data;
+        size_t size = wsm->data->size;
+
+        if (vrtql_msg_is_batch(data, size) == true)
+        {
+            // Split envelope into frames and put them back on the connection
+            // queue ahead of anything received after it. The queue is consumed
+            // from the back so we add them to the back in reverse order.
+
+            struct sc_queue_ptr frames;
+            sc_queue_init(&frames);
+
+            int rc = vrtql_msg_batch_unpack(data, size, msg_batch_collect, &frames);
+
+            while (sc_queue_size(&frames) > 0)
+            {
+                vws_cnx_frame_return(c, sc_queue_del_last(&frames));
+            }
+
+            sc_queue_term(&frames);
+            vws_msg_free(wsm);
+
+            if (rc < 0)
+            {
+                // Error already set
+                return NULL;
+            }
+
+            continue;
+        }
 
-    if (wsm == NULL)
+        // Deserialize VRTQL message
+        vrtql_msg* m = vrtql_msg_new();
+
+        if (vrtql_msg_deserialize(m, data, size) == false)
+        {
+            // Error already set
+            vws_msg_free(wsm);
+            vrtql_msg_free(m);
+            return NULL;
+        }
+
+        vws_msg_free(wsm);
+
+        return m;
+    }
+}
+
+//------------------------------------------------------------------------------
+// Batching
+//------------------------------------------------------------------------------
+
+// Envelope header: fixarray(2), version, array32 + 32-bit count. The array32
+// form is used so that the count can be patched in place when the batch is
+// finished without moving the messages.
+#define VM_BATCH_HEADER_SIZE 7
+
+vrtql_msg_batch* vrtql_msg_batch_new(size_t max_size, uint64_t max_delay)
+{
+    vrtql_msg_batch* b = vws.malloc(sizeof(vrtql_msg_batch));
+    b->buffer          = vws_buffer_new();
+    b->count           = 0;
+    b->start           = 0;
+    b->max_size        = max_size;
+    b->max_delay       = max_delay;
+
+    return b;
+}
+
+void vrtql_msg_batch_free(vrtql_msg_batch* b)
+{
+    if (b == NULL)
     {
-        return NULL;
+        return;
     }
 
-    // Deserialize VRTQL message
-    vrtql_msg* m = vrtql_msg_new();
-    ucstr data   = wsm->data->data;
-    size_t size  = wsm->data->size;
-    if (vrtql_msg_deserialize(m, data, size) == false)
+    vws_buffer_free(b->buffer);
+    vws.free(b);
+}
+
+bool vrtql_msg_batch_add(vrtql_msg_batch* b, vrtql_msg* m)
+{
+    vrtql_msg_format_t format = VM_MPACK_FORMAT;
+
+    if (m->format == VM_MPACK_SCHEMA_FORMAT)
+    {
+        format = VM_MPACK_SCHEMA_FORMAT;
+    }
+
+    vws_buffer* data = msg_serialize_mpack(m, format);
+
+    if (data == NULL)
     {
         // Error already set
-        vws_msg_free(wsm);
-        vrtql_msg_free(m);
+        return vrtql_msg_batch_due(b);
+    }
+
+    bool due = vrtql_msg_batch_append(b, data->data, data->size);
+    vws_buffer_free(data);
+
+    return due;
+}
+
+bool vrtql_msg_batch_append(vrtql_msg_batch* b, ucstr data, size_t size)
+{
+    if (b->count == 0)
+    {
+        // Reserve space for envelope header, written by finish()
+        unsigned char header[VM_BATCH_HEADER_SIZE] = {0};
+        vws_buffer_clear(b->buffer);
+        vws_buffer_append(b->buffer, header, sizeof(header));
+
+        b->start = vws_clock_usec();
+    }
+
+    vws_buffer_append(b->buffer, data, size);
+    b->count++;
+
+    return vrtql_msg_batch_due(b);
+}
+
+bool vrtql_msg_batch_due(vrtql_msg_batch* b)
+{
+    if (b->count == 0)
+    {
+        return false;
+    }
+
+    if ((b->max_size > 0) && (b->buffer->size >= b->max_size))
+    {
+        return true;
+    }
+
+    return (vws_clock_usec() - b->start) >= b->max_delay;
+}
+
+vws_buffer* vrtql_msg_batch_finish(vrtql_msg_batch* b)
+{
+    if (b->count == 0)
+    {
         return NULL;
     }
 
-    vws_msg_free(wsm);
+    vws_buffer* buffer = b->buffer;
+
+    if (b->count == 1)
+    {
+        // No point in an envelope for a single message
+        vws_buffer_drain(buffer, VM_BATCH_HEADER_SIZE);
+    }
+    else
+    {
+        unsigned char* h = buffer->data;
+
+        h[0] = VM_BATCH_MAGIC;
+        h[1] = VM_BATCH_VERSION;
+        h[2] = 0xdd; // array32
+        h[3] = (b->count >> 24) & 0xff;
+        h[4] = (b->count >> 16) & 0xff;
+        h[5] = (b->count >> 8)  & 0xff;
+        h[6] = b->count & 0xff;
+    }
+
+    // Hand buffer to caller and start a new one
+    b->buffer = vws_buffer_new();
+    b->count  = 0;
+    b->start  = 0;
 
-    return m;
+    return buffer;
+}
+
+bool vrtql_msg_is_batch(ucstr data, size_t size)
+{
+    return (data != NULL) && (size > 0) && (data[0] == VM_BATCH_MAGIC);
+}
+
+int vrtql_msg_batch_unpack( ucstr data,
+                            size_t size,
+                            vrtql_msg_batch_fn fn,
+                            void* x )
+{
+    if (vrtql_msg_is_batch(data, size) == false)
+    {
+        vws.error(VE_RT, "Invalid batch envelope");
+        return -1;
+    }
+
+    mpack_reader_t reader;
+    mpack_reader_init_data(&reader, (cstr)data, size);
+
+    mpack_expect_array_match(&reader, 2);
+
+    if (mpack_expect_uint(&reader) != VM_BATCH_VERSION)
+    {
+        mpack_reader_destroy(&reader);
+        vws.error(VE_RT, "Unsupported batch envelope version");
+        return -1;
+    }
+
+    uint32_t count = mpack_expect_array(&reader);
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        // Find message boundaries by skipping over it
+        cstr start; cstr end;
+        mpack_reader_remaining(&reader, &start);
+        mpack_discard(&reader);
+
+        if (mpack_reader_error(&reader) != mpack_ok)
+        {
+            break;
+        }
+
+        mpack_reader_remaining(&reader, &end);
+        fn((ucstr)start, end - start, x);
+    }
+
+    mpack_done_array(&reader);
+    mpack_done_array(&reader);
+
+    mpack_error_t rc = mpack_reader_destroy(&reader);
+
+    if (rc != mpack_ok)
+    {
+        char buf[256];
+        cstr text = mpack_error_to_string(rc);
+        snprintf(buf, sizeof(buf), "Decoding errror: %s", text);
+        vws.error(VE_RT, buf);
+
+        return -1;
+    }
+
+    return count;
+}
+
+ssize_t vrtql_msg_batch_send(vws_cnx* c, vrtql_msg_batch* b)
+{
+    vws_buffer* binary = vrtql_msg_batch_finish(b);
+
+    if (binary == NULL)
+    {
+        return 0;
+    }
+
+    ssize_t bytes = vws_frame_send_binary(c, binary->data, binary->size);
+    vws_buffer_free(binary);
+
+    return bytes;
 }
 
 //------------------------------------------------------------------------------
 // Utility functions
 //------------------------------------------------------------------------------
 
-bool msg_parse_map(mpack_reader_t* reader, vws_kvs* map)
+void msg_write_key(mpack_writer_t* w, cstr key, vrtql_msg_format_t format)
+{
+    if (format == VM_MPACK_SCHEMA_FORMAT)
+    {
+        uint8_t id = vrtql_msg_schema_id(key);
+
+        if (id != 0)
+        {
+            mpack_write_uint(w, id);
+            return;
+        }
+    }
+
+    mpack_write_cstr(w, key);
+}
+
+bool msg_parse_map(mpack_reader_t* reader, vws_kvs* map, bool* schema)
 {
     // Clear contents
     vws_kvs_clear(map);
@@ -661,20 +999,36 @@ bool msg_parse_map(mpack_reader_t* reader, vws_kvs* map)
 
         tag = mpack_read_tag(reader);
 
-        if (mpack_tag_type(&tag) != mpack_type_str)
+        if (mpack_tag_type(&tag) == mpack_type_uint)
+        {
+            // Schema id
+            cstr name = vrtql_msg_schema_key(mpack_tag_uint_value(&tag));
+
+            if (name == NULL)
+            {
+                vws.error(VE_RT, "Unknown schema key id");
+                return false;
+            }
+
+            *schema = true;
+            key     = vws.strdup(name);
+        }
+        else if (mpack_tag_type(&tag) == mpack_type_str)
+        {
+            length = mpack_tag_str_length(&tag);
+            data   = mpack_read_bytes_inplace(reader, length);
+            key    = vws.malloc(length + 1);
+
+            memcpy(key, data, length);
+            key[length] = 0;
+            mpack_done_str(reader);
+        }
+        else
         {
             printf("ERROR: key must be string\n");
             return false;
         }
 
-        length = mpack_tag_str_length(&tag);
-        data   = mpack_read_bytes_inplace(reader, length);
-        key    = vws.malloc(length + 1);
-
-        memcpy(key, data, length);
-        key[length] = 0;
-        mpack_done_str(reader);
-
         //> Get value
 
         tag = mpack_read_tag(reader);
@@ -682,6 +1036,7 @@ bool msg_parse_map(mpack_reader_t* reader, vws_kvs* map)
         if (mpack_tag_type(&tag) != mpack_type_str)
         {
             printf("ERROR: value must be string\n");
+            vws.free(key);
             return false;
         }
 
@@ -709,6 +1064,12 @@ bool msg_parse_map(mpack_reader_t* reader, vws_kvs* map)
     return true;
 }
 
+void msg_batch_collect(ucstr data, size_t size, void* x)
+{
+    struct sc_queue_ptr* frames = (struct sc_queue_ptr*)x;
+    sc_queue_add_last(frames, vws_frame_new(data, size, BINARY_FRAME));
+}
+
 int32_t msg_parse_content(mpack_reader_t* reader, vws_buffer* buffer)
 {
     mpack_tag_t tag = mpack_read_tag(reader);
@@ -10,9 +10,30 @@ extern "C" {
 typedef enum
 {
     VM_MPACK_FORMAT,
-    VM_JSON_FORMAT
+    VM_JSON_FORMAT,
+    VM_MPACK_SCHEMA_FORMAT
 } vrtql_msg_format_t;
 
+/**
+ * @brief Registered schema keys.
+ *
+ * Routing and header keys listed here are encoded as small positive integers
+ * (MessagePack positive fixint, one byte) rather than strings when a message
+ * is serialized in VM_MPACK_SCHEMA_FORMAT. Decoders always accept both integer
+ * and string keys, so a peer opts in simply by sending schema-encoded messages
+ * and replies mirror the format of the request (see vrtql_rpc_reply()).
+ *
+ * The table is expanded with X(id, key) to generate the codec lookup tables in
+ * message.c. Ids must be unique, in the range 1-127, and never reused: they are
+ * part of the wire protocol. Append new keys at the end.
+ */
+#define VM_SCHEMA_KEYS(X) \
+    X(1, "id")            \
+    X(2, "rc")            \
+    X(3, "msg")           \
+    X(4, "tag")           \
+    X(5, "timestamp")
+
 /** Values 1-10 are reserved. Apps can use 11-63 */
 typedef enum
 {
@@ -227,6 +248,24 @@ void vrtql_msg_clear(vrtql_msg* msg);
  */
 bool vrtql_msg_is_empty(vrtql_msg* msg);
 
+/**
+ * @brief Looks up the schema id of a routing/header key.
+ * @param key The key.
+ * @return The schema id (1-127) or 0 if the key is not registered.
+ *
+ * @ingroup MessageFunctions
+ */
+uint8_t vrtql_msg_schema_id(cstr key);
+
+/**
+ * @brief Looks up the routing/header key of a schema id.
+ * @param id The schema id.
+ * @return The key or NULL if the id is not registered.
+ *
+ * @ingroup MessageFunctions
+ */
+cstr vrtql_msg_schema_key(uint64_t id);
+
 /**
  * @brief Serializes a vrtql_msg instance to a buffer.
  * @param msg The vrtql_msg instance.
@@ -263,7 +302,8 @@ bool vrtql_msg_deserialize(vrtql_msg* msg, ucstr data, size_t length);
 ssize_t vrtql_msg_send(vws_cnx* c, vrtql_msg* msg);
 
 /**
- * @brief Receives a message from the connection.
+ * @brief Receives a message from the connection. If a batch envelope arrives,
+ * its messages are returned one at a time by successive calls.
  *
  * @param c The connection.
  * @return Returns the most recent message or NULL if the socket timed out
@@ -275,6 +315,163 @@ ssize_t vrtql_msg_send(vws_cnx* c, vrtql_msg* msg);
  */
 vrtql_msg* vrtql_msg_recv(vws_cnx* c);
 
+//------------------------------------------------------------------------------
+// Batching
+//------------------------------------------------------------------------------
+
+/**
+ * @defgroup BatchFunctions
+ *
+ * @brief Functions that pack multiple messages into a single WebSocket frame
+ *
+ * A batch envelope is a MessagePack array of two elements: a version number
+ * and an array of MessagePack-serialized messages. Its first byte (0x92) is
+ * distinct from a single message (0x93) and from JSON, so batches can be mixed
+ * freely with unbatched messages on the same connection. JSON-format messages
+ * are serialized as MessagePack when added to a batch.
+ *
+ * Messages accumulate in a batch until either max_size bytes have been
+ * buffered or max_delay microseconds have elapsed since the first message was
+ * added, at which point the batch is due to be flushed (Nagle-style).
+ */
+
+/** Magic number (first byte) of a batch envelope: MessagePack fixarray(2) */
+#define VM_BATCH_MAGIC   (0x90u | 2)
+
+/** Batch envelope format version */
+#define VM_BATCH_VERSION 1
+
+/**
+ * @brief Accumulates serialized messages for transmission in a single frame.
+ *
+ * @ingroup BatchFunctions
+ */
+typedef struct vrtql_msg_batch
+{
+    vws_buffer* buffer;  /**< The envelope under construction            */
+    uint32_t count;      /**< Number of messages in the envelope         */
+    uint64_t start;      /**< When first message was added (usec)        */
+    size_t max_size;     /**< Flush once envelope reaches this size      */
+    uint64_t max_delay;  /**< Flush once oldest message is this old (us) */
+
+} vrtql_msg_batch;
+
+/**
+ * @brief Callback for vrtql_msg_batch_unpack().
+ *
+ * @param data A single serialized (MessagePack) message within the envelope.
+ *   This points into the envelope and is only valid during the callback.
+ * @param size The size of the message in bytes.
+ * @param x The user-defined context
+ *
+ * @ingroup BatchFunctions
+ */
+typedef void (*vrtql_msg_batch_fn)(ucstr data, size_t size, void* x);
+
+/**
+ * @brief Creates a new batch.
+ * @param max_size Size in bytes at which the batch is due. 0 means no limit.
+ * @param max_delay Age in microseconds at which the batch is due.
+ * @return A pointer to the new batch.
+ *
+ * @ingroup BatchFunctions
+ */
+vrtql_msg_batch* vrtql_msg_batch_new(size_t max_size, uint64_t max_delay);
+
+/**
+ * @brief Frees a batch and any messages it holds.
+ * @param b The batch.
+ *
+ * @ingroup BatchFunctions
+ */
+void vrtql_msg_batch_free(vrtql_msg_batch* b);
+
+/**
+ * @brief Serializes a message into a batch. Does not take ownership of the
+ * message.
+ *
+ * @param b The batch.
+ * @param m The message.
+ * @return true if the batch is now due to be flushed, false otherwise.
+ *
+ * @ingroup BatchFunctions
+ */
+bool vrtql_msg_batch_add(vrtql_msg_batch* b, vrtql_msg* m);
+
+/**
+ * @brief Appends an already serialized MessagePack message to a batch.
+ *
+ * @param b The batch.
+ * @param data The serialized message.
+ * @param size The size of the serialized message.
+ * @return true if the batch is now due to be flushed, false otherwise.
+ *
+ * @ingroup BatchFunctions
+ */
+bool vrtql_msg_batch_append(vrtql_msg_batch* b, ucstr data, size_t size);
+
+/**
+ * @brief Checks if a batch is due to be flushed, either by size or age.
+ * @param b The batch.
+ * @return true if the batch holds messages and is due, false otherwise.
+ *
+ * @ingroup BatchFunctions
+ */
+bool vrtql_msg_batch_due(vrtql_msg_batch* b);
+
+/**
+ * @brief Completes the envelope and resets the batch.
+ *
+ * If the batch holds a single message, the bare message is returned without
+ * an envelope.
+ *
+ * @param b The batch.
+ * @return A buffer containing the envelope, or NULL if the batch is empty.
+ *   Caller must free with vws_buffer_free().
+ *
+ * @ingroup BatchFunctions
+ */
+vws_buffer* vrtql_msg_batch_finish(vrtql_msg_batch* b);
+
+/**
+ * @brief Checks if serialized data is a batch envelope.
+ * @param data The data.
+ * @param size The size of the data.
+ * @return true if data is a batch envelope, false otherwise.
+ *
+ * @ingroup BatchFunctions
+ */
+bool vrtql_msg_is_batch(ucstr data, size_t size);
+
+/**
+ * @brief Iterates over the messages in a batch envelope.
+ *
+ * @param data The envelope.
+ * @param size The size of the envelope.
+ * @param fn Function called for each serialized message, in order.
+ * @param x User-defined context passed to fn.
+ * @return The number of messages, or -1 on error (vws.e is set).
+ *
+ * @ingroup BatchFunctions
+ */
+int vrtql_msg_batch_unpack( ucstr data,
+                            size_t size,
+                            vrtql_msg_batch_fn fn,
+                            void* x );
+
+/**
+ * @brief Sends the contents of a batch as a single WebSocket frame and resets
+ * the batch.
+ *
+ * @param c The connection.
+ * @param b The batch.
+ * @return Returns the number of bytes sent, 0 if the batch was empty or -1 on
+ *   error. In the case of error, check vws.e for details.
+ *
+ * @ingroup BatchFunctions
+ */
+ssize_t vrtql_msg_batch_send(vws_cnx* c, vrtql_msg_batch* b);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,1004 @@
+#if defined(__linux__) || defined(__bsd__) || defined(__sunos__)
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#endif
+
+#include <errno.h>
+#include <string.h>
+
+#include <openssl/err.h>
+
+#include "mux.h"
+#include "socket.h"
+#include "url.h"
+
+//------------------------------------------------------------------------------
+// Internal functions
+//------------------------------------------------------------------------------
+
+/** Size of the shared socket read buffer */
+#define MUX_READ_SIZE 65536
+
+/**
+ * @brief Callback for name resolution.
+ *
+ * @param req The resolver request
+ * @param status Zero on success, libuv error code otherwise
+ * @param res The addresses
+ *
+ * @ingroup MuxFunctions
+ */
+static void mux_on_resolve( uv_getaddrinfo_t* req,
+                            int status,
+                            struct addrinfo* res );
+
+/**
+ * @brief Callback for socket readiness. Drives the connection state machine.
+ *
+ * @param handle The poll handle
+ * @param status Zero on success, libuv error code otherwise
+ * @param events UV_READABLE and/or UV_WRITABLE
+ *
+ * @ingroup MuxFunctions
+ */
+static void mux_on_poll(uv_poll_t* handle, int status, int events);
+
+/**
+ * @brief Callback for poll handle close. Releases the connection.
+ *
+ * @param handle The poll handle
+ *
+ * @ingroup MuxFunctions
+ */
+static void mux_on_close(uv_handle_t* handle);
+
+/**
+ * @brief uv_walk() callback used on free. Shuts down connections.
+ *
+ * @param handle The handle
+ * @param arg Unused
+ *
+ * @ingroup MuxFunctions
+ */
+static void mux_on_walk(uv_handle_t* handle, void* arg);
+
+/**
+ * @brief Calls on_close and frees the connection.
+ *
+ * @param c The connection
+ *
+ * @ingroup MuxFunctions
+ */
+static void mux_release(vws_mux_cnx* c);
+
+/**
+ * @brief Closes the socket and releases the connection once its handles are
+ * closed. Safe to call more than once.
+ *
+ * @param c The connection
+ *
+ * @ingroup MuxFunctions
+ */
+static void mux_shutdown(vws_mux_cnx* c);
+
+/**
+ * @brief Starts a non-blocking TCP connect to the first usable address,
+ * starting from res.
+ *
+ * @param c The connection
+ * @param res The addresses
+ * @return True if a connect is in progress, false otherwise
+ *
+ * @ingroup MuxFunctions
+ */
+static bool mux_connect(vws_mux_cnx* c, struct addrinfo* res);
+
+/**
+ * @brief Callback for poll handle close after a refused or timed out connect.
+ * Tries the next address, or releases the connection if there is none.
+ *
+ * @param handle The poll handle
+ *
+ * @ingroup MuxFunctions
+ */
+static void mux_on_retry(uv_handle_t* handle);
+
+/**
+ * @brief Advances the SSL handshake.
+ *
+ * @param c The connection
+ *
+ * @ingroup MuxFunctions
+ */
+static void mux_tls(vws_mux_cnx* c);
+
+/**
+ * @brief Queues the websocket handshake request.
+ *
+ * @param c The connection
+ *
+ * @ingroup MuxFunctions
+ */
+static void mux_handshake(vws_mux_cnx* c);
+
+/**
+ * @brief Checks the websocket handshake response once complete.
+ *
+ * @param c The connection
+ * @return False if the handshake failed and the connection was shut down
+ *
+ * @ingroup MuxFunctions
+ */
+static bool mux_handshake_response(vws_mux_cnx* c);
+
+/**
+ * @brief Reads from the socket into the connection buffer until it would
+ * block.
+ *
+ * @param c The connection
+ * @return False on EOF or error
+ *
+ * @ingroup MuxFunctions
+ */
+static bool mux_read(vws_mux_cnx* c);
+
+/**
+ * @brief Writes pending output until done or it would block.
+ *
+ * @param c The connection
+ * @return False on error
+ *
+ * @ingroup MuxFunctions
+ */
+static bool mux_flush(vws_mux_cnx* c);
+
+/**
+ * @brief Processes received data according to connection state.
+ *
+ * @param c The connection
+ *
+ * @ingroup MuxFunctions
+ */
+static void mux_process(vws_mux_cnx* c);
+
+/**
+ * @brief Frame processing callback (vws_cnx.process). Queues data frames and
+ * answers control frames without blocking.
+ *
+ * @param cnx The websocket connection
+ * @param f The frame
+ *
+ * @ingroup MuxFunctions
+ */
+static void mux_process_frame(vws_cnx* cnx, vws_frame* f);
+
+/**
+ * @brief Serializes a frame onto the output buffer. The frame is freed.
+ *
+ * @param c The connection
+ * @param f The frame
+ *
+ * @ingroup MuxFunctions
+ */
+static void mux_queue_frame(vws_mux_cnx* c, vws_frame* f);
+
+/**
+ * @brief Sets the poll events, only calling into libuv when they change.
+ *
+ * @param c The connection
+ * @param events UV_READABLE and/or UV_WRITABLE
+ *
+ * @ingroup MuxFunctions
+ */
+static void mux_poll(vws_mux_cnx* c, int events);
+
+/**
+ * @brief Flushes output and updates poll events to suit. Shuts the connection
+ * down on error, or when a close has been flushed.
+ *
+ * @param c The connection
+ *
+ * @ingroup MuxFunctions
+ */
+static void mux_update(vws_mux_cnx* c);
+
+//------------------------------------------------------------------------------
+// API
+//------------------------------------------------------------------------------
+
+vws_mux* vws_mux_new()
+{
+    vws_mux* m = (vws_mux*)vws.malloc(sizeof(vws_mux));
+    memset(m, 0, sizeof(vws_mux));
+
+    m->loop  = (uv_loop_t*)vws.malloc(sizeof(uv_loop_t));
+    m->rsize = MUX_READ_SIZE;
+    m->rbuf  = (unsigned char*)vws.malloc(m->rsize);
+
+    uv_loop_init(m->loop);
+
+    return m;
+}
+
+void vws_mux_free(vws_mux* m)
+{
+    if (m == NULL)
+    {
+        return;
+    }
+
+    // Shut down any remaining connections and let their handles close
+    uv_walk(m->loop, mux_on_walk, NULL);
+    uv_run(m->loop, UV_RUN_DEFAULT);
+    uv_loop_close(m->loop);
+
+    vws.free(m->loop);
+    vws.free(m->rbuf);
+    vws.free(m);
+}
+
+vws_mux_cnx* vws_mux_connect(vws_mux* m, cstr uri, void* data)
+{
+    url_data_t* url = url_parse((char*)uri);
+
+    if ((url == NULL) || (url->host == NULL) || (url->protocol == NULL))
+    {
+        if (url != NULL)
+        {
+            url_free(url);
+        }
+
+        vws.error(VE_RT, "Invalid URL %s", uri);
+
+        return NULL;
+    }
+
+    vws_mux_cnx* c = (vws_mux_cnx*)vws.malloc(sizeof(vws_mux_cnx));
+    memset(c, 0, sizeof(vws_mux_cnx));
+
+    c->mux          = m;
+    c->state        = VWS_MUX_RESOLVING;
+    c->out          = vws_buffer_new();
+    c->data         = data;
+    c->cnx          = vws_cnx_new();
+    c->cnx->url     = (vws_url_data*)url;
+    c->cnx->process = mux_process_frame;
+    c->cnx->data    = (char*)c;
+    c->resolver.data = c;
+
+    m->count++;
+
+    bool ssl  = (strcmp(url->protocol, "wss") == 0);
+    cstr port = (url->port != NULL) ? url->port : (ssl ? "443" : "80");
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = PF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int rc = uv_getaddrinfo( m->loop, &c->resolver, mux_on_resolve,
+                             url->host, port, &hints );
+
+    if (rc != 0)
+    {
+        vws.error(VE_SYS, "uv_getaddrinfo(): %s", uv_strerror(rc));
+
+        // Never started, so on_close does not apply
+        vws_cnx_free(c->cnx);
+        vws_buffer_free(c->out);
+        vws.free(c);
+        m->count--;
+
+        return NULL;
+    }
+
+    return c;
+}
+
+bool vws_mux_send( vws_mux_cnx* c,
+                   ucstr data,
+                   size_t size,
+                   unsigned char opcode )
+{
+    if (c->state != VWS_MUX_OPEN)
+    {
+        vws.error(VE_SOCKET, "vws_mux_send(): not open");
+        return false;
+    }
+
+    mux_queue_frame(c, vws_frame_new(data, size, opcode));
+    mux_update(c);
+
+    return true;
+}
+
+void vws_mux_close(vws_mux_cnx* c)
+{
+    if (c->state != VWS_MUX_OPEN)
+    {
+        if (c->state < VWS_MUX_OPEN)
+        {
+            mux_shutdown(c);
+        }
+
+        return;
+    }
+
+    vws_buffer* buffer = vws_generate_close_frame();
+    vws_buffer_append(c->out, buffer->data, buffer->size);
+    vws_buffer_free(buffer);
+
+    c->state = VWS_MUX_CLOSING;
+    mux_update(c);
+}
+
+void vws_mux_run(vws_mux* m)
+{
+    uv_run(m->loop, UV_RUN_DEFAULT);
+}
+
+int vws_mux_poll(vws_mux* m)
+{
+    return uv_run(m->loop, UV_RUN_NOWAIT);
+}
+
+void vws_mux_stop(vws_mux* m)
+{
+    uv_stop(m->loop);
+}
+
+//------------------------------------------------------------------------------
+// Connection state machine
+//------------------------------------------------------------------------------
+
+void mux_on_resolve(uv_getaddrinfo_t* req, int status, struct addrinfo* res)
+{
+    vws_mux_cnx* c = (vws_mux_cnx*)req->data;
+
+    if (c->state == VWS_MUX_CLOSED)
+    {
+        // Closed while resolving
+        uv_freeaddrinfo(res);
+        mux_release(c);
+
+        return;
+    }
+
+    if (status != 0)
+    {
+        vws.error( VE_SYS, "resolve %s: %s",
+                   c->cnx->url->host, uv_strerror(status) );
+        c->state = VWS_MUX_CLOSED;
+        mux_release(c);
+
+        return;
+    }
+
+    // Kept to try the other addresses if the connect fails
+    c->addrs = res;
+
+    if (mux_connect(c, res) == false)
+    {
+        c->state = VWS_MUX_CLOSED;
+        mux_release(c);
+    }
+}
+
+bool mux_connect(vws_mux_cnx* c, struct addrinfo* res)
+{
+    vws_socket* s = (vws_socket*)c->cnx;
+
+    for (; res != NULL; res = res->ai_next)
+    {
+        int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+
+        if (fd < 0)
+        {
+            continue;
+        }
+
+        if (vws_socket_set_nonblocking(fd) == false)
+        {
+            close(fd);
+            continue;
+        }
+
+        if ( (connect(fd, res->ai_addr, res->ai_addrlen) != 0) &&
+             (errno != EINPROGRESS) )
+        {
+            close(fd);
+            continue;
+        }
+
+        #if defined(__bsd__)
+
+        // Disable SIGPIPE
+        int val = 1;
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &val, sizeof(val));
+
+        #endif
+
+        s->sockfd = fd;
+
+        if (strcmp(c->cnx->url->protocol, "wss") == 0)
+        {
+            if (vws_socket_ssl_init() == false)
+            {
+                vws_socket_close(s);
+                return false;
+            }
+
+            s->ssl = SSL_new(vws_ssl_ctx);
+            SSL_set_fd(s->ssl, fd);
+            SSL_set_connect_state(s->ssl);
+            SSL_set_tlsext_host_name(s->ssl, c->cnx->url->host);
+        }
+
+        c->addr      = res;
+        c->state     = VWS_MUX_CONNECTING;
+        c->events    = 0;
+        c->poll.data = c;
+        uv_poll_init_socket(c->mux->loop, &c->poll, fd);
+
+        // Writable signals connect completion
+        mux_poll(c, UV_WRITABLE);
+
+        return true;
+    }
+
+    vws.error(VE_SYS, "connect %s failed", c->cnx->url->host);
+
+    return false;
+}
+
+void mux_on_poll(uv_poll_t* handle, int status, int events)
+{
+    vws_mux_cnx* c = (vws_mux_cnx*)handle->data;
+
+    // A failed connect is reported as a poll error, with its cause in SO_ERROR
+    if ((status < 0) && (c->state != VWS_MUX_CONNECTING))
+    {
+        vws.error(VE_SOCKET, "poll: %s", uv_strerror(status));
+        mux_shutdown(c);
+
+        return;
+    }
+
+    switch (c->state)
+    {
+        case VWS_MUX_CONNECTING:
+        {
+            int error       = 0;
+            socklen_t len   = sizeof(error);
+            int fd          = c->cnx->base.sockfd;
+
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len);
+
+            bool retry = (error == ECONNREFUSED) || (error == ETIMEDOUT);
+
+            if ((retry == true) && (c->addr->ai_next != NULL))
+            {
+                // Try the next address once the handle is closed
+                uv_poll_stop(&c->poll);
+                uv_close((uv_handle_t*)&c->poll, mux_on_retry);
+
+                return;
+            }
+
+            if (error != 0)
+            {
+                vws.error(VE_SYS, "connect failed: %s", strerror(error));
+                mux_shutdown(c);
+
+                return;
+            }
+
+            if (status < 0)
+            {
+                vws.error(VE_SOCKET, "poll: %s", uv_strerror(status));
+                mux_shutdown(c);
+
+                return;
+            }
+
+            uv_freeaddrinfo(c->addrs);
+            c->addrs = NULL;
+            c->addr  = NULL;
+
+            if (c->cnx->base.ssl != NULL)
+            {
+                c->state = VWS_MUX_TLS;
+                mux_tls(c);
+            }
+            else
+            {
+                mux_handshake(c);
+            }
+
+            return;
+        }
+
+        case VWS_MUX_TLS:
+        {
+            mux_tls(c);
+
+            return;
+        }
+
+        case VWS_MUX_HANDSHAKE:
+        case VWS_MUX_OPEN:
+        case VWS_MUX_CLOSING:
+        {
+            if (events & UV_READABLE)
+            {
+                bool open = mux_read(c);
+
+                // Process what arrived, even if the peer then closed
+                mux_process(c);
+
+                if ((open == false) && (c->state != VWS_MUX_CLOSED))
+                {
+                    mux_shutdown(c);
+                }
+            }
+
+            if (c->state != VWS_MUX_CLOSED)
+            {
+                mux_update(c);
+            }
+
+            return;
+        }
+
+        default:
+        {
+            return;
+        }
+    }
+}
+
+void mux_tls(vws_mux_cnx* c)
+{
+    SSL* ssl = c->cnx->base.ssl;
+    int rc   = SSL_connect(ssl);
+
+    if (rc == 1)
+    {
+        mux_handshake(c);
+        return;
+    }
+
+    switch (SSL_get_error(ssl, rc))
+    {
+        case SSL_ERROR_WANT_READ:
+        {
+            mux_poll(c, UV_READABLE);
+            break;
+        }
+
+        case SSL_ERROR_WANT_WRITE:
+        {
+            mux_poll(c, UV_WRITABLE);
+            break;
+        }
+
+        default:
+        {
+            char buf[256];
+            ERR_error_string_n(ERR_get_error(), buf, sizeof(buf));
+            vws.error(VE_SYS, "SSL connection failed: %s", buf);
+            mux_shutdown(c);
+        }
+    }
+}
+
+void mux_handshake(vws_mux_cnx* c)
+{
+    vws_url_data* url = c->cnx->url;
+
+    if (c->cnx->key == NULL)
+    {
+        c->cnx->key = vws_generate_key();
+    }
+
+    vws_buffer_printf( c->out,
+                       "GET %s HTTP/1.1\r\n"
+                       "Host: %s\r\n"
+                       "Cache-Control: no-cache\r\n"
+                       "Origin: %s\r\n"
+                       "Upgrade: websocket\r\n"
+                       "Connection: Upgrade\r\n"
+                       "Sec-WebSocket-Key: %s\r\n"
+                       "Sec-WebSocket-Version: 13\r\n"
+                       "\r\n",
+                       url->path, url->host, url->href, c->cnx->key );
+
+    c->state = VWS_MUX_HANDSHAKE;
+    c->http  = vws_http_msg_new(HTTP_RESPONSE);
+
+    mux_update(c);
+}
+
+bool mux_handshake_response(vws_mux_cnx* c)
+{
+    vws_buffer* b = c->cnx->base.buffer;
+    int n         = vws_http_msg_parse(c->http, (cstr)b->data, b->size);
+
+    if (n < 0)
+    {
+        vws.error(VE_RT, "Invalid handshake response");
+        mux_shutdown(c);
+
+        return false;
+    }
+
+    vws_buffer_drain(b, n);
+
+    if (c->http->done == false)
+    {
+        // Wait for more
+        return true;
+    }
+
+    vws_kvs* headers = c->http->headers;
+    cstr accept      = vws_kvs_get_cstring(headers, "sec-websocket-accept");
+    char expected[VWS_ACCEPT_KEY_SIZE + 1];
+    vws_accept_key_r(c->cnx->key, expected);
+
+    bool valid = (vws_http_msg_status_code(c->http) == 101) &&
+                 (accept != NULL) &&
+                 (strcmp(accept, expected) == 0);
+
+    vws_http_msg_free(c->http);
+    c->http = NULL;
+
+    if (valid == false)
+    {
+        vws.error(VE_RT, "Handshake verification failed");
+        mux_shutdown(c);
+
+        return false;
+    }
+
+    c->state = VWS_MUX_OPEN;
+
+    if (c->mux->on_open != NULL)
+    {
+        c->mux->on_open(c);
+    }
+
+    return (c->state == VWS_MUX_OPEN);
+}
+
+bool mux_read(vws_mux_cnx* c)
+{
+    vws_socket* s = (vws_socket*)c->cnx;
+    vws_mux* m    = c->mux;
+
+    while (true)
+    {
+        ssize_t n;
+
+        if (s->ssl != NULL)
+        {
+            n = SSL_read(s->ssl, m->rbuf, m->rsize);
+
+            if (n <= 0)
+            {
+                int error = SSL_get_error(s->ssl, n);
+
+                return (error == SSL_ERROR_WANT_READ) ||
+                       (error == SSL_ERROR_WANT_WRITE);
+            }
+        }
+        else
+        {
+            n = recv(s->sockfd, m->rbuf, m->rsize, 0);
+
+            if (n == 0)
+            {
+                return false;
+            }
+
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+
+                return (errno == EAGAIN) || (errno == EWOULDBLOCK);
+            }
+        }
+
+        vws_buffer_append(s->buffer, m->rbuf, n);
+    }
+}
+
+bool mux_flush(vws_mux_cnx* c)
+{
+    vws_socket* s = (vws_socket*)c->cnx;
+
+    while (c->out->size > 0)
+    {
+        ssize_t n;
+
+        if (s->ssl != NULL)
+        {
+            n = SSL_write(s->ssl, c->out->data, c->out->size);
+
+            if (n <= 0)
+            {
+                int error = SSL_get_error(s->ssl, n);
+
+                return (error == SSL_ERROR_WANT_READ) ||
+                       (error == SSL_ERROR_WANT_WRITE);
+            }
+        }
+        else
+        {
+            #if defined(__linux__)
+            n = send(s->sockfd, c->out->data, c->out->size, MSG_NOSIGNAL);
+            #else
+            n = send(s->sockfd, c->out->data, c->out->size, 0);
+            #endif
+
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+
+                return (errno == EAGAIN) || (errno == EWOULDBLOCK);
+            }
+        }
+
+        vws_buffer_drain(c->out, n);
+    }
+
+    return true;
+}
+
+void mux_process(vws_mux_cnx* c)
+{
+    if (c->state == VWS_MUX_HANDSHAKE)
+    {
+        if (mux_handshake_response(c) == false)
+        {
+            return;
+        }
+
+        if (c->state != VWS_MUX_OPEN)
+        {
+            // Still waiting for response, or closed in on_open
+            return;
+        }
+    }
+
+    if ((c->state != VWS_MUX_OPEN) && (c->state != VWS_MUX_CLOSING))
+    {
+        return;
+    }
+
+    vws_cnx* cnx = c->cnx;
+
+    vws.success();
+
+    if ((vws_cnx_ingress(cnx) == 0) && (vws.e.code == VE_WARN))
+    {
+        // Frame error
+        mux_shutdown(c);
+        return;
+    }
+
+    vws_msg* m;
+
+    while ((c->state == VWS_MUX_OPEN) && (m = vws_msg_pop(cnx)) != NULL)
+    {
+        if (c->mux->on_msg != NULL)
+        {
+            c->mux->on_msg(c, m);
+        }
+        else
+        {
+            vws_msg_free(m);
+        }
+    }
+}
+
+void mux_process_frame(vws_cnx* cnx, vws_frame* f)
+{
+    vws_mux_cnx* c = (vws_mux_cnx*)cnx->data;
+
+    switch (f->opcode)
+    {
+        case CLOSE_FRAME:
+        {
+            vws_frame_free(f);
+
+            if (c->state == VWS_MUX_OPEN)
+            {
+                // Reply, then close once flushed
+                vws_buffer* buffer = vws_generate_close_frame();
+                vws_buffer_append(c->out, buffer->data, buffer->size);
+                vws_buffer_free(buffer);
+
+                c->state = VWS_MUX_CLOSING;
+            }
+
+            break;
+        }
+
+        case TEXT_FRAME:
+        case BINARY_FRAME:
+        case CONTINUATION_FRAME:
+        {
+            vws_cnx_frame_push(cnx, f);
+
+            break;
+        }
+
+        case PING_FRAME:
+        {
+            vws_frame* pong = vws_frame_new(f->data, f->size, PONG_FRAME);
+            vws_frame_free(f);
+            mux_queue_frame(c, pong);
+
+            break;
+        }
+
+        default:
+        {
+            vws_frame_free(f);
+        }
+    }
+}
+
+void mux_queue_frame(vws_mux_cnx* c, vws_frame* f)
+{
+    // Serialization frees the frame
+    unsigned char opcode = f->opcode;
+    vws_buffer* binary   = vws_serialize(f);
+
+    vws_tev_emit(VTE_FRAME_OUT, c->cnx->base.sockfd, opcode, binary->size);
+
+    vws_buffer_append(c->out, binary->data, binary->size);
+    vws_buffer_free(binary);
+}
+
+void mux_poll(vws_mux_cnx* c, int events)
+{
+    if (c->events != events)
+    {
+        c->events = events;
+        uv_poll_start(&c->poll, events, mux_on_poll);
+    }
+}
+
+void mux_update(vws_mux_cnx* c)
+{
+    if (mux_flush(c) == false)
+    {
+        mux_shutdown(c);
+        return;
+    }
+
+    if ((c->state == VWS_MUX_CLOSING) && (c->out->size == 0))
+    {
+        mux_shutdown(c);
+        return;
+    }
+
+    mux_poll(c, UV_READABLE | ((c->out->size > 0) ? UV_WRITABLE : 0));
+}
+
+//------------------------------------------------------------------------------
+// Cleanup
+//------------------------------------------------------------------------------
+
+void mux_shutdown(vws_mux_cnx* c)
+{
+    if (c->state == VWS_MUX_CLOSED)
+    {
+        return;
+    }
+
+    bool resolving = (c->state == VWS_MUX_RESOLVING);
+    c->state       = VWS_MUX_CLOSED;
+
+    if (resolving)
+    {
+        // Released by mux_on_resolve()
+        uv_cancel((uv_req_t*)&c->resolver);
+        return;
+    }
+
+    if (uv_is_closing((uv_handle_t*)&c->poll))
+    {
+        // Released by mux_on_retry()
+        return;
+    }
+
+    uv_poll_stop(&c->poll);
+    uv_close((uv_handle_t*)&c->poll, mux_on_close);
+
+    // Socket is closed after handle, as libuv may still reference it
+}
+
+void mux_on_walk(uv_handle_t* handle, void* arg)
+{
+    (void)arg;
+
+    if ( (handle->type == UV_POLL) &&
+         (((uv_poll_t*)handle)->poll_cb == mux_on_poll) )
+    {
+        mux_shutdown((vws_mux_cnx*)handle->data);
+    }
+}
+
+void mux_on_close(uv_handle_t* handle)
+{
+    mux_release((vws_mux_cnx*)handle->data);
+}
+
+void mux_on_retry(uv_handle_t* handle)
+{
+    vws_mux_cnx* c = (vws_mux_cnx*)handle->data;
+    vws_socket* s  = (vws_socket*)c->cnx;
+
+    // The SSL handshake has not started, so there is nothing to shut down
+    if (s->ssl != NULL)
+    {
+        SSL_free(s->ssl);
+        s->ssl = NULL;
+    }
+
+    close(s->sockfd);
+    s->sockfd = -1;
+
+    if (c->state == VWS_MUX_CLOSED)
+    {
+        // Closed while the handle was closing
+        mux_release(c);
+
+        return;
+    }
+
+    if (mux_connect(c, c->addr->ai_next) == false)
+    {
+        c->state = VWS_MUX_CLOSED;
+        mux_release(c);
+    }
+}
+
+void mux_release(vws_mux_cnx* c)
+{
+    vws_mux* m = c->mux;
+
+    if (m->on_close != NULL)
+    {
+        m->on_close(c);
+    }
+
+    if (c->addrs != NULL)
+    {
+        uv_freeaddrinfo(c->addrs);
+    }
+
+    // Close socket without the blocking close handshake of vws_disconnect()
+    vws_socket_close((vws_socket*)c->cnx);
+    vws_cnx_free(c->cnx);
+
+    if (c->http != NULL)
+    {
+        vws_http_msg_free(c->http);
+    }
+
+    vws_buffer_free(c->out);
+    vws.free(c);
+
+    m->count--;
+}
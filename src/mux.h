@@ -0,0 +1,231 @@
+#ifndef VWS_MUX_DECLARE
+#define VWS_MUX_DECLARE
+
+#include <uv.h>
+
+#include "websocket.h"
+#include "http_message.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//------------------------------------------------------------------------------
+// Client Multiplexer
+//------------------------------------------------------------------------------
+
+/**
+ * @defgroup MuxFunctions
+ *
+ * @brief Client multiplexer: many outbound websocket connections on one libuv
+ * loop.
+ *
+ * Connections are made entirely non-blocking: name resolution, TCP connect, SSL
+ * and the websocket handshake are driven by the loop, as is all I/O after that.
+ * Messages are delivered by callback. A single thread can therefore hold as
+ * many connections as it has file descriptors.
+ *
+ * The multiplexer is not thread-safe. All functions must be called from the
+ * thread running the loop, typically from within callbacks.
+ */
+
+struct vws_mux;
+struct vws_mux_cnx;
+
+/**
+ * @brief Multiplexed connection states.
+ */
+typedef enum
+{
+    VWS_MUX_RESOLVING,  /**< Resolving host name                      */
+    VWS_MUX_CONNECTING, /**< TCP connect in progress                  */
+    VWS_MUX_TLS,        /**< SSL handshake in progress                */
+    VWS_MUX_HANDSHAKE,  /**< Websocket handshake in progress          */
+    VWS_MUX_OPEN,       /**< Connected, messages flow                 */
+    VWS_MUX_CLOSING,    /**< Close frame sent, flushing before close  */
+    VWS_MUX_CLOSED      /**< Closed, waiting for handle to be released */
+} vws_mux_state_t;
+
+/**
+ * @brief Callback for connection events.
+ *
+ * @param c The connection
+ */
+typedef void (*vws_mux_cb)(struct vws_mux_cnx* c);
+
+/**
+ * @brief Callback for incoming messages.
+ *
+ * @param c The connection
+ * @param m The message. The callback takes ownership and must free it.
+ */
+typedef void (*vws_mux_msg_cb)(struct vws_mux_cnx* c, vws_msg* m);
+
+/**
+ * @brief A multiplexed client connection
+ */
+typedef struct vws_mux_cnx
+{
+    /**< The websocket connection. Holds the socket, URL, receive buffer and
+     *   frame queue. Not to be used with blocking vws_cnx functions. */
+    vws_cnx* cnx;
+
+    /**< The multiplexer */
+    struct vws_mux* mux;
+
+    /**< Connection state */
+    vws_mux_state_t state;
+
+    /**< Socket poll handle */
+    uv_poll_t poll;
+
+    /**< Poll events currently requested */
+    int events;
+
+    /**< Name resolution request */
+    uv_getaddrinfo_t resolver;
+
+    /**< Resolved addresses, tried in turn until one connects. NULL once
+     *   connected. */
+    struct addrinfo* addrs;
+
+    /**< Address being connected to */
+    struct addrinfo* addr;
+
+    /**< Pending output */
+    vws_buffer* out;
+
+    /**< Handshake response parser. NULL once open. */
+    vws_http_msg* http;
+
+    /**< User-defined data associated with the connection */
+    void* data;
+
+} vws_mux_cnx;
+
+/**
+ * @brief A client multiplexer
+ */
+typedef struct vws_mux
+{
+    /**< The event loop. Applications may add their own handles to it. */
+    uv_loop_t* loop;
+
+    /**< Number of connections not yet released */
+    size_t count;
+
+    /**< Socket read buffer, shared by all connections */
+    unsigned char* rbuf;
+
+    /**< Size of rbuf */
+    size_t rsize;
+
+    /**< Called when a connection completes the websocket handshake */
+    vws_mux_cb on_open;
+
+    /**< Called for each message received */
+    vws_mux_msg_cb on_msg;
+
+    /**< Called exactly once for every connection when it closes or fails to
+     *   connect, before it is freed. */
+    vws_mux_cb on_close;
+
+    /**< User-defined data */
+    void* data;
+
+} vws_mux;
+
+/**
+ * @brief Creates a multiplexer with its own event loop.
+ *
+ * @return The multiplexer
+ *
+ * @ingroup MuxFunctions
+ */
+vws_mux* vws_mux_new();
+
+/**
+ * @brief Frees a multiplexer. Any remaining connections are closed without
+ * a close handshake.
+ *
+ * @param m The multiplexer
+ *
+ * @ingroup MuxFunctions
+ */
+void vws_mux_free(vws_mux* m);
+
+/**
+ * @brief Starts a connection. Returns immediately: on_open is called once the
+ * connection is established, on_close if it fails.
+ *
+ * @param m The multiplexer
+ * @param uri The websocket URL (ws:// or wss://)
+ * @param data User-defined data for the connection
+ * @return The connection, or NULL if the URL is invalid or resolution could
+ *         not be started.
+ *
+ * @ingroup MuxFunctions
+ */
+vws_mux_cnx* vws_mux_connect(vws_mux* m, cstr uri, void* data);
+
+/**
+ * @brief Queues a message for sending. Data is written immediately if the
+ * socket allows, the remainder when it becomes writable.
+ *
+ * @param c The connection
+ * @param data The message data
+ * @param size The size of data
+ * @param opcode TEXT_FRAME or BINARY_FRAME
+ * @return True if queued, false if the connection is not open
+ *
+ * @ingroup MuxFunctions
+ */
+bool vws_mux_send( vws_mux_cnx* c,
+                   ucstr data,
+                   size_t size,
+                   unsigned char opcode );
+
+/**
+ * @brief Starts closing a connection: sends a close frame and closes the
+ * socket once output is flushed. on_close is called when done.
+ *
+ * @param c The connection
+ *
+ * @ingroup MuxFunctions
+ */
+void vws_mux_close(vws_mux_cnx* c);
+
+/**
+ * @brief Runs the loop until all connections have closed or vws_mux_stop() is
+ * called.
+ *
+ * @param m The multiplexer
+ *
+ * @ingroup MuxFunctions
+ */
+void vws_mux_run(vws_mux* m);
+
+/**
+ * @brief Processes pending events without blocking.
+ *
+ * @param m The multiplexer
+ * @return Non-zero if there are still active handles
+ *
+ * @ingroup MuxFunctions
+ */
+int vws_mux_poll(vws_mux* m);
+
+/**
+ * @brief Stops vws_mux_run() after the current loop iteration.
+ *
+ * @param m The multiplexer
+ *
+ * @ingroup MuxFunctions
+ */
+void vws_mux_stop(vws_mux* m);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* VWS_MUX_DECLARE */
@@ -34,11 +34,217 @@ static bool reconnect(vrtql_rpc* rpc)
 // Client-side Internal functions
 //------------------------------------------------------------------------------
 
+/**
+ * @brief An in-flight asynchronous call
+ */
+typedef struct rpc_pending
+{
+    /**< The call tag. This is also the key in the pending map. */
+    char* tag;
+
+    /**< The completion callback */
+    vrtql_rpc_cb cb;
+
+    /**< User-defined data passed to the callback */
+    void* data;
+
+    /**< Deadline in microseconds (vws_clock_usec()). Zero means none. */
+    uint64_t deadline;
+
+} rpc_pending;
+
+/**
+ * @brief Sends a message, reconnecting if the connection has dropped.
+ *
+ * @param rpc The RPC instance
+ * @param req The message to send
+ * @return True if sent, false otherwise. On connection failure vws.e has both
+ *         VE_SOCKET and VE_SEND set.
+ */
+static bool rpc_send(vrtql_rpc* rpc, vrtql_msg* req);
+
+/**
+ * @brief Removes an in-flight call from the pending map and invokes its
+ * callback with the given reply.
+ *
+ * @param rpc The RPC instance
+ * @param p The call
+ * @param reply The reply (callback takes ownership), or NULL on failure
+ */
+static void rpc_complete(vrtql_rpc* rpc, rpc_pending* p, vrtql_msg* reply);
+
+/**
+ * @brief Completes the in-flight call matching a reply's tag, if any.
+ *
+ * @param rpc The RPC instance
+ * @param reply The reply
+ * @return True if the reply matched a call (and was consumed), false otherwise.
+ */
+static bool rpc_dispatch(vrtql_rpc* rpc, vrtql_msg* reply);
+
+/**
+ * @brief Completes in-flight calls with a NULL reply and the given error.
+ *
+ * @param rpc The RPC instance
+ * @param now If non-zero, only calls whose deadline is at or before this time
+ *        (usec) are completed. If zero, all calls are completed.
+ * @param code The error code to set for each completion
+ * @return The number of calls completed
+ */
+static int rpc_fail(vrtql_rpc* rpc, uint64_t now, int code);
+
+/**
+ * @brief Computes how long poll() may wait without overrunning the nearest
+ * call deadline.
+ *
+ * @param rpc The RPC instance
+ * @param timeout The maximum wait in milliseconds
+ * @return The wait in milliseconds
+ */
+static int rpc_wait_time(vrtql_rpc* rpc, int timeout);
+
+static bool rpc_send(vrtql_rpc* rpc, vrtql_msg* req)
+{
+    // Loop until message sent or fatal error. Timeouts are ignored: keeps
+    // grinding until message is fully sent or error.
+    while (true)
+    {
+        if (vrtql_msg_send(rpc->cnx, req) > 0)
+        {
+            // Message successfully sent
+            return true;
+        }
+
+        // If connection dropped
+        if (vws.e.code == VE_SOCKET)
+        {
+            // Replies to calls in flight were lost with the connection. They
+            // cannot arrive on a new one, so fail them before reconnecting.
+            rpc_fail(rpc, 0, VE_SOCKET | VE_RECV);
+
+            // Try to reconnect
+            if (reconnect(rpc) == true)
+            {
+                // Reconnect worked. Try again.
+                continue;
+            }
+
+            // Failed to reconnect. Modify error to indicate the failure was on
+            // send so the caller knows the message was not sent. Error will
+            // have both bits set: VE_SOCKET and VE_SEND.
+            vws_set_flag(&vws.e.code, VE_SEND);
+        }
+
+        return false;
+    }
+}
+
+static void rpc_complete(vrtql_rpc* rpc, rpc_pending* p, vrtql_msg* reply)
+{
+    // Remove before invoking callback as it may issue new calls
+    sc_map_del_sv(&rpc->pending, p->tag);
+
+    p->cb(rpc, reply, p->data);
+
+    free(p->tag);
+    vws.free(p);
+}
+
+static bool rpc_dispatch(vrtql_rpc* rpc, vrtql_msg* reply)
+{
+    cstr tag = vrtql_msg_get_routing(reply, "tag");
+
+    if (tag == NULL)
+    {
+        return false;
+    }
+
+    rpc_pending* p = sc_map_get_sv(&rpc->pending, tag);
+
+    if (sc_map_found(&rpc->pending) == false)
+    {
+        return false;
+    }
+
+    vws.success();
+    rpc_complete(rpc, p, reply);
+
+    return true;
+}
+
+static int rpc_fail(vrtql_rpc* rpc, uint64_t now, int code)
+{
+    size_t size = sc_map_size_sv(&rpc->pending);
+
+    if (size == 0)
+    {
+        return 0;
+    }
+
+    // Collect first: the map cannot be modified while iterating it.
+    rpc_pending** list = vws.malloc(sizeof(rpc_pending*) * size);
+    size_t n           = 0;
+
+    cstr key; rpc_pending* p;
+    sc_map_foreach(&rpc->pending, key, p)
+    {
+        if ((now == 0) || ((p->deadline != 0) && (p->deadline <= now)))
+        {
+            list[n++] = p;
+        }
+    }
+
+    // Detach all before invoking any callback. A callback may issue a new call
+    // that fails in turn, which must not complete these a second time.
+    for (size_t i = 0; i < n; i++)
+    {
+        sc_map_del_sv(&rpc->pending, list[i]->tag);
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+        vws.error(code, "RPC call did not complete");
+        rpc_complete(rpc, list[i], NULL);
+    }
+
+    vws.free(list);
+
+    return n;
+}
+
+static int rpc_wait_time(vrtql_rpc* rpc, int timeout)
+{
+    uint64_t now  = vws_clock_usec();
+    uint64_t wait = (uint64_t)timeout * 1000;
+
+    cstr key; rpc_pending* p;
+    sc_map_foreach(&rpc->pending, key, p)
+    {
+        if (p->deadline == 0)
+        {
+            continue;
+        }
+
+        if (p->deadline <= now)
+        {
+            return 0;
+        }
+
+        if (p->deadline - now < wait)
+        {
+            wait = p->deadline - now;
+        }
+    }
+
+    // Round up so we do not wake just short of the deadline
+    return (int)((wait + 999) / 1000);
+}
+
 char* vrtql_rpc_tag(uint16_t length)
 {
     char valid_chars[]  = "abcdefghijklmnopqrstuvwxyz0123456789";
     unsigned char* data = (unsigned char*)malloc(length);
-    unsigned char* tag  = (unsigned char*)malloc(length);
+    unsigned char* tag  = (unsigned char*)malloc(length + 1);
 
     if (RAND_bytes(data, length) != 1)
     {
@@ -55,6 +261,8 @@ char* vrtql_rpc_tag(uint16_t length)
         tag[cnt]   = valid_chars[c];
     }
 
+    tag[length] = '\0';
+
     free(data);
 
     return (char*)tag;
@@ -122,32 +330,8 @@ vrtql_msg* vrtql_rpc_exec(vrtql_rpc* rpc, vrtql_msg* req)
         vws_trace_unlock();
     }
 
-    // Loop until message sent or fatal error. Timeouts are ignored: keeps
-    // grinding until message is fully sent or error.
-    while (true)
+    if (rpc_send(rpc, req) == false)
     {
-        if (vrtql_msg_send(rpc->cnx, req) > 0)
-        {
-            // Message successfully sent
-            break;
-        }
-
-        // If connection dropped
-        if (vws.e.code == VE_SOCKET)
-        {
-            // Try to reconnect
-            if (reconnect(rpc) == true)
-            {
-                // Reconnect worked. Try again.
-                continue;
-            }
-
-            // Failed to reconnect. Modify error to indicate the failure was on
-            // send so the caller knows the message was not sent. Error will
-            // have both bits set: VE_SOCKET and VE_SEND.
-            vws_set_flag(&vws.e.code, VE_SEND);
-        }
-
         // Hand error back to caller.
         free(tag);
         return NULL;
@@ -169,10 +353,16 @@ vrtql_msg* vrtql_rpc_exec(vrtql_rpc* rpc, vrtql_msg* req)
             cstr t = vrtql_msg_get_routing(reply, "tag");
 
             // If tags do not match
-            if (strncmp(tag, t, strlen(tag)) != 0)
+            if ((t == NULL) || (strcmp(tag, t) != 0))
             {
-                // This is not response message. Send to handler.
-                rpc->out_of_band(rpc, reply);
+                // This is not response message. It may be the response to an
+                // asynchronous call. Otherwise send to handler.
+                if (rpc_dispatch(rpc, reply) == false)
+                {
+                    rpc->out_of_band(rpc, reply);
+                }
+
+                reply = NULL;
 
                 // Keep waiting for response.
                 continue;
@@ -223,6 +413,135 @@ vrtql_msg* vrtql_rpc_exec(vrtql_rpc* rpc, vrtql_msg* req)
     return reply;
 }
 
+bool vrtql_rpc_send( vrtql_rpc* rpc,
+                     vrtql_msg* req,
+                     uint32_t timeout,
+                     vrtql_rpc_cb cb,
+                     void* data )
+{
+    // Assign a tag unique among calls in flight
+    char* tag = NULL;
+
+    while (true)
+    {
+        tag = vrtql_rpc_tag(7);
+
+        if (tag == NULL)
+        {
+            vws.error(VE_RT, "Failed to generate tag");
+            return false;
+        }
+
+        sc_map_get_sv(&rpc->pending, tag);
+
+        if (sc_map_found(&rpc->pending) == false)
+        {
+            break;
+        }
+
+        free(tag);
+    }
+
+    vrtql_msg_set_routing(req, "tag", tag);
+
+    if (rpc_send(rpc, req) == false)
+    {
+        // Error already set
+        free(tag);
+        return false;
+    }
+
+    rpc_pending* p = vws.malloc(sizeof(rpc_pending));
+    p->tag         = tag;
+    p->cb          = cb;
+    p->data        = data;
+    p->deadline    = 0;
+
+    if (timeout > 0)
+    {
+        p->deadline = vws_clock_usec() + (uint64_t)timeout * 1000;
+    }
+
+    sc_map_put_sv(&rpc->pending, p->tag, p);
+
+    return true;
+}
+
+int vrtql_rpc_poll(vrtql_rpc* rpc, int timeout)
+{
+    vws.success();
+
+    int completed = 0;
+    int saved     = rpc->cnx->base.timeout;
+    int wait      = rpc_wait_time(rpc, timeout);
+
+    while (sc_map_size_sv(&rpc->pending) > 0)
+    {
+        rpc->cnx->base.timeout = wait;
+        vrtql_msg* reply       = vrtql_msg_recv(rpc->cnx);
+
+        if (reply == NULL)
+        {
+            if (vws_cnx_is_connected(rpc->cnx) == false)
+            {
+                rpc->cnx->base.timeout = saved;
+
+                // All responses are lost. There is no point in reconnecting.
+                rpc_fail(rpc, 0, VE_SOCKET | VE_RECV);
+                vws.error(VE_SOCKET | VE_RECV, "Connection lost");
+
+                return -1;
+            }
+
+            // Timeout (nothing more buffered) or undecodable message
+            if (vws.e.code == VE_TIMEOUT)
+            {
+                break;
+            }
+
+            continue;
+        }
+
+        if (rpc_dispatch(rpc, reply) == true)
+        {
+            completed++;
+        }
+        else
+        {
+            rpc->out_of_band(rpc, reply);
+        }
+
+        // We have waited once. From here on only take what has already arrived.
+        wait = 0;
+    }
+
+    rpc->cnx->base.timeout = saved;
+
+    completed += rpc_fail(rpc, vws_clock_usec(), VE_TIMEOUT);
+
+    vws.success();
+
+    return completed;
+}
+
+bool vrtql_rpc_wait(vrtql_rpc* rpc)
+{
+    while (sc_map_size_sv(&rpc->pending) > 0)
+    {
+        if (vrtql_rpc_poll(rpc, rpc->cnx->base.timeout) < 0)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+size_t vrtql_rpc_pending(vrtql_rpc* rpc)
+{
+    return sc_map_size_sv(&rpc->pending);
+}
+
 void out_of_band_default(vrtql_rpc* rpc, vrtql_msg* m)
 {
     if (m != NULL)
@@ -245,6 +564,8 @@ vrtql_rpc* vrtql_rpc_new(vws_cnx* cnx)
     rpc->data        = NULL;
     rpc->val         = vws_buffer_new();
 
+    sc_map_init_sv(&rpc->pending, 0, 0);
+
     return rpc;
 }
 
@@ -252,7 +573,9 @@ void vrtql_rpc_free(vrtql_rpc* rpc)
 {
     if (rpc != NULL)
     {
-        vws_buffer_new(rpc->val);
+        rpc_fail(rpc, 0, VE_RT);
+        sc_map_term_sv(&rpc->pending);
+        vws_buffer_free(rpc->val);
         vws.free(rpc);
     }
 }
@@ -295,6 +618,28 @@ static void sys_map_set(vrtql_rpc_map* map, cstr key, void* value);
  */
 static void sys_map_clear(vrtql_rpc_map* map, cstr key, vrtql_rpc_map_free cb);
 
+/**
+ * @brief Adds or updates a call in a system's dispatch index.
+ *
+ * @param s The RPC system
+ * @param m The module the call belongs to
+ * @param fn The call name within the module
+ * @param c The RPC call
+ */
+static void sys_index_set( vrtql_rpc_system* s,
+                           vrtql_rpc_module* m,
+                           cstr fn,
+                           vrtql_rpc_call c );
+
+/**
+ * @brief Removes all calls belonging to a module from a system's dispatch
+ * index.
+ *
+ * @param s The RPC system
+ * @param m The module
+ */
+static void sys_index_drop(vrtql_rpc_system* s, vrtql_rpc_module* m);
+
 //------------------------------------------------------------------------------
 // Server-side API
 //------------------------------------------------------------------------------
@@ -310,8 +655,9 @@ vrtql_rpc_module* vrtql_rpc_module_new(cstr name)
 
     m = (vrtql_rpc_module*)vws.malloc(sizeof(vrtql_rpc_module));
 
-    m->name = strdup(name);
-    m->data = NULL;
+    m->name   = strdup(name);
+    m->system = NULL;
+    m->data   = NULL;
     sc_map_init_sv(&m->calls, 0, 0);
 
     return m;
@@ -337,6 +683,11 @@ void vrtql_rpc_module_free(vrtql_rpc_module* m)
 void vrtql_rpc_module_set(vrtql_rpc_module* m, cstr n, vrtql_rpc_call c)
 {
     sys_map_set(&m->calls, n, c);
+
+    if (m->system != NULL)
+    {
+        sys_index_set(m->system, m, n, c);
+    }
 }
 
 vrtql_rpc_call vrtql_rpc_module_get(vrtql_rpc_module* m, cstr n)
@@ -353,6 +704,8 @@ vrtql_rpc_system* vrtql_rpc_system_new()
     vrtql_rpc_system* s;
     s = (vrtql_rpc_system*)vws.malloc(sizeof(vrtql_rpc_system));
     sc_map_init_sv(&s->modules, 0, 0);
+    sc_map_init_sv(&s->index, 0, 0);
+    s->slots = 0;
 
     return s;
 }
@@ -376,13 +729,44 @@ void vrtql_rpc_system_free(vrtql_rpc_system* s)
 
         sc_map_term_sv(&s->modules);
 
+        vrtql_rpc_entry* entry;
+        sc_map_foreach(&s->index, key, entry)
+        {
+            vws.free(entry);
+            vws.free(key);
+        }
+
+        sc_map_term_sv(&s->index);
+
         vws.free(s);
     }
 }
 
 void vrtql_rpc_system_set(vrtql_rpc_system* s, vrtql_rpc_module* m)
 {
+    vrtql_rpc_module* existing = sys_map_get(&s->modules, m->name);
+
+    if (existing == m)
+    {
+        existing = NULL;
+    }
+
+    if (existing != NULL)
+    {
+        sys_index_drop(s, existing);
+    }
+
     sys_map_set(&s->modules, m->name, m);
+    m->system = s;
+
+    // The system owned the module it replaced
+    vrtql_rpc_module_free(existing);
+
+    cstr key; vrtql_rpc_call call;
+    sc_map_foreach(&m->calls, key, call)
+    {
+        sys_index_set(s, m, key, call);
+    }
 }
 
 vrtql_rpc_module* vrtql_rpc_system_get(vrtql_rpc_system* s, cstr n)
@@ -390,49 +774,51 @@ vrtql_rpc_module* vrtql_rpc_system_get(vrtql_rpc_system* s, cstr n)
     return sys_map_get(&s->modules, n);
 }
 
+vrtql_rpc_entry* vrtql_rpc_system_lookup(vrtql_rpc_system* s, cstr id)
+{
+    return sys_map_get(&s->index, id);
+}
+
 //------------------------------------------------------------------------------
 // RPC API
 //------------------------------------------------------------------------------
 
-bool parse_rpc_string(const char* input, char** module, char** function)
+vrtql_msg* vrtql_rpc_reply(vrtql_msg* req)
 {
-    // Find the first occurrence of the period
-    const char* delimiter = strchr(input, '.');
+    vrtql_msg* reply = vrtql_msg_new();
 
-    if (delimiter != NULL)
-    {
-        // Calculate the lengths of the module and function substrings
-        size_t m_len = delimiter - input;
-        size_t f_len = strlen(input) - m_len - 1;
+    cstr tag = vrtql_msg_get_routing(req, "tag");
 
-        // Allocate memory for the module and function strings
-        *module   = (char*)vws.malloc((m_len + 1) * sizeof(char));
-        *function = (char*)vws.malloc((f_len + 1) * sizeof(char));
+    if (tag != NULL)
+    {
+        vrtql_msg_set_routing(reply, "tag", tag);
+    }
 
-        // Copy the module substring
-        strncpy(*module, input, m_len);
-        (*module)[m_len] = '\0';
+    // Use same format as request (JSON/MessagePack)
+    reply->format = req->format;
 
-        // Copy the function substring
-        strncpy(*function, delimiter + 1, f_len);
-        (*function)[f_len] = '\0';
+    return reply;
+}
 
-        return true;
+vrtql_msg* vrtql_rpc_env_reply(vrtql_rpc_env* e, vrtql_msg* req)
+{
+    if (e->reply == NULL)
+    {
+        return vrtql_rpc_reply(req);
     }
 
-    // Invalid input format
-    return false;
-}
+    vrtql_msg* reply = e->reply;
+    vrtql_msg_clear(reply);
 
-vrtql_msg* vrtql_rpc_reply(vrtql_msg* req)
-{
-    vrtql_msg* reply = vrtql_msg_new();
+    // Lanes set on the previous reply must not carry over
+    reply->flags = 0;
+    vws_set_flag(&reply->flags, VM_MSG_VALID);
 
     cstr tag = vrtql_msg_get_routing(req, "tag");
 
     if (tag != NULL)
     {
-        vrtql_msg_set_routing(req, "tag", tag);
+        vrtql_msg_set_routing(reply, "tag", tag);
     }
 
     // Use same format as request (JSON/MessagePack)
@@ -468,53 +854,30 @@ vrtql_msg* vrtql_rpc_service(vrtql_rpc_system* s, vrtql_rpc_env* e, vrtql_msg* r
         return NULL;
     }
 
-    // Parse ID into module and function
-    char* mn; char* fn;
-    if (parse_rpc_string(id, &mn, &fn) == false)
-    {
-        vws.error(VE_RT, "Invalid ID format");
-
-        vrtql_msg_free(req);
-
-        return NULL;
-    }
-
-    // Lookup module in system
-    vrtql_rpc_module* module = vrtql_rpc_system_get(s, mn);
+    // Resolve module and function in a single lookup
+    vrtql_rpc_entry* entry = vrtql_rpc_system_lookup(s, id);
 
-    if (module == NULL)
+    if (entry == NULL)
     {
-        vws.error(VE_RT, "RPC does not exist");
+        if (strchr(id, '.') == NULL)
+        {
+            vws.error(VE_RT, "Invalid ID format");
+        }
+        else
+        {
+            vws.error(VE_RT, "RPC does not exist");
+        }
 
         vrtql_msg_free(req);
-        vws.free(mn);
-        vws.free(fn);
 
         return NULL;
     }
 
     // Set module reference in environment
-    e->module = module;
-
-    // Lookup RPC in module
-    vrtql_rpc_call rpc = vrtql_rpc_module_get(module, fn);
-
-    if (rpc == NULL)
-    {
-        vws.error(VE_RT, "RPC does not exist");
-
-        vrtql_msg_free(req);
-        vws.free(mn);
-        vws.free(fn);
-
-        return NULL;
-    }
-
-    vws.free(mn);
-    vws.free(fn);
+    e->module = entry->module;
 
     // Invoke RPC
-    vrtql_msg* reply = rpc(e, req);
+    vrtql_msg* reply = entry->call(e, req);
 
     // Free request
     vrtql_msg_free(req);
@@ -562,6 +925,20 @@ void sys_map_set(vrtql_rpc_map* map, cstr key, void* value)
         // We don't. Therefore we need to allocate new key.
         key = strdup(key);
     }
+    else
+    {
+        // We do. Put replaces the stored key as well as the value, so we must
+        // pass back the key the map already owns.
+        cstr k;
+        sc_map_foreach_key(map, k)
+        {
+            if (strcmp(k, key) == 0)
+            {
+                key = k;
+                break;
+            }
+        }
+    }
 
     sc_map_put_sv(map, key, value);
 }
@@ -580,3 +957,61 @@ void sys_map_clear(vrtql_rpc_map* map, cstr key, vrtql_rpc_map_free cb)
     sc_map_del_sv(map, key);
 }
 
+void sys_index_set( vrtql_rpc_system* s,
+                    vrtql_rpc_module* m,
+                    cstr fn,
+                    vrtql_rpc_call c )
+{
+    size_t size = strlen(m->name) + strlen(fn) + 2;
+    char* key   = (char*)vws.malloc(size);
+    snprintf(key, size, "%s.%s", m->name, fn);
+
+    vrtql_rpc_entry* entry = sc_map_get_sv(&s->index, key);
+
+    if (sc_map_found(&s->index) == true)
+    {
+        // Existing entry: update in place
+        vws.free(key);
+    }
+    else
+    {
+        entry       = (vrtql_rpc_entry*)vws.malloc(sizeof(vrtql_rpc_entry));
+        entry->slot = s->slots++;
+        sc_map_put_sv(&s->index, key, entry);
+    }
+
+    entry->module = m;
+    entry->call   = c;
+}
+
+void sys_index_drop(vrtql_rpc_system* s, vrtql_rpc_module* m)
+{
+    size_t size = sc_map_size_sv(&s->index);
+
+    if (size == 0)
+    {
+        return;
+    }
+
+    // Collect first: the map cannot be modified while iterating it.
+    char** keys = (char**)vws.malloc(sizeof(char*) * size);
+    size_t n    = 0;
+
+    cstr key; vrtql_rpc_entry* entry;
+    sc_map_foreach(&s->index, key, entry)
+    {
+        if (entry->module == m)
+        {
+            keys[n++] = key;
+        }
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+        vws.free(sc_map_get_sv(&s->index, keys[i]));
+        sc_map_del_sv(&s->index, keys[i]);
+        vws.free(keys[i]);
+    }
+
+    vws.free(keys);
+}
@@ -36,6 +36,17 @@ typedef void (*vrtql_rpc_ob)(struct vrtql_rpc* rpc, vrtql_msg* m);
  */
 typedef bool (*vrtql_rpc_reconnect)(struct vrtql_rpc* rpc);
 
+/**
+ * @brief Callback for completion of an asynchronous RPC call
+ * @param rpc The RPC environment
+ * @param reply The response message. The callback takes ownership and must
+ *        free it with vrtql_msg_free(). This is NULL if the call failed, in
+ *        which case vws.e holds the reason: VE_TIMEOUT if the deadline passed,
+ *        VE_SOCKET if the connection was lost, VE_RT if the call was cancelled.
+ * @param data The user-defined data passed to vrtql_rpc_send()
+ */
+typedef void (*vrtql_rpc_cb)(struct vrtql_rpc* rpc, vrtql_msg* reply, void* data);
+
 /**
  * @brief Struct representing a RPC environment
  */
@@ -56,6 +67,9 @@ typedef struct vrtql_rpc
     /**< Data from last response */
     vws_buffer* val;
 
+    /**< In-flight asynchronous calls. Key is tag, value is internal record. */
+    struct sc_map_sv pending;
+
     /**> User-defined data*/
     void* data;
 
@@ -70,7 +84,8 @@ typedef struct vrtql_rpc
 vrtql_rpc* vrtql_rpc_new(vws_cnx* cnx);
 
 /**
- * @brief Frees the resources allocated to a RPC module
+ * @brief Frees the resources allocated to a RPC module. Any asynchronous calls
+ * still in flight are completed with a NULL reply and VE_RT.
  *
  * @param rpc The RPC instance
  */
@@ -115,6 +130,67 @@ vrtql_msg* vrtql_rpc_exec(vrtql_rpc* rpc, vrtql_msg* req);
  */
 bool vrtql_rpc_invoke(vrtql_rpc* rpc, vrtql_msg* req);
 
+/**
+ * @brief Asynchronous RPC call invocation. This assigns the request a unique
+ * tag, sends it and returns immediately without waiting for the response. Any
+ * number of calls may be in flight at once on the same connection. Responses
+ * are matched to calls by tag in vrtql_rpc_poll(), which invokes the callback.
+ *
+ * @param rpc The RPC instance
+ * @param req The message to send. Caller retains ownership and may free it as
+ *        soon as this function returns.
+ * @param timeout The call deadline in milliseconds. If no response arrives in
+ *        time the callback is invoked with NULL and VE_TIMEOUT. Zero means no
+ *        deadline.
+ * @param cb The completion callback
+ * @param data User-defined data passed to the callback
+ * @return True if the request was sent, false otherwise. On failure the
+ *         callback is not invoked and vws.e has VE_SOCKET and VE_SEND set if
+ *         the connection dropped. If the connection dropped, calls already in
+ *         flight are completed with VE_SOCKET | VE_RECV before reconnecting,
+ *         whether or not the reconnect succeeds.
+ */
+bool vrtql_rpc_send( vrtql_rpc* rpc,
+                     vrtql_msg* req,
+                     uint32_t timeout,
+                     vrtql_rpc_cb cb,
+                     void* data );
+
+/**
+ * @brief Processes responses to asynchronous calls. This waits up to timeout
+ * milliseconds for the first response (never past the nearest call deadline),
+ * then completes every response already received without further waiting.
+ * Messages whose tag does not match an in-flight call are passed to the
+ * out_of_band handler. Calls whose deadline has passed are completed with
+ * VE_TIMEOUT.
+ *
+ * @param rpc The RPC instance
+ * @param timeout Maximum time to wait in milliseconds
+ * @return The number of calls completed (including timeouts), or -1 if the
+ *         connection failed. On connection failure all in-flight calls are
+ *         completed with VE_SOCKET | VE_RECV.
+ */
+int vrtql_rpc_poll(vrtql_rpc* rpc, int timeout);
+
+/**
+ * @brief Polls until all in-flight asynchronous calls have completed, either
+ * by response, deadline or connection failure. Calls sent without a deadline
+ * may cause this to block indefinitely if the peer never responds.
+ *
+ * @param rpc The RPC instance
+ * @return True if all calls completed without connection failure, false
+ *         otherwise.
+ */
+bool vrtql_rpc_wait(vrtql_rpc* rpc);
+
+/**
+ * @brief Returns the number of asynchronous calls in flight
+ *
+ * @param rpc The RPC instance
+ * @return The number of calls awaiting completion
+ */
+size_t vrtql_rpc_pending(vrtql_rpc* rpc);
+
 //------------------------------------------------------------------------------
 // Server Side
 //------------------------------------------------------------------------------
@@ -131,6 +207,9 @@ typedef struct vrtql_rpc_module
     /**< Map of RPC calls. Key is call name. Value is vrtql_rpc_call. */
     vrtql_rpc_map calls;
 
+    /**< The system this module is registered in, NULL if none. */
+    struct vrtql_rpc_system* system;
+
     /**> User-defined data*/
     void* data;
 
@@ -147,6 +226,12 @@ typedef struct vrtql_rpc_env
     /**< Reference to current module */
     vrtql_rpc_module* module;
 
+    /**< Reusable reply message. If set, vrtql_rpc_env_reply() clears it
+     *   (flags included) and returns it instead of allocating a new message.
+     *   It remains owned by whoever set it (e.g. the RPC server), who must not
+     *   free a returned reply that is this message. NULL if unused. */
+    vrtql_msg* reply;
+
 } vrtql_rpc_env;
 
 /**
@@ -156,11 +241,38 @@ typedef struct vrtql_rpc_env
  */
 typedef vrtql_msg* (*vrtql_rpc_call)(vrtql_rpc_env* e, vrtql_msg* m);
 
+/**
+ * @brief Dispatch index entry. Resolves a fully qualified call name to the
+ * module and function that implement it.
+ */
+typedef struct vrtql_rpc_entry
+{
+    /**< The module the call belongs to */
+    vrtql_rpc_module* module;
+
+    /**< The RPC call */
+    vrtql_rpc_call call;
+
+    /**< Dense index of this entry, unique within the system. Used to keep
+     *   per-call data (e.g. statistics) in arrays rather than maps. */
+    uint32_t slot;
+
+} vrtql_rpc_entry;
+
 typedef struct vrtql_rpc_system
 {
     /**< Map of RPC modules. Key is module name. Value is module instance. */
     vrtql_rpc_map modules;
 
+    /**< Dispatch index. Key is "module.function". Value is vrtql_rpc_entry.
+     *   This is maintained by vrtql_rpc_system_set() and
+     *   vrtql_rpc_module_set() so that servicing a call takes a single lookup
+     *   with no allocation. */
+    vrtql_rpc_map index;
+
+    /**< Number of slots assigned to index entries */
+    uint32_t slots;
+
 } vrtql_rpc_system;
 
 /**
@@ -171,14 +283,16 @@ typedef struct vrtql_rpc_system
 vrtql_rpc_module* vrtql_rpc_module_new(cstr name);
 
 /**
- * @brief Frees the resources allocated to a RPC module
+ * @brief Frees the resources allocated to a RPC module. Modules registered in a
+ * system are owned by the system and freed by vrtql_rpc_system_free().
  *
  * @param m The RPC module
  */
 void vrtql_rpc_module_free(vrtql_rpc_module* m);
 
 /**
- * @brief Adds an RPC to module.
+ * @brief Adds an RPC to module. If the module is registered in a system, the
+ * system's dispatch index is updated.
  *
  * @param m The RPC module
  * @param n The name of the The RPC module
@@ -210,7 +324,9 @@ vrtql_rpc_system* vrtql_rpc_system_new();
 void vrtql_rpc_system_free(vrtql_rpc_system* s);
 
 /**
- * @brief Adds a module to a system.
+ * @brief Adds a module to a system and indexes its calls. The system takes
+ * ownership of the module. A module previously registered under the same name
+ * is removed from the index and freed.
  *
  * @param s The RPC system
  * @param m The RPC module
@@ -226,6 +342,15 @@ void vrtql_rpc_system_set(vrtql_rpc_system* s, vrtql_rpc_module* m);
  */
 vrtql_rpc_module* vrtql_rpc_system_get(vrtql_rpc_system* s, cstr n);
 
+/**
+ * @brief Resolves a fully qualified call name using the dispatch index.
+ *
+ * @param s The RPC system
+ * @param id The call name in the form "module.function"
+ * @return The index entry if the call exists, NULL otherwise
+ */
+vrtql_rpc_entry* vrtql_rpc_system_lookup(vrtql_rpc_system* s, cstr id);
+
 /**
  * @brief Creates and initializes reply message for RPC call
  * @param m The incoming message to process
@@ -233,6 +358,19 @@ vrtql_rpc_module* vrtql_rpc_system_get(vrtql_rpc_system* s, cstr n);
  */
 vrtql_msg* vrtql_rpc_reply(vrtql_msg* req);
 
+/**
+ * @brief Creates and initializes reply message for RPC call, reusing the
+ * environment's reply message if it has one. RPC calls should prefer this over
+ * vrtql_rpc_reply() so servers that provide a reusable reply avoid allocating
+ * a message per call.
+ *
+ * @param e The RPC environment
+ * @param req The incoming message to process
+ * @return A reply message. If this is e->reply the caller must not free it,
+ *         otherwise the caller takes ownership.
+ */
+vrtql_msg* vrtql_rpc_env_reply(vrtql_rpc_env* e, vrtql_msg* req);
+
 /**
  * @brief Service an RPC call
  * @param c The RPC system instance
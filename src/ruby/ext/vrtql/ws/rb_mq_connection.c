@@ -73,7 +73,7 @@ static vws_cnx* get_object(VALUE self)
  * @param  value [VRTQL::Message] The message to send.
 
  * @param format [:Symbol] (optional) Specify the serialization format. This can
- * be either :json or :mpack. The default is :mpack.
+ * be either :json, :mpack or :schema. The default is :mpack.
 
  * @return [Integer] The number of bytes sent.
  */
@@ -109,11 +109,15 @@ static VALUE m_send(int argc, VALUE* argv, VALUE self)
         {
             format = VM_MPACK_FORMAT;
         }
+        else if (SYM2ID(format_value) == rb_intern("schema"))
+        {
+            format = VM_MPACK_SCHEMA_FORMAT;
+        }
         else
         {
             rb_raise( rb_eArgError,
                       "Invalid format specified. "
-                      "Expected :json or :mpack.");
+                      "Expected :json, :mpack or :schema.");
         }
     }
     else
@@ -185,7 +189,7 @@ static VALUE m_receive(VALUE self)
  * Sets the default message serializeation form
  *
  * @param format [:Symbol] (optional) Specify the serialization format. This can
- * be either :json or :mpack. The default is :mpack.
+ * be either :json, :mpack or :schema. The default is :mpack.
  *
  * @return [Integer] The number of bytes sent.
  */
@@ -205,11 +209,15 @@ static VALUE m_set_format(VALUE self, VALUE format_value)
     {
         handle->default_format = VM_MPACK_FORMAT;
     }
+    else if (SYM2ID(format_value) == rb_intern("schema"))
+    {
+        handle->default_format = VM_MPACK_SCHEMA_FORMAT;
+    }
     else
     {
         rb_raise( rb_eArgError,
                   "Invalid format specified. "
-                  "Expected :json or :mpack.");
+                  "Expected :json, :mpack or :schema.");
     }
 
     return Qnil;
@@ -0,0 +1,2 @@
+
+export version='2.0.0'
@@ -2,10 +2,27 @@
 #include <unistd.h>
 #endif
 
+#if defined(__linux__)
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#endif
+
+#if defined(VWS_IO_URING)
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "uring.h"
+#endif
+
+#include <ctype.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include "server.h"
 #include "websocket.h"
@@ -172,6 +189,53 @@ static void uv_thread(uv_async_t* handle);
  */
 static void worker_thread(void* arg);
 
+/**
+ * @defgroup MetricsFunctions
+ *
+ * @brief Functions that record server metrics
+ *
+ */
+
+/**
+ * @brief Returns the metrics block of the calling thread. Worker threads have
+ * their own. All other threads (network thread, application threads) share
+ * element 0.
+ *
+ * @param s The server
+ * @return The metrics block
+ *
+ * @ingroup MetricsFunctions
+ */
+static vws_svr_metrics* svr_metrics(vws_tcp_svr* s);
+
+/**
+ * @brief Adds to a counter in the calling thread's metrics block.
+ *
+ * @param s The server
+ * @param k The metric
+ * @param n The amount to add. Gauges are decremented by adding the two's
+ *        complement.
+ *
+ * @ingroup MetricsFunctions
+ */
+static void svr_metric_add(vws_tcp_svr* s, vws_svr_metric_t k, uint64_t n);
+
+/**
+ * @brief Records the latency of a stage in the calling thread's metrics block.
+ * Nothing is recorded if either timestamp is missing.
+ *
+ * @param s The server
+ * @param k The stage
+ * @param start The stage start time (usec), zero if unknown
+ * @param end The stage end time (usec)
+ *
+ * @ingroup MetricsFunctions
+ */
+static void svr_metric_stage( vws_tcp_svr* s,
+                              vws_svr_stage_t k,
+                              uint64_t start,
+                              uint64_t end );
+
 /**
  * @defgroup ServerFunctions
  *
@@ -261,6 +325,28 @@ static void on_uv_walk(uv_handle_t* handle, void* arg);
  */
 static void svr_on_connect(uv_stream_t* server, int status);
 
+/**
+ * @brief Applies the socket options of the server to its listening socket,
+ * after bind and before listen.
+ *
+ * @param s The server
+ * @param socket The bound listening socket
+ * @return 0 if successful, a libuv error code otherwise.
+ *
+ * @ingroup ServerFunctions
+ */
+static int svr_listen_options(vws_tcp_svr* s, uv_tcp_t* socket);
+
+/**
+ * @brief Applies the socket options of the server to an accepted connection.
+ *
+ * @param s The server
+ * @param c The accepted connection
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_accept_options(vws_tcp_svr* s, uv_tcp_t* c);
+
 /**
  * @brief Callback for buffer reallocation.
  *
@@ -321,6 +407,17 @@ static void svr_on_read(uv_stream_t* client, ssize_t size, const uv_buf_t* buf);
  */
 static void svr_on_write_complete(uv_write_t* req, int status);
 
+/**
+ * @brief Completes written data, whichever backend wrote it. Updates the
+ *        metrics and frees it.
+ *
+ * @param data The data
+ * @param status The status of the write operation.
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_write_done(vws_svr_data* data, int status);
+
 /**
  * @defgroup Connection Functions
  *
@@ -352,6 +449,27 @@ static vws_svr_cnx* svr_cnx_new(vws_tcp_svr* s, uv_stream_t* c);
  */
 static void svr_cnx_free(vws_svr_cnx* c);
 
+/**
+ * @brief Calls fn for each message held in a batch and resets the batch.
+ *
+ * @param b The batch
+ * @param fn Function called for each serialized message, in order
+ * @param x User-defined context passed to fn
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_batch_each(vrtql_msg_batch* b, vrtql_msg_batch_fn fn, void* x);
+
+/**
+ * @brief Frees the batch of a closing connection, passing each message it
+ * still holds to data_lost_cb().
+ *
+ * @param c The connection
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_batch_lost(vws_svr_cnx* c);
+
 /**
  * @brief Actively close a client connection
  *
@@ -359,6 +477,126 @@ static void svr_cnx_free(vws_svr_cnx* c);
  */
 static void svr_cnx_close(vws_tcp_svr* server, vws_cid_t c);
 
+/**
+ * @brief Closes a client connection once its pending writes are done. Used
+ *        to close after a response. Runs in uv_thread().
+ *
+ * @param c The connection
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_cnx_shutdown(vws_svr_cnx* c);
+
+/**
+ * @brief Callback for the completion of svr_cnx_shutdown(). Closes the handle.
+ *
+ * @param req The shutdown request
+ * @param status The status of the shutdown
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_on_shutdown(uv_shutdown_t* req, int status);
+
+/**
+ * @brief Handles notice from a worker that it is done with a connection's
+ *        HTTP request and has queued its response. Closes the connection if
+ *        it was not keep-alive, otherwise goes on with requests pipelined
+ *        behind it. Runs in uv_thread().
+ *
+ * @param server The server
+ * @param cid The connection ID
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_http_complete(vws_tcp_svr* server, vws_cid_t cid);
+
+/**
+ * @brief Takes an HTTP request parser from the server's pool, or creates one
+ *        if the pool is empty. Parsers borrow headers from the connection's
+ *        receive buffer. Runs in uv_thread().
+ *
+ * @param s The server
+ * @return A parser in borrow mode, ready for a new request
+ *
+ * @ingroup ServerFunctions
+ */
+static vws_http_msg* svr_http_acquire(vws_tcp_svr* s);
+
+/**
+ * @brief Returns an HTTP request parser to the server's pool, or frees it if
+ *        the pool is full. May be called from any thread.
+ *
+ * @param s The server
+ * @param m The parser. NULL is ignored.
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_http_release(vws_tcp_svr* s, vws_http_msg* m);
+
+/**
+ * @brief Starts the connection timing wheel if the server has an idle or
+ *        handshake timeout or a ping interval. Runs in uv_thread().
+ *
+ * @param s The server
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_wheel_start(vws_tcp_svr* s);
+
+/**
+ * @brief Puts a newly accepted connection on the timing wheel, if it runs.
+ *
+ * @param s The server
+ * @param c The connection
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_wheel_add(vws_tcp_svr* s, vws_svr_cnx* c);
+
+/**
+ * @brief Files a connection in the timing wheel slot of a deadline.
+ *
+ * @param s The server
+ * @param c The connection, not on the wheel
+ * @param due The loop time (ms) of the deadline
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_wheel_schedule(vws_tcp_svr* s, vws_svr_cnx* c, uint64_t due);
+
+/**
+ * @brief Takes a connection off the timing wheel. Does nothing if it is not
+ *        on it.
+ *
+ * @param s The server
+ * @param c The connection
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_wheel_remove(vws_tcp_svr* s, vws_svr_cnx* c);
+
+/**
+ * @brief Checks a connection whose slot came up. Closes it if a timeout
+ *        expired, probes it if it is due for a ping, and otherwise files it
+ *        under its next deadline.
+ *
+ * @param s The server
+ * @param c The connection, not on the wheel
+ * @param now The loop time (ms)
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_wheel_visit(vws_tcp_svr* s, vws_svr_cnx* c, uint64_t now);
+
+/**
+ * @brief Timer callback advancing the timing wheel to the current tick.
+ *
+ * @param handle The wheel timer
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_wheel_on_tick(uv_timer_t* handle);
+
 /**
  * @brief Callback for client connection.
  *
@@ -385,6 +623,37 @@ static void svr_client_connect(vws_svr_cnx* c);
  */
 static void svr_client_disconnect(vws_svr_cnx* c);
 
+/**
+ * @brief Callback for peer connection. Default does nothing.
+ *
+ * @param c The connection
+ * @param p The peer
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_client_peer_connect(vws_svr_cnx* c, vws_peer* p);
+
+/**
+ * @brief Callback for peer loss. Default does nothing.
+ *
+ * @param c The connection
+ * @param p The peer
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_client_peer_lost(vws_svr_cnx* c, vws_peer* p);
+
+/**
+ * @brief Marks the peer of a closing peer connection as closed so that
+ * uv_thread() reconnects it.
+ *
+ * @param server The server
+ * @param c The connection
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_peer_lost(vws_tcp_svr* server, vws_svr_cnx* c);
+
 /**
  * @brief Callback for client read operations.
  *
@@ -497,2472 +766,7776 @@ static void ws_svr_client_disconnect(vws_svr_cnx* c);
 static void ws_svr_client_read(vws_svr_cnx* c, ssize_t size, const uv_buf_t* buf);
 
 /**
- * @brief Callback for processing client data in (ingress) for msg server
+ * @brief Parses and dispatches the HTTP requests in a connection's buffer.
  *
- * This function processes data arriving from client to worker thread. It
- * collects data until there is a complete message. It passes message to
- * ws_svr_client_msg_in() for processing. This takes place in the context of
- * worker_thread().
+ * Pipelined requests are taken one at a time. While a request is with a
+ * worker, those behind it stay in the buffer until svr_http_complete(), so
+ * responses go out in request order. Handles the WebSocket upgrade.
  *
- * @param server The server instance
- * @param data The incoming data from the client to process.
- * @param x The user-defined context
+ * @param c The connection
+ * @return Returns true if the connection was upgraded and WebSocket data
+ *   follows the request in the buffer, false otherwise.
  *
  * @ingroup WebSocketServerFunctions
  */
-static void ws_svr_client_data_in(vws_svr_data* data, void* x);
+static bool ws_svr_http_ingress(vws_svr_cnx* c);
 
 /**
- * @brief Sends data from a server connection to a client WebSocket connection.
+ * @brief Offers a complete HTTP request to the server's inline_http callback
+ *        and sends its response directly. Runs in uv_thread().
  *
- * @param server The server
- * @param c The connection index
- * @param buffer The data to send.
- * @param opcode The opcode for the WebSocket frame.
+ * @param c The connection
+ * @param used The bytes of the request in the connection's buffer
+ * @return Returns true if the request was answered, false otherwise.
+ *
+ * @ingroup WebSocketServerFunctions
  */
-static void ws_svr_client_data_out( vws_svr* server,
-                                    vws_cid_t c,
-                                    vws_buffer* buffer,
-                                    unsigned char opcode);
+static bool ws_svr_http_inline(vws_svr_cnx* c, size_t used);
 
 /**
- * @brief Process a WebSocket frame received from a client.
+ * @brief Answers a request in place on uv_thread(): releases it, drains it
+ *        from the connection's buffer and writes the response. Closes the
+ *        connection after if it is not keep-alive.
  *
- * @param c The WebSocket connection.
- * @param f The incoming frame to process.
+ * @param c The connection
+ * @param used The bytes of the request in the connection's buffer
+ * @param out The response. Its data is taken, the caller frees it.
+ *
+ * @ingroup WebSocketServerFunctions
  */
-static void ws_svr_process_frame(vws_cnx* c, vws_frame* f);
+static void ws_svr_http_send(vws_svr_cnx* c, size_t used, vws_buffer* out);
 
 /**
- * @brief Callback for client message processing
- *
- * This function is triggered when a message is read from a client
- * connection. It is responsible for processing the message. This takes place in
- * the context of worker_thread().
+ * @brief Answers a complete HTTP request from the server's static files if
+ *        its path is under their prefix. Runs in uv_thread().
  *
- * @param s The server
- * @param c The connection ID
- * @param m The message to process
- * @param x The user-defined context
+ * @param c The connection
+ * @param used The bytes of the request in the connection's buffer
+ * @return Returns true if the request was answered, false otherwise.
  *
  * @ingroup WebSocketServerFunctions
  */
-static void ws_svr_client_msg_in(vws_svr* s, vws_cid_t cid, vws_msg* m, void* x);
+static bool ws_svr_http_file(vws_svr_cnx* c, size_t used);
 
 /**
- * @brief Callback for sending message to client. It takes a message as input,
- * serializes it to a binary WebSocket message and then sends it to the
- * uv_thread() to send back to client. This takes place in the context of
- * worker_thread() (only to be called within that context).
+ * @brief Writes the 101 response to a WebSocket upgrade. Runs in uv_thread().
  *
- * This function sends a message back to a client.
+ * The response is assembled from static parts on the stack and written with
+ * uv_try_write(), so the common case does not allocate. Whatever the socket
+ * does not take is queued through on_data_out().
  *
- * @param s The server
- * @param c The connection ID
- * @param m The message to send
- * @param x The user-defined context
+ * @param c The connection
+ * @param key The Sec-WebSocket-Key header value
+ * @param proto The Sec-WebSocket-Protocol header value, or NULL
  *
  * @ingroup WebSocketServerFunctions
  */
-static void ws_svr_client_msg_out(vws_svr* s, vws_cid_t c, vws_msg* m, void* x);
+static void ws_svr_upgrade(vws_svr_cnx* c, cstr key, cstr proto);
+
+//------------------------------------------------------------------------------
+// Static files
+//------------------------------------------------------------------------------
 
 /**
- * @brief Default WebSocket message processing function. This is mean to be
- * overriden by application to perform message processing, specifically by
- * assigning the vws_svr.process callback to the desired processing
- * handler. The default implementation simple drops (deletes) the incoming
- * message.
+ * @brief Closes all cached files and frees static file serving.
  *
- * @param s The server instance.
- * @param c The server connection.
- * @param m The incoming WebSocket message.
- * @param x The user-defined context
+ * @param files The static files. NULL is ignored.
  *
- * @ingroup MessageServerFunctions
+ * @ingroup ServerFunctions
  */
-static void ws_svr_client_process(vws_svr* s, vws_cid_t c, vws_msg* m, void* x);
+static void svr_files_free(vws_svr_files* files);
+
+// Files are sent with sendfile() on a socket descriptor, which Windows does not
+// have. There vws_svr_static() fails and server->files stays NULL.
+#if !defined(__windows__)
+
+/**
+ * @brief A static file being sent on a connection. Only used by uv_thread().
+ */
+typedef struct svr_sendfile
+{
+    /**< The server */
+    vws_tcp_svr* server;
+
+    /**< The connection. NULL once it is done with the file. */
+    vws_svr_cnx* cnx;
+
+    /**< The connection ID */
+    vws_cid_t cid;
+
+    /**< The file */
+    vws_svr_file* file;
+
+    /**< The response head */
+    vws_buffer* head;
+
+    /**< Writes the head */
+    uv_write_t write;
+
+    /**< Sends file data in the libuv thread pool */
+    uv_work_t work;
+
+    /**< Bytes sent by the last send, or a libuv error code */
+    ssize_t result;
+
+    /**< Waits for the socket to take more data */
+    uv_poll_t poll;
+
+    /**< Duplicate of the socket descriptor. It keeps the socket open while a
+     *   send is in flight, even if the connection closes. */
+    int fd;
 
+    /**< File offset of the next send */
+    int64_t offset;
 
+    /**< Bytes left to send */
+    uint64_t remaining;
 
+    /** Flag set while the head is being written */
+    bool writing;
+
+    /** Flag set while a send is in flight */
+    bool sending;
+
+    /** Flag set while the poll handle is open */
+    bool polling;
+
+    /** Flag set while the poll handle is closing */
+    bool closing;
+
+} svr_sendfile;
 
 /**
- * @defgroup MessageServerFunctions
+ * @brief Decodes the path of a URL below a static file prefix into a path
+ *        relative to the root, appending the index file to directory paths.
  *
- * @brief Functions that support message server operation
+ * @param files The static files
+ * @param url The URL path after the prefix, without query or fragment
+ * @param size The length of url
+ * @param path The buffer for the relative path
+ * @param max The size of path
+ * @return Returns false if the path is invalid, contains ".." or is too long.
  *
+ * @ingroup ServerFunctions
  */
+static bool svr_file_path( vws_svr_files* files,
+                           cstr url,
+                           size_t size,
+                           char* path,
+                           size_t max );
 
 /**
- * @brief Convert incoming WebSocket messages to VRTQL messages for processing.
- *
- * @param s The server instance
- * @param c The connection ID
- * @param m The incoming WebSocket message.
- * @param x The user-defined context
- *
- * @ingroup MessageServerFunctions
+ * @brief A static file request waiting on the file system. Only used by
+ *        uv_thread().
  */
-static void msg_svr_client_ws_msg_in(vws_svr* s, vws_cid_t c, vws_msg* m, void* x);
+typedef struct svr_file_lookup
+{
+    /**< The server */
+    vws_tcp_svr* server;
+
+    /**< The connection. Looked up again when done, as it may have closed. */
+    vws_cid_t cid;
+
+    /**< Path relative to the root */
+    char* path;
+
+    /**< Full path */
+    char* full;
+
+    /**< Request method */
+    int method;
+
+    /**< Copy of the If-None-Match header, or NULL */
+    char* tag;
+
+    /**< Cached file being checked against the file system. Holds a reference. */
+    vws_svr_file* check;
+
+    /**< File opened by the lookup */
+    uv_file fd;
+
+    /**< The file system request */
+    uv_fs_t req;
+
+} svr_file_lookup;
 
 /**
- * @brief Callback function for handling incoming VRTQL messages from a client.
+ * @brief Looks up a file in the static file cache without touching the file
+ *        system. The caller holds a reference until svr_file_release().
  *
- * @param s The server instance
- * @param c The connection ID
- * @param m The incoming VRTQL message.
- * @param x The user-defined context
+ * @param files The static files
+ * @param loop The loop, for its time
+ * @param path The path relative to the root
+ * @return The file, or NULL if it is not cached or its ttl is up.
  *
- * @ingroup MessageServerFunctions
+ * @ingroup ServerFunctions
  */
-static void msg_svr_client_msg_in(vws_svr* s, vws_cid_t c, vrtql_msg* m, void* x);
+static vws_svr_file* svr_file_cached( vws_svr_files* files,
+                                      uv_loop_t* loop,
+                                      cstr path );
 
 /**
- * @brief Callback function for sending VRTQL messages to a client.
+ * @brief Answers a static file request whose file is not in the cache, or is
+ *        due to be checked, once the file system has been consulted. The
+ *        request is released and later requests on the connection wait until
+ *        it is answered. Runs in uv_thread().
  *
- * @param s The server instance
- * @param c The server connection.
- * @param m The outgoing VRTQL message.
- * @param x The user-defined context
+ * @param c The connection
+ * @param used The bytes of the request in the connection's buffer
+ * @param path The path relative to the root
  *
- * @ingroup MessageServerFunctions
+ * @ingroup ServerFunctions
  */
-static void msg_svr_client_msg_out(vws_svr* s, vws_cid_t c, vrtql_msg* m, void* x);
+static void svr_file_lookup_start(vws_svr_cnx* c, size_t used, cstr path);
 
 /**
- * @brief Callback function for sending VRTQL messages to a client. This is jut
- * like msg_svr_client_msg_out() but it does NOT deallocate msg. This is for
- * when you want to send multiple copies of the same message.
+ * @brief Callback for the stat of a cached file whose ttl is up.
  *
- * @param s The server instance
- * @param c The server connection.
- * @param m The outgoing VRTQL message.
- * @param x The user-defined context
+ * @param req The file system request
  *
- * @ingroup MessageServerFunctions
+ * @ingroup ServerFunctions
  */
-static void msg_svr_client_msg_dispatch(vws_svr* s, vws_cid_t c, vrtql_msg* m, void* x);
+static void svr_file_on_stat(uv_fs_t* req);
 
 /**
- * @brief Default VRTQL message processing function.
+ * @brief Callback for opening a file which is not cached.
  *
- * @param s The server instance
- * @param c The server connection.
- * @param m The incoming VRTQL message.
- * @param x The user-defined context
+ * @param req The file system request
  *
- * @ingroup MessageServerFunctions
+ * @ingroup ServerFunctions
  */
-static void msg_svr_client_process(vws_svr* s, vws_cid_t c, vrtql_msg* m, void* x);
+static void svr_file_on_open(uv_fs_t* req);
 
+/**
+ * @brief Callback for the stat of a newly opened file. Adds it to the cache.
+ *
+ * @param req The file system request
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_file_on_fstat(uv_fs_t* req);
 
+/**
+ * @brief Ends a lookup, answering the request if its connection is still
+ *        open, and frees it.
+ *
+ * @param l The lookup
+ * @param f The file, holding a reference, or NULL if there is none
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_file_lookup_end(svr_file_lookup* l, vws_svr_file* f);
 
+/**
+ * @brief Writes the response head for a file.
+ *
+ * @param out The buffer to write to
+ * @param f The file, or NULL for 404 Not Found
+ * @param method The request method
+ * @param tag The If-None-Match header, or NULL
+ * @param close If true, adds "Connection: close"
+ * @return Returns true if the file data is to follow, false otherwise.
+ *
+ * @ingroup ServerFunctions
+ */
+static bool svr_file_head( vws_buffer* out,
+                           vws_svr_file* f,
+                           int method,
+                           cstr tag,
+                           bool close );
 
 /**
- * @defgroup ConnectionMap
+ * @brief Sends a file response on a connection whose request is released.
+ *        Completes the request if it waited on a lookup. Runs in uv_thread().
  *
- * @brief Functions that provide access to the connection map
+ * @param c The connection
+ * @param f The file. Takes the caller's reference. NULL if none.
+ * @param out The response head. Takes ownership.
+ * @param body If true, the file data follows the head
  *
- * The connection map tracks all active connections. These functions simplify
- * the map API and include memory management and other server-specific
- * functionality where appropriate.
+ * @ingroup ServerFunctions
+ */
+static void svr_file_send( vws_svr_cnx* c,
+                           vws_svr_file* f,
+                           vws_buffer* out,
+                           bool body );
+
+/**
+ * @brief Drops a reference to a file, closing it if it is no longer cached.
  *
- * @ingroup ConnectionMap
+ * @param f The file
+ *
+ * @ingroup ServerFunctions
  */
+static void svr_file_release(vws_svr_file* f);
 
 /**
- * @brief Get the connection corresponding to a client from the connection map.
+ * @brief Removes a file from the cache. It is closed once unused.
  *
- * @param map The connection map.
- * @param key The client (used as key in the map).
- * @return The corresponding server connection.
+ * @param files The static files
+ * @param f The file
  *
- * @ingroup ConnectionMap
+ * @ingroup ServerFunctions
  */
-static vws_svr_cnx* svr_cnx_map_get(vws_svr_cnx_map* map, uv_stream_t* key);
+static void svr_file_evict(vws_svr_files* files, vws_svr_file* f);
 
 /**
- * @brief Set a connection for a client in the connection map.
+ * @brief Returns the content type for a file, from its extension.
  *
- * @param map The connection map.
- * @param key The client (used as key in the map).
- * @param value The server connection.
- * @return Success or failure status.
+ * @param path The file path
+ * @return The content type
  *
- * @ingroup ConnectionMap
+ * @ingroup ServerFunctions
  */
-static int8_t svr_cnx_map_set( vws_svr_cnx_map* map,
-                               uv_stream_t* key,
-                               vws_svr_cnx* value );
+static cstr svr_file_type(cstr path);
 
 /**
- * @brief Remove a client's connection from the connection map.
+ * @brief Starts sending a file on a connection: writes the head, then the
+ *        file data with sendfile(). Later requests on the connection
+ *        wait until it is done. Runs in uv_thread().
  *
- * @param map The connection map.
- * @param key The client (used as key in the map).
+ * @param c The connection
+ * @param f The file. Takes the caller's reference.
+ * @param head The response head. Takes ownership.
  *
- * @ingroup ConnectionMap
+ * @ingroup ServerFunctions
  */
-static void svr_cnx_map_remove(vws_svr_cnx_map* map, uv_stream_t* key);
+static void svr_sendfile_start( vws_svr_cnx* c,
+                                vws_svr_file* f,
+                                vws_buffer* head );
 
 /**
- * @brief Clear all connections from the connection map.
+ * @brief Sends the next part of the file.
  *
- * @param map The connection map.
+ * @param t The transfer
  *
- * @ingroup ConnectionMap
+ * @ingroup ServerFunctions
  */
-static void svr_cnx_map_clear(vws_svr_cnx_map* map);
+static void svr_sendfile_next(svr_sendfile* t);
 
 /**
- * @defgroup QueueGroup
+ * @brief Callback for the head write. Starts sending file data.
  *
- * @brief Queue functions which bridge the network thread and workers
+ * @param req The write request
+ * @param status The status of the write
  *
- * The network thread and worker threads pass data via queues. These queues
- * contain vws_svr_data instances. There is a requests queue which passes
- * data from the network thread to workers for processing. There is a response
- * queue that passed data from worker queues to the network thread. When passed
- * from network thread to work, data take form of incoming data from the
- * client. When passed from the worker threads the the networking thread, data
- * take the form of outgoing data to be sent back to the client.
+ * @ingroup ServerFunctions
+ */
+static void svr_sendfile_on_head(uv_write_t* req, int status);
+
+/**
+ * @brief Sends as much of the file as the socket takes without blocking. Runs
+ *        in the libuv thread pool, so reading the file does not hold up the
+ *        loop.
  *
- * Queues have built-in synchronization mechanisms that allow the data to be
- * safely passed between threads, as well as ways to gracefull put waiting
- * threads to sleep until data arrives for processing.
+ * @param req The work request
+ *
+ * @ingroup ServerFunctions
  */
+static void svr_sendfile_work(uv_work_t* req);
 
 /**
- * @brief Initializes a server queue.
+ * @brief Callback for svr_sendfile_work(). Sends more, waits for the socket if
+ *        it is full, or ends the transfer.
  *
- * This function sets up the provided queue with the given capacity. It also
- * initializes the synchronization mechanisms associated with the queue.
+ * @param req The work request
+ * @param status The status of the work request
  *
- * @param queue Pointer to the server queue to be initialized.
- * @param capacity The maximum capacity of the queue.
- * @param name The queue name
+ * @ingroup ServerFunctions
+ */
+static void svr_sendfile_on_send(uv_work_t* req, int status);
+
+/**
+ * @brief Callback for the socket taking more data.
  *
- * @ingroup QueueGroup
+ * @param poll The poll handle
+ * @param status The status
+ * @param events The events
+ *
+ * @ingroup ServerFunctions
  */
-static void queue_init(vws_svr_queue* queue, int capacity, cstr name);
+static void svr_sendfile_on_poll(uv_poll_t* poll, int status, int events);
 
 /**
- * @brief Destroys a server queue.
+ * @brief Callback for the poll handle closing.
  *
- * This function cleans up the resources associated with the provided queue.
- * It also handles the synchronization mechanisms associated with the queue.
+ * @param handle The poll handle
  *
- * @param queue Pointer to the server queue to be destroyed.
+ * @ingroup ServerFunctions
+ */
+static void svr_sendfile_on_close(uv_handle_t* handle);
+
+/**
+ * @brief Ends a transfer. On success the connection goes on with the next
+ *        request, on failure it is closed. The transfer is freed once no
+ *        operation is in flight.
  *
- * @ingroup QueueGroup
+ * @param t The transfer
+ * @param status 0 on success, a libuv error code otherwise
+ *
+ * @ingroup ServerFunctions
  */
-static void queue_destroy(vws_svr_queue* queue);
+static void svr_sendfile_end(svr_sendfile* t, int status);
 
 /**
- * @brief Pushes data to the server queue.
+ * @brief Frees a transfer once no operation is in flight. Called again by the
+ *        last callback otherwise.
  *
- * This function adds data to the end of the provided queue. It also handles
- * the necessary synchronization to ensure thread safety.
+ * @param t The transfer
  *
- * @param queue Pointer to the server queue.
- * @param data Data to be added to the queue.
+ * @ingroup ServerFunctions
+ */
+static void svr_sendfile_free(svr_sendfile* t);
+
+
+/**
+ * @brief Writes the response head, then sends the file. Waits for sends queued
+ *        through the io_uring backend first, so the head follows them.
  *
- * @ingroup QueueGroup
+ * @param t The transfer
+ *
+ * @ingroup ServerFunctions
  */
-static void queue_push(vws_svr_queue* queue, vws_svr_data* data);
+static void svr_sendfile_head(svr_sendfile* t);
+
+#endif
+
+//------------------------------------------------------------------------------
+// io_uring backend
+//------------------------------------------------------------------------------
 
 /**
- * @brief Pops data from the server queue.
+ * @defgroup RingFunctions
  *
- * This function removes and returns data from the front of the provided queue.
- * It also handles the necessary synchronization to ensure thread safety.
+ * @brief io_uring I/O for accepted connections (VWS_SVR_BACKEND_URING).
  *
- * @param queue Pointer to the server queue.
- * @return A data element from the front of the queue.
+ * The ring runs beside the libuv loop, which watches its eventfd. Each
+ * connection keeps one multishot receive armed. The kernel picks a buffer for
+ * each read from a provided buffer ring, so there is no read system call and no
+ * buffer allocated per read. Responses queue per connection and go out as one
+ * sendmsg() of up to SVR_RING_IOV of them. The sends of all connections are
+ * submitted together in one system call before the loop blocks. The libuv
+ * handle stays and is still used for close, shutdown and socket options.
  *
- * @ingroup QueueGroup
+ * Everything runs in uv_thread(). Without VWS_IO_URING these functions are
+ * stubs and the server always uses libuv.
  */
-static vws_svr_data* queue_pop(vws_svr_queue* queue);
+
+/** What waits for a connection's queued sends to go out */
+#define SVR_RING_SHUTDOWN 1
+#define SVR_RING_SENDFILE 2
 
 /**
- * @brief Checks if the server queue is empty.
+ * @brief Sets up the ring and hooks it into the loop.
  *
- * This function checks whether the provided queue is empty.
- * It also handles the necessary synchronization to ensure thread safety.
+ * @param s The server
+ * @return true if successful, false if the kernel does not support it.
  *
- * @param queue Pointer to the server queue.
- * @return True if the queue is empty, false otherwise.
+ * @ingroup RingFunctions
+ */
+static bool svr_ring_start(vws_tcp_svr* s);
+
+/**
+ * @brief Closes the loop handles of the ring. Called before the loop is
+ *        closed.
  *
- * @ingroup QueueGroup
+ * @param s The server
+ *
+ * @ingroup RingFunctions
  */
-static bool queue_empty(vws_svr_queue* queue);
+static void svr_ring_stop(vws_tcp_svr* s);
 
-//------------------------------------------------------------------------------
-// Peer timer
-//------------------------------------------------------------------------------
+/**
+ * @brief Frees the ring, along with connection state and data still waiting
+ *        on requests in flight. Called after the loop is closed.
+ *
+ * @param s The server
+ *
+ * @ingroup RingFunctions
+ */
+static void svr_ring_free(vws_tcp_svr* s);
 
-void peer_timer_callback(uv_timer_t* handle)
-{
-    if (vws.tracelevel >= VT_SERVICE)
-    {
-        vws.trace(VL_INFO, "peer_timer_callback(%p)", handle);
-    }
+/**
+ * @brief Hands the I/O of an accepted connection to the ring and arms its
+ *        receive.
+ *
+ * @param c The connection
+ * @return true if successful, false if it has to use libuv.
+ *
+ * @ingroup RingFunctions
+ */
+static bool svr_ring_attach(vws_svr_cnx* c);
 
-    // Stop timer
-    uv_timer_stop(handle);
+/**
+ * @brief Detaches a connection that is being freed. Cancels its requests in
+ *        flight. The ring state goes once they complete.
+ *
+ * @param c The connection
+ *
+ * @ingroup RingFunctions
+ */
+static void svr_ring_detach(vws_svr_cnx* c);
 
-    // Wakeup server
-    vws_tcp_svr* s = (vws_tcp_svr*)handle->data;
-    uv_async_send(s->wakeup);
-}
+/**
+ * @brief Queues data to send on a ring connection.
+ *
+ * @param c The connection
+ * @param data The data. Takes ownership if successful.
+ * @return true if queued, false if the connection is closing.
+ *
+ * @ingroup RingFunctions
+ */
+static bool svr_ring_send(vws_svr_cnx* c, vws_svr_data* data);
 
-void vws_tcp_svr_peer_timer(vws_tcp_svr* s)
-{
-    float interval = 0.2;
+/**
+ * @brief Checks whether a connection has sends queued or in flight on the
+ *        ring. Anything written past the ring must wait until it has not.
+ *
+ * @param c The connection
+ * @return true if so, false otherwise or if the ring does not do its I/O.
+ *
+ * @ingroup RingFunctions
+ */
+static bool svr_ring_busy(vws_svr_cnx* c);
 
-    // Get the current time
-    time_t current_time = time(NULL);
+/**
+ * @brief Has an action wait for the sends queued on the ring.
+ *
+ * @param c The connection
+ * @param what SVR_RING_SHUTDOWN to call svr_cnx_shutdown(), or
+ *        SVR_RING_SENDFILE to call svr_sendfile_head(), once they are out
+ * @return true if it waits, false if nothing is queued and it may go ahead.
+ *
+ * @ingroup RingFunctions
+ */
+static bool svr_ring_defer(vws_svr_cnx* c, int what);
 
-    if (s->peer_timeout > current_time)
-    {
-        // If we have a timeout already set in the future
-        return;
-    }
+/**
+ * @brief Stops reading a connection, like uv_read_stop().
+ *
+ * @param c The connection
+ *
+ * @ingroup RingFunctions
+ */
+static void svr_ring_read_stop(vws_svr_cnx* c);
 
-    if (vws.tracelevel >= VT_SERVICE)
-    {
-        vws.trace(VL_INFO, "vws_tcp_svr_peer_timer(%p)", s);
-    }
+#if defined(VWS_IO_URING)
 
-    // Calculate the time 15 seconds in advance
-    time_t timeout_time = current_time + interval;
+/** Submission queue size of the ring */
+#define SVR_RING_ENTRIES 1024
 
-    // Set data
-    s->peer_timer->data = s;
+/** Number of receive buffers the kernel picks from */
+#define SVR_RING_BUFFERS 512
 
-    // Start the timer with a 15-second timeout
-    uv_timer_start(s->peer_timer, peer_timer_callback, interval * 1000, 0);
+/** Size of each receive buffer */
+#define SVR_RING_BUFFER_SIZE 16384
 
-    // Update peer_timeout to the timeout time
-    s->peer_timeout = timeout_time;
-}
+/** Most queued responses gathered into one send */
+#define SVR_RING_IOV 16
 
-//------------------------------------------------------------------------------
-// Threads
-//------------------------------------------------------------------------------
+/** Request kinds, kept in the low bits of the request user data */
+#define SVR_RING_RECV   1
+#define SVR_RING_SEND   2
+#define SVR_RING_CANCEL 3
+#define SVR_RING_OPS    3
 
-void worker_thread(void* arg)
-{
-    vws_tcp_svr* server = (vws_tcp_svr*)arg;
+struct svr_ring;
+
+/**
+ * @brief io_uring state of a connection. Outlives the connection until its
+ * last request completes.
+ */
+typedef struct svr_ring_cnx
+{
+    /**< The ring */
+    struct svr_ring* ring;
+
+    /**< The connection. NULL once it is freed. */
+    vws_svr_cnx* cnx;
+
+    /**< The socket */
+    int fd;
+
+    /**< Requests in flight. A multishot receive counts once. */
+    uint32_t ops;
+
+    /** Flag set while the connection is to be read */
+    bool reading;
+
+    /** Flag set while a multishot receive is armed */
+    bool armed;
+
+    /** Flag set while a send is in flight */
+    bool sending;
+
+    /** Flag set while on the list of connections with data to send */
+    bool queued;
+
+    /** Flag set while svr_cnx_shutdown() waits for the sends */
+    bool shutdown;
+
+    /** Flag set while svr_sendfile_head() waits for the sends */
+    bool sendfile;
+
+    /**< Data to send, a circular queue. Its capacity is a power of two. */
+    vws_svr_data** queue;
+
+    /**< Index of the first queued data */
+    uint32_t head;
+
+    /**< Number of queued data */
+    uint32_t count;
+
+    /**< Size of queue */
+    uint32_t capacity;
+
+    /**< Bytes of the first queued data already sent */
+    size_t offset;
+
+    /**< The send in flight */
+    struct msghdr msg;
+
+    /**< The data of the send in flight */
+    struct iovec iov[SVR_RING_IOV];
+
+    /**< Next and previous connection of the ring, for teardown */
+    struct svr_ring_cnx* next;
+    struct svr_ring_cnx* prev;
+
+    /**< Next connection with data to send */
+    struct svr_ring_cnx* send_next;
+
+} svr_ring_cnx;
+
+/**
+ * @brief The io_uring instance of a server
+ */
+typedef struct svr_ring
+{
+    /**< The server */
+    vws_tcp_svr* server;
+
+    /**< The ring */
+    vws_uring uring;
+
+    /**< Receive buffers */
+    vws_uring_bufs bufs;
+
+    /**< Signalled by the kernel on each completion */
+    int efd;
+
+    /**< Watches efd on the loop */
+    uv_poll_t poll;
+
+    /**< Submits before the loop blocks */
+    uv_prepare_t prepare;
+
+    /**< Connections, including those freed with requests in flight */
+    svr_ring_cnx* cnxs;
+
+    /**< Connections with data to send and no send in flight */
+    svr_ring_cnx* sends;
+
+} svr_ring;
+
+/**
+ * @brief Callback for the ring eventfd. Handles completions.
+ *
+ * @param poll The poll handle
+ * @param status The status
+ * @param events The events
+ *
+ * @ingroup RingFunctions
+ */
+static void svr_ring_on_poll(uv_poll_t* poll, int status, int events);
+
+/**
+ * @brief Callback run before the loop blocks. Starts the sends queued in this
+ *        iteration and submits them, with anything else pending, at once.
+ *
+ * @param prepare The prepare handle
+ *
+ * @ingroup RingFunctions
+ */
+static void svr_ring_on_prepare(uv_prepare_t* prepare);
+
+/**
+ * @brief Handles all completions in the completion queue.
+ *
+ * @param ring The ring
+ *
+ * @ingroup RingFunctions
+ */
+static void svr_ring_reap(svr_ring* ring);
+
+/**
+ * @brief Handles a receive completion. Passes data to on_read() and re-arms
+ *        or closes the connection when the multishot receive ends.
+ *
+ * @param rc The connection state
+ * @param res The result
+ * @param flags The completion flags
+ *
+ * @ingroup RingFunctions
+ */
+static void svr_ring_on_recv(svr_ring_cnx* rc, int res, uint32_t flags);
+
+/**
+ * @brief Handles a send completion. Completes the data sent and sends the
+ *        rest.
+ *
+ * @param rc The connection state
+ * @param res Bytes sent, or -errno
+ *
+ * @ingroup RingFunctions
+ */
+static void svr_ring_on_send(svr_ring_cnx* rc, int res);
+
+/**
+ * @brief Starts the sends queued since the last call and submits.
+ *
+ * @param ring The ring
+ *
+ * @ingroup RingFunctions
+ */
+static void svr_ring_flush(svr_ring* ring);
+
+/**
+ * @brief Takes a submission entry, submitting to make room if the queue is
+ *        full.
+ *
+ * @param ring The ring
+ * @return The entry, NULL if none could be had.
+ *
+ * @ingroup RingFunctions
+ */
+static struct io_uring_sqe* svr_ring_sqe(svr_ring* ring);
+
+/**
+ * @brief Arms the multishot receive of a connection.
+ *
+ * @param rc The connection state
+ * @return true if successful, false otherwise.
+ *
+ * @ingroup RingFunctions
+ */
+static bool svr_ring_recv(svr_ring_cnx* rc);
+
+/**
+ * @brief Sends as much queued data as fits into one sendmsg().
+ *
+ * @param rc The connection state
+ *
+ * @ingroup RingFunctions
+ */
+static void svr_ring_send_next(svr_ring_cnx* rc);
+
+/**
+ * @brief Runs what waited for the sends of a connection to go out.
+ *
+ * @param rc The connection state
+ *
+ * @ingroup RingFunctions
+ */
+static void svr_ring_drained(svr_ring_cnx* rc);
+
+/**
+ * @brief Cancels a request of a connection.
+ *
+ * @param rc The connection state
+ * @param op SVR_RING_RECV or SVR_RING_SEND
+ *
+ * @ingroup RingFunctions
+ */
+static void svr_ring_cancel(svr_ring_cnx* rc, int op);
+
+/**
+ * @brief Drops the queued data of a connection.
+ *
+ * @param rc The connection state
+ * @param status The write status to complete it with
+ *
+ * @ingroup RingFunctions
+ */
+static void svr_ring_drop(svr_ring_cnx* rc, int status);
+
+/**
+ * @brief Frees the state of a freed connection once it has no request in
+ *        flight.
+ *
+ * @param rc The connection state
+ *
+ * @ingroup RingFunctions
+ */
+static void svr_ring_release(svr_ring_cnx* rc);
+
+#endif
+
+/**
+ * @brief Callback for processing client data in (ingress) for msg server
+ *
+ * This function processes data arriving from client to worker thread. It
+ * collects data until there is a complete message. It passes message to
+ * ws_svr_client_msg_in() for processing. This takes place in the context of
+ * worker_thread().
+ *
+ * @param server The server instance
+ * @param data The incoming data from the client to process.
+ * @param x The user-defined context
+ *
+ * @ingroup WebSocketServerFunctions
+ */
+static void ws_svr_client_data_in(vws_svr_data* data, void* x);
+
+/**
+ * @brief Sends data from a server connection to a client WebSocket connection.
+ *
+ * @param server The server
+ * @param c The connection index
+ * @param buffer The data to send.
+ * @param opcode The opcode for the WebSocket frame.
+ */
+static void ws_svr_client_data_out( vws_svr* server,
+                                    vws_cid_t c,
+                                    vws_buffer* buffer,
+                                    unsigned char opcode);
+
+/**
+ * @brief Process a WebSocket frame received from a client.
+ *
+ * @param c The WebSocket connection.
+ * @param f The incoming frame to process.
+ */
+static void ws_svr_process_frame(vws_cnx* c, vws_frame* f);
+
+/**
+ * @brief Sends a WebSocket ping to an idle connection. HTTP connections are
+ *        left alone. Runs in uv_thread().
+ *
+ * @param c The connection
+ *
+ * @ingroup WebSocketServerFunctions
+ */
+static void ws_svr_client_ping(vws_svr_cnx* c);
+
+/**
+ * @brief Callback for client message processing
+ *
+ * This function is triggered when a message is read from a client
+ * connection. It is responsible for processing the message. This takes place in
+ * the context of worker_thread().
+ *
+ * @param s The server
+ * @param c The connection ID
+ * @param m The message to process
+ * @param x The user-defined context
+ *
+ * @ingroup WebSocketServerFunctions
+ */
+static void ws_svr_client_msg_in(vws_svr* s, vws_cid_t cid, vws_msg* m, void* x);
+
+/**
+ * @brief Callback for sending message to client. It takes a message as input,
+ * serializes it to a binary WebSocket message and then sends it to the
+ * uv_thread() to send back to client. This takes place in the context of
+ * worker_thread() (only to be called within that context).
+ *
+ * This function sends a message back to a client.
+ *
+ * @param s The server
+ * @param c The connection ID
+ * @param m The message to send
+ * @param x The user-defined context
+ *
+ * @ingroup WebSocketServerFunctions
+ */
+static void ws_svr_client_msg_out(vws_svr* s, vws_cid_t c, vws_msg* m, void* x);
+
+/**
+ * @brief Default WebSocket message processing function. This is mean to be
+ * overriden by application to perform message processing, specifically by
+ * assigning the vws_svr.process callback to the desired processing
+ * handler. The default implementation simple drops (deletes) the incoming
+ * message.
+ *
+ * @param s The server instance.
+ * @param c The server connection.
+ * @param m The incoming WebSocket message.
+ * @param x The user-defined context
+ *
+ * @ingroup MessageServerFunctions
+ */
+static void ws_svr_client_process(vws_svr* s, vws_cid_t c, vws_msg* m, void* x);
+
+
+
+
+/**
+ * @defgroup MessageServerFunctions
+ *
+ * @brief Functions that support message server operation
+ *
+ */
+
+/**
+ * @brief Convert incoming WebSocket messages to VRTQL messages for processing.
+ *
+ * @param s The server instance
+ * @param c The connection ID
+ * @param m The incoming WebSocket message.
+ * @param x The user-defined context
+ *
+ * @ingroup MessageServerFunctions
+ */
+static void msg_svr_client_ws_msg_in(vws_svr* s, vws_cid_t c, vws_msg* m, void* x);
+
+/**
+ * @brief Callback function for handling incoming VRTQL messages from a client.
+ *
+ * @param s The server instance
+ * @param c The connection ID
+ * @param m The incoming VRTQL message.
+ * @param x The user-defined context
+ *
+ * @ingroup MessageServerFunctions
+ */
+static void msg_svr_client_msg_in(vws_svr* s, vws_cid_t c, vrtql_msg* m, void* x);
+
+/**
+ * @brief Callback function for sending VRTQL messages to a client.
+ *
+ * @param s The server instance
+ * @param c The server connection.
+ * @param m The outgoing VRTQL message.
+ * @param x The user-defined context
+ *
+ * @ingroup MessageServerFunctions
+ */
+static void msg_svr_client_msg_out(vws_svr* s, vws_cid_t c, vrtql_msg* m, void* x);
+
+/**
+ * @brief Callback function for sending VRTQL messages to a client. This is jut
+ * like msg_svr_client_msg_out() but it does NOT deallocate msg. This is for
+ * when you want to send multiple copies of the same message.
+ *
+ * @param s The server instance
+ * @param c The server connection.
+ * @param m The outgoing VRTQL message.
+ * @param x The user-defined context
+ *
+ * @ingroup MessageServerFunctions
+ */
+static void msg_svr_client_msg_dispatch(vws_svr* s, vws_cid_t c, vrtql_msg* m, void* x);
+
+/**
+ * @brief Sends data to the client, accumulating batched messages
+ *
+ * This overrides vws_tcp_svr.on_data_out for the message server. Data flagged
+ * VWS_SVR_STATE_BATCH holds a single serialized message which is appended to
+ * the connection's batch rather than written. Other data causes any pending
+ * batch to be flushed first to preserve ordering. This takes place in the
+ * context of uv_thread().
+ *
+ * @param data The outgoing data
+ * @param x The user-defined context
+ *
+ * @ingroup MessageServerFunctions
+ */
+static void msg_svr_client_data_out(vws_svr_data* data, void* x);
+
+/**
+ * @brief Queues a VRTQL message to uv_thread() for sending. If batching is
+ * enabled, MessagePack messages are queued as batch items.
+ *
+ * @param s The server instance
+ * @param c The server connection.
+ * @param m The outgoing VRTQL message. Not freed.
+ *
+ * @ingroup MessageServerFunctions
+ */
+static void msg_svr_client_msg_send(vws_svr* s, vws_cid_t c, vrtql_msg* m);
+
+/**
+ * @brief Writes out a connection's pending batch, if any, as a single
+ * WebSocket frame. This takes place in the context of uv_thread().
+ *
+ * @param cnx The connection
+ *
+ * @ingroup MessageServerFunctions
+ */
+static void msg_svr_batch_flush(vws_svr_cnx* cnx);
+
+/**
+ * @brief Batch deadline timer callback. Flushes the connection's batch.
+ *
+ * @param handle The timer handle. Data points to connection.
+ *
+ * @ingroup MessageServerFunctions
+ */
+static void msg_svr_batch_timer_cb(uv_timer_t* handle);
+
+/**
+ * @brief Routing state entry for a peer
+ *
+ * @ingroup MessageServerFunctions
+ */
+typedef struct msg_svr_route_peer
+{
+    /**< The peer */
+    vws_peer* peer;
+
+    /**< Messages held while peer is disconnected. NULL if none. */
+    vrtql_msg_batch* backlog;
+} msg_svr_route_peer;
+
+/**
+ * @brief Context for moving the batch of a lost peer connection to the
+ * peer's backlog
+ *
+ * @ingroup MessageServerFunctions
+ */
+typedef struct msg_svr_route_hold
+{
+    /**< The lost peer connection */
+    vws_svr_cnx* cnx;
+
+    /**< Routing state entry of its peer */
+    msg_svr_route_peer* rp;
+} msg_svr_route_hold;
+
+/**
+ * @brief Point on the consistent hash ring
+ *
+ * @ingroup MessageServerFunctions
+ */
+typedef struct msg_svr_route_point
+{
+    /**< Position on ring */
+    uint32_t hash;
+
+    /**< Index of peer in vrtql_msg_route.peers */
+    uint32_t index;
+} msg_svr_route_point;
+
+/**
+ * @brief Routing state of a message server. Rebuilt from server->peers when
+ * its peers_version changes.
+ *
+ * @ingroup MessageServerFunctions
+ */
+typedef struct vrtql_msg_route
+{
+    /**< The peers_version the ring was built from */
+    uint32_t version;
+
+    /**< Peers */
+    msg_svr_route_peer* peers;
+
+    /**< Number of peers */
+    size_t size;
+
+    /**< Ring points, sorted by hash */
+    msg_svr_route_point* ring;
+
+    /**< Number of ring points */
+    size_t points;
+} vrtql_msg_route;
+
+/**
+ * @brief Hashes a routing key onto the ring.
+ *
+ * @param data The key
+ * @param size The key size
+ * @return The hash
+ *
+ * @ingroup MessageServerFunctions
+ */
+static uint32_t msg_svr_route_hash(cstr data, size_t size);
+
+/**
+ * @brief Returns the routing state, rebuilding the ring if the peers have
+ * changed. Backlogs of remaining peers are kept. This takes place in the
+ * context of uv_thread().
+ *
+ * @param server The server
+ * @return The routing state
+ *
+ * @ingroup MessageServerFunctions
+ */
+static vrtql_msg_route* msg_svr_route_sync(vrtql_msg_svr* server);
+
+/**
+ * @brief Frees the routing state.
+ *
+ * @param server The server
+ *
+ * @ingroup MessageServerFunctions
+ */
+static void msg_svr_route_free(vrtql_msg_svr* server);
+
+/**
+ * @brief Sends a routed message to its peer, or holds it in the peer's
+ * backlog. This takes place in the context of uv_thread().
+ *
+ * @param server The server
+ * @param data The serialized message. cid.key holds the routing hash.
+ *
+ * @ingroup MessageServerFunctions
+ */
+static void msg_svr_route_out(vrtql_msg_svr* server, vws_svr_data* data);
+
+/**
+ * @brief Peer connect handler. Sends any backlog held for the peer.
+ *
+ * @param c The connection
+ * @param p The peer
+ *
+ * @ingroup MessageServerFunctions
+ */
+static void msg_svr_peer_connect(vws_svr_cnx* c, vws_peer* p);
+
+/**
+ * @brief Peer loss handler. Moves messages batched on the connection but not
+ * yet sent back to the peer's backlog so they go out on reconnect.
+ *
+ * @param c The connection
+ * @param p The peer
+ *
+ * @ingroup MessageServerFunctions
+ */
+static void msg_svr_peer_lost(vws_svr_cnx* c, vws_peer* p);
+
+/**
+ * @brief Default VRTQL message processing function.
+ *
+ * @param s The server instance
+ * @param c The server connection.
+ * @param m The incoming VRTQL message.
+ * @param x The user-defined context
+ *
+ * @ingroup MessageServerFunctions
+ */
+static void msg_svr_client_process(vws_svr* s, vws_cid_t c, vrtql_msg* m, void* x);
+
+/**
+ * @brief RPC server message processing function. Dispatches the message to
+ * the RPC system, sends the reply and records call latency. This takes place
+ * in the context of worker_thread().
+ *
+ * @param s The server instance
+ * @param c The server connection.
+ * @param m The incoming VRTQL message.
+ * @param x The worker state (vrtql_rpc_svr_worker)
+ *
+ * @ingroup RpcServerFunctions
+ */
+static void rpc_svr_client_process(vws_svr* s, vws_cid_t c, vrtql_msg* m, void* x);
+
+/**
+ * @brief RPC server worker constructor. Creates the worker state, including
+ * its RPC environment, and registers it with the server.
+ *
+ * @param data The server instance
+ * @return The worker state (vrtql_rpc_svr_worker)
+ *
+ * @ingroup RpcServerFunctions
+ */
+static void* rpc_svr_worker_ctor(void* data);
+
+/**
+ * @brief RPC server worker destructor. Destructs the worker's RPC environment.
+ * The worker state itself is kept for its statistics and freed with the server.
+ *
+ * @param data The worker state (vrtql_rpc_svr_worker)
+ *
+ * @ingroup RpcServerFunctions
+ */
+static void rpc_svr_worker_dtor(void* data);
+
+/**
+ * @brief Records a call latency in a worker's statistics.
+ *
+ * @param w The worker state
+ * @param slot The call's index entry slot
+ * @param usec The latency in microseconds
+ *
+ * @ingroup RpcServerFunctions
+ */
+static void rpc_svr_worker_record(vrtql_rpc_svr_worker* w, uint32_t slot, uint64_t usec);
+
+
+
+
+/**
+ * @defgroup ConnectionMap
+ *
+ * @brief Functions that provide access to the connection map
+ *
+ * The connection map tracks all active connections. These functions simplify
+ * the map API and include memory management and other server-specific
+ * functionality where appropriate.
+ *
+ * @ingroup ConnectionMap
+ */
+
+/**
+ * @brief Get the connection corresponding to a client from the connection map.
+ *
+ * @param map The connection map.
+ * @param key The client (used as key in the map).
+ * @return The corresponding server connection.
+ *
+ * @ingroup ConnectionMap
+ */
+static vws_svr_cnx* svr_cnx_map_get(vws_svr_cnx_map* map, uv_stream_t* key);
+
+/**
+ * @brief Set a connection for a client in the connection map.
+ *
+ * @param map The connection map.
+ * @param key The client (used as key in the map).
+ * @param value The server connection.
+ * @return Success or failure status.
+ *
+ * @ingroup ConnectionMap
+ */
+static int8_t svr_cnx_map_set( vws_svr_cnx_map* map,
+                               uv_stream_t* key,
+                               vws_svr_cnx* value );
+
+/**
+ * @brief Remove a client's connection from the connection map.
+ *
+ * @param map The connection map.
+ * @param key The client (used as key in the map).
+ *
+ * @ingroup ConnectionMap
+ */
+static void svr_cnx_map_remove(vws_svr_cnx_map* map, uv_stream_t* key);
+
+/**
+ * @brief Clear all connections from the connection map.
+ *
+ * @param map The connection map.
+ *
+ * @ingroup ConnectionMap
+ */
+static void svr_cnx_map_clear(vws_svr_cnx_map* map);
+
+/**
+ * @defgroup QueueGroup
+ *
+ * @brief Queue functions which bridge the network thread and workers
+ *
+ * The network thread and worker threads pass data via queues. These queues
+ * contain vws_svr_data instances. There is a requests queue which passes
+ * data from the network thread to workers for processing. There is a response
+ * queue that passed data from worker queues to the network thread. When passed
+ * from network thread to work, data take form of incoming data from the
+ * client. When passed from the worker threads the the networking thread, data
+ * take the form of outgoing data to be sent back to the client.
+ *
+ * Queues have built-in synchronization mechanisms that allow the data to be
+ * safely passed between threads, as well as ways to gracefull put waiting
+ * threads to sleep until data arrives for processing.
+ */
+
+/**
+ * @brief Initializes a server queue.
+ *
+ * This function sets up the provided queue with the given capacity. It also
+ * initializes the synchronization mechanisms associated with the queue.
+ *
+ * @param queue Pointer to the server queue to be initialized.
+ * @param capacity The maximum capacity of the queue.
+ * @param name The queue name
+ *
+ * @ingroup QueueGroup
+ */
+static void queue_init(vws_svr_queue* queue, int capacity, cstr name);
+
+/**
+ * @brief Destroys a server queue.
+ *
+ * This function cleans up the resources associated with the provided queue.
+ * It also handles the synchronization mechanisms associated with the queue.
+ *
+ * @param queue Pointer to the server queue to be destroyed.
+ *
+ * @ingroup QueueGroup
+ */
+static void queue_destroy(vws_svr_queue* queue);
+
+/**
+ * @brief Pushes data to the server queue.
+ *
+ * This function adds data to the end of the provided queue. It also handles
+ * the necessary synchronization to ensure thread safety.
+ *
+ * @param queue Pointer to the server queue.
+ * @param data Data to be added to the queue.
+ *
+ * @ingroup QueueGroup
+ */
+static void queue_push(vws_svr_queue* queue, vws_svr_data* data);
+
+/**
+ * @brief Returns the lane data belongs in.
+ *
+ * @param data The data
+ * @return The lane
+ *
+ * @ingroup QueueGroup
+ */
+static vws_svr_lane_t queue_lane(vws_svr_data* data);
+
+/**
+ * @brief Pops data from the server queue.
+ *
+ * This function removes and returns data from the front of the highest
+ * priority lane holding data, subject to the queue's starvation quota. It also
+ * handles the necessary synchronization to ensure thread safety.
+ *
+ * @param queue Pointer to the server queue.
+ * @return A data element from the front of the queue.
+ *
+ * @ingroup QueueGroup
+ */
+static vws_svr_data* queue_pop(vws_svr_queue* queue);
+
+/**
+ * @brief Checks if the server queue is empty.
+ *
+ * This function checks whether the provided queue is empty.
+ * It also handles the necessary synchronization to ensure thread safety.
+ *
+ * @param queue Pointer to the server queue.
+ * @return True if the queue is empty, false otherwise.
+ *
+ * @ingroup QueueGroup
+ */
+static bool queue_empty(vws_svr_queue* queue);
+
+//------------------------------------------------------------------------------
+// Peer connect
+//------------------------------------------------------------------------------
+
+/**
+ * @brief State of a built-in peer connect in progress.
+ *
+ * Resolution, connect and websocket handshake all run on the server loop. The
+ * instance hangs off peer->pending until the connection is either adopted into
+ * the connection pool or fails.
+ *
+ * @ingroup ServerFunctions
+ */
+typedef struct svr_peer_cnx
+{
+    /**< The server */
+    vws_tcp_svr* server;
+
+    /**< The peer. NULL once aborted. */
+    vws_peer* peer;
+
+    /**< Name resolution request */
+    uv_getaddrinfo_t resolver;
+
+    /**< Connect request */
+    uv_connect_t request;
+
+    /**< The socket, NULL until resolved */
+    uv_tcp_t* tcp;
+
+    /**< Connect timeout timer, NULL if no timeout */
+    uv_timer_t* timer;
+
+    /**< Handshake response parser */
+    vws_http_msg* http;
+
+    /**< Handshake key */
+    char* key;
+
+    /**< Resolved addresses */
+    struct addrinfo* addrs;
+
+    /**< Next address to try */
+    struct addrinfo* next;
+
+    /**< True while resolution is in progress */
+    bool resolving;
+} svr_peer_cnx;
+
+/**
+ * @brief Adopts a connected websocket to a peer into the connection pool.
+ *
+ * Creates the vws_svr_cnx for the socket, marks it as an upgraded, trusted
+ * peer connection and starts reads on it.
+ *
+ * @param server The server
+ * @param peer The peer
+ * @param c The connected socket, already initialized on the server loop
+ * @return The connection or NULL on failure
+ *
+ * @ingroup ServerFunctions
+ */
+static vws_svr_cnx* svr_peer_adopt( vws_tcp_svr* server,
+                                    vws_peer* peer,
+                                    uv_tcp_t* c );
+
+/**
+ * @brief Starts the built-in connect to a peer.
+ *
+ * @param server The server
+ * @param peer The peer. Must be in state VWS_PEER_PENDING.
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_peer_connect_start(vws_tcp_svr* server, vws_peer* peer);
+
+/**
+ * @brief Abandons a built-in peer connect.
+ *
+ * The peer is set to VWS_PEER_CLOSED and detached. The connect state is freed
+ * once libuv has released its handles and requests.
+ *
+ * @param pc The connect state
+ *
+ * @ingroup ServerFunctions
+ */
+static void svr_peer_connect_abort(svr_peer_cnx* pc);
+
+/**
+ * @brief Connects to the next resolved address of a peer.
+ *
+ * @param pc The connect state
+ * @return True if a connect is in progress, false if no addresses remain
+ *
+ * @ingroup ServerFunctions
+ */
+static bool svr_peer_connect_next(svr_peer_cnx* pc);
+
+/**
+ * @brief Callback for peer name resolution.
+ * @ingroup ServerFunctions
+ */
+static void svr_peer_on_resolve( uv_getaddrinfo_t* req,
+                                 int status,
+                                 struct addrinfo* res );
+
+/**
+ * @brief Callback for peer TCP connect.
+ * @ingroup ServerFunctions
+ */
+static void svr_peer_on_connect(uv_connect_t* req, int status);
+
+/**
+ * @brief Callback for handshake request write completion.
+ * @ingroup ServerFunctions
+ */
+static void svr_peer_on_write(uv_write_t* req, int status);
+
+/**
+ * @brief Callback for handshake response reads.
+ * @ingroup ServerFunctions
+ */
+static void svr_peer_on_read(uv_stream_t* s, ssize_t n, const uv_buf_t* buf);
+
+/**
+ * @brief Callback for the peer connect timeout.
+ * @ingroup ServerFunctions
+ */
+static void svr_peer_on_timeout(uv_timer_t* handle);
+
+/**
+ * @brief Callback for closure of a peer connect socket. Frees the connect
+ * state if attached.
+ * @ingroup ServerFunctions
+ */
+static void svr_peer_on_close(uv_handle_t* handle);
+
+/**
+ * @brief Frees the connect state.
+ * @ingroup ServerFunctions
+ */
+static void svr_peer_cnx_free(svr_peer_cnx* pc);
+
+//------------------------------------------------------------------------------
+// Peer timer
+//------------------------------------------------------------------------------
+
+void peer_timer_callback(uv_timer_t* handle)
+{
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace(VL_INFO, "peer_timer_callback(%p)", handle);
+    }
+
+    // Stop timer
+    uv_timer_stop(handle);
+
+    // Wakeup server
+    vws_tcp_svr* s = (vws_tcp_svr*)handle->data;
+    uv_async_send(s->wakeup);
+}
+
+void vws_tcp_svr_peer_timer(vws_tcp_svr* s)
+{
+    // Milliseconds
+    uint64_t interval = 200;
+
+    // Loop time. A float of time(NULL) + 0.2 rounds to 128 seconds, which put
+    // the timeout up to a minute ahead and held back reconnects.
+    uint64_t current_time = uv_now(s->loop);
+
+    if (s->peer_timeout > current_time)
+    {
+        // If we have a timeout already set in the future
+        return;
+    }
+
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace(VL_INFO, "vws_tcp_svr_peer_timer(%p)", s);
+    }
+
+    // Set data
+    s->peer_timer->data = s;
+
+    uv_timer_start(s->peer_timer, peer_timer_callback, interval, 0);
+
+    // Update peer_timeout to the timeout time
+    s->peer_timeout = current_time + interval;
+}
+
+//------------------------------------------------------------------------------
+// Peer connect
+//------------------------------------------------------------------------------
+
+vws_svr_cnx* svr_peer_adopt(vws_tcp_svr* server, vws_peer* peer, uv_tcp_t* c)
+{
+    // Create socket info structure
+    vws_cinfo* ci = vws.malloc(sizeof(vws_cinfo));
+    memcpy(ci, &peer->info, sizeof(vws_cinfo));
+    ci->server = server;
+    c->data    = ci;
+
+    // Start reads on socket
+    if (uv_read_start((uv_stream_t*)c, svr_on_realloc, svr_on_read) != 0)
+    {
+        vws.error(VE_RT, "Failed to start reading from client");
+        vws.free(ci);
+        c->data = NULL;
+        uv_close((uv_handle_t*)c, svr_on_timer_close);
+
+        // Try again later
+        peer->state = VWS_PEER_CLOSED;
+
+        return NULL;
+    }
+
+    if (vws.tracelevel >= VT_THREAD)
+    {
+        vws.trace( VL_INFO, "svr_peer_adopt(): %s:%i",
+                   peer->host, peer->port );
+    }
+
+    //> Add connection to registry and initialize
+
+    vws_svr_cnx* cnx = svr_cnx_new(server, (uv_stream_t*)c);
+    ci->cnx          = cnx;
+    ci->cid          = cnx->cid;
+
+    // We have already upgraded this connection.
+    cnx->upgraded = true;
+
+    // Call svr_on_connect() handler to complete initialization
+    server->on_connect(cnx);
+
+    // Mark connection as peer
+    vws_set_flag(&cnx->cid.flags, VWS_SVR_STATE_PEER);
+
+    // Remove UNAUTH flag as peers are automatically trusted
+    vws_clear_flag(&cnx->cid.flags, VWS_SVR_STATE_UNAUTH);
+
+    //> Update peer record
+
+    // New connection information
+    peer->info = *ci;
+
+    // New connection state
+    peer->state = VWS_PEER_CONNECTED;
+
+    server->on_peer_connect(cnx, peer);
+
+    return cnx;
+}
+
+void svr_peer_connect_start(vws_tcp_svr* server, vws_peer* peer)
+{
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace( VL_INFO, "svr_peer_connect_start(): %s:%i",
+                   peer->host, peer->port );
+    }
+
+    svr_peer_cnx* pc = vws.malloc(sizeof(svr_peer_cnx));
+    memset(pc, 0, sizeof(svr_peer_cnx));
+
+    pc->server        = server;
+    pc->peer          = peer;
+    pc->resolver.data = pc;
+    pc->request.data  = pc;
+    peer->pending     = pc;
+
+    // Bound the whole attempt, from resolve to handshake
+    if (server->peer_connect_timeout > 0)
+    {
+        pc->timer = vws.malloc(sizeof(uv_timer_t));
+        uv_timer_init(server->loop, pc->timer);
+        pc->timer->data = pc;
+
+        uv_timer_start( pc->timer,
+                        svr_peer_on_timeout,
+                        server->peer_connect_timeout,
+                        0 );
+    }
+
+    char port[16];
+    snprintf(port, sizeof(port), "%i", peer->port);
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = PF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int rc = uv_getaddrinfo( server->loop, &pc->resolver, svr_peer_on_resolve,
+                             peer->host, port, &hints );
+
+    if (rc != 0)
+    {
+        vws.error(VE_SYS, "uv_getaddrinfo(): %s", uv_strerror(rc));
+        svr_peer_connect_abort(pc);
+
+        return;
+    }
+
+    pc->resolving = true;
+}
+
+void svr_peer_connect_abort(svr_peer_cnx* pc)
+{
+    if (pc->peer != NULL)
+    {
+        // Detach. uv_thread() will try again.
+        pc->peer->pending = NULL;
+        pc->peer->state   = VWS_PEER_CLOSED;
+        pc->peer          = NULL;
+    }
+
+    if (pc->timer != NULL)
+    {
+        uv_close((uv_handle_t*)pc->timer, svr_on_timer_close);
+        pc->timer = NULL;
+    }
+
+    if (pc->tcp != NULL)
+    {
+        // Pending requests are cancelled before svr_peer_on_close() frees pc
+        uv_close((uv_handle_t*)pc->tcp, svr_peer_on_close);
+        pc->tcp = NULL;
+
+        return;
+    }
+
+    if (pc->resolving == true)
+    {
+        // svr_peer_on_resolve() frees pc
+        uv_cancel((uv_req_t*)&pc->resolver);
+
+        return;
+    }
+
+    svr_peer_cnx_free(pc);
+}
+
+bool svr_peer_connect_next(svr_peer_cnx* pc)
+{
+    while (pc->next != NULL)
+    {
+        struct addrinfo* ai = pc->next;
+        pc->next            = ai->ai_next;
+
+        if (pc->tcp != NULL)
+        {
+            // Discard the socket of the previous attempt
+            pc->tcp->data = NULL;
+            uv_close((uv_handle_t*)pc->tcp, svr_peer_on_close);
+        }
+
+        pc->tcp = vws.malloc(sizeof(uv_tcp_t));
+        uv_tcp_init(pc->server->loop, pc->tcp);
+        pc->tcp->data = pc;
+
+        int rc = uv_tcp_connect( &pc->request,
+                                 pc->tcp,
+                                 ai->ai_addr,
+                                 svr_peer_on_connect );
+
+        if (rc == 0)
+        {
+            // Keep the address for the connection's cid
+            memcpy(&pc->peer->info.cid.addr, ai->ai_addr, ai->ai_addrlen);
+
+            return true;
+        }
+
+        vws.error(VE_SYS, "uv_tcp_connect(): %s", uv_strerror(rc));
+    }
+
+    return false;
+}
+
+void svr_peer_on_resolve(uv_getaddrinfo_t* req, int status, struct addrinfo* res)
+{
+    svr_peer_cnx* pc = (svr_peer_cnx*)req->data;
+    pc->resolving    = false;
+
+    if (pc->peer == NULL)
+    {
+        // Aborted while resolving
+        uv_freeaddrinfo(res);
+        svr_peer_cnx_free(pc);
+
+        return;
+    }
+
+    if (status != 0)
+    {
+        vws.error( VE_SYS, "resolve %s:%i: %s",
+                   pc->peer->host, pc->peer->port, uv_strerror(status) );
+
+        svr_peer_connect_abort(pc);
+
+        return;
+    }
+
+    // Try each address in turn
+    pc->addrs = res;
+    pc->next  = res;
+
+    if (svr_peer_connect_next(pc) == false)
+    {
+        svr_peer_connect_abort(pc);
+    }
+}
+
+void svr_peer_on_connect(uv_connect_t* req, int status)
+{
+    svr_peer_cnx* pc = (svr_peer_cnx*)req->data;
+
+    if (pc->peer == NULL)
+    {
+        // Aborted. svr_peer_on_close() frees pc.
+        return;
+    }
+
+    vws_peer* peer = pc->peer;
+
+    if (status != 0)
+    {
+        vws.error( VE_SOCKET, "connect %s:%i: %s",
+                   peer->host, peer->port, uv_strerror(status) );
+
+        if (svr_peer_connect_next(pc) == false)
+        {
+            svr_peer_connect_abort(pc);
+        }
+
+        return;
+    }
+
+    //> Send the websocket handshake request
+
+    cstr path = (peer->path != NULL) ? peer->path : "/";
+    pc->key   = vws_generate_key();
+    pc->http  = vws_http_msg_new(HTTP_RESPONSE);
+
+    vws_buffer* b = vws_buffer_new();
+    vws_buffer_printf( b,
+                       "GET %s HTTP/1.1\r\n"
+                       "Host: %s:%i\r\n"
+                       "Cache-Control: no-cache\r\n"
+                       "Origin: ws://%s:%i%s\r\n"
+                       "Upgrade: websocket\r\n"
+                       "Connection: Upgrade\r\n"
+                       "Sec-WebSocket-Key: %s\r\n"
+                       "Sec-WebSocket-Version: 13\r\n"
+                       "\r\n",
+                       path,
+                       peer->host, peer->port,
+                       peer->host, peer->port, path,
+                       pc->key );
+
+    // The request owns the buffer so that nothing refers back to pc
+    uv_write_t* w = vws.malloc(sizeof(uv_write_t));
+    w->data       = b;
+    uv_buf_t buf  = uv_buf_init((char*)b->data, b->size);
+    uv_stream_t* s = (uv_stream_t*)pc->tcp;
+
+    if (uv_write(w, s, &buf, 1, svr_peer_on_write) != 0)
+    {
+        vws.error(VE_SEND, "peer %s:%i: write failed", peer->host, peer->port);
+        vws_buffer_free(b);
+        vws.free(w);
+        svr_peer_connect_abort(pc);
+
+        return;
+    }
+
+    if (uv_read_start(s, svr_on_realloc, svr_peer_on_read) != 0)
+    {
+        vws.error(VE_RECV, "peer %s:%i: read failed", peer->host, peer->port);
+        svr_peer_connect_abort(pc);
+    }
+}
+
+void svr_peer_on_write(uv_write_t* req, int status)
+{
+    // Failures surface on the read side or as a timeout
+    vws_buffer_free((vws_buffer*)req->data);
+    vws.free(req);
+}
+
+void svr_peer_on_read(uv_stream_t* s, ssize_t n, const uv_buf_t* buf)
+{
+    svr_peer_cnx* pc = (svr_peer_cnx*)s->data;
+    vws_peer* peer   = pc->peer;
+
+    if (n <= 0)
+    {
+        vws.free(buf->base);
+
+        if (n < 0)
+        {
+            vws.error( VE_RECV, "peer %s:%i: %s",
+                       peer->host, peer->port, uv_strerror(n) );
+
+            svr_peer_connect_abort(pc);
+        }
+
+        return;
+    }
+
+    int rc = vws_http_msg_parse(pc->http, buf->base, n);
+
+    if (rc < 0)
+    {
+        vws.free(buf->base);
+        vws.error(VE_RT, "Invalid handshake response");
+        svr_peer_connect_abort(pc);
+
+        return;
+    }
+
+    if (pc->http->done == false)
+    {
+        // Wait for more
+        vws.free(buf->base);
+
+        return;
+    }
+
+    vws_kvs* headers = pc->http->headers;
+    cstr accept      = vws_kvs_get_cstring(headers, "sec-websocket-accept");
+    char expected[VWS_ACCEPT_KEY_SIZE + 1];
+    vws_accept_key_r(pc->key, expected);
+
+    bool valid = (vws_http_msg_status_code(pc->http) == 101) &&
+                 (accept != NULL) &&
+                 (strcmp(accept, expected) == 0);
+
+
+    if (valid == false)
+    {
+        vws.free(buf->base);
+        vws.error(VE_RT, "Handshake verification failed");
+        svr_peer_connect_abort(pc);
+
+        return;
+    }
+
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace( VL_INFO, "svr_peer_on_read(): connected %s:%i",
+                   peer->host, peer->port );
+    }
+
+    //> Hand the socket over to the server
+
+    vws_tcp_svr* server = pc->server;
+    uv_tcp_t* c         = pc->tcp;
+
+    uv_read_stop(s);
+
+    // Release connect state but not the socket
+    pc->tcp = NULL;
+    svr_peer_connect_abort(pc);
+
+    vws_svr_cnx* cnx = svr_peer_adopt(server, peer, c);
+
+    // Pass on any frames which arrived along with the response
+    size_t left = n - rc;
+
+    if ((cnx == NULL) || (left == 0))
+    {
+        vws.free(buf->base);
+
+        return;
+    }
+
+    memmove(buf->base, buf->base + rc, left);
+    uv_buf_t data = uv_buf_init(buf->base, left);
+
+    svr_metric_add(server, VWS_METRIC_BYTES_IN, left);
+    server->on_read(cnx, left, &data);
+}
+
+void svr_peer_on_timeout(uv_timer_t* handle)
+{
+    svr_peer_cnx* pc = (svr_peer_cnx*)handle->data;
+
+    vws.error( VE_TIMEOUT, "peer %s:%i: connect timed out",
+               pc->peer->host, pc->peer->port );
+
+    svr_peer_connect_abort(pc);
+}
+
+void svr_peer_on_close(uv_handle_t* handle)
+{
+    svr_peer_cnx* pc = (svr_peer_cnx*)handle->data;
+
+    if (pc != NULL)
+    {
+        svr_peer_cnx_free(pc);
+    }
+
+    vws.free(handle);
+}
+
+void svr_peer_cnx_free(svr_peer_cnx* pc)
+{
+    if (pc->http != NULL)
+    {
+        vws_http_msg_free(pc->http);
+    }
+
+    if (pc->addrs != NULL)
+    {
+        uv_freeaddrinfo(pc->addrs);
+    }
+
+    vws.free(pc->key);
+    vws.free(pc);
+}
+
+//------------------------------------------------------------------------------
+// Metrics
+//------------------------------------------------------------------------------
+
+/** The metrics block of the calling thread, if it is a worker thread */
+static __thread vws_svr_metrics* svr_thread_metrics = NULL;
+
+/** Stamps of the request being processed by the calling worker thread */
+static __thread vws_svr_stamps* svr_thread_stamps = NULL;
+
+/** Prometheus metadata, indexed by vws_svr_stage_t */
+static const struct
+{
+    cstr name;
+    cstr help;
+} svr_stage_info[VWS_STAGE_COUNT] =
+{
+    { "vws_request_wait_seconds",  "Time from read to worker" },
+    { "vws_handler_seconds",       "Time from worker to response" },
+    { "vws_response_wait_seconds", "Time from response to write" },
+    { "vws_write_seconds",         "Time to complete socket write" },
+    { "vws_total_seconds",         "Time from read to write complete" }
+};
+
+/** Prometheus metadata, indexed by vws_svr_metric_t */
+static const struct
+{
+    cstr name;
+    cstr type;
+    cstr help;
+} svr_metric_info[VWS_METRIC_COUNT] =
+{
+    { "vws_connections_opened_total", "counter", "Connections opened" },
+    { "vws_connections_closed_total", "counter", "Connections closed" },
+    { "vws_connection_timeouts_total", "counter", "Connections timed out" },
+    { "vws_pings_total",              "counter", "Keepalive pings sent" },
+    { "vws_bytes_in_total",           "counter", "Bytes read from sockets" },
+    { "vws_bytes_out_total",          "counter", "Bytes written to sockets" },
+    { "vws_frames_in_total",          "counter", "WebSocket frames received" },
+    { "vws_frames_out_total",         "counter", "WebSocket frames sent" },
+    { "vws_messages_in_total",        "counter", "WebSocket messages received" },
+    { "vws_messages_out_total",       "counter", "WebSocket messages sent" },
+    { "vws_requests_total",           "counter", "Requests processed by workers" },
+    { "vws_responses_total",          "counter", "Responses processed by network thread" },
+    { "vws_write_backlog_bytes",      "gauge",   "Bytes queued for write" },
+    { "vws_request_queue_depth",      "gauge",   "Items in request queue" },
+    { "vws_response_queue_depth",     "gauge",   "Items in response queue" }
+};
+
+vws_svr_metrics* svr_metrics(vws_tcp_svr* s)
+{
+    vws_svr_metrics* m = svr_thread_metrics;
+
+    if ((m != NULL) && (m >= s->metrics) && (m < s->metrics + s->metrics_size))
+    {
+        return m;
+    }
+
+    return &s->metrics[0];
+}
+
+void svr_metric_add(vws_tcp_svr* s, vws_svr_metric_t k, uint64_t n)
+{
+    __atomic_fetch_add(&svr_metrics(s)->counters[k], n, __ATOMIC_RELAXED);
+}
+
+void svr_metric_stage( vws_tcp_svr* s,
+                       vws_svr_stage_t k,
+                       uint64_t start,
+                       uint64_t end )
+{
+    if ((start == 0) || (end < start))
+    {
+        return;
+    }
+
+    vws_svr_metrics* m = svr_metrics(s);
+
+    uv_mutex_lock(&m->lock);
+    vws_hist_add(&m->stages[k], end - start);
+    uv_mutex_unlock(&m->lock);
+}
+
+static int svr_queue_depth(vws_svr_queue* queue)
+{
+    uv_mutex_lock(&queue->mutex);
+    int size = queue->size;
+    uv_mutex_unlock(&queue->mutex);
+
+    return size;
+}
+
+vws_svr_metrics* vws_tcp_svr_metrics(vws_tcp_svr* s)
+{
+    vws_svr_metrics* snapshot = vws.malloc(sizeof(vws_svr_metrics));
+    memset(snapshot->counters, 0, sizeof(snapshot->counters));
+
+    for (int k = 0; k < VWS_STAGE_COUNT; k++)
+    {
+        vws_hist_clear(&snapshot->stages[k]);
+    }
+
+    for (int i = 0; i < s->metrics_size; i++)
+    {
+        vws_svr_metrics* m = &s->metrics[i];
+
+        for (int k = 0; k < VWS_METRIC_COUNT; k++)
+        {
+            uint64_t n = __atomic_load_n(&m->counters[k], __ATOMIC_RELAXED);
+            snapshot->counters[k] += n;
+        }
+
+        uv_mutex_lock(&m->lock);
+
+        for (int k = 0; k < VWS_STAGE_COUNT; k++)
+        {
+            vws_hist_merge(&snapshot->stages[k], &m->stages[k]);
+        }
+
+        uv_mutex_unlock(&m->lock);
+    }
+
+    snapshot->counters[VWS_METRIC_REQUEST_DEPTH]  = svr_queue_depth(&s->requests);
+    snapshot->counters[VWS_METRIC_RESPONSE_DEPTH] = svr_queue_depth(&s->responses);
+
+    return snapshot;
+}
+
+void vws_svr_metrics_free(vws_svr_metrics* m)
+{
+    if (m != NULL)
+    {
+        vws.free(m);
+    }
+}
+
+static void svr_metrics_summary(vws_buffer* b, cstr name, cstr help, vws_hist* h)
+{
+    double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+    vws_buffer_printf(b, "# HELP %s %s\n", name, help);
+    vws_buffer_printf(b, "# TYPE %s summary\n", name);
+
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(double); i++)
+    {
+        uint64_t usec = vws_hist_percentile(h, quantiles[i] * 100);
+        vws_buffer_printf( b, "%s{quantile=\"%g\"} %.6f\n",
+                           name, quantiles[i], usec / 1e6 );
+    }
+
+    vws_buffer_printf(b, "%s_sum %.6f\n", name, h->sum / 1e6);
+    vws_buffer_printf(b, "%s_count %" PRIu64 "\n", name, h->count);
+}
+
+vws_buffer* vws_svr_metrics_prometheus(vws_svr_metrics* m)
+{
+    vws_buffer* b = vws_buffer_new();
+
+    for (int k = 0; k < VWS_METRIC_COUNT; k++)
+    {
+        cstr name = svr_metric_info[k].name;
+
+        vws_buffer_printf(b, "# HELP %s %s\n", name, svr_metric_info[k].help);
+        vws_buffer_printf(b, "# TYPE %s %s\n", name, svr_metric_info[k].type);
+        vws_buffer_printf(b, "%s %" PRIu64 "\n", name, m->counters[k]);
+    }
+
+    for (int k = 0; k < VWS_STAGE_COUNT; k++)
+    {
+        svr_metrics_summary( b,
+                             svr_stage_info[k].name,
+                             svr_stage_info[k].help,
+                             &m->stages[k] );
+    }
+
+    return b;
+}
+
+//------------------------------------------------------------------------------
+// Threads
+//------------------------------------------------------------------------------
+
+void worker_thread(void* arg)
+{
+    vws_tcp_svr* server = (vws_tcp_svr*)arg;
 
     // Set thread tracing level to server.
     vws.tracelevel = server->trace;
 
-    if (vws.tracelevel >= VT_THREAD)
+    if (vws.tracelevel >= VT_THREAD)
+    {
+        vws.trace(VL_INFO, "worker_thread(): Starting");
+    }
+
+    // Claim a metrics block for this thread
+    int slot = __atomic_fetch_add(&server->metrics_next, 1, __ATOMIC_RELAXED);
+    svr_thread_metrics = &server->metrics[1 + slot % server->pool_size];
+
+    vws_thread_ctx ctx;
+    ctx.ctor      = server->worker_ctor;
+    ctx.ctor_data = server->worker_ctor_data;
+    ctx.dtor      = server->worker_dtor;
+    ctx.data      = NULL;
+
+    if (ctx.ctor != NULL)
+    {
+        ctx.data = ctx.ctor(ctx.ctor_data);
+    }
+
+    while (true)
+    {
+        //> Wait for arrival
+
+        // This will put the thread to sleep on a condition variable until
+        // something arrives in queue.
+        vws_svr_data* request = queue_pop(&server->requests);
+
+        // If there's no request (null request), check the server's state
+        if (request == NULL)
+        {
+            // If server is in halting state, return
+            if (server->state == VS_HALTING)
+            {
+                if (vws.tracelevel >= VT_THREAD)
+                {
+                    vws.trace(VL_INFO, "worker_thread(): Exiting");
+                }
+
+                break;
+            }
+            else
+            {
+                // If not halting, skip to the next iteration of the loop
+                continue;
+            }
+        }
+
+        // Keep a copy of the request stamps for responses to inherit. The
+        // request itself is freed by the handler.
+        vws_svr_stamps stamps = request->stamps;
+        stamps.dequeued       = vws_clock_usec();
+        svr_thread_stamps     = &stamps;
+
+        svr_metric_add(server, VWS_METRIC_REQUESTS, 1);
+        svr_metric_stage( server, VWS_STAGE_REQUEST_WAIT,
+                          stamps.ingress, stamps.dequeued );
+
+        server->on_data_in(request, ctx.data);
+
+        svr_thread_stamps = NULL;
+    }
+
+    if (ctx.dtor != NULL)
+    {
+        ctx.dtor(ctx.data);
+    }
+
+    svr_thread_metrics = NULL;
+}
+
+void vws_tcp_svr_uv_close(vws_tcp_svr* server, uv_handle_t* handle)
+{
+    uv_close(handle, svr_on_close);
+}
+
+void uv_thread(uv_async_t* handle)
+{
+    vws_cinfo* cinfo    = (vws_cinfo*)handle->data;
+    vws_tcp_svr* server = cinfo->server;
+
+    vws.trace(VL_INFO, "uv_thread()");
+
+    if (server->state == VS_HALTING)
+    {
+        if (vws.tracelevel >= VT_THREAD)
+        {
+            vws.trace(VL_INFO, "uv_thread(): stop");
+        }
+
+        // Join worker threads. Worker threads must all exit before we can
+        // shutdown libuv as they must release their mutexes and condition
+        // variables first, otherwise uv_stop() will not actually stop the loop.
+        for (int i = 0; i < server->pool_size; i++)
+        {
+            uv_thread_join(&server->threads[i]);
+        }
+
+        svr_shutdown(server);
+
+        return;
+    }
+
+    // We process responses first so that if a peer has disconnected, its cid
+    // still points to the closed connect. If a response maps to a closed peer
+    // connection, we can catch it and call hook which allows outside queue to
+    // queue and resend data when peer reconnects.
+    while (queue_empty(&server->responses) == false)
+    {
+        vws_svr_data* data = queue_pop(&server->responses);
+
+        if ((data == NULL) || (server->responses.state != VS_RUNNING))
+        {
+            if (data != NULL)
+            {
+                vws_svr_data_free(data);
+            }
+
+            return;
+        }
+
+        // The final response to an HTTP request, or vws_svr_http_done() with
+        // no data. Data goes out first, then the next pipelined request.
+        bool http     = vws_is_flag(&data->flags, VWS_SVR_STATE_HTTP);
+        vws_cid_t cid = data->cid;
+
+        if ((http == true) && (data->size == 0))
+        {
+            svr_http_complete(server, cid);
+            vws_svr_data_free(data);
+
+            continue;
+        }
+
+        data->stamps.dispatched = vws_clock_usec();
+
+        svr_metric_add(server, VWS_METRIC_RESPONSES, 1);
+        svr_metric_stage( server, VWS_STAGE_RESPONSE_WAIT,
+                          data->stamps.enqueued, data->stamps.dispatched );
+
+        if (vws_is_flag(&data->flags, VWS_SVR_STATE_CLOSE))
+        {
+            // Lookup connection
+            uintptr_t ptr = address_pool_get(server->cpool, data->cid.key);
+
+            if (ptr != 0)
+            {
+                // Close connections
+                vws_svr_cnx* cnx = (vws_svr_cnx*)ptr;
+                uv_close((uv_handle_t*)cnx->handle, svr_on_close);
+            }
+
+            vws_svr_data_free(data);
+        }
+        else
+        {
+            server->on_data_out(data, NULL);
+        }
+
+        if (http == true)
+        {
+            svr_http_complete(server, cid);
+        }
+    }
+
+    // Check for closed peer connections.
+    int pending_peers = 0;
+    for (size_t i = 0; i < server->peers->used; i++)
+    {
+        vws_peer* peer = (vws_peer*)server->peers->array[i].value.data;
+
+        // If closed
+        if (peer->state == VWS_PEER_CLOSED)
+        {
+            // Set to pending
+            peer->state = VWS_PEER_PENDING;
+
+            // Built-in connect runs on this loop
+            if (peer->connect == NULL)
+            {
+                svr_peer_connect_start(server, peer);
+                continue;
+            }
+
+            // Create queue element
+            vws_svr_data* block;
+            block = vws_svr_data_own( server,
+                                      peer->info.cid,
+                                      (ucstr)peer,
+                                      sizeof(vws_peer*) );
+
+            // Flag as closed connection
+            vws_set_flag(&block->flags, VWS_SVR_STATE_PEER_CONNECT);
+
+            // Queue request
+            queue_push(&server->requests, block);
+        }
+
+        // NOTE: This code is very similar to vws_tcp_svr_inetd_run() but
+        // different enough in that it cannot be easily factored and reused. In
+        // both cases we are taking an open socket descriptor and importing it
+        // into libuv loop.
+        if (peer->state == VWS_PEER_RECONNECTED)
+        {
+            // We have successfully connected to remote peer and have an active
+            // socket descriptor. We now need to take ownership of the socket
+            // descriptor, create an associated vws_svr_cnx connection instance
+            // for that socket descriptor, customize it for websocket operation
+            // and add to connection pool.
+
+            // Set socket to non-blocking mode for libuv
+            if (vws_socket_set_nonblocking(peer->sockfd) == false)
+            {
+                vws.error(VE_RT, "Failed to set socket to nonblocking");
+                return;
+            }
+
+            // Adopt socket descriptor into libuv loop
+            uv_tcp_t* c = (uv_tcp_t*)vws.malloc(sizeof(uv_tcp_t));
+
+            if (uv_tcp_init(server->loop, c))
+            {
+                // Handle uv_tcp_init failure.
+                vws.error(VE_RT, "Failed to initialize new TCP handle");
+                vws.free(c);
+                return;
+            }
+
+            if (uv_tcp_open(c, peer->sockfd))
+            {
+                // Handle uv_tcp_open failure.
+                vws.error(VE_RT, "Failed to adopt the socket descriptor.");
+                vws.free(c);
+                return;
+            }
+
+            // Add to connection pool
+            svr_peer_adopt(server, peer, c);
+        }
+    }
+
+    // Call user-defined loop callback if defined
+    if (server->loop_cb != NULL)
+    {
+        server->loop_cb(server);
+    }
+
+    // If not all peers are connected
+    if (vws_tcp_svr_peers_online(server) == false)
+    {
+        // Set wakeup timer since we expect response from thread(s)
+        vws_tcp_svr_peer_timer(server);
+    }
+}
+
+//------------------------------------------------------------------------------
+// Server API
+//------------------------------------------------------------------------------
+
+vws_svr_data* vws_svr_data_new(vws_tcp_svr* s, vws_cid_t cid, vws_buffer** b)
+{
+    // Create a new vws_svr_data taking ownership of the buffer's data
+    vws_svr_data* item = vws_svr_data_own(s, cid, (*b)->data, (*b)->size);
+
+    // Since we take ownership of buffer data, we clear the buffer.
+    (*b)->data = NULL;
+    (*b)->size = 0;
+
+    return item;
+}
+
+vws_svr_data* vws_svr_data_own(vws_tcp_svr* s, vws_cid_t cid, ucstr data, size_t size)
+{
+    vws_svr_data* item;
+    item = (vws_svr_data*)vws.malloc(sizeof(vws_svr_data));
+
+    item->server = s;
+    item->cid    = cid;
+    item->size   = size;
+    item->data   = data;
+    item->flags  = 0;
+
+    memset(&item->stamps, 0, sizeof(vws_svr_stamps));
+
+    return item;
+}
+
+void vws_svr_data_free(vws_svr_data* t)
+{
+    if (t != NULL)
+    {
+        vws.free(t->data);
+        vws.free(t);
+    }
+}
+
+vws_tcp_svr* vws_tcp_svr_new(int num_threads, int backlog, int queue_size)
+{
+    vws_tcp_svr* server = vws.malloc(sizeof(vws_tcp_svr));
+    return tcp_svr_ctor(server, num_threads, backlog, queue_size);
+}
+
+void vws_tcp_svr_close(vws_tcp_svr* server, vws_cid_t cid)
+{
+    // Create reply
+    vws_svr_data* reply;
+    reply = vws_svr_data_own(server, cid, NULL, 0);
+
+    // Set connection close flag
+    vws_set_flag(&reply->flags, VWS_SVR_STATE_CLOSE);
+
+    // Queue the data to uv_thread() to send out on wire
+    vws_tcp_svr_send(reply);
+}
+
+uint8_t vws_tcp_svr_state(vws_tcp_svr* server)
+{
+    return server->state;
+}
+
+void vws_tcp_svr_free(vws_tcp_svr* server)
+{
+    if (server == NULL)
+    {
+        return;
+    }
+
+    tcp_svr_dtor(server);
+    vws.free(server);
+}
+
+bool vws_tcp_svr_peers_online(vws_tcp_svr* server)
+{
+    // Server is online if there are no peers in state VWS_PEER_PENDING
+    for (size_t i = 0; i < server->peers->used; i++)
+    {
+        vws_peer* peer = (vws_peer*)server->peers->array[i].value.data;
+
+        if (peer->state != VWS_PEER_CONNECTED)
+        {
+            if (vws.tracelevel >= VT_SERVICE)
+            {
+                vws.trace( VL_INFO,
+                           "vws_tcp_svr_peers_online(%p): "
+                           "peer offline %s state=%lu",
+                           server,
+                           peer->host,
+                           peer->state );
+            }
+
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int vws_tcp_svr_send(vws_svr_data* data)
+{
+    vws_svr_stamps* stamps = &data->stamps;
+    stamps->enqueued       = vws_clock_usec();
+
+    // If sent from a worker, inherit the stamps of the request it is handling
+    if ((svr_thread_stamps != NULL) && (stamps->ingress == 0))
+    {
+        stamps->ingress  = svr_thread_stamps->ingress;
+        stamps->dequeued = svr_thread_stamps->dequeued;
+
+        svr_metric_stage( data->server, VWS_STAGE_HANDLER,
+                          stamps->dequeued, stamps->enqueued );
+    }
+
+    // Data is freed by queue_push() if the queue is shutting down
+    vws_tcp_svr* server = data->server;
+
+    queue_push(&server->responses, data);
+
+    // Notify event loop about the new response
+    uv_async_send(server->wakeup);
+
+    return 0;
+}
+
+void vws_tcp_svr_wakeup(vws_tcp_svr* s)
+{
+    uv_async_send(s->wakeup);
+}
+
+int vws_tcp_svr_run(vws_tcp_svr* server, cstr host, int port)
+{
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace( VL_INFO,
+                   "vws_tcp_svr_run(%p): Starting worker %i threads",
+                   server,
+                   server->pool_size );
+    }
+
+    for (int i = 0; i < server->pool_size; i++)
+    {
+        uv_thread_create(&server->threads[i], worker_thread, server);
+    }
+
+    //> Create listening socket
+
+    uv_tcp_t* socket = vws.malloc(sizeof(uv_tcp_t));
+    uv_tcp_init(server->loop, socket);
+
+    vws_cinfo* ci = vws.malloc(sizeof(vws_cinfo));
+    ci->cnx       = NULL;
+    ci->server    = server;
+    ci->cid.key   = 0;
+    socket->data  = ci;
+
+    //> Bind to address
+
+    int rc;
+    int flags                  = 0;
+    struct sockaddr_storage addr;
+    struct sockaddr_in* addr4  = (struct sockaddr_in*)&addr;
+    struct sockaddr_in6* addr6 = (struct sockaddr_in6*)&addr;
+
+    // An IPv6 host such as "::" also accepts IPv4 unless ipv6only is set
+    if (uv_ip4_addr(host, port, addr4) != 0)
+    {
+        if (uv_ip6_addr(host, port, addr6) == 0)
+        {
+            if (server->sockopts.ipv6only == true)
+            {
+                flags = UV_TCP_IPV6ONLY;
+            }
+        }
+        else
+        {
+            uv_ip4_addr(host, port, addr4);
+        }
+    }
+
+    rc = uv_tcp_bind(socket, (const struct sockaddr*)&addr, flags);
+
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace( VL_INFO,
+                   "vws_tcp_svr_run(%p): Bind %s:%lu",
+                   server, host, port );
+    }
+
+    if (rc)
+    {
+        vws.error(VE_RT, "Bind error %s", uv_strerror(rc));
+        return -1;
+    }
+
+    if ((rc = svr_listen_options(server, socket)) != 0)
+    {
+        vws.error(VE_RT, "Socket option error %s", uv_strerror(rc));
+        return -1;
+    }
+
+    //> Listen
+
+    rc = uv_listen((uv_stream_t*)socket, server->backlog, svr_on_connect);
+
+    if (rc)
+    {
+        vws.error(VE_RT, "Listen error %s", uv_strerror(rc));
+        return -1;
+    }
+
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace( VL_INFO,
+                   "vws_tcp_svr_run(%p): Listen %s:%lu",
+                   server, host, port );
+    }
+
+    svr_wheel_start(server);
+
+    if ( (server->backend == VWS_SVR_BACKEND_URING) &&
+         (server->ring == NULL) && (svr_ring_start(server) == false) )
+    {
+        vws.trace(VL_WARN, "io_uring not available, using libuv");
+        server->backend = VWS_SVR_BACKEND_UV;
+    }
+
+    //> Start server
+
+    // Set state to running
+    server->state = VS_RUNNING;
+
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace(VL_INFO, "vws_tcp_svr_run(%p): Starting uv_run()", server);
+    }
+
+    while (vws_tcp_svr_is_running(server))
+    {
+        // Run UV loop. This runs indefinitely, passing network I/O and and out
+        // of system until server is shutdown by vws_tcp_svr_stop() (by external
+        // thread).
+        uv_run(server->loop, UV_RUN_DEFAULT);
+    }
+
+    //> Shutdown server
+
+    // Close the listening socket handle
+    uv_close((uv_handle_t*)socket, svr_on_close);
+
+    vws.trace( VL_INFO, "vws_tcp_svr_run(%p): Shutdown connections=%lu",
+               server,
+               server->cpool->count );
+
+    // Close connections.
+    for (uint32_t i = 0; i < server->cpool->capacity; i++)
+    {
+        uintptr_t ptr = server->cpool->slots[i];
+
+        if (ptr != 0)
+        {
+            // Close connection
+            vws_svr_cnx* cnx = (vws_svr_cnx*)ptr;
+
+            if (vws.tracelevel >= VT_SERVICE)
+            {
+                vws.trace( VL_INFO,
+                           "vws_tcp_svr_run(%p): closing %p",
+                           server,
+                           cnx->handle );
+            }
+
+            uv_close((uv_handle_t*)cnx->handle, svr_on_close);
+        }
+    }
+
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace(VL_INFO, "vws_tcp_svr_run(%p): Shutdown complete", server);
+    }
+
+    // Set state to halted
+    server->state = VS_HALTED;
+
+    return 0;
+}
+
+bool vws_tcp_svr_is_running(vws_tcp_svr* server)
+{
+    if (server->state == VS_RUNNING)
+    {
+        return true;
+    }
+
+    return false;
+}
+
+void vws_tcp_svr_stop(vws_tcp_svr* server)
+{
+    // Set shutdown flags
+    server->state           = VS_HALTING;
+    server->requests.state  = VS_HALTING;
+    server->responses.state = VS_HALTING;
+
+    // Wakeup all worker threads
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace(VL_INFO, "vws_tcp_svr_stop(): stop worker threads");
+    }
+
+    uv_mutex_lock(&server->requests.mutex);
+    uv_cond_broadcast(&server->requests.cond);
+    uv_mutex_unlock(&server->requests.mutex);
+
+    // Wakeup the main event loop to shutdown main thread
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace(VL_INFO, "vws_tcp_svr_stop(): stop main thread");
+    }
+
+    uv_async_send(server->wakeup);
+
+    while (server->state != VS_HALTED)
+    {
+        sleep(1);
+    }
+}
+
+int vws_tcp_svr_inetd_run(vws_tcp_svr* server, int sockfd)
+{
+    if (sockfd < 0)
+    {
+        vws.error(VE_RT, "Invalid server or socket descriptor provided");
+        return 1;
+    }
+
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace( VL_INFO,
+                   "vws_tcp_svr_run(%p): Starting worker %i threads",
+                   server,
+                   server->pool_size );
+    }
+
+    for (int i = 0; i < server->pool_size; i++)
+    {
+        uv_thread_create(&server->threads[i], worker_thread, server);
+    }
+
+    // Go into non-blocking mode as we are using poll() for socket_read() and
+    // socket_write().
+    if (vws_socket_set_nonblocking(sockfd) == false)
+    {
+        vws.error(VE_RT, "Failed to set socket to nonblocking");
+        return 1;
+    }
+
+    // Set to inetd mode
+    server->inetd_mode = 1;
+
+    // Adopt socket descriptor into libuv loop
+    uv_tcp_t* c = (uv_tcp_t*)vws.malloc(sizeof(uv_tcp_t));
+
+    if (uv_tcp_init(server->loop, c))
+    {
+        // Handle uv_tcp_init failure.
+        vws.error(VE_RT, "Failed to initialize new TCP handle");
+        vws.free(c);
+        return 1;
+    }
+
+    if (uv_tcp_open(c, sockfd))
+    {
+        // Handle uv_tcp_open failure.
+        vws.error(VE_RT, "Failed to adopt the socket descriptor.");
+        vws.free(c);
+        return 1;
+    }
+
+    // Create socket info structure
+    vws_cinfo* ci = vws.malloc(sizeof(vws_cinfo));
+    ci->cnx       = NULL;
+    ci->server    = server;
+    c->data       = ci;
+
+    // Start reads on socket
+    if (uv_read_start((uv_stream_t*)c, svr_on_realloc, svr_on_read) != 0)
+    {
+        vws.error(VE_RT, "Failed to start reading from client");
+        vws.free(c);
+        vws.free(ci);
+        return 1;
+    }
+
+    //> Add connection to registry and initialize
+
+    vws_svr_cnx* cnx = svr_cnx_new(server, (uv_stream_t*)c);
+    ci->cnx          = cnx;
+    ci->cid          = cnx->cid;
+
+    // Call svr_on_connect() handler to complete initialization
+    server->on_connect(cnx);
+
+    // Now, the handle is associated with the socket and is ready to be used.
+    // Start the libuv loop.
+    uv_run(server->loop, UV_RUN_DEFAULT);
+
+    return 0;
+}
+
+void vws_tcp_svr_inetd_stop(vws_tcp_svr* server)
+{
+    // Set shutdown flags
+    server->state           = VS_HALTING;
+    server->requests.state  = VS_HALTING;
+    server->responses.state = VS_HALTING;
+
+    // Stop the loop. We have not more I/O to deal with. We don't want the loop
+    // to run any more for any reason.
+    uv_stop(server->loop);
+
+    // Wakeup all worker threads
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace(VL_INFO, "vws_tcp_svr_inetd_stop(): stop worker threads");
+    }
+
+    uv_mutex_lock(&server->requests.mutex);
+    uv_cond_broadcast(&server->requests.cond);
+    uv_mutex_unlock(&server->requests.mutex);
+
+    // Wakeup the main event loop to shutdown main thread
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace(VL_INFO, "vws_tcp_svr_inetd_stop(): stop main thread");
+    }
+
+    // Wait for all threads to complete
+    uv_thread(server->wakeup);
+
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace(VL_INFO, "vws_tcp_svr_inetd_stop(): done");
+    }
+
+    // Set state to halted
+    server->state = VS_HALTED;
+}
+
+bool svr_resolve(cstr host, int port, struct sockaddr_storage** s)
+{
+    int sockfd = -1;
+
+    // Resolve the host
+    struct addrinfo hints, *res, *res0;
+    int error;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = PF_UNSPEC; // Accept any family (IPv4 or IPv6)
+    hints.ai_socktype = SOCK_STREAM;
+
+    char port_str[50];
+    sprintf(port_str, "%lu", port);
+
+    error = getaddrinfo(host, &port_str[0], &hints, &res0);
+
+    if (error)
+    {
+        if (vws.tracelevel > 0)
+        {
+            cstr msg = gai_strerror(error);
+            vws.trace(VL_ERROR, "getaddrinfo failed: %s: %s", host, msg);
+        }
+
+        vws.error(VE_SYS, "getaddrinfo() failed");
+
+        return -1;
+    }
+
+    for (res = res0; res; res = res->ai_next)
+    {
+        sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+
+        if (sockfd == -1)
+        {
+            vws.error(VE_SYS, "Failed to create socket");
+            continue;
+        }
+
+        if (vws.tracelevel >= VT_SERVICE)
+        {
+            cstr host; int port;
+            struct sockaddr* addr = (struct sockaddr*)res->ai_addr;
+            if (vws_socket_addr_info(addr, &host, &port) == true)
+            {
+                vws.trace(VL_INFO, "svr_resolve() connect %s:%lu", host, port);
+                free(host);
+            }
+            else
+            {
+                vws.trace(VL_INFO, "svr_resolve(): connect");
+            }
+        }
+
+        if (connect(sockfd, res->ai_addr, res->ai_addrlen) == -1)
+        {
+            close(sockfd);
+            sockfd = -1;
+
+            vws.error(VE_SYS, "Failed to connect");
+            continue;
+        }
+
+        break; // If we get here, we must have connected successfully
+    }
+
+    // Free the addrinfo structure for this host
+    freeaddrinfo(res0);
+
+    if (sockfd == -1)
+    {
+        vws.error(VE_SYS, "Unable to resolve host %s:%lu", host, port);
+        return false;
+    }
+
+    close(sockfd);
+
+    return true;
+}
+
+bool vws_tcp_svr_peer_connect(vws_tcp_svr* s, vws_peer* peer)
+{
+    // Attempt reconnection
+    peer->sockfd = peer->connect(peer);
+
+    // Successful it sockfd not -1
+    return (peer->sockfd != -1);
+}
+
+void vws_tcp_svr_peer_disconnect(vws_tcp_svr* s, vws_peer* peer)
+{
+    // Close the server-side connection
+    uv_close((uv_handle_t*)peer->info.cnx->handle, svr_on_close);
+}
+
+void svr_peer_lost(vws_tcp_svr* server, vws_svr_cnx* c)
+{
+    for (size_t i = 0; i < server->peers->used; i++)
+    {
+        vws_peer* peer = (vws_peer*)server->peers->array[i].value.data;
+
+        if ((peer->state == VWS_PEER_CONNECTED) && (peer->info.cnx == c))
+        {
+            if (vws.tracelevel >= VT_SERVICE)
+            {
+                vws.trace( VL_INFO, "svr_peer_lost(): %s:%i",
+                           peer->host, peer->port );
+            }
+
+            server->on_peer_lost(c, peer);
+
+            peer->state    = VWS_PEER_CLOSED;
+            peer->info.cnx = NULL;
+        }
+    }
+
+    // Schedule reconnect
+    if (vws_tcp_svr_is_running(server))
+    {
+        vws_tcp_svr_peer_timer(server);
+    }
+}
+
+vws_peer* vws_tcp_svr_peer_add( vws_tcp_svr* s,
+                                cstr h,
+                                int p,
+                                vws_peer_connect fn,
+                                void* data )
+{
+    vws_peer peer;
+    memset(&peer, 0, sizeof(vws_peer));
+
+    // Set connection function. If NULL, uv_thread() connects asynchronously.
+    peer.connect = fn;
+
+    // Set connection as closed. uv_thread() will connect
+    peer.state = VWS_PEER_CLOSED;
+    peer.host  = strdup(h);
+    peer.port  = p;
+    peer.data  = data;
+
+    char key[514];
+    sprintf(key, "%s:%lu", h, p);
+    vws_kvs_set(s->peers, key, &peer, sizeof(vws_peer));
+    s->peers_version++;
+
+    // Set wakeup timer
+    vws_tcp_svr_peer_timer(s);
+
+    return vws_kvs_get(s->peers, key)->data;
+}
+
+void vws_tcp_svr_peer_remove(vws_tcp_svr* s, cstr h, int p)
+{
+    char key[514];
+    sprintf(key, "%s:%lu", h, p);
+
+    vws_peer* peer = vws_kvs_get(s->peers, key)->data;
+
+    if (peer != NULL)
+    {
+        if (peer->pending != NULL)
+        {
+            svr_peer_connect_abort((svr_peer_cnx*)peer->pending);
+        }
+
+        free(peer->host);
+    }
+
+    vws_kvs_remove(s->peers, key);
+    s->peers_version++;
+}
+
+//------------------------------------------------------------------------------
+// Server construction / destruction
+//------------------------------------------------------------------------------
+
+vws_tcp_svr* tcp_svr_ctor(vws_tcp_svr* svr, int nt, int backlog, int queue_size)
+{
+    if (backlog == 0)
+    {
+        backlog = 128;
+    }
+
+    if (queue_size == 0)
+    {
+        queue_size = 1024;
+    }
+
+    svr->threads          = vws.malloc(sizeof(uv_thread_t) * nt);
+    svr->pool_size        = nt;
+    svr->on_connect       = svr_client_connect;
+    svr->on_disconnect    = svr_client_disconnect;
+    svr->on_read          = svr_client_read;
+    svr->on_peer_connect  = svr_client_peer_connect;
+    svr->on_peer_lost     = svr_client_peer_lost;
+    svr->on_data_in       = svr_client_data_in;
+    svr->on_data_out      = svr_client_data_out;
+    svr->worker_ctor      = NULL;
+    svr->worker_ctor_data = NULL;
+    svr->worker_dtor      = NULL;
+    svr->loop_cb          = NULL;
+    svr->shutdown_cb      = NULL;
+    svr->data_lost_cb     = NULL;
+    svr->cnx_open_cb      = NULL;
+    svr->cnx_close_cb     = NULL;
+    svr->backlog          = backlog;
+    svr->loop             = (uv_loop_t*)vws.malloc(sizeof(uv_loop_t));
+    svr->state            = VS_HALTED;
+    svr->trace            = vws.tracelevel;
+    svr->inetd_mode       = 0;
+    svr->peers            = vws_kvs_new(10, false);
+    svr->peer_timeout     = 0;
+    svr->peers_version    = 0;
+    svr->metrics_size     = nt + 1;
+    svr->metrics_next     = 0;
+    svr->metrics          = vws.malloc(sizeof(vws_svr_metrics) * (nt + 1));
+
+    // Built-in peer connects give up after 10 seconds
+    svr->peer_connect_timeout = 10000;
+
+    // HTTP parsers are pooled on first release
+    svr->http_pool      = NULL;
+    svr->http_pooled    = 0;
+    svr->http_pool_size = 64;
+    uv_mutex_init(&svr->http_lock);
+
+    for (int i = 0; i < svr->metrics_size; i++)
+    {
+        vws_svr_metrics* m = &svr->metrics[i];
+        memset(m->counters, 0, sizeof(m->counters));
+        uv_mutex_init(&m->lock);
+
+        for (int k = 0; k < VWS_STAGE_COUNT; k++)
+        {
+            vws_hist_clear(&m->stages[k]);
+        }
+    }
+
+    uv_loop_init(svr->loop);
+    svr->cpool = address_pool_new(1000, 2);
+    queue_init(&svr->requests, queue_size, "requests");
+    queue_init(&svr->responses, queue_size, "responses");
+
+    vws_cinfo* cinfo = vws.malloc(sizeof(vws_cinfo));
+    cinfo->cnx       = NULL;
+    cinfo->server    = svr;
+    cinfo->cid.key   = 0;
+
+    svr->wakeup = vws.malloc(sizeof(uv_async_t));
+    svr->wakeup->data = cinfo;
+    uv_async_init(svr->loop, svr->wakeup, uv_thread);
+
+    svr->peer_timer = vws.malloc(sizeof(uv_timer_t));
+    uv_timer_init(svr->loop, svr->peer_timer);
+
+    // Timeouts are off until configured. The wheel spans 51.2 seconds.
+    svr->on_ping           = NULL;
+    svr->idle_timeout      = 0;
+    svr->handshake_timeout = 0;
+    svr->ping_interval     = 0;
+    svr->wheel.slots       = NULL;
+    svr->wheel.size        = 512;
+    svr->wheel.tick        = 100;
+    svr->wheel.start       = 0;
+    svr->wheel.current     = 0;
+    svr->wheel.timer       = vws.malloc(sizeof(uv_timer_t));
+    svr->wheel.timer->data = svr;
+    uv_timer_init(svr->loop, svr->wheel.timer);
+
+    svr->sockopts.nodelay              = true;
+    svr->sockopts.keepalive            = 0;
+    svr->sockopts.rcvbuf               = 0;
+    svr->sockopts.sndbuf               = 0;
+    svr->sockopts.defer_accept         = 0;
+    svr->sockopts.simultaneous_accepts = true;
+    svr->sockopts.ipv6only             = false;
+    svr->backend                       = VWS_SVR_BACKEND_UV;
+    svr->ring_connections              = 4096;
+    svr->ring                          = NULL;
+
+    return svr;
+}
+
+void on_uv_close(uv_handle_t* handle)
+{
+    if (handle != NULL)
+    {
+        // As a policy we don't put heap data on handle->data. If that is ever
+        // done then it must be freed in the appropriate place. It is ignored
+        // here because it's impossible to tell what it is by the very nature of
+        // uv_handle_t. We will generate a warning however.
+        if (handle->data != NULL)
+        {
+            vws.trace( VL_WARN,
+                       "on_uv_close(): libuv resource not properly freed:"
+                       "handle=%p handle->data=%p",
+                       (void*)handle,
+                       (void*)handle->data );
+        }
+    }
+}
+
+void on_uv_walk(uv_handle_t* handle, void* arg)
+{
+    // If this handle has not been closed, it should have been. Nevertheless we
+    // will make an attempt to close it.
+    if (uv_is_closing(handle) == 0)
+    {
+        uv_close(handle, (uv_close_cb)on_uv_close);
+    }
+}
+
+void tcp_svr_dtor(vws_tcp_svr* svr)
+{
+    vws.free(svr->threads);
+
+    // Close the server async handle
+    uv_close((uv_handle_t*)svr->wakeup, svr_on_close);
+
+    // Close peer timer
+    svr->peer_timer->data = NULL;
+    uv_close((uv_handle_t*)svr->peer_timer, svr_on_timer_close);
+
+    // Close wheel timer. The slots stay until the connections are freed.
+    svr->wheel.timer->data = NULL;
+    uv_close((uv_handle_t*)svr->wheel.timer, svr_on_timer_close);
+
+    // Close the ring handles. The ring stays until the connections are freed.
+    svr_ring_stop(svr);
+
+    // Abandon peer connects in progress
+    for (size_t i = 0; i < svr->peers->used; i++)
+    {
+        vws_peer* peer = (vws_peer*)svr->peers->array[i].value.data;
+
+        if (peer->pending != NULL)
+        {
+            svr_peer_connect_abort((svr_peer_cnx*)peer->pending);
+        }
+    }
+
+    //> Shutdown libuv
+
+    // Run pending close callbacks first, so connections close the handles they
+    // own (such as batch timers) before the walk closes whatever remains.
+    uv_run(svr->loop, UV_RUN_NOWAIT);
+
+    // Walk the loop to close everything
+    uv_walk(svr->loop, on_uv_walk, NULL);
+
+    while (uv_loop_close(svr->loop))
+    {
+        // Run the loop until there are no more active handles
+        while (uv_loop_alive(svr->loop))
+        {
+            uv_run(svr->loop, UV_RUN_DEFAULT);
+        }
+    }
+
+    // Free loop
+    vws.free(svr->loop);
+
+    svr_ring_free(svr);
+
+    // Call user-defined loop callback if defined
+    if (svr->shutdown_cb != NULL)
+    {
+        svr->shutdown_cb(svr);
+    }
+
+    // Free address pool
+    address_pool_free(&svr->cpool);
+
+    vws.free(svr->wheel.slots);
+
+    // Free peers
+
+    for (size_t i = 0; i < svr->peers->used; i++)
+    {
+        vws_peer* peer = (vws_peer*)svr->peers->array[i].value.data;
+        free(peer->host);
+    }
+
+    vws_kvs_free(svr->peers);
+
+    // Free metrics
+    for (int i = 0; i < svr->metrics_size; i++)
+    {
+        uv_mutex_destroy(&svr->metrics[i].lock);
+    }
+
+    vws.free(svr->metrics);
+
+    // Free pooled HTTP parsers
+    for (size_t i = 0; i < svr->http_pooled; i++)
+    {
+        vws_http_msg_free(svr->http_pool[i]);
+    }
+
+    vws.free(svr->http_pool);
+    uv_mutex_destroy(&svr->http_lock);
+}
+
+//------------------------------------------------------------------------------
+// Client connection callbacks
+//------------------------------------------------------------------------------
+
+void svr_client_connect(vws_svr_cnx* c)
+{
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace(VL_INFO, "svr_client_connect(%p)", c->handle);
+    }
+}
+
+void svr_client_disconnect(vws_svr_cnx* c)
+{
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        if (c != NULL)
+        {
+            vws.trace(VL_INFO, "svr_client_disconnect(%p)", c->handle);
+        }
+        else
+        {
+            vws.trace(VL_INFO, "svr_client_disconnect(%p)", NULL);
+        }
+    }
+}
+
+void svr_client_peer_connect(vws_svr_cnx* c, vws_peer* p)
+{
+    // Default: Do nothing.
+}
+
+void svr_client_peer_lost(vws_svr_cnx* c, vws_peer* p)
+{
+    // Default: Do nothing.
+}
+
+void svr_client_read(vws_svr_cnx* c, ssize_t size, const uv_buf_t* buf)
+{
+    vws_tcp_svr* server = c->server;
+
+    // Raw TCP has no handshake
+    c->established = true;
+
+    // Queue data to worker pool for processing
+    vws_svr_data* data   = vws_svr_data_own(server, c->cid, (ucstr)buf->base, size);
+    data->stamps.ingress = vws_clock_usec();
+
+    // Store reference to server
+    data->server = c->server;
+
+    // Put on queue
+    queue_push(&server->requests, data);
+}
+
+void svr_client_data_in(vws_svr_data* m, void* x)
+{
+    // Default: Do nothing. Drop data.
+    vws_svr_data_free(m);
+}
+
+void svr_client_data_out(vws_svr_data* data, void* x)
+{
+    if (data->size == 0)
+    {
+        vws.trace(VL_INFO, "svr_client_data_out(): no data");
+        vws.error(VL_WARN, "svr_client_data_out(): no data");
+
+        vws_svr_data_free(data);
+
+        return;
+    }
+
+    // Check address pool and ensure connection is still active
+    uintptr_t ptr = address_pool_get(data->server->cpool, data->cid.key);
+
+    if (ptr == 0)
+    {
+        // Connection no longer exists.
+
+        // Call user-defined loop callback if defined
+        if (data->server->data_lost_cb != NULL)
+        {
+            data->server->data_lost_cb(data, x);
+        }
+        else
+        {
+            // Unhandled. Delete.
+            vws_svr_data_free(data);
+        }
+
+        return;
+    }
+
+    vws_svr_cnx* cnx = (vws_svr_cnx*)ptr;
+
+    if (cnx->ring != NULL)
+    {
+        // Sent with the ring's next submit
+        if (svr_ring_send(cnx, data) == false)
+        {
+            // Connection is closing/closed.
+            vws_svr_data_free(data);
+
+            return;
+        }
+    }
+    else
+    {
+        uv_buf_t buf    = uv_buf_init(data->data, data->size);
+        uv_write_t* req = (uv_write_t*)vws.malloc(sizeof(uv_write_t));
+        req->data       = data;
+
+        // Write out to libuv
+        if (uv_write(req, cnx->handle, &buf, 1, svr_on_write_complete) != 0)
+        {
+            // Connection is closing/closed.
+            vws_svr_data_free(data);
+            vws.free(req);
+
+            return;
+        }
+    }
+
+    svr_metric_add(data->server, VWS_METRIC_WRITE_BACKLOG, data->size);
+
+    // Data written directly by the network thread has not been dispatched
+    if (data->stamps.dispatched == 0)
+    {
+        data->stamps.dispatched = vws_clock_usec();
+    }
+}
+
+//------------------------------------------------------------------------------
+// io_uring backend
+//------------------------------------------------------------------------------
+
+#if defined(VWS_IO_URING)
+
+bool svr_ring_start(vws_tcp_svr* s)
+{
+    svr_ring* ring = vws.calloc(1, sizeof(svr_ring));
+    ring->server   = s;
+    ring->efd      = -1;
+
+    // Room for a receive, a send and a cancel of every connection, and a
+    // receive into every buffer
+    uint64_t cq = (uint64_t)s->ring_connections * 3 + SVR_RING_BUFFERS;
+
+    if (cq < SVR_RING_ENTRIES * 2)
+    {
+        cq = SVR_RING_ENTRIES * 2;
+    }
+
+    if (cq > UINT32_MAX)
+    {
+        cq = UINT32_MAX;
+    }
+
+    if (vws_uring_init(&ring->uring, SVR_RING_ENTRIES, (uint32_t)cq) == false)
+    {
+        vws.free(ring);
+
+        return false;
+    }
+
+    bool ok = vws_uring_bufs_init( &ring->uring, &ring->bufs, 0,
+                                   SVR_RING_BUFFERS, SVR_RING_BUFFER_SIZE );
+
+    if (ok == true)
+    {
+        ring->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        ok        = (ring->efd >= 0) &&
+                    vws_uring_eventfd(&ring->uring, ring->efd);
+    }
+
+    if (ok == false)
+    {
+        if (ring->efd >= 0)
+        {
+            close(ring->efd);
+        }
+
+        vws_uring_destroy(&ring->uring);
+        vws_uring_bufs_free(&ring->uring, &ring->bufs);
+        vws.free(ring);
+
+        return false;
+    }
+
+    uv_poll_init(s->loop, &ring->poll, ring->efd);
+    ring->poll.data = ring;
+    uv_poll_start(&ring->poll, UV_READABLE, svr_ring_on_poll);
+
+    uv_prepare_init(s->loop, &ring->prepare);
+    ring->prepare.data = ring;
+    uv_prepare_start(&ring->prepare, svr_ring_on_prepare);
+
+    s->ring = ring;
+
+    return true;
+}
+
+void svr_ring_stop(vws_tcp_svr* s)
+{
+    svr_ring* ring = (svr_ring*)s->ring;
+
+    if (ring == NULL)
+    {
+        return;
+    }
+
+    // Embedded in the ring, which goes in svr_ring_free()
+    ring->poll.data    = NULL;
+    ring->prepare.data = NULL;
+    uv_close((uv_handle_t*)&ring->poll, NULL);
+    uv_close((uv_handle_t*)&ring->prepare, NULL);
+}
+
+void svr_ring_free(vws_tcp_svr* s)
+{
+    svr_ring* ring = (svr_ring*)s->ring;
+
+    if (ring == NULL)
+    {
+        return;
+    }
+
+    // Closing the ring cancels what is in flight, so the memory it refers to
+    // can go after.
+    vws_uring_destroy(&ring->uring);
+    vws_uring_bufs_free(&ring->uring, &ring->bufs);
+    close(ring->efd);
+
+    while (ring->cnxs != NULL)
+    {
+        svr_ring_cnx* rc = ring->cnxs;
+        ring->cnxs       = rc->next;
+
+        svr_ring_drop(rc, UV_ECANCELED);
+        vws.free(rc->queue);
+        vws.free(rc);
+    }
+
+    vws.free(ring);
+    s->ring = NULL;
+}
+
+bool svr_ring_attach(vws_svr_cnx* cnx)
+{
+    svr_ring* ring = (svr_ring*)cnx->server->ring;
+    uv_os_fd_t fd;
+
+    if ((ring == NULL) || (uv_fileno((uv_handle_t*)cnx->handle, &fd) != 0))
+    {
+        return false;
+    }
+
+    svr_ring_cnx* rc = vws.calloc(1, sizeof(svr_ring_cnx));
+    rc->ring         = ring;
+    rc->cnx          = cnx;
+    rc->fd           = fd;
+    rc->reading      = true;
+
+    if (svr_ring_recv(rc) == false)
+    {
+        vws.free(rc);
+
+        return false;
+    }
+
+    rc->next = ring->cnxs;
+
+    if (ring->cnxs != NULL)
+    {
+        ring->cnxs->prev = rc;
+    }
+
+    ring->cnxs = rc;
+    cnx->ring  = rc;
+
+    return true;
+}
+
+void svr_ring_detach(vws_svr_cnx* cnx)
+{
+    svr_ring_cnx* rc = (svr_ring_cnx*)cnx->ring;
+
+    if (rc == NULL)
+    {
+        return;
+    }
+
+    cnx->ring    = NULL;
+    rc->cnx      = NULL;
+    rc->shutdown = false;
+    rc->sendfile = false;
+
+    if (rc->armed == true)
+    {
+        svr_ring_cancel(rc, SVR_RING_RECV);
+    }
+
+    // Data in a send in flight is dropped when it completes
+    if (rc->sending == true)
+    {
+        svr_ring_cancel(rc, SVR_RING_SEND);
+    }
+    else
+    {
+        svr_ring_drop(rc, UV_ECANCELED);
+    }
+
+    // The socket is closed, but stays open until its requests are cancelled
+    vws_uring_submit(&rc->ring->uring);
+
+    svr_ring_release(rc);
+}
+
+bool svr_ring_send(vws_svr_cnx* cnx, vws_svr_data* data)
+{
+    svr_ring_cnx* rc = (svr_ring_cnx*)cnx->ring;
+    svr_ring* ring   = rc->ring;
+
+    if (uv_is_closing((uv_handle_t*)cnx->handle))
+    {
+        return false;
+    }
+
+    if (rc->count == rc->capacity)
+    {
+        // Grow, unwrapping the queue
+        uint32_t capacity    = (rc->capacity == 0) ? 8 : rc->capacity * 2;
+        vws_svr_data** queue = vws.malloc(capacity * sizeof(vws_svr_data*));
+
+        for (uint32_t i = 0; i < rc->count; i++)
+        {
+            queue[i] = rc->queue[(rc->head + i) & (rc->capacity - 1)];
+        }
+
+        vws.free(rc->queue);
+
+        rc->queue    = queue;
+        rc->capacity = capacity;
+        rc->head     = 0;
+    }
+
+    rc->queue[(rc->head + rc->count) & (rc->capacity - 1)] = data;
+    rc->count++;
+
+    // A send in flight picks it up when it completes
+    if ((rc->sending == false) && (rc->queued == false))
+    {
+        rc->queued    = true;
+        rc->send_next = ring->sends;
+        ring->sends   = rc;
+    }
+
+    return true;
+}
+
+bool svr_ring_busy(vws_svr_cnx* cnx)
+{
+    svr_ring_cnx* rc = (svr_ring_cnx*)cnx->ring;
+
+    return (rc != NULL) && ((rc->sending == true) || (rc->count > 0));
+}
+
+bool svr_ring_defer(vws_svr_cnx* cnx, int what)
+{
+    if (svr_ring_busy(cnx) == false)
+    {
+        return false;
+    }
+
+    svr_ring_cnx* rc = (svr_ring_cnx*)cnx->ring;
+
+    if (what == SVR_RING_SHUTDOWN)
+    {
+        rc->shutdown = true;
+    }
+    else
+    {
+        rc->sendfile = true;
+    }
+
+    return true;
+}
+
+void svr_ring_read_stop(vws_svr_cnx* cnx)
+{
+    svr_ring_cnx* rc = (svr_ring_cnx*)cnx->ring;
+
+    if ((rc == NULL) || (rc->reading == false))
+    {
+        return;
+    }
+
+    rc->reading = false;
+
+    if (rc->armed == true)
+    {
+        svr_ring_cancel(rc, SVR_RING_RECV);
+    }
+}
+
+void svr_ring_on_poll(uv_poll_t* poll, int status, int events)
+{
+    svr_ring* ring = (svr_ring*)poll->data;
+    uint64_t count;
+
+    // Reset before reaping, so completions posted meanwhile signal again
+    if (read(ring->efd, &count, sizeof(count)) < 0)
+    {
+        // Not signalled. The queue is checked all the same.
+    }
+
+    svr_ring_reap(ring);
+}
+
+void svr_ring_on_prepare(uv_prepare_t* prepare)
+{
+    svr_ring_flush((svr_ring*)prepare->data);
+}
+
+void svr_ring_reap(svr_ring* ring)
+{
+    struct io_uring_cqe* cqe;
+
+    while ((cqe = vws_uring_cqe(&ring->uring)) != NULL)
+    {
+        uint64_t data  = cqe->user_data;
+        int res        = cqe->res;
+        uint32_t flags = cqe->flags;
+
+        // Released first, as handling it may submit
+        vws_uring_cqe_seen(&ring->uring);
+
+        svr_ring_cnx* rc = (svr_ring_cnx*)(uintptr_t)(data & ~SVR_RING_OPS);
+
+        switch (data & SVR_RING_OPS)
+        {
+            case SVR_RING_RECV:
+            {
+                svr_ring_on_recv(rc, res, flags);
+                break;
+            }
+
+            case SVR_RING_SEND:
+            {
+                svr_ring_on_send(rc, res);
+                break;
+            }
+
+            default:
+            {
+                rc->ops--;
+                svr_ring_release(rc);
+            }
+        }
+    }
+}
+
+void svr_ring_on_recv(svr_ring_cnx* rc, int res, uint32_t flags)
+{
+    svr_ring* ring      = rc->ring;
+    vws_tcp_svr* server = ring->server;
+    vws_svr_cnx* cnx    = rc->cnx;
+    bool more           = (flags & IORING_CQE_F_MORE) != 0;
+
+    if (more == false)
+    {
+        rc->ops--;
+        rc->armed = false;
+    }
+
+    // Closing and shut down connections read nothing more
+    bool open = (cnx != NULL) && (rc->reading == true) &&
+                (uv_is_closing((uv_handle_t*)cnx->handle) == false);
+
+    if (flags & IORING_CQE_F_BUFFER)
+    {
+        uint16_t bid = (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT);
+
+        if ((res > 0) && (open == true))
+        {
+            // on_read() takes ownership, as with libuv reads. The kernel gets
+            // the buffer back right away.
+            uv_buf_t buf = uv_buf_init(vws.malloc(res), res);
+            memcpy(buf.base, vws_uring_buf(&ring->bufs, bid), res);
+            vws_uring_buf_return(&ring->bufs, bid);
+
+            svr_metric_add(server, VWS_METRIC_BYTES_IN, res);
+            cnx->active = uv_now(server->loop);
+            server->on_read(cnx, res, &buf);
+
+            open = (rc->reading == true) &&
+                   (uv_is_closing((uv_handle_t*)cnx->handle) == false);
+        }
+        else
+        {
+            vws_uring_buf_return(&ring->bufs, bid);
+        }
+    }
+
+    if ((more == true) || (cnx == NULL) || (open == false))
+    {
+        svr_ring_release(rc);
+
+        return;
+    }
+
+    // The multishot receive ended
+
+    if ((res > 0) || (res == -ENOBUFS))
+    {
+        // Ended by the kernel or out of buffers for the moment
+        if (svr_ring_recv(rc) == false)
+        {
+            uv_close((uv_handle_t*)cnx->handle, svr_on_close);
+        }
+
+        return;
+    }
+
+    if (res == -EINVAL)
+    {
+        // The kernel has no multishot receive. libuv reads instead.
+        rc->reading = false;
+        uv_read_start(cnx->handle, svr_on_realloc, svr_on_read);
+
+        return;
+    }
+
+    // End of file or error
+    uv_close((uv_handle_t*)cnx->handle, svr_on_close);
+}
+
+void svr_ring_on_send(svr_ring_cnx* rc, int res)
+{
+    vws_svr_cnx* cnx = rc->cnx;
+
+    rc->ops--;
+    rc->sending = false;
+
+    if (cnx == NULL)
+    {
+        svr_ring_drop(rc, UV_ECANCELED);
+        svr_ring_release(rc);
+
+        return;
+    }
+
+    if (res < 0)
+    {
+        svr_ring_drop(rc, res);
+
+        if (uv_is_closing((uv_handle_t*)cnx->handle) == false)
+        {
+            uv_close((uv_handle_t*)cnx->handle, svr_on_close);
+        }
+
+        return;
+    }
+
+    size_t sent = (size_t)res;
+
+    while ((sent > 0) && (rc->count > 0))
+    {
+        vws_svr_data* data = rc->queue[rc->head];
+        size_t left        = data->size - rc->offset;
+
+        if (sent < left)
+        {
+            rc->offset += sent;
+            break;
+        }
+
+        sent       -= left;
+        rc->offset  = 0;
+        rc->head    = (rc->head + 1) & (rc->capacity - 1);
+        rc->count--;
+
+        svr_write_done(data, 0);
+    }
+
+    if (rc->count > 0)
+    {
+        svr_ring_send_next(rc);
+
+        return;
+    }
+
+    svr_ring_drained(rc);
+}
+
+void svr_ring_flush(svr_ring* ring)
+{
+    while (ring->sends != NULL)
+    {
+        svr_ring_cnx* rc = ring->sends;
+        ring->sends      = rc->send_next;
+        rc->send_next    = NULL;
+        rc->queued       = false;
+
+        if (rc->cnx == NULL)
+        {
+            svr_ring_release(rc);
+            continue;
+        }
+
+        if ((rc->sending == false) && (rc->count > 0))
+        {
+            svr_ring_send_next(rc);
+        }
+    }
+
+    if (vws_uring_pending(&ring->uring) == false)
+    {
+        return;
+    }
+
+    int rc = vws_uring_submit(&ring->uring);
+
+    // What was not taken goes with the next submit
+    if ((rc < 0) && (vws.tracelevel >= VT_SERVICE))
+    {
+        vws.trace(VL_WARN, "svr_ring_flush(): submit failed %s", strerror(-rc));
+    }
+}
+
+struct io_uring_sqe* svr_ring_sqe(svr_ring* ring)
+{
+    struct io_uring_sqe* sqe = vws_uring_sqe(&ring->uring);
+
+    if (sqe == NULL)
+    {
+        vws_uring_submit(&ring->uring);
+        sqe = vws_uring_sqe(&ring->uring);
+    }
+
+    return sqe;
+}
+
+bool svr_ring_recv(svr_ring_cnx* rc)
+{
+    struct io_uring_sqe* sqe = svr_ring_sqe(rc->ring);
+
+    if (sqe == NULL)
+    {
+        return false;
+    }
+
+    sqe->opcode    = IORING_OP_RECV;
+    sqe->fd        = rc->fd;
+    sqe->ioprio    = IORING_RECV_MULTISHOT;
+    sqe->flags     = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = rc->ring->bufs.bgid;
+    sqe->user_data = (uint64_t)(uintptr_t)rc | SVR_RING_RECV;
+
+    rc->armed = true;
+    rc->ops++;
+
+    return true;
+}
+
+void svr_ring_send_next(svr_ring_cnx* rc)
+{
+    struct io_uring_sqe* sqe = svr_ring_sqe(rc->ring);
+
+    if (sqe == NULL)
+    {
+        uv_handle_t* handle = (uv_handle_t*)rc->cnx->handle;
+
+        svr_ring_drop(rc, UV_ENOBUFS);
+
+        if (uv_is_closing(handle) == false)
+        {
+            uv_close(handle, svr_on_close);
+        }
+
+        return;
+    }
+
+    uint32_t n = (rc->count < SVR_RING_IOV) ? rc->count : SVR_RING_IOV;
+
+    for (uint32_t i = 0; i < n; i++)
+    {
+        vws_svr_data* data = rc->queue[(rc->head + i) & (rc->capacity - 1)];
+        size_t skip        = (i == 0) ? rc->offset : 0;
+
+        rc->iov[i].iov_base = data->data + skip;
+        rc->iov[i].iov_len  = data->size - skip;
+    }
+
+    memset(&rc->msg, 0, sizeof(struct msghdr));
+    rc->msg.msg_iov    = rc->iov;
+    rc->msg.msg_iovlen = n;
+
+    sqe->opcode    = IORING_OP_SENDMSG;
+    sqe->fd        = rc->fd;
+    sqe->addr      = (uint64_t)(uintptr_t)&rc->msg;
+    sqe->len       = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t)(uintptr_t)rc | SVR_RING_SEND;
+
+    rc->sending = true;
+    rc->ops++;
+}
+
+void svr_ring_drained(svr_ring_cnx* rc)
+{
+    vws_svr_cnx* cnx = rc->cnx;
+
+    if (rc->sendfile == true)
+    {
+        rc->sendfile = false;
+
+        if (cnx->sendfile != NULL)
+        {
+            svr_sendfile_head((svr_sendfile*)cnx->sendfile);
+        }
+    }
+
+    if (rc->shutdown == true)
+    {
+        rc->shutdown = false;
+        svr_cnx_shutdown(cnx);
+    }
+}
+
+void svr_ring_cancel(svr_ring_cnx* rc, int op)
+{
+    struct io_uring_sqe* sqe = svr_ring_sqe(rc->ring);
+
+    if (sqe == NULL)
+    {
+        // The request ends when the ring does
+        return;
+    }
+
+    sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+    sqe->fd        = -1;
+    sqe->addr      = (uint64_t)(uintptr_t)rc | op;
+    sqe->user_data = (uint64_t)(uintptr_t)rc | SVR_RING_CANCEL;
+
+    rc->ops++;
+}
+
+void svr_ring_drop(svr_ring_cnx* rc, int status)
+{
+    while (rc->count > 0)
+    {
+        vws_svr_data* data = rc->queue[rc->head];
+        rc->head           = (rc->head + 1) & (rc->capacity - 1);
+        rc->count--;
+
+        svr_write_done(data, status);
+    }
+
+    rc->offset = 0;
+}
+
+void svr_ring_release(svr_ring_cnx* rc)
+{
+    if ((rc->cnx != NULL) || (rc->ops > 0) || (rc->queued == true))
+    {
+        return;
+    }
+
+    svr_ring* ring = rc->ring;
+
+    if (rc->prev != NULL)
+    {
+        rc->prev->next = rc->next;
+    }
+    else
+    {
+        ring->cnxs = rc->next;
+    }
+
+    if (rc->next != NULL)
+    {
+        rc->next->prev = rc->prev;
+    }
+
+    vws.free(rc->queue);
+    vws.free(rc);
+}
+
+#else
+
+bool svr_ring_start(vws_tcp_svr* s)
+{
+    return false;
+}
+
+void svr_ring_stop(vws_tcp_svr* s)
+{
+
+}
+
+void svr_ring_free(vws_tcp_svr* s)
+{
+
+}
+
+bool svr_ring_attach(vws_svr_cnx* c)
+{
+    return false;
+}
+
+void svr_ring_detach(vws_svr_cnx* c)
+{
+
+}
+
+bool svr_ring_send(vws_svr_cnx* c, vws_svr_data* data)
+{
+    return false;
+}
+
+bool svr_ring_busy(vws_svr_cnx* c)
+{
+    return false;
+}
+
+bool svr_ring_defer(vws_svr_cnx* c, int what)
+{
+    return false;
+}
+
+void svr_ring_read_stop(vws_svr_cnx* c)
+{
+
+}
+
+#endif
+
+//------------------------------------------------------------------------------
+// Server Connection
+//------------------------------------------------------------------------------
+
+vws_svr_cnx* svr_cnx_new(vws_tcp_svr* s, uv_stream_t* handle)
+{
+    vws_svr_cnx* cnx = vws.malloc(sizeof(vws_svr_cnx));
+    cnx->server      = s;
+    cnx->handle      = handle;
+    cnx->data        = NULL;
+    cnx->format      = VM_MPACK_FORMAT;
+    cnx->batch       = NULL;
+    cnx->batch_timer = NULL;
+    cnx->sendfile    = NULL;
+    cnx->ring        = NULL;
+    cnx->established = false;
+    cnx->opened      = 0;
+    cnx->active      = 0;
+    cnx->pinged      = 0;
+    cnx->wheel_next  = NULL;
+    cnx->wheel_prev  = NULL;
+    cnx->wheel_slot  = VWS_SVR_WHEEL_NONE;
+
+    vws_cid_clear(&cnx->cid);
+
+    // Initialize HTTP state. The request parser is allocated when the first
+    // bytes arrive, so idle and peer connections never carry one.
+    cnx->upgraded    = false;
+    cnx->http        = NULL;
+    cnx->http_busy   = false;
+    cnx->http_close  = false;
+
+    // Add to address pool
+    cnx->cid.key     = address_pool_set(s->cpool, (uintptr_t)cnx);
+
+    // Mark connection as unauthorized
+    vws_set_flag(&cnx->cid.flags, VWS_SVR_STATE_UNAUTH);
+
+    svr_metric_add(s, VWS_METRIC_CNX_OPENED, 1);
+    vws_tev_emit(VTE_CNX_OPEN, cnx->cid.key, 0, 0);
+
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace(VL_INFO, "svr_cnx_new(%p): added %lu", s, cnx->cid.key);
+    }
+
+    // Get peer info
+    int len = sizeof(struct sockaddr_storage);
+    uv_tcp_getpeername( (const uv_tcp_t*)handle,
+                        (struct sockaddr*)&cnx->cid.addr, &len );
+
+    // Call user-defined connection open callback if defined
+    if (s->cnx_open_cb != NULL)
+    {
+        s->cnx_open_cb(cnx);
+    }
+
+    return cnx;
+}
+
+void svr_cnx_free(vws_svr_cnx* cnx)
+{
+    if (cnx != NULL)
+    {
+        if (vws.tracelevel >= VT_SERVICE)
+        {
+            vws.trace(VL_INFO, "svr_cnx_free(%p)", cnx);
+        }
+
+        // Call user-defined connection close callback if defined
+        if (cnx->server->cnx_close_cb != NULL)
+        {
+            cnx->server->cnx_close_cb(cnx);
+        }
+
+        svr_http_release(cnx->server, cnx->http);
+
+#if !defined(__windows__)
+        // A file being sent is abandoned
+        if (cnx->sendfile != NULL)
+        {
+            svr_sendfile* t = (svr_sendfile*)cnx->sendfile;
+            t->cnx          = NULL;
+            svr_sendfile_free(t);
+        }
+#endif
+
+        // Batched messages still here were never sent. A message server moves
+        // those of a peer connection back to the route backlog in
+        // on_peer_lost(). Anything else is passed to data_lost_cb().
+        svr_batch_lost(cnx);
+
+        if (cnx->batch_timer != NULL)
+        {
+            cnx->batch_timer->data = NULL;
+            uv_close((uv_handle_t*)cnx->batch_timer, svr_on_timer_close);
+        }
+
+        svr_wheel_remove(cnx->server, cnx);
+
+        if (cnx->ring != NULL)
+        {
+            svr_ring_detach(cnx);
+        }
+
+        // Remove from pool
+        address_pool_remove(cnx->server->cpool, cnx->cid.key);
+
+        svr_metric_add(cnx->server, VWS_METRIC_CNX_CLOSED, 1);
+        vws_tev_emit(VTE_CNX_CLOSE, cnx->cid.key, 0, 0);
+
+        vws.free(cnx);
+    }
+}
+
+void svr_batch_each(vrtql_msg_batch* b, vrtql_msg_batch_fn fn, void* x)
+{
+    if ((b == NULL) || (b->count == 0))
+    {
+        return;
+    }
+
+    vws_buffer* buffer = vrtql_msg_batch_finish(b);
+
+    // A single message is returned without an envelope
+    if (vrtql_msg_is_batch(buffer->data, buffer->size) == true)
+    {
+        vrtql_msg_batch_unpack(buffer->data, buffer->size, fn, x);
+    }
+    else
+    {
+        fn(buffer->data, buffer->size, x);
+    }
+
+    vws_buffer_free(buffer);
+}
+
+static void svr_batch_lost_item(ucstr data, size_t size, void* x)
+{
+    vws_svr_cnx* c = (vws_svr_cnx*)x;
+    ucstr copy     = vws.malloc(size);
+    memcpy(copy, data, size);
+
+    vws_svr_data* item = vws_svr_data_own(c->server, c->cid, copy, size);
+    vws_set_flag(&item->flags, VWS_SVR_STATE_BATCH);
+
+    c->server->data_lost_cb(item, NULL);
+}
+
+void svr_batch_lost(vws_svr_cnx* c)
+{
+    if (c->server->data_lost_cb != NULL)
+    {
+        svr_batch_each(c->batch, svr_batch_lost_item, c);
+    }
+
+    vrtql_msg_batch_free(c->batch);
+    c->batch = NULL;
+}
+
+void svr_cnx_close(vws_tcp_svr* server, vws_cid_t cid)
+{
+    vws_tcp_svr_close(server, cid);
+}
+
+void svr_cnx_shutdown(vws_svr_cnx* cnx)
+{
+    uv_handle_t* handle = (uv_handle_t*)cnx->handle;
+
+    if (uv_is_closing(handle))
+    {
+        return;
+    }
+
+    // No more requests are read
+    uv_read_stop(cnx->handle);
+    svr_ring_read_stop(cnx);
+
+    // The ring sends what is queued first
+    if (svr_ring_defer(cnx, SVR_RING_SHUTDOWN) == true)
+    {
+        return;
+    }
+
+    uv_shutdown_t* req = vws.malloc(sizeof(uv_shutdown_t));
+
+    if (uv_shutdown(req, cnx->handle, svr_on_shutdown) != 0)
+    {
+        vws.free(req);
+        uv_close(handle, svr_on_close);
+    }
+}
+
+void svr_on_shutdown(uv_shutdown_t* req, int status)
+{
+    uv_handle_t* handle = (uv_handle_t*)req->handle;
+
+    // Cancelled if the handle was closed meanwhile
+    if (uv_is_closing(handle) == false)
+    {
+        uv_close(handle, svr_on_close);
+    }
+
+    vws.free(req);
+}
+
+void svr_http_complete(vws_tcp_svr* server, vws_cid_t cid)
+{
+    uintptr_t ptr = address_pool_get(server->cpool, cid.key);
+
+    if (ptr == 0)
+    {
+        return;
+    }
+
+    vws_svr_cnx* cnx = (vws_svr_cnx*)ptr;
+    cnx->http_busy   = false;
+
+    if (uv_is_closing((uv_handle_t*)cnx->handle))
+    {
+        return;
+    }
+
+    if (cnx->http_close == true)
+    {
+        svr_cnx_shutdown(cnx);
+
+        return;
+    }
+
+    // Go on with pipelined requests already in the buffer
+    uv_buf_t buf = uv_buf_init(NULL, 0);
+    server->on_read(cnx, 0, &buf);
+}
+
+vws_http_msg* svr_http_acquire(vws_tcp_svr* s)
+{
+    vws_http_msg* m = NULL;
+
+    uv_mutex_lock(&s->http_lock);
+
+    if (s->http_pooled > 0)
+    {
+        m = s->http_pool[--s->http_pooled];
+    }
+
+    uv_mutex_unlock(&s->http_lock);
+
+    if (m == NULL)
+    {
+        m = vws_http_msg_new(HTTP_REQUEST);
+    }
+
+    m->borrow = true;
+
+    return m;
+}
+
+void svr_http_release(vws_tcp_svr* s, vws_http_msg* m)
+{
+    if (m == NULL)
+    {
+        return;
+    }
+
+    vws_http_msg_reset(m);
+
+    uv_mutex_lock(&s->http_lock);
+
+    if (s->http_pool == NULL)
+    {
+        s->http_pool = vws.malloc(sizeof(vws_http_msg*) * s->http_pool_size);
+    }
+
+    if (s->http_pooled < s->http_pool_size)
+    {
+        s->http_pool[s->http_pooled++] = m;
+        m = NULL;
+    }
+
+    uv_mutex_unlock(&s->http_lock);
+
+    vws_http_msg_free(m);
+}
+
+//------------------------------------------------------------------------------
+// Timing wheel
+//------------------------------------------------------------------------------
+
+void svr_wheel_start(vws_tcp_svr* s)
+{
+    vws_svr_wheel* w = &s->wheel;
+
+    if ( (s->idle_timeout == 0) &&
+         (s->handshake_timeout == 0) &&
+         (s->ping_interval == 0) )
+    {
+        return;
+    }
+
+    if (w->size == 0)
+    {
+        w->size = 512;
+    }
+
+    if (w->tick == 0)
+    {
+        w->tick = 100;
+    }
+
+    // Slots are found by masking with size - 1
+    while ((w->size & (w->size - 1)) != 0)
+    {
+        w->size++;
+    }
+
+    if (w->slots == NULL)
+    {
+        w->slots = vws.calloc(w->size, sizeof(vws_svr_cnx*));
+    }
+
+    w->start   = uv_now(s->loop);
+    w->current = 0;
+
+    uv_timer_start(w->timer, svr_wheel_on_tick, w->tick, w->tick);
+}
+
+void svr_wheel_add(vws_tcp_svr* s, vws_svr_cnx* c)
+{
+    if (s->wheel.slots == NULL)
+    {
+        return;
+    }
+
+    uint64_t now = uv_now(s->loop);
+    c->opened    = now;
+    c->active    = now;
+    c->pinged    = now;
+
+    // First look at it after the shortest timeout
+    uint32_t first = UINT32_MAX;
+    uint32_t t[]   = { s->idle_timeout,
+                       s->handshake_timeout,
+                       s->ping_interval };
+
+    for (int i = 0; i < 3; i++)
+    {
+        if ((t[i] > 0) && (t[i] < first))
+        {
+            first = t[i];
+        }
+    }
+
+    svr_wheel_schedule(s, c, now + first);
+}
+
+void svr_wheel_schedule(vws_tcp_svr* s, vws_svr_cnx* c, uint64_t due)
+{
+    vws_svr_wheel* w = &s->wheel;
+
+    // Round up to the tick, and never into one already processed
+    uint64_t tick = (due - w->start + w->tick - 1) / w->tick;
+
+    if (tick <= w->current)
+    {
+        tick = w->current + 1;
+    }
+
+    uint32_t slot = (uint32_t)(tick & (w->size - 1));
+
+    c->wheel_slot = slot;
+    c->wheel_prev = NULL;
+    c->wheel_next = w->slots[slot];
+
+    if (c->wheel_next != NULL)
+    {
+        c->wheel_next->wheel_prev = c;
+    }
+
+    w->slots[slot] = c;
+}
+
+void svr_wheel_remove(vws_tcp_svr* s, vws_svr_cnx* c)
+{
+    if (c->wheel_slot == VWS_SVR_WHEEL_NONE)
+    {
+        return;
+    }
+
+    if (c->wheel_prev != NULL)
+    {
+        c->wheel_prev->wheel_next = c->wheel_next;
+    }
+    else
+    {
+        s->wheel.slots[c->wheel_slot] = c->wheel_next;
+    }
+
+    if (c->wheel_next != NULL)
+    {
+        c->wheel_next->wheel_prev = c->wheel_prev;
+    }
+
+    c->wheel_next = NULL;
+    c->wheel_prev = NULL;
+    c->wheel_slot = VWS_SVR_WHEEL_NONE;
+}
+
+void svr_wheel_visit(vws_tcp_svr* s, vws_svr_cnx* c, uint64_t now)
+{
+    uv_handle_t* handle = (uv_handle_t*)c->handle;
+
+    if (uv_is_closing(handle))
+    {
+        return;
+    }
+
+    uint64_t due = UINT64_MAX;
+    bool expired = false;
+
+    // A request with a worker or a file being sent is progress
+    if (c->http_busy == false)
+    {
+        if ((s->handshake_timeout > 0) && (c->established == false))
+        {
+            uint64_t t = c->opened + s->handshake_timeout;
+            expired    = expired || (t <= now);
+            due        = (t < due) ? t : due;
+        }
+
+        if (s->idle_timeout > 0)
+        {
+            uint64_t t = c->active + s->idle_timeout;
+            expired    = expired || (t <= now);
+            due        = (t < due) ? t : due;
+        }
+    }
+
+    if (expired == true)
+    {
+        if (vws.tracelevel >= VT_SERVICE)
+        {
+            vws.trace(VL_INFO, "svr_wheel_visit(%p): timeout %p", s, c);
+        }
+
+        svr_metric_add(s, VWS_METRIC_CNX_TIMEOUTS, 1);
+        uv_close(handle, svr_on_close);
+
+        return;
+    }
+
+    if ( (s->ping_interval > 0) &&
+         (s->on_ping != NULL) &&
+         (c->established == true) )
+    {
+        uint64_t last = (c->active > c->pinged) ? c->active : c->pinged;
+        uint64_t t    = last + s->ping_interval;
+
+        if (t <= now)
+        {
+            s->on_ping(c);
+            c->pinged = now;
+            t         = now + s->ping_interval;
+        }
+
+        due = (t < due) ? t : due;
+    }
+
+    // Nothing applies right now (e.g. busy). Check back a timeout later.
+    if (due == UINT64_MAX)
+    {
+        uint32_t t = s->idle_timeout;
+        t          = (t > 0) ? t : s->handshake_timeout;
+        t          = (t > 0) ? t : s->ping_interval;
+        due        = now + t;
+    }
+
+    svr_wheel_schedule(s, c, due);
+}
+
+void svr_wheel_on_tick(uv_timer_t* handle)
+{
+    vws_tcp_svr* s   = (vws_tcp_svr*)handle->data;
+    vws_svr_wheel* w = &s->wheel;
+    uint64_t now     = uv_now(s->loop);
+    uint64_t target  = (now - w->start) / w->tick;
+
+    // Catch up on ticks missed while the loop was busy. One turn covers every
+    // slot.
+    if (target - w->current > w->size)
+    {
+        w->current = target - w->size;
+    }
+
+    while (w->current < target)
+    {
+        w->current++;
+
+        // Take the whole list first. Connections not yet due are filed again
+        // under later ticks, which may map to this same slot.
+        uint32_t slot  = (uint32_t)(w->current & (w->size - 1));
+        vws_svr_cnx* c = w->slots[slot];
+        w->slots[slot] = NULL;
+
+        while (c != NULL)
+        {
+            vws_svr_cnx* next = c->wheel_next;
+
+            c->wheel_next = NULL;
+            c->wheel_prev = NULL;
+            c->wheel_slot = VWS_SVR_WHEEL_NONE;
+
+            svr_wheel_visit(s, c, now);
+
+            c = next;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+// Server Utilities
+//------------------------------------------------------------------------------
+
+vws_svr_cnx* svr_cnx_map_get(vws_svr_cnx_map* map, uv_stream_t* key)
+{
+    vws_svr_cnx* cnx = sc_map_get_64v(map, (uint64_t)key);
+
+    // If entry exists
+    if (sc_map_found(map) == true)
+    {
+        return cnx;
+    }
+
+    return NULL;
+}
+
+void svr_cnx_map_remove(vws_svr_cnx_map* map, uv_stream_t* key)
+{
+    vws_svr_cnx* cnx = sc_map_get_64v(map, (uint64_t)key);
+
+    // If entry exists
+    if (sc_map_found(map) == true)
+    {
+        sc_map_del_64v(map, (uint64_t)key);
+
+        // Call on_disconnect() handler
+        cnx->server->on_disconnect(cnx);
+
+        // Cleanup
+        vws.free(cnx);
+    }
+}
+
+int8_t svr_cnx_map_set(vws_svr_cnx_map* map, uv_stream_t* key, vws_svr_cnx* value)
+{
+    // See if we have an existing entry
+    sc_map_get_64v(map, (uint64_t)key);
+
+    if (sc_map_found(map) == true)
+    {
+        // Exsiting entry. Return false.
+        return 0;
+    }
+
+    sc_map_put_64v(map, (uint64_t)key, value);
+
+    // True
+    return 1;
+}
+
+void svr_cnx_map_clear(vws_svr_cnx_map* map)
+{
+    uint64_t key; vws_svr_cnx* cnx;
+    sc_map_foreach(map, key, cnx)
+    {
+        cnx->server->on_disconnect(cnx);
+        vws.free(cnx);
+    }
+
+    sc_map_clear_64v(map);
+}
+
+void svr_shutdown(vws_tcp_svr* server)
+{
+    if (server->state == VS_HALTED)
+    {
+        return;
+    }
+
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace(VL_INFO, "svr_shutdown(%p): Shutdown starting", server);
+    }
+
+    //> Cleanup queues
+
+    vws_svr_queue* queue = &server->responses;
+    uv_mutex_lock(&queue->mutex);
+    for (int i = 0; i < VWS_SVR_LANES; i++)
+    {
+        vws_svr_lane* lane = &queue->lanes[i];
+
+        while (lane->size > 0)
+        {
+            vws_svr_data* data = lane->buffer[lane->head];
+            lane->head         = (lane->head + 1) % queue->capacity;
+            lane->size--;
+            queue->size--;
+
+            vws_svr_data_free(data);
+        }
+    }
+    uv_mutex_unlock(&queue->mutex);
+
+    queue_destroy(&server->requests);
+    queue_destroy(&server->responses);
+
+    // Stop the loop. This will cause uv_run() to return in vws_tcp_svr_run()
+    // which will also return.
+    uv_stop(server->loop);
+}
+
+int svr_listen_options(vws_tcp_svr* s, uv_tcp_t* socket)
+{
+    vws_svr_sockopts* o = &s->sockopts;
+    int rc;
+
+    // Accepted connections inherit the buffer sizes, so they apply from the
+    // SYN on, which is when the window scale is settled.
+    if (o->rcvbuf > 0)
+    {
+        int size = o->rcvbuf;
+
+        if ((rc = uv_recv_buffer_size((uv_handle_t*)socket, &size)) != 0)
+        {
+            return rc;
+        }
+    }
+
+    if (o->sndbuf > 0)
+    {
+        int size = o->sndbuf;
+
+        if ((rc = uv_send_buffer_size((uv_handle_t*)socket, &size)) != 0)
+        {
+            return rc;
+        }
+    }
+
+#if defined(__linux__) && defined(TCP_DEFER_ACCEPT)
+    if (o->defer_accept > 0)
+    {
+        uv_os_fd_t fd;
+        int secs = (int)o->defer_accept;
+
+        if ((rc = uv_fileno((uv_handle_t*)socket, &fd)) != 0)
+        {
+            return rc;
+        }
+
+        if (setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &secs, sizeof(secs)))
+        {
+            return uv_translate_sys_error(errno);
+        }
+    }
+#endif
+
+    return uv_tcp_simultaneous_accepts(socket, o->simultaneous_accepts);
+}
+
+void svr_accept_options(vws_tcp_svr* s, uv_tcp_t* c)
+{
+    vws_svr_sockopts* o = &s->sockopts;
+
+    // Failures here leave the connection usable, so they are only traced
+    if (uv_tcp_nodelay(c, o->nodelay) != 0)
+    {
+        if (vws.tracelevel >= VT_SERVICE)
+        {
+            vws.trace(VL_WARN, "svr_accept_options(%p): nodelay failed", c);
+        }
+    }
+
+    if (uv_tcp_keepalive(c, o->keepalive > 0, o->keepalive) != 0)
+    {
+        if (vws.tracelevel >= VT_SERVICE)
+        {
+            vws.trace(VL_WARN, "svr_accept_options(%p): keepalive failed", c);
+        }
+    }
+}
+
+void svr_on_connect(uv_stream_t* socket, int status)
+{
+    vws_cinfo* svr_addr = (vws_cinfo*)socket->data;
+    vws_tcp_svr* server = svr_addr->server;
+
+    if (status < 0)
+    {
+        cstr e = uv_strerror(status);
+        vws.error(VE_RT, "Error in connection callback: %s", e);
+        return;
+    }
+
+    uv_tcp_t* c = (uv_tcp_t*)vws.malloc(sizeof(uv_tcp_t));
+
+    if (c == NULL)
+    {
+        vws.error(VE_RT, "Failed to allocate memory for client");
+        return;
+    }
+
+    vws_cinfo* cinfo = vws.malloc(sizeof(vws_cinfo));
+    cinfo->cnx       = NULL;
+    cinfo->server    = server;
+    c->data          = cinfo;
+
+    if (uv_tcp_init(server->loop, c) != 0)
+    {
+        vws.error(VE_RT, "Failed to initialize client");
+        return;
+    }
+
+    if (uv_accept(socket, (uv_stream_t*)c) == 0)
+    {
+        svr_accept_options(server, c);
+
+        // The ring reads once the connection is set up
+        if ( (server->ring == NULL) &&
+             (uv_read_start((uv_stream_t*)c, svr_on_realloc, svr_on_read) != 0))
+        {
+            vws.error(VE_RT, "Failed to start reading from client");
+            return;
+        }
+    }
+    else
+    {
+        // Not registered, so svr_on_close() only frees the handle
+        vws_cid_clear(&cinfo->cid);
+        uv_close((uv_handle_t*)c, svr_on_close);
+        return;
+    }
+
+    //> Add connection to registry and initialize
+
+    vws_svr_cnx* cnx = svr_cnx_new(server, (uv_stream_t*)c);
+    cinfo->cnx       = cnx;
+    cinfo->cid       = cnx->cid;
+
+    svr_wheel_add(server, cnx);
+
+    if ((server->ring != NULL) && (svr_ring_attach(cnx) == false))
+    {
+        uv_read_start((uv_stream_t*)c, svr_on_realloc, svr_on_read);
+    }
+
+    //> Call svr_on_connect() handler
+
+    server->on_connect(cnx);
+}
+
+void svr_on_read(uv_stream_t* c, ssize_t nread, const uv_buf_t* buf)
+{
+    vws_cinfo* cinfo    = (vws_cinfo*)c->data;
+    vws_svr_cnx* cnx    = cinfo->cnx;
+    vws_tcp_svr* server = cinfo->server;
+    vws_cid_t cid       = cinfo->cid;
+
+    if (nread < 0)
+    {
+        uv_close((uv_handle_t*)c, svr_on_close);
+        vws.free(buf->base);
+        return;
+    }
+
+    svr_metric_add(server, VWS_METRIC_BYTES_IN, nread);
+
+    // Lookup connection
+    uintptr_t ptr = address_pool_get(server->cpool, cid.key);
+
+    if (ptr != 0)
+    {
+        vws_svr_cnx* cnx = (vws_svr_cnx*)ptr;
+        cnx->active      = uv_now(server->loop);
+        server->on_read(cnx, nread, buf);
+    }
+}
+
+void svr_on_write_complete(uv_write_t* req, int status)
+{
+    svr_write_done((vws_svr_data*)req->data, status);
+    vws.free(req);
+}
+
+void svr_write_done(vws_svr_data* data, int status)
+{
+    svr_metric_add(data->server, VWS_METRIC_WRITE_BACKLOG, -(uint64_t)data->size);
+
+    if (status == 0)
     {
-        vws.trace(VL_INFO, "worker_thread(): Starting");
+        vws_svr_stamps* stamps = &data->stamps;
+        stamps->written        = vws_clock_usec();
+
+        svr_metric_add(data->server, VWS_METRIC_BYTES_OUT, data->size);
+
+        svr_metric_stage( data->server, VWS_STAGE_WRITE,
+                          stamps->dispatched, stamps->written );
+
+        svr_metric_stage( data->server, VWS_STAGE_TOTAL,
+                          stamps->ingress, stamps->written );
     }
 
-    vws_thread_ctx ctx;
-    ctx.ctor      = server->worker_ctor;
-    ctx.ctor_data = server->worker_ctor_data;
-    ctx.dtor      = server->worker_dtor;
-    ctx.data      = NULL;
+    vws_svr_data_free(data);
+}
 
-    if (ctx.ctor != NULL)
+void svr_on_timer_close(uv_handle_t* handle)
+{
+    vws.free(handle);
+}
+
+void svr_on_close(uv_handle_t* handle)
+{
+    vws_cinfo* cinfo    = (vws_cinfo*)handle->data;
+    vws_svr_cnx* cnx    = cinfo->cnx;
+    vws_tcp_svr* server = cinfo->server;
+    vws_cid_t cid       = cinfo->cid;
+
+    if (vws.tracelevel >= VT_SERVICE)
     {
-        ctx.data = ctx.ctor(ctx.ctor_data);
+        vws.trace(VL_INFO, "svr_on_close(%p, %p)", server, handle);
     }
 
-    while (true)
+    if (server == NULL)
     {
-        //> Wait for arrival
+        assert(false);
+        vws.free(handle->data);
+        vws.free(handle);
 
-        // This will put the thread to sleep on a condition variable until
-        // something arrives in queue.
-        vws_svr_data* request = queue_pop(&server->requests);
+        return;
+    }
 
-        // If there's no request (null request), check the server's state
-        if (request == NULL)
-        {
-            // If server is in halting state, return
-            if (server->state == VS_HALTING)
-            {
-                if (vws.tracelevel >= VT_THREAD)
-                {
-                    vws.trace(VL_INFO, "worker_thread(): Exiting");
-                }
+    // Lookup connection. If it's not in pool then it's already been cleaned up.
+    uintptr_t ptr = address_pool_get(server->cpool, cid.key);
 
-                break;
-            }
-            else
-            {
-                // If not halting, skip to the next iteration of the loop
-                continue;
-            }
+    if (ptr != 0)
+    {
+        vws_svr_cnx* cnx = (vws_svr_cnx*)ptr;
+
+        // A lost peer connection is reconnected by uv_thread()
+        if (vws_is_flag(&cnx->cid.flags, VWS_SVR_STATE_PEER))
+        {
+            svr_peer_lost(server, cnx);
         }
 
-        server->on_data_in(request, ctx.data);
+        // Call on_disconnect() handler
+        server->on_disconnect(cnx);
+
+        // Cleanup
+        svr_cnx_free(cnx);
     }
 
-    if (ctx.dtor != NULL)
+    vws.free(handle->data);
+    vws.free(handle);
+
+    // If we are running in inetd mode, there is only one socket and its closing
+    // means we are done and should exit process.
+
+    if ((server->inetd_mode == 1) && vws_tcp_svr_is_running(server))
     {
-        ctx.dtor(ctx.data);
+        vws_tcp_svr_inetd_stop(server);
     }
 }
 
-void vws_tcp_svr_uv_close(vws_tcp_svr* server, uv_handle_t* handle)
+void svr_on_realloc(uv_handle_t* handle, size_t size, uv_buf_t* buf)
 {
-    uv_close(handle, svr_on_close);
+    buf->base = (char*)vws.realloc(buf->base, size);
+    buf->len  = size;
 }
 
-void uv_thread(uv_async_t* handle)
+//------------------------------------------------------------------------------
+// Queue API
+//------------------------------------------------------------------------------
+
+void queue_init(vws_svr_queue* queue, int size, cstr name)
 {
-    vws_cinfo* cinfo    = (vws_cinfo*)handle->data;
-    vws_tcp_svr* server = cinfo->server;
+    for (int i = 0; i < VWS_SVR_LANES; i++)
+    {
+        vws_svr_lane* lane = &queue->lanes[i];
+        lane->buffer = (vws_svr_data**)vws.malloc(size * sizeof(vws_svr_data*));
+        lane->size   = 0;
+        lane->head   = 0;
+        lane->tail   = 0;
 
-    vws.trace(VL_INFO, "uv_thread()");
+        queue->passed[i] = 0;
+    }
 
-    if (server->state == VS_HALTING)
+    queue->size     = 0;
+    queue->capacity = size;
+    queue->quota    = 16;
+    queue->state    = VS_RUNNING;
+    queue->name     = strdup(name);
+
+    // Initialize mutex and condition variable
+    uv_mutex_init(&queue->mutex);
+    uv_cond_init(&queue->cond);
+}
+
+void queue_destroy(vws_svr_queue* queue)
+{
+    if (queue->lanes[0].buffer != NULL)
     {
-        if (vws.tracelevel >= VT_THREAD)
-        {
-            vws.trace(VL_INFO, "uv_thread(): stop");
-        }
+        vws.free(queue->name);
+        uv_mutex_destroy(&queue->mutex);
+        uv_cond_destroy(&queue->cond);
 
-        // Join worker threads. Worker threads must all exit before we can
-        // shutdown libuv as they must release their mutexes and condition
-        // variables first, otherwise uv_stop() will not actually stop the loop.
-        for (int i = 0; i < server->pool_size; i++)
+        for (int i = 0; i < VWS_SVR_LANES; i++)
         {
-            uv_thread_join(&server->threads[i]);
+            vws.free(queue->lanes[i].buffer);
+            queue->lanes[i].buffer = NULL;
         }
 
-        svr_shutdown(server);
+        queue->state = VS_HALTED;
+    }
+}
+
+vws_svr_lane_t queue_lane(vws_svr_data* data)
+{
+    uint64_t flags = data->flags | data->cid.flags;
+
+    if (flags & VWS_SVR_STATE_IRQ)
+    {
+        return VWS_SVR_LANE_IRQ;
+    }
+
+    if (flags & VWS_SVR_STATE_PRIORITY)
+    {
+        return VWS_SVR_LANE_PRIORITY;
+    }
+
+    return VWS_SVR_LANE_BULK;
+}
 
+void queue_push(vws_svr_queue* queue, vws_svr_data* data)
+{
+    if (queue->state != VS_RUNNING)
+    {
+        vws_svr_data_free(data);
         return;
     }
 
-    // We process responses first so that if a peer has disconnected, its cid
-    // still points to the closed connect. If a response maps to a closed peer
-    // connection, we can catch it and call hook which allows outside queue to
-    // queue and resend data when peer reconnects.
-    while (queue_empty(&server->responses) == false)
+    vws_svr_lane* lane = &queue->lanes[queue_lane(data)];
+
+    uv_mutex_lock(&queue->mutex);
+
+    while (lane->size == queue->capacity)
     {
-        vws_svr_data* data = queue_pop(&server->responses);
+        uv_cond_wait(&queue->cond, &queue->mutex);
+    }
 
-        if ((data == NULL) || (server->responses.state != VS_RUNNING))
+    if (queue->state != VS_RUNNING)
+    {
+        uv_cond_signal(&queue->cond);
+        uv_mutex_unlock(&queue->mutex);
+        return;
+    }
+
+    lane->buffer[lane->tail] = data;
+    lane->tail = (lane->tail + 1) % queue->capacity;
+    lane->size++;
+    queue->size++;
+
+    // Signal condition variable
+    uv_cond_signal(&queue->cond);
+    uv_mutex_unlock(&queue->mutex);
+}
+
+vws_svr_data* queue_pop(vws_svr_queue* queue)
+{
+    uv_mutex_lock(&queue->mutex);
+
+    while (queue->size == 0 && queue->state == VS_RUNNING)
+    {
+        uv_cond_wait(&queue->cond, &queue->mutex);
+    }
+
+    if (queue->state == VS_HALTING)
+    {
+        uv_cond_broadcast(&queue->cond);
+        uv_mutex_unlock(&queue->mutex);
+
+        return NULL;
+    }
+
+    // Highest lane with data
+    int first = 0;
+
+    while (queue->lanes[first].size == 0)
+    {
+        first++;
+    }
+
+    // Starvation protection: the highest waiting lane which has been passed
+    // over more than quota times gets this turn instead.
+    int i = first;
+
+    for (int j = first + 1; j < VWS_SVR_LANES; j++)
+    {
+        if (queue->lanes[j].size == 0)
         {
-            if (data != NULL)
-            {
-                vws_svr_data_free(data);
-            }
+            queue->passed[j] = 0;
+            continue;
+        }
 
-            return;
+        if ((queue->passed[j] >= queue->quota) && (i == first))
+        {
+            i = j;
         }
+    }
 
-        if (vws_is_flag(&data->flags, VWS_SVR_STATE_CLOSE))
+    // Every waiting lane not served now has been passed over once more
+    for (int j = first; j < VWS_SVR_LANES; j++)
+    {
+        if (j == i)
         {
-            // Lookup connection
-            uintptr_t ptr = address_pool_get(server->cpool, data->cid.key);
+            queue->passed[j] = 0;
+        }
+        else if (queue->lanes[j].size > 0)
+        {
+            queue->passed[j]++;
+        }
+    }
 
-            if (ptr != 0)
-            {
-                // Close connections
-                vws_svr_cnx* cnx = (vws_svr_cnx*)ptr;
-                uv_close((uv_handle_t*)cnx->handle, svr_on_close);
-            }
+    vws_svr_lane* lane = &queue->lanes[i];
+    vws_svr_data* data = lane->buffer[lane->head];
+    lane->head         = (lane->head + 1) % queue->capacity;
+    lane->size--;
+    queue->size--;
 
-            vws_svr_data_free(data);
+    // Wake up any producer blocked on this lane
+    if (lane->size == queue->capacity - 1)
+    {
+        uv_cond_broadcast(&queue->cond);
+    }
+
+    uv_mutex_unlock(&queue->mutex);
+
+    return data;
+}
+
+bool queue_empty(vws_svr_queue* queue)
+{
+    uv_mutex_lock(&queue->mutex);
+    bool empty = (queue->size == 0);
+    uv_mutex_unlock(&queue->mutex);
+
+    return empty;
+}
+
+//------------------------------------------------------------------------------
+// Pure WebSocket Server
+//------------------------------------------------------------------------------
+
+// For handling HTTP requests
+int ws_svr_on_http_read(vws_svr_cnx* cnx)
+{
+    // The the HTTP request complete?
+    if (cnx->http->done == true)
+    {
+        vws_svr* server = (vws_svr*)cnx->server;
+
+        // Pass to some processing function if defined
+        if (server->process_http != NULL)
+        {
+            // Pass message pointer in block
+            vws_svr_data* block;
+            block = vws_svr_data_own( cnx->server,
+                                      cnx->cid,
+                                      (ucstr)cnx->http,
+                                      sizeof(vws_http_msg*) );
+
+            // Flag this message as HTTP request
+            vws_set_flag(&block->flags, VWS_SVR_STATE_HTTP);
+            block->stamps.ingress = vws_clock_usec();
+
+            // Hold later requests until the worker is done with this one
+            cnx->http_busy = true;
+
+            // Queue request
+            queue_push(&cnx->server->requests, block);
         }
         else
         {
-            server->on_data_out(data, NULL);
+            // No HTTP processing function defined. Since we take ownership of
+            // message to we must up clean up.
+            svr_http_release(cnx->server, cnx->http);
         }
-    }
-
-    // Check for closed peer connections.
-    int pending_peers = 0;
-    for (size_t i = 0; i < server->peers->used; i++)
-    {
-        vws_peer* peer = (vws_peer*)server->peers->array[i].value.data;
 
-        // If closed
-        if (peer->state == VWS_PEER_CLOSED)
-        {
-            // Set to pending
-            peer->state = VWS_PEER_PENDING;
+        // By returning 1 we tell the caller we handled the request and took
+        // owndership of it (freed memory). Caller will allocate a new request
+        // and continue with connection processing.
+        return 1;
+    }
 
-            // Create queue element
-            vws_svr_data* block;
-            block = vws_svr_data_own( server,
-                                      peer->info.cid,
-                                      (ucstr)peer,
-                                      sizeof(vws_peer*) );
+    // By returning 0, we tell caller that the HTTP request is not
+    // complete. Keep reading and call us again when more data arrives.
+    return 0;
+}
 
-            // Flag as closed connection
-            vws_set_flag(&block->flags, VWS_SVR_STATE_PEER_CONNECT);
+void ws_svr_process_frame(vws_cnx* c, vws_frame* f)
+{
+    vws_svr_cnx* cnx = (vws_svr_cnx*)c->data;
 
-            // Queue request
-            queue_push(&server->requests, block);
-        }
+    svr_metric_add(cnx->server, VWS_METRIC_FRAMES_IN, 1);
+    vws_tev_emit(VTE_FRAME_IN, cnx->cid.key, f->opcode, f->size);
 
-        // NOTE: This code is very similar to vws_tcp_svr_inetd_run() but
-        // different enough in that it cannot be easily factored and reused. In
-        // both cases we are taking an open socket descriptor and importing it
-        // into libuv loop.
-        if (peer->state == VWS_PEER_RECONNECTED)
+    switch (f->opcode)
+    {
+        case CLOSE_FRAME:
         {
-            // We have successfully connected to remote peer and have an active
-            // socket descriptor. We now need to take ownership of the socket
-            // descriptor, create an associated vws_svr_cnx connection instance
-            // for that socket descriptor, customize it for websocket operation
-            // and add to connection pool.
+            // Build the response frame
+            vws_buffer* buffer = vws_generate_close_frame();
 
-            // Set socket to non-blocking mode for libuv
-            if (vws_socket_set_nonblocking(peer->sockfd) == false)
-            {
-                vws.error(VE_RT, "Failed to set socket to nonblocking");
-                return;
-            }
+            // Send back to cliane Send the PONG response
+            vws_svr_data* response;
 
-            // Adopt socket descriptor into libuv loop
-            uv_tcp_t* c = (uv_tcp_t*)vws.malloc(sizeof(uv_tcp_t));
+            response = vws_svr_data_new(cnx->server, cnx->cid, &buffer);
+            vws_tcp_svr_send(response);
 
-            if (uv_tcp_init(server->loop, c))
-            {
-                // Handle uv_tcp_init failure.
-                vws.error(VE_RT, "Failed to initialize new TCP handle");
-                vws.free(c);
-                return;
-            }
+            // Free buffer
+            vws_buffer_free(buffer);
 
-            if (uv_tcp_open(c, peer->sockfd))
-            {
-                // Handle uv_tcp_open failure.
-                vws.error(VE_RT, "Failed to adopt the socket descriptor.");
-                vws.free(c);
-                return;
-            }
+            // Free frame
+            vws_frame_free(f);
 
-            // Create socket info structure
-            vws_cinfo* ci = vws.malloc(sizeof(vws_cinfo));
-            memcpy(ci, &peer->info, sizeof(vws_cinfo));
-            ci->server = server;
-            c->data    = ci;
+            break;
+        }
 
-            // Start reads on socket
-            if (uv_read_start((uv_stream_t*)c, svr_on_realloc, svr_on_read) != 0)
-            {
-                vws.error(VE_RT, "Failed to start reading from client");
-                vws.free(c);
-                vws.free(ci);
-                return;
-            }
+        case TEXT_FRAME:
+        case BINARY_FRAME:
+        case CONTINUATION_FRAME:
+        {
+            // Add to queue
+            vws_cnx_frame_push(c, f);
 
-            if (vws.tracelevel >= VT_THREAD)
-            {
-                vws.trace(VL_INFO, "uv_thread(): connecting peer");
-            }
+            break;
+        }
 
-            //> Add connection to registry and initialize
+        case PING_FRAME:
+        {
+            // Generate the PONG response
+            vws_buffer* buffer = vws_generate_pong_frame(f->data, f->size);
 
-            vws_svr_cnx* cnx = svr_cnx_new(server, (uv_stream_t*)c);
-            ci->cnx          = cnx;
-            ci->cid          = cnx->cid;
+            // Send back to cliane Send the PONG response
+            vws_svr_data* response;
+            response = vws_svr_data_new(cnx->server, cnx->cid, &buffer);
+            vws_tcp_svr_send(response);
 
-            // We have already upgraded this connection.
-            cnx->upgraded = true;
-            vws_http_msg_free(cnx->http);
-            cnx->http = NULL;
+            // Free buffer
+            vws_buffer_free(buffer);
 
-            // Call svr_on_connect() handler to complete initialization
-            server->on_connect(cnx);
+            // Free frame
+            vws_frame_free(f);
 
-            // Mark connection as peer
-            vws_set_flag(&cnx->cid.flags, VWS_SVR_STATE_PEER);
+            break;
+        }
 
-            // Remove UNAUTH flag as peers are automatically trusted
-            vws_clear_flag(&cnx->cid.flags, VWS_SVR_STATE_UNAUTH);
+        case PONG_FRAME:
+        {
+            // No need to send a response
 
-            //> Update peer record
+            vws_frame_free(f);
 
-            // New connection information
-            peer->info = *ci;
+            break;
+        }
 
-            // New connection state
-            peer->state = VWS_PEER_CONNECTED;
+        default:
+        {
+            // Invalid frame type
+            vws_frame_free(f);
         }
     }
 
-    // Call user-defined loop callback if defined
-    if (server->loop_cb != NULL)
-    {
-        server->loop_cb(server);
-    }
+    vws.success();
+}
 
-    // If not all peers are connected
-    if (vws_tcp_svr_peers_online(server) == false)
+// Runs in uv_thread()
+void ws_svr_client_ping(vws_svr_cnx* c)
+{
+    if (c->upgraded == false)
     {
-        // Set wakeup timer since we expect response from thread(s)
-        vws_tcp_svr_peer_timer(server);
+        return;
     }
-}
 
-//------------------------------------------------------------------------------
-// Server API
-//------------------------------------------------------------------------------
+    // Unmasked PING with no payload
+    static const unsigned char ping[] = { 0x80 | PING_FRAME, 0x00 };
 
-vws_svr_data* vws_svr_data_new(vws_tcp_svr* s, vws_cid_t cid, vws_buffer** b)
-{
-    // Create a new vws_svr_data taking ownership of the buffer's data
-    vws_svr_data* item = vws_svr_data_own(s, cid, (*b)->data, (*b)->size);
+    ucstr data = vws.malloc(sizeof(ping));
+    memcpy((unsigned char*)data, ping, sizeof(ping));
 
-    // Since we take ownership of buffer data, we clear the buffer.
-    (*b)->data = NULL;
-    (*b)->size = 0;
+    vws_svr_data* frame;
+    frame = vws_svr_data_own(c->server, c->cid, data, sizeof(ping));
 
-    return item;
+    svr_metric_add(c->server, VWS_METRIC_FRAMES_OUT, 1);
+    svr_metric_add(c->server, VWS_METRIC_PINGS, 1);
+    vws_tev_emit(VTE_FRAME_OUT, c->cid.key, PING_FRAME, sizeof(ping));
+
+    // Send directly out as we are in uv_thread()
+    c->server->on_data_out(frame, NULL);
 }
 
-vws_svr_data* vws_svr_data_own(vws_tcp_svr* s, vws_cid_t cid, ucstr data, size_t size)
+void ws_svr_client_connect(vws_svr_cnx* c)
 {
-    vws_svr_data* item;
-    item = (vws_svr_data*)vws.malloc(sizeof(vws_svr_data));
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        cstr host;
+        int port;
 
-    item->server = s;
-    item->cid    = cid;
-    item->size   = size;
-    item->data   = data;
-    item->flags  = 0;
+        struct sockaddr* addr = (struct sockaddr*)&c->cid.addr;
+        if (vws_socket_addr_info(addr, &host, &port) == true)
+        {
+            vws.trace( VL_INFO,
+                       "ws_svr_client_connect(%p, %p) socket %s:%lu",
+                       c->server, c->handle, host, port);
+            free(host);
+        }
+        else
+        {
+            vws.trace(VL_INFO, "ws_svr_client_connect(%p)", c->handle);
+        }
+    }
 
-    return item;
+    // Create a new vws_cnx
+    vws_cnx* cnx = (void*)vws_cnx_new();
+    cnx->process = ws_svr_process_frame;
+    cnx->data    = (void*)c;   // Link cnx -> c
+    c->data      = (void*)cnx; // Link c -> cnx
 }
 
-void vws_svr_data_free(vws_svr_data* t)
+void ws_svr_client_disconnect(vws_svr_cnx* c)
 {
-    if (t != NULL)
+    if (c == NULL)
     {
-        vws.free(t->data);
-        vws.free(t);
+        return;
     }
-}
 
-vws_tcp_svr* vws_tcp_svr_new(int num_threads, int backlog, int queue_size)
-{
-    vws_tcp_svr* server = vws.malloc(sizeof(vws_tcp_svr));
-    return tcp_svr_ctor(server, num_threads, backlog, queue_size);
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace(VL_INFO, "ws_svr_client_disconnect(%p)", c->handle);
+    }
+
+    if (c->data != NULL)
+    {
+        vws_cnx_free((vws_cnx*)c->data);
+        c->data = NULL;
+    }
 }
 
-void vws_tcp_svr_close(vws_tcp_svr* server, vws_cid_t cid)
+// Runs in uv_thread()
+void ws_svr_client_read(vws_svr_cnx* cnx, ssize_t size, const uv_buf_t* buf)
 {
-    // Create reply
-    vws_svr_data* reply;
-    reply = vws_svr_data_own(server, cid, NULL, 0);
+    vws_cnx* c = (vws_cnx*)cnx->data;
 
-    // Set connection close flag
-    vws_set_flag(&reply->flags, VWS_SVR_STATE_CLOSE);
+    // Add to client socket buffer
+    vws_buffer_append(c->base.buffer, (ucstr)buf->base, size);
 
-    // Queue the data to uv_thread() to send out on wire
-    vws_tcp_svr_send(reply);
-}
+    // Free libuv memory
+    vws.free(buf->base);
 
-uint8_t vws_tcp_svr_state(vws_tcp_svr* server)
-{
-    return server->state;
-}
+    // If we are in HTTP mode
+    if (cnx->upgraded == false)
+    {
+        // Parse incoming data as HTTP requests. Go on only if the connection
+        // was upgraded and there is WebSocket data behind the request.
+        if (ws_svr_http_ingress(cnx) == false)
+        {
+            return;
+        }
+    }
 
-void vws_tcp_svr_free(vws_tcp_svr* server)
-{
-    if (server == NULL)
+    if (vws_cnx_ingress(c) > 0)
     {
-        return;
+        uint64_t ingress = vws_clock_usec();
+
+        // Process as many messages as possible
+        while (true)
+        {
+            // Check for a complete message
+            vws_msg* wsm = vws_msg_pop(c);
+
+            if (wsm == NULL)
+            {
+                vws_cnx_trim(c);
+                return;
+            }
+
+            svr_metric_add(cnx->server, VWS_METRIC_MSGS_IN, 1);
+            vws_tev_emit(VTE_MSG_IN, cnx->cid.key, wsm->data->size, 0);
+
+            // Pass message pointer in block
+            vws_svr_data* block;
+            block = vws_svr_data_own( cnx->server,
+                                      cnx->cid,
+                                      (ucstr)wsm,
+                                      sizeof(vws_msg*) );
+            block->stamps.ingress = ingress;
+            queue_push(&cnx->server->requests, block);
+        }
     }
-
-    tcp_svr_dtor(server);
-    vws.free(server);
 }
 
-bool vws_tcp_svr_peers_online(vws_tcp_svr* server)
+// Runs in uv_thread()
+bool ws_svr_http_ingress(vws_svr_cnx* cnx)
 {
-    // Server is online if there are no peers in state VWS_PEER_PENDING
-    for (size_t i = 0; i < server->peers->used; i++)
+    vws_svr* server = (vws_svr*)cnx->server;
+    vws_cnx* c      = (vws_cnx*)cnx->data;
+
+    // One request at a time. While one is with a worker, or the connection
+    // closes after its response, the rest wait in the buffer.
+    while ( (cnx->http_busy == false) &&
+            (cnx->http_close == false) &&
+            (c->base.buffer->size > 0) )
     {
-        vws_peer* peer = (vws_peer*)server->peers->array[i].value.data;
+        if (cnx->http == NULL)
+        {
+            cnx->http = svr_http_acquire(cnx->server);
+        }
 
-        if (peer->state != VWS_PEER_CONNECTED)
+        // Until its headers are complete, the request stays at the front of
+        // the buffer, where the parser borrows them from. Only data not yet
+        // parsed is passed.
+        size_t offset = 0;
+
+        if (cnx->http->headers_complete == false)
         {
-            if (vws.tracelevel >= VT_SERVICE)
-            {
-                vws.trace( VL_INFO,
-                           "vws_tcp_svr_peers_online(%p): "
-                           "peer offline %s state=%lu",
-                           server,
-                           peer->host,
-                           peer->state );
-            }
+            offset = cnx->http->consumed;
+        }
+
+        ucstr data  = c->base.buffer->data + offset;
+        size_t size = c->base.buffer->size - offset;
+        ssize_t n   = vws_http_msg_parse(cnx->http, (cstr)data, size);
 
+        // No complete request yet
+        if (cnx->http->headers_complete == false)
+        {
             return false;
         }
-    }
 
-    return true;
-}
+        // Check for parsing errors
+        enum llhttp_errno err = llhttp_get_errno(cnx->http->parser);
 
-int vws_tcp_svr_send(vws_svr_data* data)
-{
-    queue_push(&data->server->responses, data);
+        // If there was a parsing error, close connection. The parser is
+        // paused on a complete request and OK while reading the body.
+        if ((n < 0) || ((err != HPE_PAUSED) && (err != HPE_OK)))
+        {
+            vws.error( VE_RT, "Error: %s (%s)",
+                       llhttp_errno_name(err),
+                       llhttp_get_error_reason(cnx->http->parser) );
 
-    // Notify event loop about the new response
-    uv_async_send(data->server->wakeup);
+            // Close connection
+            svr_cnx_close(cnx->server, cnx->cid);
 
-    return 0;
-}
+            return false;
+        }
 
-void vws_tcp_svr_wakeup(vws_tcp_svr* s)
-{
-    uv_async_send(s->wakeup);
-}
+        // Request data consumed from the buffer so far
+        size_t used = offset + n;
 
-int vws_tcp_svr_run(vws_tcp_svr* server, cstr host, int port)
-{
-    if (vws.tracelevel >= VT_SERVICE)
-    {
-        vws.trace( VL_INFO,
-                   "vws_tcp_svr_run(%p): Starting worker %i threads",
-                   server,
-                   server->pool_size );
-    }
+        //> Generate HTTP response and send
 
-    for (int i = 0; i < server->pool_size; i++)
-    {
-        uv_thread_create(&server->threads[i], worker_thread, server);
-    }
+        // Check if it's an upgrade request
+        cstr upgrade = vws_http_msg_header(cnx->http, "upgrade");
 
-    //> Create listening socket
+        if (upgrade == NULL)
+        {
+            if (cnx->http->done == true)
+            {
+                // Past the handshake timeout
+                cnx->established = true;
 
-    uv_tcp_t* socket = vws.malloc(sizeof(uv_tcp_t));
-    uv_tcp_init(server->loop, socket);
+                // Close after the response unless the client keeps alive
+                cnx->http_close = !vws_http_msg_keep_alive(cnx->http);
 
-    vws_cinfo* ci = vws.malloc(sizeof(vws_cinfo));
-    ci->cnx       = NULL;
-    ci->server    = server;
-    ci->cid.key   = 0;
-    socket->data  = ci;
+                // Static files and simple routes are answered right here
+                if ( (server->files != NULL) &&
+                     (ws_svr_http_file(cnx, used) == true) )
+                {
+                    continue;
+                }
 
-    //> Bind to address
+                if ( (server->inline_http != NULL) &&
+                     (ws_svr_http_inline(cnx, used) == true) )
+                {
+                    continue;
+                }
+            }
 
-    int rc;
-    struct sockaddr_in addr;
-    uv_ip4_addr(host, port, &addr);
-    rc = uv_tcp_bind(socket, (const struct sockaddr*)&addr, 0);
+            // The handler may keep the request beyond the buffer data
+            vws_http_msg_detach(cnx->http);
 
-    if (vws.tracelevel >= VT_SERVICE)
-    {
-        vws.trace( VL_INFO,
-                   "vws_tcp_svr_run(%p): Bind %s:%lu",
-                   server, host, port );
-    }
+            // Drain HTTP request data from cnx->data buffer
+            vws_buffer_drain(c->base.buffer, used);
 
-    if (rc)
-    {
-        vws.error(VE_RT, "Bind error %s", uv_strerror(rc));
-        return -1;
-    }
+            // Handle regular HTTP request via callback
+            int rc = -1;
 
-    //> Listen
+            if (server->on_http_read != NULL)
+            {
+                rc = server->on_http_read(cnx);
+            }
 
-    rc = uv_listen((uv_stream_t*)socket, server->backlog, svr_on_connect);
+            if (rc == 0)
+            {
+                // Keep reading
+                return false;
+            }
 
-    if (rc)
-    {
-        vws.error(VE_RT, "Listen error %s", uv_strerror(rc));
-        return -1;
-    }
+            if (rc == -1)
+            {
+                // We are not handling HTTP requests
+                svr_cnx_close(cnx->server, cnx->cid);
 
-    if (vws.tracelevel >= VT_SERVICE)
-    {
-        vws.trace( VL_INFO,
-                   "vws_tcp_svr_run(%p): Listen %s:%lu",
-                   server, host, port );
-    }
+                return false;
+            }
 
-    //> Start server
+            // Handler owns the request. The next one is allocated when its
+            // data is parsed.
+            cnx->http = NULL;
 
-    // Set state to running
-    server->state = VS_RUNNING;
+            // Nothing pending, so close now if not keep-alive
+            if ((cnx->http_busy == false) && (cnx->http_close == true))
+            {
+                svr_cnx_shutdown(cnx);
+            }
 
-    if (vws.tracelevel >= VT_SERVICE)
-    {
-        vws.trace(VL_INFO, "vws_tcp_svr_run(%p): Starting uv_run()", server);
-    }
+            continue;
+        }
 
-    while (vws_tcp_svr_is_running(server))
-    {
-        // Run UV loop. This runs indefinitely, passing network I/O and and out
-        // of system until server is shutdown by vws_tcp_svr_stop() (by external
-        // thread).
-        uv_run(server->loop, UV_RUN_DEFAULT);
-    }
+        cstr key   = vws_http_msg_header(cnx->http, "sec-websocket-key");
+        cstr proto = vws_http_msg_header(cnx->http, "sec-websocket-protocol");
 
-    //> Shutdown server
+        if (key == NULL)
+        {
+            vws.error(VE_RT, "Error: missing sec-websocket-key");
 
-    // Close the listening socket handle
-    uv_close((uv_handle_t*)socket, svr_on_close);
+            // Close connection
+            svr_cnx_close(cnx->server, cnx->cid);
 
-    vws.trace( VL_INFO, "vws_tcp_svr_run(%p): Shutdown connections=%lu",
-               server,
-               server->cpool->count );
+            return false;
+        }
 
-    // Close connections.
-    for (uint32_t i = 0; i < server->cpool->capacity; i++)
-    {
-        uintptr_t ptr = server->cpool->slots[i];
+        ws_svr_upgrade(cnx, key, proto);
 
-        if (ptr != 0)
-        {
-            // Close connection
-            vws_svr_cnx* cnx = (vws_svr_cnx*)ptr;
+        //> Change state to WebSocket mode
 
-            if (vws.tracelevel >= VT_SERVICE)
-            {
-                vws.trace( VL_INFO,
-                           "vws_tcp_svr_run(%p): closing %p",
-                           server,
-                           cnx->handle );
-            }
+        // Set the flag that we are in WebSocket mode
+        cnx->upgraded    = true;
+        cnx->established = true;
 
-            uv_close((uv_handle_t*)cnx->handle, svr_on_close);
+        // Done with the request and the headers it borrowed
+        svr_http_release(cnx->server, cnx->http);
+        cnx->http = NULL;
+
+        // Drain HTTP request data from cnx->data buffer
+        vws_buffer_drain(c->base.buffer, used);
+
+        // Do we have any data in the socket after consuming the HTTP request?
+        // We shouldn't but if so this is WebSocket data.
+        if (c->base.buffer->size > 0)
+        {
+            return true;
         }
-    }
 
-    if (vws.tracelevel >= VT_SERVICE)
-    {
-        vws.trace(VL_INFO, "vws_tcp_svr_run(%p): Shutdown complete", server);
+        // No more data in the socket buffer. Done for now.
+        break;
     }
 
-    // Set state to halted
-    server->state = VS_HALTED;
+    vws_cnx_trim(c);
 
-    return 0;
+    return false;
 }
 
-bool vws_tcp_svr_is_running(vws_tcp_svr* server)
+// Runs in uv_thread()
+void ws_svr_upgrade(vws_svr_cnx* cnx, cstr key, cstr proto)
 {
-    if (server->state == VS_RUNNING)
+    // Response up to the accept key and from it to the protocol
+    static const char head[] = "HTTP/1.1 101 Switching Protocols\r\n"
+                               "Upgrade: websocket\r\n"
+                               "Connection: Upgrade\r\n"
+                               "Sec-WebSocket-Accept: ";
+
+    static const char tail[] = "\r\n"
+                               "Sec-WebSocket-Version: 13\r\n"
+                               "Sec-WebSocket-Protocol: ";
+
+    if (proto == NULL)
     {
-        return true;
+        proto = "vrtql";
     }
 
-    return false;
-}
+    size_t psize = strlen(proto);
+    size_t size  = sizeof(head) - 1 + VWS_ACCEPT_KEY_SIZE +
+                   sizeof(tail) - 1 + psize + 4;
 
-void vws_tcp_svr_stop(vws_tcp_svr* server)
-{
-    // Set shutdown flags
-    server->state           = VS_HALTING;
-    server->requests.state  = VS_HALTING;
-    server->responses.state = VS_HALTING;
+    // Fits on the stack unless the client sent a very long protocol list
+    char stack[256];
+    char* data = (size <= sizeof(stack)) ? stack : vws.malloc(size);
+    char* p    = data;
 
-    // Wakeup all worker threads
-    if (vws.tracelevel >= VT_SERVICE)
-    {
-        vws.trace(VL_INFO, "vws_tcp_svr_stop(): stop worker threads");
-    }
+    memcpy(p, head, sizeof(head) - 1);
+    p += sizeof(head) - 1;
 
-    uv_mutex_lock(&server->requests.mutex);
-    uv_cond_broadcast(&server->requests.cond);
-    uv_mutex_unlock(&server->requests.mutex);
+    char accept[VWS_ACCEPT_KEY_SIZE + 1];
+    vws_accept_key_r(key, accept);
+    memcpy(p, accept, VWS_ACCEPT_KEY_SIZE);
+    p += VWS_ACCEPT_KEY_SIZE;
 
-    // Wakeup the main event loop to shutdown main thread
-    if (vws.tracelevel >= VT_SERVICE)
-    {
-        vws.trace(VL_INFO, "vws_tcp_svr_stop(): stop main thread");
-    }
+    memcpy(p, tail, sizeof(tail) - 1);
+    p += sizeof(tail) - 1;
 
-    uv_async_send(server->wakeup);
+    memcpy(p, proto, psize);
+    p += psize;
 
-    while (server->state != VS_HALTED)
-    {
-        sleep(1);
-    }
-}
+    memcpy(p, "\r\n\r\n", 4);
 
-int vws_tcp_svr_inetd_run(vws_tcp_svr* server, int sockfd)
-{
-    if (sockfd < 0)
-    {
-        vws.error(VE_RT, "Invalid server or socket descriptor provided");
-        return 1;
-    }
+    // Nothing is queued ahead of the response on a new connection, so the
+    // socket normally takes it all at once.
+    // Unless the ring is still sending, as the response must follow that
+    uv_buf_t buf = uv_buf_init(data, size);
+    int rc       = svr_ring_busy(cnx) ? UV_EAGAIN
+                                      : uv_try_write(cnx->handle, &buf, 1);
+    size_t sent  = (rc > 0) ? (size_t)rc : 0;
 
-    if (vws.tracelevel >= VT_SERVICE)
+    if (sent > 0)
     {
-        vws.trace( VL_INFO,
-                   "vws_tcp_svr_run(%p): Starting worker %i threads",
-                   server,
-                   server->pool_size );
+        svr_metric_add(cnx->server, VWS_METRIC_BYTES_OUT, sent);
     }
 
-    for (int i = 0; i < server->pool_size; i++)
+    if (sent < size)
     {
-        uv_thread_create(&server->threads[i], worker_thread, server);
+        // Queue the rest
+        size_t left = size - sent;
+        ucstr rest  = vws.malloc(left);
+        memcpy((char*)rest, data + sent, left);
+
+        vws_svr_data* reply;
+        reply = vws_svr_data_own(cnx->server, cnx->cid, rest, left);
+
+        // Send directly out as we are in uv_thread()
+        cnx->server->on_data_out(reply, NULL);
     }
 
-    // Go into non-blocking mode as we are using poll() for socket_read() and
-    // socket_write().
-    if (vws_socket_set_nonblocking(sockfd) == false)
+    if (data != stack)
     {
-        vws.error(VE_RT, "Failed to set socket to nonblocking");
-        return 1;
+        vws.free(data);
     }
+}
 
-    // Set to inetd mode
-    server->inetd_mode = 1;
-
-    // Adopt socket descriptor into libuv loop
-    uv_tcp_t* c = (uv_tcp_t*)vws.malloc(sizeof(uv_tcp_t));
+// Runs in uv_thread()
+bool ws_svr_http_inline(vws_svr_cnx* cnx, size_t used)
+{
+    vws_svr* server = (vws_svr*)cnx->server;
+    vws_buffer* out = vws_buffer_new();
 
-    if (uv_tcp_init(server->loop, c))
+    if (server->inline_http(server, cnx->http, out) == false)
     {
-        // Handle uv_tcp_init failure.
-        vws.error(VE_RT, "Failed to initialize new TCP handle");
-        vws.free(c);
-        return 1;
-    }
+        vws_buffer_free(out);
 
-    if (uv_tcp_open(c, sockfd))
-    {
-        // Handle uv_tcp_open failure.
-        vws.error(VE_RT, "Failed to adopt the socket descriptor.");
-        vws.free(c);
-        return 1;
+        return false;
     }
 
-    // Create socket info structure
-    vws_cinfo* ci = vws.malloc(sizeof(vws_cinfo));
-    ci->cnx       = NULL;
-    ci->server    = server;
-    c->data       = ci;
+    ws_svr_http_send(cnx, used, out);
+    vws_buffer_free(out);
 
-    // Start reads on socket
-    if (uv_read_start((uv_stream_t*)c, svr_on_realloc, svr_on_read) != 0)
-    {
-        vws.error(VE_RT, "Failed to start reading from client");
-        vws.free(c);
-        vws.free(ci);
-        return 1;
-    }
+    return true;
+}
+
+// Runs in uv_thread()
+void ws_svr_http_send(vws_svr_cnx* cnx, size_t used, vws_buffer* out)
+{
+    vws_cnx* c = (vws_cnx*)cnx->data;
 
-    //> Add connection to registry and initialize
+    // Done with the request and the headers it borrowed
+    svr_http_release(cnx->server, cnx->http);
+    cnx->http = NULL;
 
-    vws_svr_cnx* cnx = svr_cnx_new(server, (uv_stream_t*)c);
-    ci->cnx          = cnx;
-    ci->cid          = cnx->cid;
+    // Drain HTTP request data from cnx->data buffer
+    vws_buffer_drain(c->base.buffer, used);
 
-    // Call svr_on_connect() handler to complete initialization
-    server->on_connect(cnx);
+    if (out->size > 0)
+    {
+        vws_svr_data* reply;
+        reply                 = vws_svr_data_new(cnx->server, cnx->cid, &out);
+        reply->stamps.ingress = vws_clock_usec();
 
-    // Now, the handle is associated with the socket and is ready to be used.
-    // Start the libuv loop.
-    uv_run(server->loop, UV_RUN_DEFAULT);
+        // Send directly out as we are in uv_thread()
+        cnx->server->on_data_out(reply, NULL);
+    }
 
-    return 0;
+    if (cnx->http_close == true)
+    {
+        svr_cnx_shutdown(cnx);
+    }
 }
 
-void vws_tcp_svr_inetd_stop(vws_tcp_svr* server)
+#if !defined(__windows__)
+
+// Runs in uv_thread()
+bool ws_svr_http_file(vws_svr_cnx* cnx, size_t used)
 {
-    // Set shutdown flags
-    server->state           = VS_HALTING;
-    server->requests.state  = VS_HALTING;
-    server->responses.state = VS_HALTING;
+    vws_svr* server      = (vws_svr*)cnx->server;
+    vws_svr_files* files = server->files;
+    vws_http_msg* m      = cnx->http;
+    cstr url             = (cstr)m->url->data;
+    size_t size          = m->url->size;
+    size_t n             = 0;
+
+    // Path without query or fragment
+    while ((n < size) && (url[n] != '?') && (url[n] != '#'))
+    {
+        n++;
+    }
 
-    // Stop the loop. We have not more I/O to deal with. We don't want the loop
-    // to run any more for any reason.
-    uv_stop(server->loop);
+    if ( (n < files->prefix_size) ||
+         (strncmp(url, files->prefix, files->prefix_size) != 0) ||
+         ((n > files->prefix_size) && (url[files->prefix_size] != '/')) )
+    {
+        return false;
+    }
 
-    // Wakeup all worker threads
-    if (vws.tracelevel >= VT_SERVICE)
+    vws_buffer* out = vws_buffer_new();
+    int method      = llhttp_get_method(m->parser);
+    bool close      = cnx->http_close;
+
+    if ((method != HTTP_GET) && (method != HTTP_HEAD))
     {
-        vws.trace(VL_INFO, "vws_tcp_svr_inetd_stop(): stop worker threads");
+        vws_http_response(out, 405, "Allow: GET, HEAD\r\n", NULL, 0, close);
+        ws_svr_http_send(cnx, used, out);
+        vws_buffer_free(out);
+
+        return true;
     }
 
-    uv_mutex_lock(&server->requests.mutex);
-    uv_cond_broadcast(&server->requests.cond);
-    uv_mutex_unlock(&server->requests.mutex);
+    char path[1024];
+    cstr rest     = url + files->prefix_size;
+    size_t length = n - files->prefix_size;
 
-    // Wakeup the main event loop to shutdown main thread
-    if (vws.tracelevel >= VT_SERVICE)
+    if (svr_file_path(files, rest, length, path, sizeof(path)) == false)
     {
-        vws.trace(VL_INFO, "vws_tcp_svr_inetd_stop(): stop main thread");
+        vws_http_response(out, 404, NULL, NULL, 0, close);
+        ws_svr_http_send(cnx, used, out);
+        vws_buffer_free(out);
+
+        return true;
     }
 
-    // Wait for all threads to complete
-    uv_thread(server->wakeup);
+    vws_svr_file* f = svr_file_cached(files, cnx->server->loop, path);
 
-    if (vws.tracelevel >= VT_SERVICE)
+    if (f == NULL)
     {
-        vws.trace(VL_INFO, "vws_tcp_svr_inetd_stop(): done");
+        // Answered once the file system has been checked
+        vws_buffer_free(out);
+        svr_file_lookup_start(cnx, used, path);
+
+        return true;
     }
 
-    // Set state to halted
-    server->state = VS_HALTED;
+    cstr tag  = vws_http_msg_header(m, "if-none-match");
+    bool body = svr_file_head(out, f, method, tag, close);
+
+    // Done with the request and the headers it borrowed
+    vws_cnx* c = (vws_cnx*)cnx->data;
+    svr_http_release(cnx->server, cnx->http);
+    cnx->http = NULL;
+    vws_buffer_drain(c->base.buffer, used);
+
+    svr_file_send(cnx, f, out, body);
+
+    return true;
 }
 
-bool svr_resolve(cstr host, int port, struct sockaddr_storage** s)
-{
-    int sockfd = -1;
+#else
 
-    // Resolve the host
-    struct addrinfo hints, *res, *res0;
-    int error;
+bool ws_svr_http_file(vws_svr_cnx* cnx, size_t used)
+{
+    return false;
+}
 
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family   = PF_UNSPEC; // Accept any family (IPv4 or IPv6)
-    hints.ai_socktype = SOCK_STREAM;
+#endif
 
-    char port_str[50];
-    sprintf(port_str, "%lu", port);
+// Runs in worker_thread()
+void ws_svr_client_data_in(vws_svr_data* block, void* x)
+{
+    //> Append data to connection buffer
 
-    error = getaddrinfo(host, &port_str[0], &hints, &res0);
+    vws_cid_t cid   = block->cid;
+    vws_svr* server = (vws_svr*)block->server;
 
-    if (error)
+    // If this is a HTTP request
+    if (vws_is_flag(&block->flags, VWS_SVR_STATE_HTTP))
     {
-        if (vws.tracelevel > 0)
+        // Data simply contains a pointer to a websocket message
+        vws_http_msg* req = (vws_http_msg*)block->data;
+
+        // Free incoming data
+        block->data = NULL;
+        block->size = 0;
+        vws_svr_data_free(block);
+
+        // Process message
+        if (server->process_http(server, cid, req, x) == false)
         {
-            cstr msg = gai_strerror(error);
-            vws.trace(VL_ERROR, "getaddrinfo failed: %s: %s", host, msg);
+            // If processing function returns false, we close connection.
+            vws_tcp_svr_close((vws_tcp_svr*)server, cid);
         }
 
-        vws.error(VE_SYS, "getaddrinfo() failed");
+        // Since we take ownership of message to we must up clean up.
+        svr_http_release((vws_tcp_svr*)server, req);
 
-        return -1;
+        // The next pipelined request is released by the final response, which
+        // may be sent later from another thread (see vws_svr_http_done()).
+
+        return;
     }
 
-    for (res = res0; res; res = res->ai_next)
+    // If this is a peer which needs connecting
+    if (vws_is_flag(&block->flags, VWS_SVR_STATE_PEER_CONNECT))
     {
-        sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+        // Data simply contains a pointer to a websocket message
+        vws_peer* peer = (vws_peer*)block->data;
 
-        if (sockfd == -1)
+        // Free incoming data
+        block->data = NULL;
+        block->size = 0;
+        vws_svr_data_free(block);
+
+        // Resolve
+        struct sockaddr_storage* addr = &peer->info.cid.addr;
+        if (svr_resolve(peer->host, peer->port, &addr) == false)
         {
-            vws.error(VE_SYS, "Failed to create socket");
-            continue;
+            vws.error( VL_WARN,
+                       "vws_tcp_svr_peer_add(): "
+                       "Failed to resolve host %s:%lu",
+                       peer->host, peer->port );
+
+            // Set state back to closed
+            peer->state = VWS_PEER_CLOSED;
+
+            return;
         }
 
-        if (vws.tracelevel >= VT_SERVICE)
+        // Connect
+        if (vws_tcp_svr_peer_connect((vws_tcp_svr*)server, peer) == false)
         {
-            cstr host; int port;
-            struct sockaddr* addr = (struct sockaddr*)res->ai_addr;
-            if (vws_socket_addr_info(addr, &host, &port) == true)
-            {
-                vws.trace(VL_INFO, "svr_resolve() connect %s:%lu", host, port);
-                free(host);
-            }
-            else
-            {
-                vws.trace(VL_INFO, "svr_resolve(): connect");
-            }
+            // Set state back to closed
+            peer->state = VWS_PEER_CLOSED;
         }
-
-        if (connect(sockfd, res->ai_addr, res->ai_addrlen) == -1)
+        else
         {
-            close(sockfd);
-            sockfd = -1;
-
-            vws.error(VE_SYS, "Failed to connect");
-            continue;
+            // Set state back to connected. uv_thread() will add it to
+            // connection pool.
+            peer->state = VWS_PEER_RECONNECTED;
         }
 
-        break; // If we get here, we must have connected successfully
+        // We don't need to send message back regarding this request, but we do
+        // need the server to wakeup and realize that this peer connection state
+        // has changed and needs to be attended to.
+        uv_async_send(((vws_tcp_svr*)server)->wakeup);
+
+        return;
     }
 
-    // Free the addrinfo structure for this host
-    freeaddrinfo(res0);
+    // Data simply contains a pointer to a websocket message
+    vws_msg* wsm = (vws_msg*)block->data;
 
-    if (sockfd == -1)
-    {
-        vws.error(VE_SYS, "Unable to resolve host %s:%lu", host, port);
-        return false;
-    }
+    // Free incoming data
+    block->data = NULL;
+    block->size = 0;
+    vws_svr_data_free(block);
 
-    close(sockfd);
+    //> Process connection buffer data for complete messages
+    server->on_msg_in(server, cid, wsm, x);
+}
 
-    return true;
+void ws_svr_client_data_out( vws_svr* server,
+                             vws_cid_t cid,
+                             vws_buffer* buffer,
+                             unsigned char opcode )
+{
+    // Create a binary websocket frame containing message
+    vws_frame* frame;
+    ucstr data  = buffer->data;
+    size_t size = buffer->size;
+    frame       = vws_frame_new(data, size, opcode);
+
+    // This frame is from server to we don't mask it
+    frame->mask = 0;
+
+    // Serialize frame: frame is freed by function
+    vws_buffer* fdata = vws_serialize(frame);
+
+    svr_metric_add((vws_tcp_svr*)server, VWS_METRIC_FRAMES_OUT, 1);
+    svr_metric_add((vws_tcp_svr*)server, VWS_METRIC_MSGS_OUT, 1);
+    vws_tev_emit(VTE_MSG_OUT, cid.key, size, 0);
+    vws_tev_emit(VTE_FRAME_OUT, cid.key, opcode, fdata->size);
+
+    // Pack frame binary into queue data
+    vws_svr_data* response;
+
+    response = vws_svr_data_new((vws_tcp_svr*)server, cid, &fdata);
+
+    // Queue the data to uv_thread() to send out on wire
+    vws_tcp_svr_send(response);
+
+    // Free buffers
+    vws_buffer_free(fdata);
 }
 
-bool vws_tcp_svr_peer_connect(vws_tcp_svr* s, vws_peer* peer)
+void ws_svr_client_msg_in(vws_svr* s, vws_cid_t c, vws_msg* m, void* x)
 {
-    // Attempt reconnection
-    peer->sockfd = peer->connect(peer);
+    vws_svr* server = (vws_svr*)s;
 
-    // Successful it sockfd not -1
-    return (peer->sockfd != -1);
+    // Route to application-specific processing callback
+    server->process_ws(server, c, m, x);
+}
+
+void ws_svr_client_process(vws_svr* s, vws_cid_t c, vws_msg* m, void* x)
+{
+    // Default: Do nothing. Drop message.
+    vws_msg_free(m);
+}
+
+void ws_svr_client_msg_out(vws_svr* s, vws_cid_t c, vws_msg* m, void* x)
+{
+    ws_svr_client_data_out(s, c, m->data, m->opcode);
+    vws_msg_free(m);
+}
+
+void ws_svr_ctor(vws_svr* server, int nt, int bl, int qs)
+{
+    tcp_svr_ctor((vws_tcp_svr*)server, nt, bl, qs);
+
+    // Server base function overrides
+    server->base.on_connect    = ws_svr_client_connect;
+    server->base.on_disconnect = ws_svr_client_disconnect;
+    server->base.on_read       = ws_svr_client_read;
+    server->base.on_ping       = ws_svr_client_ping;
+    server->base.on_data_in    = ws_svr_client_data_in;
+
+    // Message handling
+    server->on_msg_in          = ws_svr_client_msg_in;
+    server->on_msg_out         = ws_svr_client_msg_out;
+
+    // HTTP handlers
+    server->on_http_read       = ws_svr_on_http_read;
+    server->process_http       = NULL;
+    server->inline_http        = NULL;
+    server->files              = NULL;
+
+    // Application functions
+    server->process_ws         = ws_svr_client_process;
+    server->send               = ws_svr_client_msg_out;
+}
+
+vws_svr* vws_svr_new(int num_threads, int backlog, int queue_size)
+{
+    vws_svr* server = vws.malloc(sizeof(vws_svr));
+    ws_svr_ctor(server, num_threads, backlog, queue_size);
+    return server;
 }
 
-void vws_tcp_svr_peer_disconnect(vws_tcp_svr* s, vws_peer* peer)
+void ws_svr_dtor(vws_svr* server)
 {
-    // Close the server-side connection
-    uv_close((uv_handle_t*)peer->info.cnx->handle, svr_on_close);
+    if (server == NULL)
+    {
+        return;
+    }
+
+    tcp_svr_dtor((vws_tcp_svr*)server);
+
+    // After the loop has finished any file transfers
+    svr_files_free(server->files);
 }
 
-vws_peer* vws_tcp_svr_peer_add( vws_tcp_svr* s,
-                                cstr h,
-                                int p,
-                                vws_peer_connect fn,
-                                void* data )
+void vws_svr_free(vws_svr* server)
 {
-    vws_peer peer;
-
-    if (fn == NULL)
+    if (server == NULL)
     {
-        vws.error( VL_WARN,
-                   "vws_tcp_svr_peer_add(): "
-                   "connection function not provided" );
-        return NULL;
+        return;
     }
 
-    // Set connection function
-    peer.connect = fn;
+    ws_svr_dtor(server);
+    vws.free(server);
+}
 
-    // Set connection as closed. uv_thread() will connect
-    peer.state = VWS_PEER_CLOSED;
-    peer.host  = strdup(h);
-    peer.port  = p;
-    peer.data  = data;
+void vws_svr_http_reply( vws_svr* s,
+                         vws_cid_t c,
+                         vws_http_msg* m,
+                         uint16_t status,
+                         cstr headers,
+                         ucstr body,
+                         size_t size )
+{
+    vws_tcp_svr* server = (vws_tcp_svr*)s;
+    bool close          = (vws_http_msg_keep_alive(m) == false);
+    vws_buffer* http    = vws_buffer_new();
 
-    char key[514];
-    sprintf(key, "%s:%lu", h, p);
-    vws_kvs_set(s->peers, key, &peer, sizeof(vws_peer));
+    vws_http_response(http, status, headers, body, size, close);
 
-    // Set wakeup timer
-    vws_tcp_svr_peer_timer(s);
+    vws_svr_data* reply = vws_svr_data_new(server, c, &http);
+    vws_set_flag(&reply->flags, VWS_SVR_STATE_HTTP);
+    vws_tcp_svr_send(reply);
+    vws_buffer_free(http);
+}
 
-    return vws_kvs_get(s->peers, key)->data;
+void vws_svr_http_done(vws_svr* s, vws_cid_t c)
+{
+    vws_tcp_svr* server = (vws_tcp_svr*)s;
+
+    // Not a response for the metrics, so it goes straight on the queue
+    vws_svr_data* done = vws_svr_data_own(server, c, NULL, 0);
+    vws_set_flag(&done->flags, VWS_SVR_STATE_HTTP);
+
+    queue_push(&server->responses, done);
+    uv_async_send(server->wakeup);
 }
 
-void vws_tcp_svr_peer_remove(vws_tcp_svr* s, cstr h, int p)
+bool vws_svr_metrics_http(vws_svr* s, vws_cid_t c, vws_http_msg* m, void* x)
 {
-    char key[514];
-    sprintf(key, "%s:%lu", h, p);
+    vws_tcp_svr* server = (vws_tcp_svr*)s;
+    cstr url            = (cstr)m->url->data;
+    size_t size         = m->url->size;
 
-    vws_peer* peer = vws_kvs_get(s->peers, key)->data;
+    bool match = (llhttp_get_method(m->parser) == HTTP_GET) &&
+                 (size >= 8) && (strncmp(url, "/metrics", 8) == 0) &&
+                 ((size == 8) || (url[8] == '?'));
 
-    if (peer != NULL)
+    if (match == false)
     {
-        free(peer->host);
+        vws_svr_http_reply(s, c, m, 404, NULL, NULL, 0);
+
+        return true;
     }
 
-    vws_kvs_remove(s->peers, key);
+    vws_svr_metrics* snapshot = vws_tcp_svr_metrics(server);
+    vws_buffer* body          = vws_svr_metrics_prometheus(snapshot);
+    vws_svr_metrics_free(snapshot);
+
+    vws_svr_http_reply( s, c, m, 200,
+                        "Content-Type: text/plain; version=0.0.4\r\n",
+                        body->data, body->size );
+
+    vws_buffer_free(body);
+
+    return true;
 }
 
 //------------------------------------------------------------------------------
-// Server construction / destruction
+// Static Files
 //------------------------------------------------------------------------------
 
-vws_tcp_svr* tcp_svr_ctor(vws_tcp_svr* svr, int nt, int backlog, int queue_size)
+#if !defined(__windows__)
+
+bool vws_svr_static(vws_svr* s, cstr prefix, cstr root)
 {
-    if (backlog == 0)
-    {
-        backlog = 128;
-    }
+    struct stat st;
 
-    if (queue_size == 0)
+    if ((stat(root, &st) != 0) || ((st.st_mode & S_IFMT) != S_IFDIR))
     {
-        queue_size = 1024;
+        vws.error(VE_RT, "vws_svr_static(): %s is not a directory", root);
+
+        return false;
     }
 
-    svr->threads          = vws.malloc(sizeof(uv_thread_t) * nt);
-    svr->pool_size        = nt;
-    svr->on_connect       = svr_client_connect;
-    svr->on_disconnect    = svr_client_disconnect;
-    svr->on_read          = svr_client_read;
-    svr->on_data_in       = svr_client_data_in;
-    svr->on_data_out      = svr_client_data_out;
-    svr->worker_ctor      = NULL;
-    svr->worker_ctor_data = NULL;
-    svr->worker_dtor      = NULL;
-    svr->loop_cb          = NULL;
-    svr->shutdown_cb      = NULL;
-    svr->data_lost_cb     = NULL;
-    svr->cnx_open_cb      = NULL;
-    svr->cnx_close_cb     = NULL;
-    svr->backlog          = backlog;
-    svr->loop             = (uv_loop_t*)vws.malloc(sizeof(uv_loop_t));
-    svr->state            = VS_HALTED;
-    svr->trace            = vws.tracelevel;
-    svr->inetd_mode       = 0;
-    svr->peers            = vws_kvs_new(10, false);
-    svr->peer_timeout     = 0;
+    svr_files_free(s->files);
 
-    uv_loop_init(svr->loop);
-    svr->cpool = address_pool_new(1000, 2);
-    queue_init(&svr->requests, queue_size, "requests");
-    queue_init(&svr->responses, queue_size, "responses");
+    vws_svr_files* files = vws.malloc(sizeof(vws_svr_files));
+    files->prefix        = vws.strdup(prefix);
+    files->prefix_size   = strlen(prefix);
+    files->root          = vws.strdup(root);
+    files->index         = "index.html";
+    files->cache         = vws_kvs_new(16, true);
+    files->cache_size    = 256;
+    files->ttl           = 1000;
 
-    vws_cinfo* cinfo = vws.malloc(sizeof(vws_cinfo));
-    cinfo->cnx       = NULL;
-    cinfo->server    = svr;
-    cinfo->cid.key   = 0;
+    // No trailing slashes
+    while ((files->prefix_size > 0) && (prefix[files->prefix_size - 1] == '/'))
+    {
+        files->prefix[--files->prefix_size] = 0;
+    }
 
-    svr->wakeup = vws.malloc(sizeof(uv_async_t));
-    svr->wakeup->data = cinfo;
-    uv_async_init(svr->loop, svr->wakeup, uv_thread);
+    size_t size = strlen(root);
 
-    svr->peer_timer = vws.malloc(sizeof(uv_timer_t));
-    uv_timer_init(svr->loop, svr->peer_timer);
+    while ((size > 1) && (root[size - 1] == '/'))
+    {
+        files->root[--size] = 0;
+    }
 
-    return svr;
+    s->files = files;
+
+    return true;
 }
 
-void on_uv_close(uv_handle_t* handle)
+bool svr_file_path( vws_svr_files* files,
+                    cstr url,
+                    size_t size,
+                    char* path,
+                    size_t max )
 {
-    if (handle != NULL)
+    size_t n = 0;
+
+    // Paths start with a slash
+    if ((size == 0) || (url[0] != '/'))
     {
-        // As a policy we don't put heap data on handle->data. If that is ever
-        // done then it must be freed in the appropriate place. It is ignored
-        // here because it's impossible to tell what it is by the very nature of
-        // uv_handle_t. We will generate a warning however.
-        if (handle->data != NULL)
-        {
-            vws.trace( VL_WARN,
-                       "on_uv_close(): libuv resource not properly freed:"
-                       "handle=%p handle->data=%p",
-                       (void*)handle,
-                       (void*)handle->data );
-        }
+        path[n++] = '/';
     }
-}
 
-void on_uv_walk(uv_handle_t* handle, void* arg)
-{
-    // If this handle has not been closed, it should have been. Nevertheless we
-    // will make an attempt to close it.
-    if (uv_is_closing(handle) == 0)
+    for (size_t i = 0; i < size; i++)
     {
-        uv_close(handle, (uv_close_cb)on_uv_close);
-    }
-}
+        char ch = url[i];
 
-void tcp_svr_dtor(vws_tcp_svr* svr)
-{
-    vws.free(svr->threads);
+        if ( (ch == '%') && (i + 2 < size) &&
+             isxdigit((uint8_t)url[i + 1]) && isxdigit((uint8_t)url[i + 2]) )
+        {
+            char hex[3] = { url[i + 1], url[i + 2], 0 };
+            ch          = (char)strtol(hex, NULL, 16);
+            i          += 2;
+        }
 
-    // Close the server async handle
-    uv_close((uv_handle_t*)svr->wakeup, svr_on_close);
+        if ((ch == 0) || (ch == '\\') || (n + 1 >= max))
+        {
+            return false;
+        }
 
-    // Close peer timer
-    svr->peer_timer->data = NULL;
-    uv_close((uv_handle_t*)svr->peer_timer, svr_on_timer_close);
+        path[n++] = ch;
+    }
 
-    //> Shutdown libuv
+    path[n] = 0;
 
-    // Walk the loop to close everything
-    uv_walk(svr->loop, on_uv_walk, NULL);
+    // No way out of the root
+    for (char* p = strstr(path, ".."); p != NULL; p = strstr(p + 2, ".."))
+    {
+        if ((p[-1] == '/') && ((p[2] == '/') || (p[2] == 0)))
+        {
+            return false;
+        }
+    }
 
-    while (uv_loop_close(svr->loop))
+    // Directories are served by their index
+    if (path[n - 1] == '/')
     {
-        // Run the loop until there are no more active handles
-        while (uv_loop_alive(svr->loop))
+        size_t isize = strlen(files->index);
+
+        if (n + isize >= max)
         {
-            uv_run(svr->loop, UV_RUN_DEFAULT);
+            return false;
         }
+
+        memcpy(path + n, files->index, isize + 1);
     }
 
-    // Free loop
-    vws.free(svr->loop);
+    return true;
+}
 
-    // Call user-defined loop callback if defined
-    if (svr->shutdown_cb != NULL)
+vws_svr_file* svr_file_cached(vws_svr_files* files, uv_loop_t* loop, cstr path)
+{
+    vws_value* v = vws_kvs_get(files->cache, path);
+
+    if (v == NULL)
     {
-        svr->shutdown_cb(svr);
+        return NULL;
     }
 
-    // Free address pool
-    address_pool_free(&svr->cpool);
-
-    // Free peers
+    vws_svr_file* f = *(vws_svr_file**)v->data;
 
-    for (size_t i = 0; i < svr->peers->used; i++)
+    if (uv_now(loop) - f->checked >= files->ttl)
     {
-        vws_peer* peer = (vws_peer*)svr->peers->array[i].value.data;
-        free(peer->host);
+        return NULL;
     }
 
-    vws_kvs_free(svr->peers);
-}
+    f->refs++;
 
-//------------------------------------------------------------------------------
-// Client connection callbacks
-//------------------------------------------------------------------------------
+    return f;
+}
 
-void svr_client_connect(vws_svr_cnx* c)
+void svr_file_lookup_start(vws_svr_cnx* cnx, size_t used, cstr path)
 {
-    if (vws.tracelevel >= VT_SERVICE)
+    vws_svr* server      = (vws_svr*)cnx->server;
+    vws_svr_files* files = server->files;
+    vws_http_msg* m      = cnx->http;
+    cstr tag             = vws_http_msg_header(m, "if-none-match");
+
+    svr_file_lookup* l = vws.malloc(sizeof(svr_file_lookup));
+    l->server          = cnx->server;
+    l->cid             = cnx->cid;
+    l->path            = vws.strdup(path);
+    l->method          = llhttp_get_method(m->parser);
+    l->tag             = (tag != NULL) ? vws.strdup(tag) : NULL;
+    l->check           = NULL;
+    l->fd              = -1;
+    l->req.data        = l;
+
+    size_t size = strlen(files->root) + strlen(path) + 1;
+    l->full     = vws.malloc(size);
+    snprintf(l->full, size, "%s%s", files->root, path);
+
+    // Done with the request and the headers it borrowed
+    vws_cnx* c = (vws_cnx*)cnx->data;
+    svr_http_release(cnx->server, cnx->http);
+    cnx->http = NULL;
+    vws_buffer_drain(c->base.buffer, used);
+
+    // Hold later requests until this one is answered
+    cnx->http_busy = true;
+
+    uv_loop_t* loop = cnx->server->loop;
+    vws_value* v    = vws_kvs_get(files->cache, path);
+    int rc;
+
+    if (v != NULL)
     {
-        vws.trace(VL_INFO, "svr_client_connect(%p)", c->handle);
+        // Cached, but due to be checked. Kept while the check runs.
+        l->check = *(vws_svr_file**)v->data;
+        l->check->refs++;
+
+        rc = uv_fs_stat(loop, &l->req, l->full, svr_file_on_stat);
+    }
+    else
+    {
+        rc = uv_fs_open( loop, &l->req, l->full, UV_FS_O_RDONLY, 0,
+                         svr_file_on_open );
     }
-}
 
-void svr_client_disconnect(vws_svr_cnx* c)
-{
-    if (vws.tracelevel >= VT_SERVICE)
+    if (rc != 0)
     {
-        if (c != NULL)
-        {
-            vws.trace(VL_INFO, "svr_client_disconnect(%p)", c->handle);
-        }
-        else
+        if (l->check != NULL)
         {
-            vws.trace(VL_INFO, "svr_client_disconnect(%p)", NULL);
+            svr_file_release(l->check);
+            l->check = NULL;
         }
+
+        svr_file_lookup_end(l, NULL);
     }
 }
 
-void svr_client_read(vws_svr_cnx* c, ssize_t size, const uv_buf_t* buf)
+void svr_file_on_stat(uv_fs_t* req)
 {
-    vws_tcp_svr* server = c->server;
-
-    // Queue data to worker pool for processing
-    vws_svr_data* data = vws_svr_data_own(server, c->cid, (ucstr)buf->base, size);
+    svr_file_lookup* l   = (svr_file_lookup*)req->data;
+    vws_svr_files* files = ((vws_svr*)l->server)->files;
+    vws_svr_file* f      = l->check;
+    bool same            = false;
 
-    // Store reference to server
-    data->server = c->server;
+    if (req->result == 0)
+    {
+        uv_stat_t* st = &req->statbuf;
+        uint64_t ns   = st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
 
-    // Put on queue
-    queue_push(&server->requests, data);
-}
+        same = (st->st_ino == f->ino) &&
+               (st->st_size == f->size) &&
+               (ns == f->mtime);
+    }
 
-void svr_client_data_in(vws_svr_data* m, void* x)
-{
-    // Default: Do nothing. Drop data.
-    vws_svr_data_free(m);
-}
+    uv_fs_req_cleanup(req);
+    l->check = NULL;
 
-void svr_client_data_out(vws_svr_data* data, void* x)
-{
-    if (data->size == 0)
+    // Another lookup may have replaced it meanwhile
+    if ((same == true) && (f->stale == false))
     {
-        vws.trace(VL_INFO, "svr_client_data_out(): no data");
-        vws.error(VL_WARN, "svr_client_data_out(): no data");
-
-        vws_svr_data_free(data);
+        f->checked = uv_now(l->server->loop);
+        svr_file_lookup_end(l, f);
 
         return;
     }
 
-    // Check address pool and ensure connection is still active
-    uintptr_t ptr = address_pool_get(data->server->cpool, data->cid.key);
+    if (f->stale == false)
+    {
+        svr_file_evict(files, f);
+    }
 
-    if (ptr == 0)
+    svr_file_release(f);
+
+    int rc = uv_fs_open( l->server->loop, &l->req, l->full, UV_FS_O_RDONLY, 0,
+                         svr_file_on_open );
+
+    if (rc != 0)
     {
-        // Connection no longer exists.
+        svr_file_lookup_end(l, NULL);
+    }
+}
 
-        // Call user-defined loop callback if defined
-        if (data->server->data_lost_cb != NULL)
-        {
-            data->server->data_lost_cb(data, x);
-        }
-        else
-        {
-            // Unhandled. Delete.
-            vws_svr_data_free(data);
-        }
+void svr_file_on_open(uv_fs_t* req)
+{
+    svr_file_lookup* l = (svr_file_lookup*)req->data;
+    ssize_t fd         = req->result;
+
+    uv_fs_req_cleanup(req);
+
+    if (fd < 0)
+    {
+        svr_file_lookup_end(l, NULL);
 
         return;
     }
 
-    uv_buf_t buf    = uv_buf_init(data->data, data->size);
-    uv_write_t* req = (uv_write_t*)vws.malloc(sizeof(uv_write_t));
-    req->data       = data;
+    l->fd  = (uv_file)fd;
+    int rc = uv_fs_fstat(l->server->loop, &l->req, l->fd, svr_file_on_fstat);
 
-    // Write out to libuv
-    uv_stream_t* handle = ((vws_svr_cnx*)ptr)->handle;
-    if (uv_write(req, handle, &buf, 1, svr_on_write_complete) != 0)
+    if (rc != 0)
     {
-        // Connection is closing/closed.
-        vws_svr_data_free(data);
-        vws.free(req);
+        close(l->fd);
+        svr_file_lookup_end(l, NULL);
     }
 }
 
-//------------------------------------------------------------------------------
-// Server Connection
-//------------------------------------------------------------------------------
-
-vws_svr_cnx* svr_cnx_new(vws_tcp_svr* s, uv_stream_t* handle)
+void svr_file_on_fstat(uv_fs_t* req)
 {
-    vws_svr_cnx* cnx = vws.malloc(sizeof(vws_svr_cnx));
-    cnx->server      = s;
-    cnx->handle      = handle;
-    cnx->data        = NULL;
-    cnx->format      = VM_MPACK_FORMAT;
+    svr_file_lookup* l   = (svr_file_lookup*)req->data;
+    vws_svr_files* files = ((vws_svr*)l->server)->files;
+    uv_stat_t st         = req->statbuf;
+    ssize_t rc           = req->result;
 
-    vws_cid_clear(&cnx->cid);
-
-    // Initialize HTTP state
-    cnx->upgraded    = false;
-    cnx->http        = vws_http_msg_new(HTTP_REQUEST);
+    uv_fs_req_cleanup(req);
 
-    // Add to address pool
-    cnx->cid.key     = address_pool_set(s->cpool, (uintptr_t)cnx);
+    if ((rc != 0) || ((st.st_mode & S_IFMT) != S_IFREG))
+    {
+        close(l->fd);
+        svr_file_lookup_end(l, NULL);
 
-    // Mark connection as unauthorized
-    vws_set_flag(&cnx->cid.flags, VWS_SVR_STATE_UNAUTH);
+        return;
+    }
 
-    if (vws.tracelevel >= VT_SERVICE)
+    vws_svr_file* f = vws.malloc(sizeof(vws_svr_file));
+    f->path         = vws.strdup(l->path);
+    f->fd           = l->fd;
+    f->size         = st.st_size;
+    f->mtime        = st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+    f->ino          = st.st_ino;
+    f->type         = svr_file_type(l->path);
+    f->refs         = 1;
+    f->checked      = uv_now(l->server->loop);
+    f->stale        = false;
+
+    snprintf( f->etag, sizeof(f->etag), "\"%llx-%llx\"",
+              (unsigned long long)f->size,
+              (unsigned long long)f->mtime );
+
+    // Another lookup may have cached the same path meanwhile
+    if ( (vws_kvs_get(files->cache, l->path) == NULL) &&
+         (vws_kvs_size(files->cache) < files->cache_size) )
     {
-        vws.trace(VL_INFO, "svr_cnx_new(%p): added %lu", s, cnx->cid.key);
+        vws_kvs_set(files->cache, l->path, &f, sizeof(vws_svr_file*));
     }
-
-    // Get peer info
-    int len = sizeof(struct sockaddr_storage);
-    uv_tcp_getpeername( (const uv_tcp_t*)handle,
-                        (struct sockaddr*)&cnx->cid.addr, &len );
-
-    // Call user-defined connection open callback if defined
-    if (s->cnx_open_cb != NULL)
+    else
     {
-        s->cnx_open_cb(cnx);
+        // Not cached. Closed once sent.
+        f->stale = true;
     }
 
-    return cnx;
+    svr_file_lookup_end(l, f);
 }
 
-void svr_cnx_free(vws_svr_cnx* cnx)
+void svr_file_lookup_end(svr_file_lookup* l, vws_svr_file* f)
 {
-    if (cnx != NULL)
-    {
-        if (vws.tracelevel >= VT_SERVICE)
-        {
-            vws.trace(VL_INFO, "svr_cnx_free(%p)", cnx);
-        }
-
-        // Call user-defined connection close callback if defined
-        if (cnx->server->cnx_close_cb != NULL)
-        {
-            cnx->server->cnx_close_cb(cnx);
-        }
+    uintptr_t ptr    = address_pool_get(l->server->cpool, l->cid.key);
+    vws_svr_cnx* cnx = (vws_svr_cnx*)ptr;
 
-        if (cnx->http != NULL)
+    if ((ptr == 0) || uv_is_closing((uv_handle_t*)cnx->handle))
+    {
+        if (f != NULL)
         {
-            vws_http_msg_free(cnx->http);
+            svr_file_release(f);
         }
+    }
+    else
+    {
+        vws_buffer* out = vws_buffer_new();
+        bool body       = svr_file_head( out, f, l->method, l->tag,
+                                         cnx->http_close );
 
-        // Remove from pool
-        address_pool_remove(cnx->server->cpool, cnx->cid.key);
-
-        vws.free(cnx);
+        svr_file_send(cnx, f, out, body);
     }
+
+    vws.free(l->path);
+    vws.free(l->full);
+    vws.free(l->tag);
+    vws.free(l);
 }
 
-void svr_cnx_close(vws_tcp_svr* server, vws_cid_t cid)
+bool svr_file_head( vws_buffer* out,
+                    vws_svr_file* f,
+                    int method,
+                    cstr tag,
+                    bool close )
 {
-    vws_tcp_svr_close(server, cid);
-}
+    if (f == NULL)
+    {
+        vws_http_response(out, 404, NULL, NULL, 0, close);
 
-//------------------------------------------------------------------------------
-// Server Utilities
-//------------------------------------------------------------------------------
+        return false;
+    }
 
-vws_svr_cnx* svr_cnx_map_get(vws_svr_cnx_map* map, uv_stream_t* key)
-{
-    vws_svr_cnx* cnx = sc_map_get_64v(map, (uint64_t)key);
+    char headers[256];
+    snprintf( headers, sizeof(headers),
+              "Content-Type: %s\r\nETag: %s\r\n", f->type, f->etag );
 
-    // If entry exists
-    if (sc_map_found(map) == true)
+    // The client has it already
+    if ( (tag != NULL) &&
+         ((strcmp(tag, "*") == 0) || (strstr(tag, f->etag) != NULL)) )
     {
-        return cnx;
+        vws_http_response(out, 304, headers, NULL, f->size, close);
+
+        return false;
     }
 
-    return NULL;
+    vws_http_response(out, 200, headers, NULL, f->size, close);
+
+    return (method != HTTP_HEAD) && (f->size > 0);
 }
 
-void svr_cnx_map_remove(vws_svr_cnx_map* map, uv_stream_t* key)
+void svr_file_send(vws_svr_cnx* cnx, vws_svr_file* f, vws_buffer* out, bool body)
 {
-    vws_svr_cnx* cnx = sc_map_get_64v(map, (uint64_t)key);
+    if (body == true)
+    {
+        svr_sendfile_start(cnx, f, out);
 
-    // If entry exists
-    if (sc_map_found(map) == true)
+        return;
+    }
+
+    if (f != NULL)
     {
-        sc_map_del_64v(map, (uint64_t)key);
+        svr_file_release(f);
+    }
 
-        // Call on_disconnect() handler
-        cnx->server->on_disconnect(cnx);
+    vws_svr_data* reply;
+    reply                 = vws_svr_data_new(cnx->server, cnx->cid, &out);
+    reply->stamps.ingress = vws_clock_usec();
 
-        // Cleanup
-        vws.free(cnx);
+    // Send directly out as we are in uv_thread()
+    cnx->server->on_data_out(reply, NULL);
+    vws_buffer_free(out);
+
+    if (cnx->http_busy == true)
+    {
+        // Waited on a lookup. Goes on with the requests behind it.
+        svr_http_complete(cnx->server, cnx->cid);
+    }
+    else if (cnx->http_close == true)
+    {
+        svr_cnx_shutdown(cnx);
     }
 }
 
-int8_t svr_cnx_map_set(vws_svr_cnx_map* map, uv_stream_t* key, vws_svr_cnx* value)
+void svr_file_release(vws_svr_file* f)
 {
-    // See if we have an existing entry
-    sc_map_get_64v(map, (uint64_t)key);
+    f->refs--;
 
-    if (sc_map_found(map) == true)
+    if ((f->refs == 0) && (f->stale == true))
     {
-        // Exsiting entry. Return false.
-        return 0;
+        close(f->fd);
+        vws.free(f->path);
+        vws.free(f);
     }
+}
 
-    sc_map_put_64v(map, (uint64_t)key, value);
+void svr_file_evict(vws_svr_files* files, vws_svr_file* f)
+{
+    vws_kvs_remove(files->cache, f->path);
+    f->stale = true;
 
-    // True
-    return 1;
+    // Responses in progress keep it open
+    if (f->refs == 0)
+    {
+        close(f->fd);
+        vws.free(f->path);
+        vws.free(f);
+    }
 }
 
-void svr_cnx_map_clear(vws_svr_cnx_map* map)
+// Case-insensitive string equality. strcasecmp() is not portable.
+static bool svr_strcaseeq(cstr a, cstr b)
 {
-    uint64_t key; vws_svr_cnx* cnx;
-    sc_map_foreach(map, key, cnx)
+    for (; (*a != 0) || (*b != 0); a++, b++)
     {
-        cnx->server->on_disconnect(cnx);
-        vws.free(cnx);
+        if (tolower((unsigned char)*a) != tolower((unsigned char)*b))
+        {
+            return false;
+        }
     }
 
-    sc_map_clear_64v(map);
+    return true;
 }
 
-void svr_shutdown(vws_tcp_svr* server)
+cstr svr_file_type(cstr path)
 {
-    if (server->state == VS_HALTED)
+    static cstr types[][2] =
+    {
+        { "html",  "text/html; charset=utf-8"              },
+        { "htm",   "text/html; charset=utf-8"              },
+        { "css",   "text/css; charset=utf-8"               },
+        { "js",    "text/javascript; charset=utf-8"        },
+        { "mjs",   "text/javascript; charset=utf-8"        },
+        { "json",  "application/json"                      },
+        { "map",   "application/json"                      },
+        { "txt",   "text/plain; charset=utf-8"             },
+        { "xml",   "application/xml"                       },
+        { "svg",   "image/svg+xml"                         },
+        { "png",   "image/png"                             },
+        { "jpg",   "image/jpeg"                            },
+        { "jpeg",  "image/jpeg"                            },
+        { "gif",   "image/gif"                             },
+        { "webp",  "image/webp"                            },
+        { "ico",   "image/x-icon"                          },
+        { "wasm",  "application/wasm"                      },
+        { "woff",  "font/woff"                             },
+        { "woff2", "font/woff2"                            },
+        { "pdf",   "application/pdf"                       },
+        { "mp4",   "video/mp4"                             },
+        { "zip",   "application/zip"                       },
+        { "gz",    "application/gzip"                      }
+    };
+
+    cstr dot   = strrchr(path, '.');
+    cstr slash = strrchr(path, '/');
+
+    if ((dot != NULL) && ((slash == NULL) || (dot > slash)))
+    {
+        for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+        {
+            if (svr_strcaseeq(dot + 1, types[i][0]) == true)
+            {
+                return types[i][1];
+            }
+        }
+    }
+
+    return "application/octet-stream";
+}
+
+void svr_files_free(vws_svr_files* files)
+{
+    if (files == NULL)
     {
         return;
     }
 
-    if (vws.tracelevel >= VT_SERVICE)
+    while (vws_kvs_size(files->cache) > 0)
     {
-        vws.trace(VL_INFO, "svr_shutdown(%p): Shutdown starting", server);
+        vws_svr_file* f = *(vws_svr_file**)files->cache->array[0].value.data;
+        svr_file_evict(files, f);
     }
 
-    //> Cleanup queues
+    vws_kvs_free(files->cache);
+    vws.free(files->prefix);
+    vws.free(files->root);
+    vws.free(files);
+}
 
-    vws_svr_queue* queue = &server->responses;
-    uv_mutex_lock(&queue->mutex);
-    while (queue->size > 0)
-    {
-        vws_svr_data* data = queue->buffer[queue->head];
-        queue->head        = (queue->head + 1) % queue->capacity;
-        queue->size--;
+void svr_sendfile_start(vws_svr_cnx* cnx, vws_svr_file* f, vws_buffer* head)
+{
+    uv_os_fd_t sock;
+    int fd = -1;
 
-        vws_svr_data_free(data);
+    if (uv_fileno((uv_handle_t*)cnx->handle, &sock) == 0)
+    {
+        fd = dup(sock);
     }
-    uv_mutex_unlock(&queue->mutex);
 
-    queue_destroy(&server->requests);
-    queue_destroy(&server->responses);
+    if (fd < 0)
+    {
+        vws.error(VE_RT, "svr_sendfile_start(): cannot duplicate socket");
 
-    // Stop the loop. This will cause uv_run() to return in vws_tcp_svr_run()
-    // which will also return.
-    uv_stop(server->loop);
+        svr_file_release(f);
+        vws_buffer_free(head);
+        uv_close((uv_handle_t*)cnx->handle, svr_on_close);
+
+        return;
+    }
+
+    svr_sendfile* t = vws.malloc(sizeof(svr_sendfile));
+    t->server       = cnx->server;
+    t->cnx          = cnx;
+    t->cid          = cnx->cid;
+    t->file         = f;
+    t->head         = head;
+    t->fd           = fd;
+    t->offset       = 0;
+    t->remaining    = f->size;
+    t->writing      = false;
+    t->sending      = false;
+    t->polling      = false;
+    t->closing      = false;
+    t->write.data   = t;
+    t->work.data    = t;
+    t->poll.data    = t;
+
+    // Hold later requests until the file is sent
+    cnx->sendfile  = t;
+    cnx->http_busy = true;
+
+    // Responses the ring is still sending go first
+    if (svr_ring_defer(cnx, SVR_RING_SENDFILE) == false)
+    {
+        svr_sendfile_head(t);
+    }
 }
 
-void svr_on_connect(uv_stream_t* socket, int status)
+void svr_sendfile_head(svr_sendfile* t)
 {
-    vws_cinfo* svr_addr = (vws_cinfo*)socket->data;
-    vws_tcp_svr* server = svr_addr->server;
+    uv_buf_t buf = uv_buf_init((char*)t->head->data, t->head->size);
+    t->writing   = true;
 
-    if (status < 0)
+    if (uv_write(&t->write, t->cnx->handle, &buf, 1, svr_sendfile_on_head) != 0)
     {
-        cstr e = uv_strerror(status);
-        vws.error(VE_RT, "Error in connection callback: %s", e);
-        return;
+        t->writing = false;
+        svr_sendfile_end(t, UV_ECANCELED);
     }
+}
 
-    uv_tcp_t* c = (uv_tcp_t*)vws.malloc(sizeof(uv_tcp_t));
+void svr_sendfile_next(svr_sendfile* t)
+{
+    t->sending = true;
 
-    if (c == NULL)
+    int rc = uv_queue_work( t->server->loop,
+                            &t->work,
+                            svr_sendfile_work,
+                            svr_sendfile_on_send );
+
+    if (rc < 0)
     {
-        vws.error(VE_RT, "Failed to allocate memory for client");
-        return;
+        t->sending = false;
+        svr_sendfile_end(t, rc);
     }
+}
 
-    vws_cinfo* cinfo = vws.malloc(sizeof(vws_cinfo));
-    cinfo->cnx       = NULL;
-    cinfo->server    = server;
-    c->data          = cinfo;
+void svr_sendfile_on_head(uv_write_t* req, int status)
+{
+    svr_sendfile* t = (svr_sendfile*)req->data;
+    t->writing      = false;
 
-    if (uv_tcp_init(server->loop, c) != 0)
+    if (t->cnx == NULL)
     {
-        vws.error(VE_RT, "Failed to initialize client");
+        svr_sendfile_free(t);
+
         return;
     }
 
-    if (uv_accept(socket, (uv_stream_t*)c) == 0)
-    {
-        if (uv_read_start((uv_stream_t*)c, svr_on_realloc, svr_on_read) != 0)
-        {
-            vws.error(VE_RT, "Failed to start reading from client");
-            return;
-        }
-    }
-    else
+    if (status < 0)
     {
-        uv_close((uv_handle_t*)c, svr_on_close);
+        svr_sendfile_end(t, status);
+
+        return;
     }
 
-    //> Add connection to registry and initialize
+    svr_metric_add(t->server, VWS_METRIC_BYTES_OUT, t->head->size);
 
-    vws_svr_cnx* cnx = svr_cnx_new(server, (uv_stream_t*)c);
-    cinfo->cnx       = cnx;
-    cinfo->cid       = cnx->cid;
+    svr_sendfile_next(t);
+}
 
-    //> Call svr_on_connect() handler
+void svr_sendfile_work(uv_work_t* req)
+{
+    svr_sendfile* t = (svr_sendfile*)req->data;
 
-    server->on_connect(cnx);
+#if defined(__linux__)
+
+    // uv_fs_sendfile() falls back to a blocking copy through a buffer when
+    // sending to a socket, so sendfile() is called directly.
+    off_t offset = t->offset;
+    ssize_t n    = sendfile(t->fd, t->file->fd, &offset, t->remaining);
+    t->result    = (n < 0) ? -errno : n;
+
+#else
+
+    uv_fs_t fs;
+    t->result = uv_fs_sendfile( t->server->loop, &fs,
+                                t->fd, t->file->fd,
+                                t->offset, t->remaining,
+                                NULL );
+    uv_fs_req_cleanup(&fs);
+
+#endif
 }
 
-void svr_on_read(uv_stream_t* c, ssize_t nread, const uv_buf_t* buf)
+void svr_sendfile_on_send(uv_work_t* req, int status)
 {
-    vws_cinfo* cinfo    = (vws_cinfo*)c->data;
-    vws_svr_cnx* cnx    = cinfo->cnx;
-    vws_tcp_svr* server = cinfo->server;
-    vws_cid_t cid       = cinfo->cid;
+    svr_sendfile* t = (svr_sendfile*)req->data;
+    ssize_t rc      = (status < 0) ? status : t->result;
+    t->sending      = false;
 
-    if (nread < 0)
+    if (t->cnx == NULL)
     {
-        uv_close((uv_handle_t*)c, svr_on_close);
-        vws.free(buf->base);
+        svr_sendfile_free(t);
+
         return;
     }
 
-    // Lookup connection
-    uintptr_t ptr = address_pool_get(server->cpool, cid.key);
+    if (rc > 0)
+    {
+        svr_metric_add(t->server, VWS_METRIC_BYTES_OUT, rc);
 
-    if (ptr != 0)
+        t->offset    += rc;
+        t->remaining -= rc;
+
+        if (t->remaining == 0)
+        {
+            svr_sendfile_end(t, 0);
+        }
+        else
+        {
+            svr_sendfile_next(t);
+        }
+
+        return;
+    }
+
+    if (rc != UV_EAGAIN)
     {
-        vws_svr_cnx* cnx = (vws_svr_cnx*)ptr;
-        server->on_read(cnx, nread, buf);
+        // A file which shrank ends early
+        svr_sendfile_end(t, (rc == 0) ? UV_EOF : (int)rc);
+
+        return;
     }
-}
 
-void svr_on_write_complete(uv_write_t* req, int status)
-{
-    vws_svr_data_free((vws_svr_data*)req->data);
-    vws.free(req);
-}
+    // Socket is full. Wait until it takes more.
+    if (t->polling == false)
+    {
+        int err = uv_poll_init(t->server->loop, &t->poll, t->fd);
 
-void svr_on_timer_close(uv_handle_t* handle)
-{
-    vws.free(handle);
+        if (err != 0)
+        {
+            svr_sendfile_end(t, err);
+
+            return;
+        }
+
+        t->polling = true;
+    }
+
+    uv_poll_start(&t->poll, UV_WRITABLE, svr_sendfile_on_poll);
 }
 
-void svr_on_close(uv_handle_t* handle)
+void svr_sendfile_on_poll(uv_poll_t* poll, int status, int events)
 {
-    vws_cinfo* cinfo    = (vws_cinfo*)handle->data;
-    vws_svr_cnx* cnx    = cinfo->cnx;
-    vws_tcp_svr* server = cinfo->server;
-    vws_cid_t cid       = cinfo->cid;
+    svr_sendfile* t = (svr_sendfile*)poll->data;
 
-    if (vws.tracelevel >= VT_SERVICE)
-    {
-        vws.trace(VL_INFO, "svr_on_close(%p, %p)", server, handle);
-    }
+    uv_poll_stop(poll);
 
-    if (server == NULL)
+    if (status < 0)
     {
-        assert(false);
-        vws.free(handle->data);
-        vws.free(handle);
+        svr_sendfile_end(t, status);
 
         return;
     }
 
-    // Lookup connection. If it's not in pool then it's already been cleaned up.
-    uintptr_t ptr = address_pool_get(server->cpool, cid.key);
+    svr_sendfile_next(t);
+}
 
-    if (ptr != 0)
-    {
-        vws_svr_cnx* cnx = (vws_svr_cnx*)ptr;
+void svr_sendfile_on_close(uv_handle_t* handle)
+{
+    svr_sendfile* t = (svr_sendfile*)handle->data;
+    t->closing      = false;
 
-        // Call on_disconnect() handler
-        server->on_disconnect(cnx);
+    svr_sendfile_free(t);
+}
 
-        // Cleanup
-        svr_cnx_free(cnx);
+void svr_sendfile_end(svr_sendfile* t, int status)
+{
+    vws_svr_cnx* cnx = t->cnx;
+
+    if (cnx != NULL)
+    {
+        cnx->sendfile = NULL;
+        t->cnx        = NULL;
+
+        if (status == 0)
+        {
+            svr_http_complete(t->server, t->cid);
+        }
+        else if (uv_is_closing((uv_handle_t*)cnx->handle) == false)
+        {
+            uv_close((uv_handle_t*)cnx->handle, svr_on_close);
+        }
     }
 
-    vws.free(handle->data);
-    vws.free(handle);
+    svr_sendfile_free(t);
+}
 
-    // If we are running in inetd mode, there is only one socket and its closing
-    // means we are done and should exit process.
+void svr_sendfile_free(svr_sendfile* t)
+{
+    if (t->polling == true)
+    {
+        // Freed when closed
+        t->polling = false;
+        t->closing = true;
+        uv_close((uv_handle_t*)&t->poll, svr_sendfile_on_close);
 
-    if ((server->inetd_mode == 1) && vws_tcp_svr_is_running(server))
+        return;
+    }
+
+    if ((t->writing == true) || (t->sending == true) || (t->closing == true))
     {
-        vws_tcp_svr_inetd_stop(server);
+        return;
     }
-}
 
-void svr_on_realloc(uv_handle_t* handle, size_t size, uv_buf_t* buf)
-{
-    buf->base = (char*)vws.realloc(buf->base, size);
-    buf->len  = size;
+    close(t->fd);
+    svr_file_release(t->file);
+    vws_buffer_free(t->head);
+    vws.free(t);
 }
 
-//------------------------------------------------------------------------------
-// Queue API
-//------------------------------------------------------------------------------
+#else
 
-void queue_init(vws_svr_queue* queue, int size, cstr name)
+bool vws_svr_static(vws_svr* s, cstr prefix, cstr root)
 {
-    queue->buffer   = (vws_svr_data**)vws.malloc(size * sizeof(vws_svr_data*));
-    queue->size     = 0;
-    queue->capacity = size;
-    queue->head     = 0;
-    queue->tail     = 0;
-    queue->state    = VS_RUNNING;
-    queue->name     = strdup(name);
+    vws.error(VE_RT, "vws_svr_static(): not supported on Windows");
 
-    // Initialize mutex and condition variable
-    uv_mutex_init(&queue->mutex);
-    uv_cond_init(&queue->cond);
+    return false;
 }
 
-void queue_destroy(vws_svr_queue* queue)
+void svr_files_free(vws_svr_files* files)
 {
-    if (queue->buffer != NULL)
-    {
-        vws.free(queue->name);
-        uv_mutex_destroy(&queue->mutex);
-        uv_cond_destroy(&queue->cond);
-        vws.free(queue->buffer);
-        queue->buffer = NULL;
-        queue->state  = VS_HALTED;
-    }
+
 }
 
-void queue_push(vws_svr_queue* queue, vws_svr_data* data)
+#endif
+
+//------------------------------------------------------------------------------
+// Messaging Server: Derived from WebSocket server
+//------------------------------------------------------------------------------
+
+/** Context used to process messages in an incoming batch envelope */
+typedef struct
 {
-    if (queue->state != VS_RUNNING)
+    vws_svr* server;
+    vws_cid_t cid;
+    void* x;
+    bool error;
+} msg_svr_batch_ctx;
+
+// Deserialize and process a single message from an incoming batch
+static void msg_svr_batch_msg_in(ucstr data, size_t size, void* ctx)
+{
+    msg_svr_batch_ctx* bc = (msg_svr_batch_ctx*)ctx;
+
+    if (bc->error == true)
     {
-        vws.free(data);
         return;
     }
 
-    uv_mutex_lock(&queue->mutex);
+    vrtql_msg* msg = vrtql_msg_new();
 
-    while (queue->size == queue->capacity)
+    if (vrtql_msg_deserialize(msg, data, size) == false)
     {
-        uv_cond_wait(&queue->cond, &queue->mutex);
-    }
+        // Error already set
+        vrtql_msg_free(msg);
+        bc->error = true;
 
-    if (queue->state != VS_RUNNING)
-    {
-        uv_cond_signal(&queue->cond);
-        uv_mutex_unlock(&queue->mutex);
         return;
     }
 
-    queue->buffer[queue->tail] = data;
-    queue->tail = (queue->tail + 1) % queue->capacity;
-    queue->size++;
-
-    // Signal condition variable
-    uv_cond_signal(&queue->cond);
-    uv_mutex_unlock(&queue->mutex);
+    vrtql_msg_svr* server = (vrtql_msg_svr*)bc->server;
+    server->on_msg_in(bc->server, bc->cid, msg, bc->x);
 }
 
-vws_svr_data* queue_pop(vws_svr_queue* queue)
+// Convert incoming WebSocket messages to VRTQL messages for processing
+void msg_svr_client_ws_msg_in(vws_svr* s, vws_cid_t cid, vws_msg* wsm, void* x)
 {
-    uv_mutex_lock(&queue->mutex);
+    ucstr data  = wsm->data->data;
+    size_t size = wsm->data->size;
 
-    while (queue->size == 0 && queue->state == VS_RUNNING)
+    if (vrtql_msg_is_batch(data, size) == true)
     {
-        uv_cond_wait(&queue->cond, &queue->mutex);
-    }
+        // Process each message in envelope in order
+        msg_svr_batch_ctx ctx = { s, cid, x, false };
 
-    if (queue->state == VS_HALTING)
-    {
-        uv_cond_broadcast(&queue->cond);
-        uv_mutex_unlock(&queue->mutex);
+        if (vrtql_msg_batch_unpack(data, size, msg_svr_batch_msg_in, &ctx) < 0)
+        {
+            ctx.error = true;
+        }
 
-        return NULL;
+        vws_msg_free(wsm);
+
+        if (ctx.error == true)
+        {
+            vws_tcp_svr_close((vws_tcp_svr*)s, cid);
+        }
+
+        return;
     }
 
-    vws_svr_data* data = queue->buffer[queue->head];
-    queue->head        = (queue->head + 1) % queue->capacity;
-    queue->size--;
+    // Deserialize message
 
-    uv_mutex_unlock(&queue->mutex);
+    vrtql_msg* msg = vrtql_msg_new(HTTP_REQUEST);
 
-    return data;
-}
+    if (vrtql_msg_deserialize(msg, data, size) == false)
+    {
+        // Deserialized failed
 
-bool queue_empty(vws_svr_queue* queue)
-{
-    uv_mutex_lock(&queue->mutex);
-    bool empty = (queue->size == 0);
-    uv_mutex_unlock(&queue->mutex);
+        // Error already set
+        vws_msg_free(wsm);
+        vrtql_msg_free(msg);
 
-    return empty;
-}
+        vws_tcp_svr_close((vws_tcp_svr*)s, cid);
 
-//------------------------------------------------------------------------------
-// Pure WebSocket Server
-//------------------------------------------------------------------------------
+        return;
+    }
 
-// For handling HTTP requests
-int ws_svr_on_http_read(vws_svr_cnx* cnx)
-{
-    // The the HTTP request complete?
-    if (cnx->http->done == true)
-    {
-        vws_svr* server = (vws_svr*)cnx->server;
+    // Deserialized succeeded
 
-        // Pass to some processing function if defined
-        if (server->process_http != NULL)
-        {
-            // Pass message pointer in block
-            vws_svr_data* block;
-            block = vws_svr_data_own( cnx->server,
-                                      cnx->cid,
-                                      (ucstr)cnx->http,
-                                      sizeof(vws_http_msg*) );
+    // TODO: We send back the format we get. More than that, a request with
+    // different format effectively changes the entire connection default format
+    // setting.
+    //
+    // cnx->format = msg->format;
 
-            // Flag this message as HTTP request
-            vws_set_flag(&block->flags, VWS_SVR_STATE_HTTP);
+    // Free websocket message
+    vws_msg_free(wsm);
 
-            // Queue request
-            queue_push(&cnx->server->requests, block);
-        }
-        else
-        {
-            // No HTTP processing function defined. Since we take ownership of
-            // message to we must up clean up.
-            vws_http_msg_free(cnx->http);
-        }
+    // Process message
+    vrtql_msg_svr* server = (vrtql_msg_svr*)s;
+    server->on_msg_in(s, cid, msg, x);
+}
 
-        // By returning 1 we tell the caller we handled the request and took
-        // owndership of it (freed memory). Caller will allocate a new request
-        // and continue with connection processing.
-        return 1;
-    }
+// Receive/handle incoming VRTQL messages
+void msg_svr_client_msg_in(vws_svr* s, vws_cid_t c, vrtql_msg* m, void* x)
+{
+    vrtql_msg_svr* server = (vrtql_msg_svr*)s;
 
-    // By returning 0, we tell caller that the HTTP request is not
-    // complete. Keep reading and call us again when more data arrives.
-    return 0;
+    // Route to application-specific processing callback
+    server->process(s, c, m, x);
 }
 
-void ws_svr_process_frame(vws_cnx* c, vws_frame* f)
+// Runs in worker_thread()
+void msg_svr_client_msg_send(vws_svr* s, vws_cid_t c, vrtql_msg* m)
 {
-    vws_svr_cnx* cnx = (vws_svr_cnx*)c->data;
+    vrtql_msg_svr* server = (vrtql_msg_svr*)s;
+    bool urgent           = false;
 
-    switch (f->opcode)
+    // Send in the message's lane
+    if (vws_is_flag(&m->flags, VM_MSG_IRQ))
     {
-        case CLOSE_FRAME:
-        {
-            // Build the response frame
-            vws_buffer* buffer = vws_generate_close_frame();
+        vws_set_flag(&c.flags, VWS_SVR_STATE_IRQ);
+        urgent = true;
+    }
+    else if (vws_is_flag(&m->flags, VM_MSG_PRIORITY))
+    {
+        vws_set_flag(&c.flags, VWS_SVR_STATE_PRIORITY);
+        urgent = true;
+    }
 
-            // Send back to cliane Send the PONG response
-            vws_svr_data* response;
+    // JSON connections may not be VRTQL clients (e.g. browsers) and the batch
+    // envelope is binary, so only MessagePack messages are batched. Urgent
+    // messages are not held back in a batch.
+    bool batch = (server->batch_size > 0) && (m->format != VM_JSON_FORMAT);
 
-            response = vws_svr_data_new(cnx->server, cnx->cid, &buffer);
-            vws_tcp_svr_send(response);
+    if ((batch == true) && (urgent == false))
+    {
+        vws_buffer* mdata = vrtql_msg_serialize(m);
 
-            // Free buffer
-            vws_buffer_free(buffer);
+        if (mdata == NULL)
+        {
+            // Error already set
+            return;
+        }
 
-            // Free frame
-            vws_frame_free(f);
+        // Queue serialized message as batch item for uv_thread() to frame
+        vws_svr_data* item = vws_svr_data_new((vws_tcp_svr*)s, c, &mdata);
+        vws_set_flag(&item->flags, VWS_SVR_STATE_BATCH);
+        vws_tcp_svr_send(item);
 
-            break;
-        }
+        vws_buffer_free(mdata);
 
-        case TEXT_FRAME:
-        case BINARY_FRAME:
-        case CONTINUATION_FRAME:
-        {
-            // Add to queue
-            sc_queue_add_first(&c->queue, f);
+        return;
+    }
 
-            break;
-        }
+    // Serialize message
+    vws_buffer* mdata = vrtql_msg_serialize(m);
 
-        case PING_FRAME:
-        {
-            // Generate the PONG response
-            vws_buffer* buffer = vws_generate_pong_frame(f->data, f->size);
+    // Send to base class
+    ws_svr_client_data_out(s, c, mdata, BINARY_FRAME);
 
-            // Send back to cliane Send the PONG response
-            vws_svr_data* response;
-            response = vws_svr_data_new(cnx->server, cnx->cid, &buffer);
-            vws_tcp_svr_send(response);
+    // Cleanup
+    vws_buffer_free(mdata);
+}
 
-            // Free buffer
-            vws_buffer_free(buffer);
+// Send VRTQL messages
+void msg_svr_client_msg_out(vws_svr* s, vws_cid_t c, vrtql_msg* m, void* x)
+{
+    msg_svr_client_msg_send(s, c, m);
+    vrtql_msg_free(m);
+}
 
-            // Free frame
-            vws_frame_free(f);
+// Send VRTQL messages
+void msg_svr_client_msg_dispatch(vws_svr* s, vws_cid_t c, vrtql_msg* m, void* x)
+{
+    msg_svr_client_msg_send(s, c, m);
+}
 
-            break;
-        }
+// Runs in uv_thread()
+void msg_svr_client_data_out(vws_svr_data* data, void* x)
+{
+    vrtql_msg_svr* server = (vrtql_msg_svr*)data->server;
+    address_pool* cpool   = data->server->cpool;
+    uintptr_t ptr;
 
-        case PONG_FRAME:
-        {
-            // No need to send a response
+    if (vws_is_flag(&data->flags, VWS_SVR_STATE_ROUTE) == true)
+    {
+        // cid.key holds the routing hash, not a connection
+        msg_svr_route_out(server, data);
 
-            vws_frame_free(f);
+        return;
+    }
 
-            break;
-        }
+    ptr = address_pool_get(cpool, data->cid.key);
 
-        default:
+    if (vws_is_flag(&data->flags, VWS_SVR_STATE_BATCH) == false)
+    {
+        // Flush anything batched ahead of this data to preserve order
+        if (ptr != 0)
         {
-            // Invalid frame type
-            vws_frame_free(f);
+            msg_svr_batch_flush((vws_svr_cnx*)ptr);
         }
+
+        svr_client_data_out(data, x);
+
+        return;
     }
 
-    vws.success();
-}
+    if (ptr == 0)
+    {
+        // Connection no longer exists. Base class passes to data_lost_cb().
+        svr_client_data_out(data, x);
 
-void ws_svr_client_connect(vws_svr_cnx* c)
-{
-    if (vws.tracelevel >= VT_SERVICE)
+        return;
+    }
+
+    vws_svr_cnx* cnx = (vws_svr_cnx*)ptr;
+
+    if (cnx->batch == NULL)
     {
-        cstr host;
-        int port;
+        size_t size    = server->batch_size;
+        uint32_t delay = server->batch_delay;
 
-        struct sockaddr* addr = (struct sockaddr*)&c->cid.addr;
-        if (vws_socket_addr_info(addr, &host, &port) == true)
-        {
-            vws.trace( VL_INFO,
-                       "ws_svr_client_connect(%p, %p) socket %s:%lu",
-                       c->server, c->handle, host, port);
-            free(host);
-        }
-        else
+        // Inter-node traffic has its own settings
+        if (vws_is_flag(&cnx->cid.flags, VWS_SVR_STATE_PEER))
         {
-            vws.trace(VL_INFO, "ws_svr_client_connect(%p)", c->handle);
+            size  = server->route_batch_size;
+            delay = server->route_batch_delay;
         }
+
+        cnx->batch = vrtql_msg_batch_new(size, delay);
     }
 
-    // Create a new vws_cnx
-    vws_cnx* cnx = (void*)vws_cnx_new();
-    cnx->process = ws_svr_process_frame;
-    cnx->data    = (void*)c;   // Link cnx -> c
-    c->data      = (void*)cnx; // Link c -> cnx
-}
+    bool first = (cnx->batch->count == 0);
+    bool due   = vrtql_msg_batch_append(cnx->batch, (ucstr)data->data, data->size);
 
-void ws_svr_client_disconnect(vws_svr_cnx* c)
-{
-    if (c == NULL)
+    vws_svr_data_free(data);
+
+    if (due == true)
     {
+        msg_svr_batch_flush(cnx);
+
         return;
     }
 
-    if (vws.tracelevel >= VT_SERVICE)
+    if (first == true)
     {
-        vws.trace(VL_INFO, "ws_svr_client_disconnect(%p)", c->handle);
-    }
+        // Start deadline timer
+        if (cnx->batch_timer == NULL)
+        {
+            cnx->batch_timer = vws.malloc(sizeof(uv_timer_t));
+            uv_timer_init(cnx->server->loop, cnx->batch_timer);
+        }
 
-    if (c->data != NULL)
-    {
-        vws_cnx_free((vws_cnx*)c->data);
-        c->data = NULL;
+        uint64_t timeout = (cnx->batch->max_delay + 999) / 1000;
+
+        cnx->batch_timer->data = cnx;
+        uv_timer_start(cnx->batch_timer, msg_svr_batch_timer_cb, timeout, 0);
     }
 }
 
 // Runs in uv_thread()
-void ws_svr_client_read(vws_svr_cnx* cnx, ssize_t size, const uv_buf_t* buf)
+void msg_svr_batch_flush(vws_svr_cnx* cnx)
 {
-    vws_svr* server = (vws_svr*)cnx->server;
-    vws_cnx* c      = (vws_cnx*)cnx->data;
+    if ((cnx->batch == NULL) || (cnx->batch->count == 0))
+    {
+        return;
+    }
 
-    // Add to client socket buffer
-    vws_buffer_append(c->base.buffer, (ucstr)buf->base, size);
+    if (cnx->batch_timer != NULL)
+    {
+        uv_timer_stop(cnx->batch_timer);
+    }
 
-    // Free libuv memory
-    vws.free(buf->base);
+    svr_metric_add(cnx->server, VWS_METRIC_FRAMES_OUT, 1);
+    svr_metric_add(cnx->server, VWS_METRIC_MSGS_OUT, cnx->batch->count);
 
-    // If we are in HTTP mode
-    if (cnx->upgraded == false)
-    {
-        // Parse incoming data as HTTP request.
+    vws_buffer* buffer = vrtql_msg_batch_finish(cnx->batch);
 
-        ucstr data  = c->base.buffer->data;
-        size_t size = c->base.buffer->size;
-        ssize_t n   = vws_http_msg_parse(cnx->http, (cstr)data, size);
+    // Create a binary websocket frame taking ownership of envelope data
+    vws_frame* frame = vws_frame_new(NULL, 0, BINARY_FRAME);
+    frame->data      = buffer->data;
+    frame->size      = buffer->size;
+    buffer->data     = NULL;
+    buffer->size     = 0;
+    vws_buffer_free(buffer);
 
-        // Did we get a complete request?
-        if (cnx->http->headers_complete == true)
-        {
-            // Check for parsing errors
-            enum llhttp_errno err = llhttp_get_errno(cnx->http->parser);
+    // This frame is from server to we don't mask it
+    frame->mask = 0;
 
-            // If there was a parsing error, close connection
-            if(err != HPE_PAUSED)
-            {
-                vws.error( VE_RT, "Error: %s (%s)",
-                           llhttp_errno_name(err),
-                           llhttp_get_error_reason(cnx->http->parser) );
+    // Serialize frame: frame is freed by function
+    vws_buffer* fdata = vws_serialize(frame);
 
-                // Close connection
-                svr_cnx_close(cnx->server, cnx->cid);
+    vws_tev_emit(VTE_FRAME_OUT, cnx->cid.key, BINARY_FRAME, fdata->size);
 
-                return;
-            }
+    // Write directly as we are in uv_thread()
+    vws_svr_data* out = vws_svr_data_new(cnx->server, cnx->cid, &fdata);
+    svr_client_data_out(out, NULL);
 
-            // Drain HTTP request data from cnx->data buffer
-            vws_buffer_drain(c->base.buffer, n);
+    vws_buffer_free(fdata);
+}
 
-            //> Generate HTTP response and send
+void msg_svr_batch_timer_cb(uv_timer_t* handle)
+{
+    msg_svr_batch_flush((vws_svr_cnx*)handle->data);
+}
 
-            vws_kvs* headers = cnx->http->headers;
+//------------------------------------------------------------------------------
+// Message Server: Peer routing
+//------------------------------------------------------------------------------
 
-            // Check if it's an upgrade request
-            cstr upgrade = vws_kvs_get_cstring(headers, "upgrade");
+bool vrtql_msg_svr_route(vrtql_msg_svr* s, cstr key, vrtql_msg* m)
+{
+    // Batch items must be MessagePack
+    if (m->format == VM_JSON_FORMAT)
+    {
+        m->format = VM_MPACK_FORMAT;
+    }
 
-            if (upgrade == NULL)
-            {
-                // Handle regular HTTP request via callback
-                if (server->on_http_read)
-                {
-                    int rc = server->on_http_read(cnx);
-
-                    if (rc == 0)
-                    {
-                        // Keep reading
-                        return;
-                    }
-
-                    if (rc == 1)
-                    {
-                        // Allocate new message
-                        cnx->http = vws_http_msg_new(HTTP_REQUEST);
-                    }
-
-                    if (rc == -1)
-                    {
-                        // We are not handling HTTP requests
-                        svr_cnx_close(cnx->server, cnx->cid);
-                    }
-                }
-                else
-                {
-                    // We are not handling HTTP requests
-                    svr_cnx_close(cnx->server, cnx->cid);
-                }
+    vws_buffer* mdata = vrtql_msg_serialize(m);
+    vrtql_msg_free(m);
 
-                return;
-            }
+    if (mdata == NULL)
+    {
+        // Error already set
+        return false;
+    }
 
-            cstr key   = vws_kvs_get_cstring(headers, "sec-websocket-key");
-            cstr proto = vws_kvs_get_cstring(headers, "sec-websocket-protocol");
+    // Hash here rather than in uv_thread()
+    vws_cid_t cid;
+    vws_cid_clear(&cid);
+    cid.key = msg_svr_route_hash(key, strlen(key));
 
-            if (key == NULL)
-            {
-                vws.error(VE_RT, "Error: missing sec-websocket-key");
+    vws_svr_data* item = vws_svr_data_new((vws_tcp_svr*)s, cid, &mdata);
+    vws_set_flag(&item->flags, VWS_SVR_STATE_ROUTE);
+    vws_tcp_svr_send(item);
 
-                // Close connection
-                svr_cnx_close(cnx->server, cnx->cid);
+    vws_buffer_free(mdata);
 
-                return;
-            }
+    return true;
+}
 
-            vws_buffer* http = vws_buffer_new();
+uint32_t msg_svr_route_hash(cstr data, size_t size)
+{
+    // FNV-1a
+    uint32_t h = 2166136261u;
 
-            vws_buffer_printf(http, "HTTP/1.1 101 Switching Protocols\r\n");
-            vws_buffer_printf(http, "Upgrade: websocket\r\n");
-            vws_buffer_printf(http, "Connection: Upgrade\r\n");
+    for (size_t i = 0; i < size; i++)
+    {
+        h ^= (unsigned char)data[i];
+        h *= 16777619u;
+    }
 
-            cstr ac = vws_accept_key(key);
-            vws_buffer_printf(http, "Sec-WebSocket-Accept: %s\r\n", ac);
-            vws.free(ac);
+    // Finalize (MurmurHash3 fmix32) so that similar keys spread over the ring
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
 
-            vws_buffer_printf(http, "Sec-WebSocket-Version: 13\r\n");
-            vws_buffer_printf(http, "Sec-WebSocket-Protocol: ");
+    return h;
+}
 
-            if (proto != NULL)
-            {
-                vws_buffer_printf(http, "%s\r\n", proto);
-            }
-            else
-            {
-                vws_buffer_printf(http, "vrtql\r\n");
-            }
+static int msg_svr_route_point_cmp(const void* a, const void* b)
+{
+    uint32_t x = ((msg_svr_route_point*)a)->hash;
+    uint32_t y = ((msg_svr_route_point*)b)->hash;
+
+    return (x > y) - (x < y);
+}
 
-            vws_buffer_printf(http, "\r\n");
+vrtql_msg_route* msg_svr_route_sync(vrtql_msg_svr* server)
+{
+    vws_tcp_svr* tcp   = (vws_tcp_svr*)server;
+    vrtql_msg_route* r = server->route;
 
-            // Package up response
-            vws_svr_data* reply;
-            reply = vws_svr_data_new(cnx->server, cnx->cid, &http);
+    if ((r != NULL) && (r->version == tcp->peers_version))
+    {
+        return r;
+    }
 
-            // Send directly out as we are in uv_thread()
-            cnx->server->on_data_out(reply, NULL);
+    if (r == NULL)
+    {
+        r = vws.malloc(sizeof(vrtql_msg_route));
+        memset(r, 0, sizeof(vrtql_msg_route));
+        server->route = r;
+    }
 
-            // Cleanup. Buffer data was passed to reply.
-            vws_buffer_free(http);
+    size_t size               = tcp->peers->used;
+    uint16_t replicas         = server->route_replicas;
+    msg_svr_route_peer* peers = NULL;
+    msg_svr_route_point* ring = NULL;
 
-            //> Change state to WebSocket mode
+    if (replicas == 0)
+    {
+        replicas = 1;
+    }
 
-            // Set the flag that we are in WebSocket mode
-            cnx->upgraded = true;
+    if (size > 0)
+    {
+        peers = vws.malloc(sizeof(msg_svr_route_peer) * size);
+        ring  = vws.malloc(sizeof(msg_svr_route_point) * size * replicas);
+    }
 
-            // Free HTTP request as we don't need it anymore
-            vws_http_msg_free(cnx->http);
-            cnx->http = NULL;
+    for (size_t i = 0; i < size; i++)
+    {
+        vws_peer* peer   = (vws_peer*)tcp->peers->array[i].value.data;
+        peers[i].peer    = peer;
+        peers[i].backlog = NULL;
 
-            // Do we have any data in the socket after consuming the HTTP
-            // request? We shouldn't but if so this is WebSocket data.
-            if (c->base.buffer->size == 0)
+        // Keep the backlog of a peer which is still present
+        for (size_t j = 0; j < r->size; j++)
+        {
+            if (r->peers[j].peer == peer)
             {
-                // No more data in the socket buffer. Done for now.
-                return;
+                peers[i].backlog    = r->peers[j].backlog;
+                r->peers[j].backlog = NULL;
             }
         }
-        else
+
+        // Points depend only on the peer address so that all servers with the
+        // same peers agree on the ring
+        for (uint16_t k = 0; k < replicas; k++)
         {
-            // No complete HTTP request yet
-            return;
+            char key[300];
+            int n = snprintf( key, sizeof(key), "%s:%i#%u",
+                              peer->host, peer->port, k );
+
+            msg_svr_route_point* p = &ring[i * replicas + k];
+            p->hash                = msg_svr_route_hash(key, n);
+            p->index               = i;
         }
+    }
 
-        // If we get here, we have a complete request and we have incoming
-        // WebSocket data to process (c->base.buffer->size > 0)
+    if (size > 0)
+    {
+        qsort( ring, size * replicas, sizeof(msg_svr_route_point),
+               msg_svr_route_point_cmp );
     }
 
-    if (vws_cnx_ingress(c) > 0)
+    // Backlogs of removed peers are dropped
+    for (size_t j = 0; j < r->size; j++)
     {
-        // Process as many messages as possible
-        while (true)
-        {
-            // Check for a complete message
-            vws_msg* wsm = vws_msg_pop(c);
+        vrtql_msg_batch_free(r->peers[j].backlog);
+    }
 
-            if (wsm == NULL)
-            {
-                return;
-            }
+    vws.free(r->peers);
+    vws.free(r->ring);
 
-            // Pass message pointer in block
-            vws_svr_data* block;
-            block = vws_svr_data_own( cnx->server,
-                                      cnx->cid,
-                                      (ucstr)wsm,
-                                      sizeof(vws_msg*) );
-            queue_push(&cnx->server->requests, block);
-        }
+    r->peers   = peers;
+    r->size    = size;
+    r->ring    = ring;
+    r->points  = size * replicas;
+    r->version = tcp->peers_version;
+
+    return r;
+}
+
+void msg_svr_route_free(vrtql_msg_svr* server)
+{
+    vrtql_msg_route* r = server->route;
+
+    if (r == NULL)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < r->size; i++)
+    {
+        vrtql_msg_batch_free(r->peers[i].backlog);
     }
+
+    vws.free(r->peers);
+    vws.free(r->ring);
+    vws.free(r);
+
+    server->route = NULL;
 }
 
-// Runs in worker_thread()
-void ws_svr_client_data_in(vws_svr_data* block, void* x)
+void msg_svr_route_out(vrtql_msg_svr* server, vws_svr_data* data)
 {
-    //> Append data to connection buffer
+    vws_tcp_svr* tcp   = (vws_tcp_svr*)server;
+    vrtql_msg_route* r = msg_svr_route_sync(server);
+    uint32_t hash      = (uint32_t)data->cid.key;
 
-    vws_cid_t cid   = block->cid;
-    vws_svr* server = (vws_svr*)block->server;
+    if (r->points == 0)
+    {
+        goto lost;
+    }
 
-    // If this is a HTTP request
-    if (vws_is_flag(&block->flags, VWS_SVR_STATE_HTTP))
+    // Find the first point at or after hash, wrapping around
+    size_t lo = 0;
+    size_t hi = r->points;
+
+    while (lo < hi)
     {
-        // Data simply contains a pointer to a websocket message
-        vws_http_msg* req = (vws_http_msg*)block->data;
+        size_t mid = lo + (hi - lo) / 2;
 
-        // Free incoming data
-        block->data = NULL;
-        block->size = 0;
-        vws_svr_data_free(block);
+        if (r->ring[mid].hash < hash)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
 
-        // Process message
-        if (server->process_http(server, cid, req, x) == false)
+    msg_svr_route_peer* rp = &r->peers[r->ring[lo % r->points].index];
+    vws_peer* peer         = rp->peer;
+
+    if (peer->state == VWS_PEER_CONNECTED)
+    {
+        // Backlog goes out first
+        if (rp->backlog != NULL)
         {
-            // If processing function returns false, we close connection.
-            vws_tcp_svr_close((vws_tcp_svr*)server, cid);
+            msg_svr_peer_connect(peer->info.cnx, peer);
         }
 
-        // Since we take ownership of message to we must up clean up.
-        vws_http_msg_free(req);
+        // Send as batch item on the peer connection
+        data->cid = peer->info.cid;
+        vws_clear_flag(&data->flags, VWS_SVR_STATE_ROUTE);
+        vws_set_flag(&data->flags, VWS_SVR_STATE_BATCH);
+        msg_svr_client_data_out(data, NULL);
 
         return;
     }
 
-    // If this is a peer which needs connecting
-    if (vws_is_flag(&block->flags, VWS_SVR_STATE_PEER_CONNECT))
+    // Hold until the peer reconnects
+    if (rp->backlog == NULL)
     {
-        // Data simply contains a pointer to a websocket message
-        vws_peer* peer = (vws_peer*)block->data;
+        rp->backlog = vrtql_msg_batch_new(0, 0);
+    }
 
-        // Free incoming data
-        block->data = NULL;
-        block->size = 0;
-        vws_svr_data_free(block);
+    if (rp->backlog->buffer->size + data->size <= server->route_backlog)
+    {
+        vrtql_msg_batch_append(rp->backlog, (ucstr)data->data, data->size);
+        vws_svr_data_free(data);
 
-        // Resolve
-        struct sockaddr_storage* addr = &peer->info.cid.addr;
-        if (svr_resolve(peer->host, peer->port, &addr) == false)
-        {
-            vws.error( VL_WARN,
-                       "vws_tcp_svr_peer_add(): "
-                       "Failed to resolve host %s:%lu",
-                       peer->host, peer->port );
+        return;
+    }
 
-            // Set state back to closed
-            peer->state = VWS_PEER_CLOSED;
+lost:
 
-            return;
-        }
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace(VL_INFO, "msg_svr_route_out(): no route");
+    }
 
-        // Connect
-        if (vws_tcp_svr_peer_connect((vws_tcp_svr*)server, peer) == false)
-        {
-            // Set state back to closed
-            peer->state = VWS_PEER_CLOSED;
-        }
-        else
+    if (tcp->data_lost_cb != NULL)
+    {
+        tcp->data_lost_cb(data, NULL);
+    }
+    else
+    {
+        vws_svr_data_free(data);
+    }
+}
+
+void msg_svr_peer_connect(vws_svr_cnx* c, vws_peer* p)
+{
+    vrtql_msg_svr* server = (vrtql_msg_svr*)c->server;
+
+    if (server->route == NULL)
+    {
+        // Nothing routed yet
+        return;
+    }
+
+    vrtql_msg_route* r = msg_svr_route_sync(server);
+
+    for (size_t i = 0; i < r->size; i++)
+    {
+        msg_svr_route_peer* rp = &r->peers[i];
+
+        if ((rp->peer != p) || (rp->backlog == NULL))
         {
-            // Set state back to connected. uv_thread() will add it to
-            // connection pool.
-            peer->state = VWS_PEER_RECONNECTED;
+            continue;
         }
 
-        // We don't need to send message back regarding this request, but we do
-        // need the server to wakeup and realize that this peer connection state
-        // has changed and needs to be attended to.
-        uv_async_send(((vws_tcp_svr*)server)->wakeup);
+        // Anything batched ahead of the backlog goes first
+        msg_svr_batch_flush(c);
 
-        return;
+        // Send the backlog as the connection's batch
+        vrtql_msg_batch_free(c->batch);
+        c->batch            = rp->backlog;
+        c->batch->max_size  = server->route_batch_size;
+        c->batch->max_delay = server->route_batch_delay;
+        rp->backlog         = NULL;
+
+        msg_svr_batch_flush(c);
     }
+}
 
-    // Data simply contains a pointer to a websocket message
-    vws_msg* wsm = (vws_msg*)block->data;
+static void msg_svr_route_hold_item(ucstr data, size_t size, void* x)
+{
+    msg_svr_route_hold* h = (msg_svr_route_hold*)x;
+    vrtql_msg_svr* server = (vrtql_msg_svr*)h->cnx->server;
+    vrtql_msg_batch* b    = h->rp->backlog;
 
-    // Free incoming data
-    block->data = NULL;
-    block->size = 0;
-    vws_svr_data_free(block);
+    if (b->buffer->size + size <= server->route_backlog)
+    {
+        vrtql_msg_batch_append(b, data, size);
 
-    //> Process connection buffer data for complete messages
-    server->on_msg_in(server, cid, wsm, x);
+        return;
+    }
+
+    if (vws.tracelevel >= VT_SERVICE)
+    {
+        vws.trace(VL_INFO, "msg_svr_peer_lost(): backlog full");
+    }
+
+    // Over the limit, same as msg_svr_route_out()
+    svr_batch_lost_item(data, size, h->cnx);
 }
 
-void ws_svr_client_data_out( vws_svr* server,
-                             vws_cid_t cid,
-                             vws_buffer* buffer,
-                             unsigned char opcode )
+void msg_svr_peer_lost(vws_svr_cnx* c, vws_peer* p)
 {
-    // Create a binary websocket frame containing message
-    vws_frame* frame;
-    ucstr data  = buffer->data;
-    size_t size = buffer->size;
-    frame       = vws_frame_new(data, size, opcode);
+    vrtql_msg_svr* server = (vrtql_msg_svr*)c->server;
 
-    // This frame is from server to we don't mask it
-    frame->mask = 0;
+    if ((c->batch == NULL) || (c->batch->count == 0))
+    {
+        return;
+    }
 
-    // Serialize frame: frame is freed by function
-    vws_buffer* fdata = vws_serialize(frame);
+    vrtql_msg_route* r = msg_svr_route_sync(server);
 
-    // Pack frame binary into queue data
-    vws_svr_data* response;
+    for (size_t i = 0; i < r->size; i++)
+    {
+        msg_svr_route_peer* rp = &r->peers[i];
 
-    response = vws_svr_data_new((vws_tcp_svr*)server, cid, &fdata);
+        if (rp->peer != p)
+        {
+            continue;
+        }
 
-    // Queue the data to uv_thread() to send out on wire
-    vws_tcp_svr_send(response);
+        if (rp->backlog == NULL)
+        {
+            rp->backlog = vrtql_msg_batch_new(0, 0);
+        }
 
-    // Free buffers
-    vws_buffer_free(fdata);
+        // Unsent messages go back to the backlog, after anything already in
+        // it, and are sent when the peer reconnects.
+        msg_svr_route_hold h = { c, rp };
+        svr_batch_each(c->batch, msg_svr_route_hold_item, &h);
+    }
 }
 
-void ws_svr_client_msg_in(vws_svr* s, vws_cid_t c, vws_msg* m, void* x)
+// Process incoming VRTQL messages
+void msg_svr_client_process(vws_svr* s, vws_cid_t c, vrtql_msg* m, void* x)
 {
-    vws_svr* server = (vws_svr*)s;
-
-    // Route to application-specific processing callback
-    server->process_ws(server, c, m, x);
+    // Default: Do nothing. Drop message.
+    vrtql_msg_free(m);
 }
 
-void ws_svr_client_process(vws_svr* s, vws_cid_t c, vws_msg* m, void* x)
+vrtql_msg_svr* vrtql_msg_svr_new(int num_threads, int backlog, int queue_size)
 {
-    // Default: Do nothing. Drop message.
-    vws_msg_free(m);
+    vrtql_msg_svr* server = vws.malloc(sizeof(vrtql_msg_svr));
+    return vrtql_msg_svr_ctor(server, num_threads, backlog, queue_size);
 }
 
-void ws_svr_client_msg_out(vws_svr* s, vws_cid_t c, vws_msg* m, void* x)
+void vrtql_msg_svr_free(vrtql_msg_svr* server)
 {
-    ws_svr_client_data_out(s, c, m->data, m->opcode);
-    vws_msg_free(m);
+    vrtql_msg_svr_dtor(server);
 }
 
-void ws_svr_ctor(vws_svr* server, int nt, int bl, int qs)
+vrtql_msg_svr*
+vrtql_msg_svr_ctor(vrtql_msg_svr* server, int threads, int backlog, int qsize)
 {
-    tcp_svr_ctor((vws_tcp_svr*)server, nt, bl, qs);
+    ws_svr_ctor((vws_svr*)server, threads, backlog, qsize);
 
     // Server base function overrides
-    server->base.on_connect    = ws_svr_client_connect;
-    server->base.on_disconnect = ws_svr_client_disconnect;
-    server->base.on_read       = ws_svr_client_read;
-    server->base.on_data_in    = ws_svr_client_data_in;
+    server->base.process_ws       = msg_svr_client_ws_msg_in;
+    server->base.base.on_data_out = msg_svr_client_data_out;
+    server->base.base.on_peer_connect = msg_svr_peer_connect;
+    server->base.base.on_peer_lost    = msg_svr_peer_lost;
 
     // Message handling
-    server->on_msg_in          = ws_svr_client_msg_in;
-    server->on_msg_out         = ws_svr_client_msg_out;
-
-    // HTTP handlers
-    server->on_http_read       = ws_svr_on_http_read;
-    server->process_http       = NULL;
+    server->on_msg_in       = msg_svr_client_msg_in;
+    server->on_msg_out      = msg_svr_client_msg_out;
 
     // Application functions
-    server->process_ws         = ws_svr_client_process;
-    server->send               = ws_svr_client_msg_out;
-}
+    server->process        = msg_svr_client_process;
+    server->send           = msg_svr_client_msg_out;
+    server->dispatch       = msg_svr_client_msg_dispatch;
+
+    // Batching (off)
+    server->batch_size     = 0;
+    server->batch_delay    = 0;
+
+    // Peer routing
+    server->route_replicas    = 64;
+    server->route_batch_size  = 65536;
+    server->route_batch_delay = 1000;
+    server->route_backlog     = 1024 * 1024;
+    server->route             = NULL;
+
+    // User-defined data
+    server->data         = NULL;
 
-vws_svr* vws_svr_new(int num_threads, int backlog, int queue_size)
-{
-    vws_svr* server = vws.malloc(sizeof(vws_svr));
-    ws_svr_ctor(server, num_threads, backlog, queue_size);
     return server;
 }
 
-void ws_svr_dtor(vws_svr* server)
+void vrtql_msg_svr_dtor(vrtql_msg_svr* server)
 {
     if (server == NULL)
     {
         return;
     }
 
-    tcp_svr_dtor((vws_tcp_svr*)server);
+    ws_svr_dtor((vws_svr*)server);
+    msg_svr_route_free(server);
+    vws.free(server);
 }
 
-void vws_svr_free(vws_svr* server)
+//------------------------------------------------------------------------------
+// RPC Server: Derived from Messaging Server
+//------------------------------------------------------------------------------
+
+// Runs in worker_thread()
+void* rpc_svr_worker_ctor(void* data)
 {
-    if (server == NULL)
+    vrtql_rpc_svr* server = (vrtql_rpc_svr*)data;
+
+    vrtql_rpc_svr_worker* w = vws.malloc(sizeof(vrtql_rpc_svr_worker));
+    w->server               = server;
+    w->env.data             = NULL;
+    w->env.module           = NULL;
+    w->env.reply            = vrtql_msg_new();
+    w->latency              = NULL;
+    w->slots                = 0;
+    uv_mutex_init(&w->lock);
+
+    if (server->env_ctor != NULL)
     {
-        return;
+        w->env.data = server->env_ctor(server->env_ctor_data);
     }
 
-    ws_svr_dtor(server);
-    vws.free(server);
-}
+    uv_mutex_lock(&server->lock);
+    sc_queue_add_last(&server->workers, w);
+    uv_mutex_unlock(&server->lock);
 
-//------------------------------------------------------------------------------
-// Messaging Server: Derived from WebSocket server
-//------------------------------------------------------------------------------
+    return w;
+}
 
-// Convert incoming WebSocket messages to VRTQL messages for processing
-void msg_svr_client_ws_msg_in(vws_svr* s, vws_cid_t cid, vws_msg* wsm, void* x)
+// Runs in worker_thread()
+void rpc_svr_worker_dtor(void* data)
 {
-    // Deserialize message
+    vrtql_rpc_svr_worker* w = (vrtql_rpc_svr_worker*)data;
 
-    vrtql_msg* msg = vrtql_msg_new(HTTP_REQUEST);
-    ucstr data     = wsm->data->data;
-    size_t size    = wsm->data->size;
+    // The environment does not outlive the thread but statistics do. The
+    // server frees the rest.
 
-    if (vrtql_msg_deserialize(msg, data, size) == false)
+    if (w->server->env_dtor != NULL)
     {
-        // Deserialized failed
+        w->server->env_dtor(w->env.data);
+    }
 
-        // Error already set
-        vws_msg_free(wsm);
-        vrtql_msg_free(msg);
+    w->env.data = NULL;
 
-        vws_tcp_svr_close((vws_tcp_svr*)s, cid);
+    vrtql_msg_free(w->env.reply);
+    w->env.reply = NULL;
+}
 
-        return;
-    }
+void rpc_svr_worker_record(vrtql_rpc_svr_worker* w, uint32_t slot, uint64_t usec)
+{
+    uv_mutex_lock(&w->lock);
 
-    // Deserialized succeeded
+    if (slot >= w->slots)
+    {
+        uint32_t slots = slot + 1;
+        w->latency     = vws.realloc(w->latency, sizeof(vws_hist*) * slots);
 
-    // TODO: We send back the format we get. More than that, a request with
-    // different format effectively changes the entire connection default format
-    // setting.
-    //
-    // cnx->format = msg->format;
+        for (uint32_t i = w->slots; i < slots; i++)
+        {
+            w->latency[i] = NULL;
+        }
 
-    // Free websocket message
-    vws_msg_free(wsm);
+        w->slots = slots;
+    }
 
-    // Process message
-    vrtql_msg_svr* server = (vrtql_msg_svr*)s;
-    server->on_msg_in(s, cid, msg, x);
-}
+    if (w->latency[slot] == NULL)
+    {
+        w->latency[slot] = vws_hist_new();
+    }
 
-// Receive/handle incoming VRTQL messages
-void msg_svr_client_msg_in(vws_svr* s, vws_cid_t c, vrtql_msg* m, void* x)
-{
-    vrtql_msg_svr* server = (vrtql_msg_svr*)s;
+    vws_hist_add(w->latency[slot], usec);
 
-    // Route to application-specific processing callback
-    server->process(s, c, m, x);
+    uv_mutex_unlock(&w->lock);
 }
 
-// Send VRTQL messages
-void msg_svr_client_msg_out(vws_svr* s, vws_cid_t c, vrtql_msg* m, void* x)
+// Runs in worker_thread()
+void rpc_svr_client_process(vws_svr* s, vws_cid_t c, vrtql_msg* m, void* x)
 {
-    // Serialize message
-    vws_buffer* mdata = vrtql_msg_serialize(m);
+    vrtql_rpc_svr* server   = (vrtql_rpc_svr*)s;
+    vrtql_rpc_svr_worker* w = (vrtql_rpc_svr_worker*)x;
+    uint64_t start          = vws_clock_usec();
+    vrtql_rpc_entry* entry  = NULL;
+    vrtql_msg* reply        = NULL;
 
-    // Send to base class
-    ws_svr_client_data_out(s, c, mdata, BINARY_FRAME);
+    cstr id = vrtql_msg_get_header(m, "id");
 
-    // Cleanup
-    vws_buffer_free(mdata);
-    vrtql_msg_free(m);
-}
+    if (id != NULL)
+    {
+        entry = vrtql_rpc_system_lookup(server->system, id);
+    }
 
-// Send VRTQL messages
-void msg_svr_client_msg_dispatch(vws_svr* s, vws_cid_t c, vrtql_msg* m, void* x)
-{
-    // Serialize message
-    vws_buffer* mdata = vrtql_msg_serialize(m);
+    if (entry != NULL)
+    {
+        vws.success();
+        w->env.module = entry->module;
+        reply         = entry->call(&w->env, m);
+    }
+    else
+    {
+        // Tell client the call does not exist
+        char rc[16];
+        snprintf(rc, sizeof(rc), "%i", VE_RT);
 
-    // Send to base class
-    ws_svr_client_data_out(s, c, mdata, BINARY_FRAME);
+        reply = vrtql_rpc_env_reply(&w->env, m);
+        vrtql_msg_set_header(reply, "rc", rc);
+        vrtql_msg_set_header(reply, "msg", "RPC does not exist");
+    }
 
-    // Cleanup
-    vws_buffer_free(mdata);
-}
+    if (reply != NULL)
+    {
+        // Serializes without freeing so we can reuse the environment's reply
+        server->base.dispatch(s, c, reply, x);
+
+        if (reply != w->env.reply)
+        {
+            vrtql_msg_free(reply);
+        }
+    }
 
-// Process incoming VRTQL messages
-void msg_svr_client_process(vws_svr* s, vws_cid_t c, vrtql_msg* m, void* x)
-{
-    // Default: Do nothing. Drop message.
     vrtql_msg_free(m);
+
+    if (entry != NULL)
+    {
+        rpc_svr_worker_record(w, entry->slot, vws_clock_usec() - start);
+    }
 }
 
-vrtql_msg_svr* vrtql_msg_svr_new(int num_threads, int backlog, int queue_size)
+vrtql_rpc_svr* vrtql_rpc_svr_new( vrtql_rpc_system* system,
+                                  int num_threads,
+                                  int backlog,
+                                  int queue_size )
 {
-    vrtql_msg_svr* server = vws.malloc(sizeof(vrtql_msg_svr));
-    return vrtql_msg_svr_ctor(server, num_threads, backlog, queue_size);
+    vrtql_rpc_svr* server = vws.malloc(sizeof(vrtql_rpc_svr));
+
+    return vrtql_rpc_svr_ctor(server, system, num_threads, backlog, queue_size);
 }
 
-void vrtql_msg_svr_free(vrtql_msg_svr* server)
+void vrtql_rpc_svr_free(vrtql_rpc_svr* server)
 {
-    vrtql_msg_svr_dtor(server);
+    vrtql_rpc_svr_dtor(server);
 }
 
-vrtql_msg_svr*
-vrtql_msg_svr_ctor(vrtql_msg_svr* server, int threads, int backlog, int qsize)
+vrtql_rpc_svr* vrtql_rpc_svr_ctor( vrtql_rpc_svr* server,
+                                   vrtql_rpc_system* system,
+                                   int threads,
+                                   int backlog,
+                                   int qsize )
 {
-    ws_svr_ctor((vws_svr*)server, threads, backlog, qsize);
+    vrtql_msg_svr_ctor((vrtql_msg_svr*)server, threads, backlog, qsize);
 
-    // Server base function overrides
-    server->base.process_ws = msg_svr_client_ws_msg_in;
+    // Message server function overrides
+    server->base.process = rpc_svr_client_process;
 
-    // Message handling
-    server->on_msg_in       = msg_svr_client_msg_in;
-    server->on_msg_out      = msg_svr_client_msg_out;
+    // One RPC environment per worker
+    vws_tcp_svr* tcp      = (vws_tcp_svr*)server;
+    tcp->worker_ctor      = rpc_svr_worker_ctor;
+    tcp->worker_ctor_data = server;
+    tcp->worker_dtor      = rpc_svr_worker_dtor;
 
-    // Application functions
-    server->process        = msg_svr_client_process;
-    server->send           = msg_svr_client_msg_out;
-    server->dispatch       = msg_svr_client_msg_dispatch;
+    server->system        = system;
+    server->env_ctor      = NULL;
+    server->env_ctor_data = NULL;
+    server->env_dtor      = NULL;
+    server->data          = NULL;
 
-    // User-defined data
-    server->data         = NULL;
+    sc_queue_init(&server->workers);
+    uv_mutex_init(&server->lock);
 
     return server;
 }
 
-void vrtql_msg_svr_dtor(vrtql_msg_svr* server)
+void vrtql_rpc_svr_dtor(vrtql_rpc_svr* server)
 {
     if (server == NULL)
     {
         return;
     }
 
-    ws_svr_dtor((vws_svr*)server);
-    vws.free(server);
+    vrtql_rpc_svr_worker* w;
+    sc_queue_foreach(&server->workers, w)
+    {
+        for (uint32_t i = 0; i < w->slots; i++)
+        {
+            vws_hist_free(w->latency[i]);
+        }
+
+        vws.free(w->latency);
+        uv_mutex_destroy(&w->lock);
+        vws.free(w);
+    }
+
+    sc_queue_term(&server->workers);
+    uv_mutex_destroy(&server->lock);
+
+    vrtql_msg_svr_dtor((vrtql_msg_svr*)server);
+}
+
+vws_hist* vrtql_rpc_svr_latency(vrtql_rpc_svr* server, cstr id)
+{
+    vrtql_rpc_entry* entry = vrtql_rpc_system_lookup(server->system, id);
+
+    if (entry == NULL)
+    {
+        return NULL;
+    }
+
+    vws_hist* h = vws_hist_new();
+
+    uv_mutex_lock(&server->lock);
+
+    vrtql_rpc_svr_worker* w;
+    sc_queue_foreach(&server->workers, w)
+    {
+        uv_mutex_lock(&w->lock);
+
+        if ((entry->slot < w->slots) && (w->latency[entry->slot] != NULL))
+        {
+            vws_hist_merge(h, w->latency[entry->slot]);
+        }
+
+        uv_mutex_unlock(&w->lock);
+    }
+
+    uv_mutex_unlock(&server->lock);
+
+    return h;
 }
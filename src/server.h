@@ -5,6 +5,7 @@
 
 #include "vws.h"
 #include "message.h"
+#include "rpc.h"
 #include "http_message.h"
 
 /**
@@ -188,7 +189,11 @@ typedef enum
     VWS_SVR_STATE_PEER         = (1 << 13),
     VWS_SVR_STATE_HTTP         = (1 << 14),
     VWS_SVR_STATE_PEER_CONNECT = (1 << 15),
-    VWS_SVR_STATE_TRUSTED      = (1 << 16)
+    VWS_SVR_STATE_TRUSTED      = (1 << 16),
+    VWS_SVR_STATE_BATCH        = (1 << 17),
+    VWS_SVR_STATE_ROUTE        = (1 << 18),
+    VWS_SVR_STATE_PRIORITY     = (1 << 19),
+    VWS_SVR_STATE_IRQ          = (1 << 20)
 } vws_svr_state_flags_t;
 
 /** Connection ID. This is the index within the address pool that the
@@ -252,12 +257,48 @@ typedef struct vws_peer
     struct vws_cinfo info;
     vws_peer_state_t state;
     int sockfd;
+
+    /**< Blocking connect function, run on a worker thread. If NULL, the server
+     *   connects asynchronously on its loop (see path). */
     vws_peer_connect connect;
+
+    /**< Request path for the built-in websocket handshake. Defaults to "/". */
+    cstr path;
+
+    /**< Built-in connect in progress, NULL otherwise. Internal. */
+    void* pending;
+
     void* data;
 } vws_peer;
 
 struct vws_tcp_svr;
 
+/**
+ * @brief Monotonic timestamps (vws_clock_usec()) of the stages data passes
+ * through on its way from socket to worker and back. A stage that has not
+ * occurred is zero. Responses inherit the ingress and dequeued stamps of the
+ * request being processed by the worker that sends them, so end-to-end latency
+ * can be measured on the response.
+ */
+typedef struct
+{
+    /**< Read from socket by the network thread */
+    uint64_t ingress;
+
+    /**< Taken off the request queue by a worker */
+    uint64_t dequeued;
+
+    /**< Put on the response queue by vws_tcp_svr_send() */
+    uint64_t enqueued;
+
+    /**< Handed to the socket by the network thread */
+    uint64_t dispatched;
+
+    /**< Write to socket completed */
+    uint64_t written;
+
+} vws_svr_stamps;
+
 /**
  * @brief Struct representing server data for inter-thread communication
  * between the main network thread and worker threads. This is the way data is
@@ -283,28 +324,70 @@ typedef struct
     /**< Reference to server this data belongs to */
     struct vws_tcp_svr* server;
 
+    /**< Stage timestamps */
+    vws_svr_stamps stamps;
+
 } vws_svr_data;
 
+/**
+ * @brief Server queue lanes, highest priority first. Data is placed in a lane
+ * by its VWS_SVR_STATE_IRQ and VWS_SVR_STATE_PRIORITY flags, in either the
+ * data or its cid. Marking a connection's cid (e.g. in cnx_open_cb()) thus puts
+ * all of its traffic in that lane. VRTQL messages flagged VM_MSG_IRQ or
+ * VM_MSG_PRIORITY are sent in the corresponding lane.
+ */
+typedef enum
+{
+    VWS_SVR_LANE_IRQ      = 0,
+    VWS_SVR_LANE_PRIORITY = 1,
+    VWS_SVR_LANE_BULK     = 2,
+    VWS_SVR_LANES         = 3
+} vws_svr_lane_t;
+
+/**
+ * @brief A FIFO ring buffer within a server queue
+ */
+typedef struct
+{
+    /**< The buffer holding data in the lane */
+    vws_svr_data** buffer;
+
+    /**< Current size of the lane */
+    int size;
+
+    /**< Head position of the lane */
+    int head;
+
+    /**< Tail position of the lane */
+    int tail;
+
+} vws_svr_lane;
+
 /**
  * @brief Struct representing a server queue, including information about
  * buffer, size, capacity, and threading.
+ *
+ * Data is popped from the highest priority lane holding any. So that bulk
+ * traffic is never starved completely, a lower lane which has been passed over
+ * quota times in a row gets the next turn. Each lane ages separately, and if
+ * several are due the highest of them goes first.
  */
 typedef struct
 {
-    /**< The buffer holding data in the queue */
-    vws_svr_data** buffer;
+    /**< The lanes, indexed by vws_svr_lane_t */
+    vws_svr_lane lanes[VWS_SVR_LANES];
 
-    /**< Current size of the queue */
+    /**< Current size of the queue (all lanes) */
     int size;
 
-    /**< Maximum capacity of the queue */
+    /**< Maximum capacity of each lane */
     int capacity;
 
-    /**< Head position of the queue */
-    int head;
+    /**< Pops a waiting lower lane may be passed over. Default 16. */
+    int quota;
 
-    /**< Tail position of the queue */
-    int tail;
+    /**< Per lane: pops which have passed over it while waiting, in a row */
+    int passed[VWS_SVR_LANES];
 
     /**< Mutex for thread safety */
     uv_mutex_t mutex;
@@ -322,6 +405,9 @@ typedef struct
 
 struct vws_tcp_svr;
 
+/** Timing wheel slot of a connection that is not on the wheel */
+#define VWS_SVR_WHEEL_NONE UINT32_MAX
+
 /**
  * @brief Represents a client connection.
  */
@@ -333,13 +419,22 @@ typedef struct vws_svr_cnx
     /**< The client associated with the connection */
     uv_stream_t* handle;
 
-    /* Flag holds the HTTP request that started connection. */
+    /* The HTTP request being parsed. Allocated when request data arrives and
+     * NULL otherwise. */
     vws_http_msg* http;
 
     /** Flag that holds whether we have upgraded connection from HTTP to
      *  WebSockets */
     bool upgraded;
 
+    /** Flag set while an HTTP request is with a worker. Requests pipelined
+     *  behind it wait in the buffer, so responses go out in request order. */
+    bool http_busy;
+
+    /** Flag to close the connection after the pending HTTP response because
+     *  the request did not ask for keep-alive */
+    bool http_close;
+
     /** Index in connection address pool */
     vws_cid_t cid;
 
@@ -351,6 +446,42 @@ typedef struct vws_svr_cnx
      */
     vrtql_msg_format_t format;
 
+    /**< Outgoing message batch (vrtql_msg_svr batching). NULL until used. */
+    vrtql_msg_batch* batch;
+
+    /**< Timer which flushes batch on deadline. NULL until used. */
+    uv_timer_t* batch_timer;
+
+    /**< Static file being sent, NULL otherwise. Internal. */
+    void* sendfile;
+
+    /** Flag set once the connection is past its protocol handshake: for
+     *  vws_svr the first complete HTTP request or the WebSocket upgrade, for
+     *  a plain vws_tcp_svr the first read. Until then handshake_timeout
+     *  applies. */
+    bool established;
+
+    /**< Loop time (ms) the connection was accepted */
+    uint64_t opened;
+
+    /**< Loop time (ms) data was last read */
+    uint64_t active;
+
+    /**< Loop time (ms) the last keepalive probe was sent */
+    uint64_t pinged;
+
+    /**< Next connection in the same timing wheel slot. Internal. */
+    struct vws_svr_cnx* wheel_next;
+
+    /**< Previous connection in the same timing wheel slot. Internal. */
+    struct vws_svr_cnx* wheel_prev;
+
+    /**< Timing wheel slot, VWS_SVR_WHEEL_NONE if not on it. Internal. */
+    uint32_t wheel_slot;
+
+    /**< io_uring state if the ring does the I/O, NULL otherwise. Internal. */
+    void* ring;
+
 } vws_svr_cnx;
 
 /**
@@ -434,6 +565,12 @@ typedef void (*vws_tcp_svr_connect)(vws_svr_cnx* c);
  */
 typedef void (*vws_tcp_svr_disconnect)(vws_svr_cnx* c);
 
+/**
+ * @brief Callback to probe an idle connection
+ * @param c The connection structure
+ */
+typedef void (*vws_tcp_svr_ping)(vws_svr_cnx* c);
+
 /**
  * @brief Callback for connection read
  * @param c The connection structure
@@ -442,6 +579,13 @@ typedef void (*vws_tcp_svr_disconnect)(vws_svr_cnx* c);
  */
 typedef void (*vws_tcp_svr_read)(vws_svr_cnx* c, ssize_t n, const uv_buf_t* b);
 
+/**
+ * @brief Callback for an established peer connection
+ * @param c The connection structure
+ * @param p The peer
+ */
+typedef void (*vws_tcp_svr_peer)(vws_svr_cnx* c, vws_peer* p);
+
 /**
  * @brief Callback for data processing within a worker thread
  * @param s The server instance
@@ -468,6 +612,191 @@ typedef enum
 /** Abbreviation for the connection map */
 typedef struct sc_map_64v vws_svr_cnx_map;
 
+/**
+ * @brief Hashed timing wheel for connection timeouts. Slot i holds the
+ * connections due in ticks congruent to i modulo the wheel size. One timer
+ * advances it each tick, so the work per tick depends on the connections due
+ * in that slot, not on how many are open. Reads only stamp the connection.
+ * When its slot comes up, a connection that is not yet due moves to the slot
+ * of its new deadline.
+ */
+typedef struct
+{
+    /**< Advances the wheel every tick while it runs */
+    uv_timer_t* timer;
+
+    /**< Connection lists, one per slot. NULL until the wheel runs. */
+    struct vws_svr_cnx** slots;
+
+    /**< Number of slots, a power of two. Default 512. */
+    uint32_t size;
+
+    /**< Tick length in milliseconds, the timeout resolution. Default 100. */
+    uint32_t tick;
+
+    /**< Loop time (ms) of tick 0 */
+    uint64_t start;
+
+    /**< Last tick processed */
+    uint64_t current;
+
+} vws_svr_wheel;
+
+/**
+ * @brief Socket options for the listening socket and the connections it
+ * accepts. Set them before vws_tcp_svr_run().
+ */
+typedef struct
+{
+    /**< Disable Nagle's algorithm (TCP_NODELAY) on accepted connections so
+     *   small replies go out at once rather than waiting for the ACK of the
+     *   previous segment. Default true. */
+    bool nodelay;
+
+    /**< Seconds of silence before TCP keepalive probes start on accepted
+     *   connections. 0 (default) disables. */
+    uint32_t keepalive;
+
+    /**< Receive buffer size (SO_RCVBUF) in bytes. It is set on the listener,
+     *   so accepted connections inherit it from the start. 0 (default) keeps
+     *   the system default. */
+    int rcvbuf;
+
+    /**< Send buffer size (SO_SNDBUF) in bytes, set like rcvbuf. 0 (default)
+     *   keeps the system default. */
+    int sndbuf;
+
+    /**< Seconds the kernel may hold a new connection until its first data
+     *   arrives (TCP_DEFER_ACCEPT), saving a wakeup per connection. Linux
+     *   only. 0 (default) disables. */
+    uint32_t defer_accept;
+
+    /**< Allow several queued accepts at once (uv_tcp_simultaneous_accepts).
+     *   Only has an effect on Windows. Default true. */
+    bool simultaneous_accepts;
+
+    /**< When the host is an IPv6 address, accept only IPv6 connections.
+     *   Default false, which on "::" also accepts IPv4. */
+    bool ipv6only;
+
+} vws_svr_sockopts;
+
+/**
+ * @brief How a server does the I/O of the connections it accepts
+ */
+typedef enum
+{
+    /**< libuv: a read per readiness event, a write per response (default) */
+    VWS_SVR_BACKEND_UV,
+
+    /**< io_uring: multishot receive into kernel-provided buffers, and the
+     *   sends of each loop iteration submitted in one system call. Linux
+     *   only. Where the kernel does not support it, the server falls back to
+     *   VWS_SVR_BACKEND_UV. */
+    VWS_SVR_BACKEND_URING
+
+} vws_svr_backend_t;
+
+/**
+ * @brief Server metrics. Counters are cumulative unless marked as gauges.
+ */
+typedef enum
+{
+    /**< Connections opened (accepted or peer) */
+    VWS_METRIC_CNX_OPENED,
+
+    /**< Connections closed */
+    VWS_METRIC_CNX_CLOSED,
+
+    /**< Connections closed by the idle or handshake timeout */
+    VWS_METRIC_CNX_TIMEOUTS,
+
+    /**< Keepalive pings sent to idle connections */
+    VWS_METRIC_PINGS,
+
+    /**< Bytes read from sockets */
+    VWS_METRIC_BYTES_IN,
+
+    /**< Bytes written to sockets */
+    VWS_METRIC_BYTES_OUT,
+
+    /**< WebSocket frames received */
+    VWS_METRIC_FRAMES_IN,
+
+    /**< WebSocket frames sent */
+    VWS_METRIC_FRAMES_OUT,
+
+    /**< WebSocket messages received */
+    VWS_METRIC_MSGS_IN,
+
+    /**< WebSocket messages sent */
+    VWS_METRIC_MSGS_OUT,
+
+    /**< Requests taken from the request queue by workers */
+    VWS_METRIC_REQUESTS,
+
+    /**< Responses taken from the response queue by the network thread */
+    VWS_METRIC_RESPONSES,
+
+    /**< Gauge: bytes handed to the socket but not yet written */
+    VWS_METRIC_WRITE_BACKLOG,
+
+    /**< Gauge: items in the request queue (snapshots only) */
+    VWS_METRIC_REQUEST_DEPTH,
+
+    /**< Gauge: items in the response queue (snapshots only) */
+    VWS_METRIC_RESPONSE_DEPTH,
+
+    /**< Number of metrics */
+    VWS_METRIC_COUNT
+
+} vws_svr_metric_t;
+
+/**
+ * @brief Latency stages, measured between vws_svr_stamps.
+ */
+typedef enum
+{
+    /**< Request queue wait: ingress to dequeued */
+    VWS_STAGE_REQUEST_WAIT,
+
+    /**< Handler: dequeued to enqueued (per response sent) */
+    VWS_STAGE_HANDLER,
+
+    /**< Response queue wait: enqueued to dispatched */
+    VWS_STAGE_RESPONSE_WAIT,
+
+    /**< Socket write: dispatched to written */
+    VWS_STAGE_WRITE,
+
+    /**< End to end: ingress to written */
+    VWS_STAGE_TOTAL,
+
+    /**< Number of stages */
+    VWS_STAGE_COUNT
+
+} vws_svr_stage_t;
+
+/**
+ * @brief Server metrics block. The server keeps one per thread so that
+ * counters are not shared between cores: element 0 belongs to the network
+ * thread and one to each worker. Counters are updated with relaxed atomic
+ * operations and may be read at any time. vws_tcp_svr_metrics() sums all
+ * blocks into a snapshot of the same type.
+ */
+typedef struct
+{
+    /**< Counters, indexed by vws_svr_metric_t */
+    uint64_t counters[VWS_METRIC_COUNT];
+
+    /**< Stage latency in microseconds, indexed by vws_svr_stage_t */
+    vws_hist stages[VWS_STAGE_COUNT];
+
+    /**< Protects the histograms. Not used in snapshots. */
+    uv_mutex_t lock;
+
+} vws_svr_metrics;
+
 /**
  * @brief Struct representing a basic server. It does not do anything but
  * process raw data. It does not have any knowledge of WebSockets.
@@ -510,6 +839,17 @@ typedef struct vws_tcp_svr
     /**< Callback function for reading incoming data */
     vws_tcp_svr_read on_read;
 
+    /**< Callback function probing idle connections. See ping_interval. */
+    vws_tcp_svr_ping on_ping;
+
+    /**< Callback function for peer connect, called once the connection is in
+     *   the pool and the peer is VWS_PEER_CONNECTED */
+    vws_tcp_svr_peer on_peer_connect;
+
+    /**< Callback function for peer loss, called before the connection of a
+     *   VWS_PEER_CONNECTED peer is freed */
+    vws_tcp_svr_peer on_peer_lost;
+
     /**< Function for processing data from the client */
     vws_tcp_svr_process_data on_data_in;
 
@@ -552,11 +892,79 @@ typedef struct vws_tcp_svr
     /**< A map peer connections */
     vws_kvs* peers;
 
-    /**< The next wakeup time to check peer connections */
-    uint32_t peer_timeout;
+    /**< Incremented whenever a peer is added or removed */
+    uint32_t peers_version;
+
+    /**< The next wakeup time to check peer connections (loop time, msec) */
+    uint64_t peer_timeout;
 
     /**< The peer timer */
     uv_timer_t* peer_timer;
+
+    /**< Timeout in milliseconds for built-in peer connects, from resolve to
+     *   completed handshake. Default 10000. */
+    int peer_connect_timeout;
+
+    /**< Per-thread metrics: element 0 is the network thread, the rest are
+     *   assigned to worker threads as they start. */
+    vws_svr_metrics* metrics;
+
+    /**< Number of elements in metrics */
+    int metrics_size;
+
+    /**< Next metrics element to assign to a worker thread */
+    int metrics_next;
+
+    /**< Reusable HTTP request parsers. The network thread takes them and
+     *   whichever thread finishes with a request returns them. */
+    vws_http_msg** http_pool;
+
+    /**< Number of parsers in http_pool */
+    size_t http_pooled;
+
+    /**< Maximum number of pooled parsers. Default 64, 0 disables pooling. */
+    size_t http_pool_size;
+
+    /**< Guards http_pool */
+    uv_mutex_t http_lock;
+
+    /**< Milliseconds a connection may go without incoming data before it is
+     *   closed. Connections with an HTTP request in progress are exempt. 0
+     *   (default) disables. Set before vws_tcp_svr_run(). */
+    uint32_t idle_timeout;
+
+    /**< Milliseconds a new connection has to get past its handshake (see
+     *   vws_svr_cnx.established) before it is closed. 0 (default) disables.
+     *   Set before vws_tcp_svr_run(). */
+    uint32_t handshake_timeout;
+
+    /**< Milliseconds an established connection may go without incoming data
+     *   before on_ping probes it, and between probes. A reply counts as
+     *   incoming data, so keep this below idle_timeout. 0 (default) disables.
+     *   Set before vws_tcp_svr_run(). */
+    uint32_t ping_interval;
+
+    /**< Timing wheel for the timeouts above. Runs only if one is set. */
+    vws_svr_wheel wheel;
+
+    /**< Listening and accepted socket options */
+    vws_svr_sockopts sockopts;
+
+    /**< I/O backend for accepted connections. Set before vws_tcp_svr_run(),
+     *   which resets it to VWS_SVR_BACKEND_UV if the requested one is not
+     *   available. Peer connections always use libuv. */
+    vws_svr_backend_t backend;
+
+    /**< Connections the io_uring completion queue is sized for. Each busy
+     *   connection may have a receive, a send and a cancel completing between
+     *   two reaps. Completions beyond that are held by the kernel and still
+     *   delivered, only more slowly. Set before vws_tcp_svr_run(). Default
+     *   4096. */
+    uint32_t ring_connections;
+
+    /**< io_uring state while the backend is VWS_SVR_BACKEND_URING. Internal. */
+    void* ring;
+
 } vws_tcp_svr;
 
 /**
@@ -619,7 +1027,7 @@ void vws_tcp_svr_wakeup(vws_tcp_svr* s);
  * @brief Starts a VRTQL server.
  *
  * @param server The server to run.
- * @param host The host to bind the server.
+ * @param host The host to bind the server, an IPv4 or IPv6 address.
  * @param port The port to bind the server.
  * @return 0 if successful, an error code otherwise.
  */
@@ -701,12 +1109,46 @@ void vws_tcp_svr_stop(vws_tcp_svr* server);
  */
 uint8_t vws_tcp_svr_state(vws_tcp_svr* s);
 
+/**
+ * @brief Takes a snapshot of server metrics, summing counters and merging
+ * histograms across all threads. This may be called from any thread at any
+ * time.
+ *
+ * @param s The server
+ * @return A new metrics snapshot. Caller must free with vws_svr_metrics_free().
+ */
+vws_svr_metrics* vws_tcp_svr_metrics(vws_tcp_svr* s);
+
+/**
+ * @brief Frees a metrics snapshot.
+ *
+ * @param m The snapshot
+ */
+void vws_svr_metrics_free(vws_svr_metrics* m);
+
+/**
+ * @brief Renders a metrics snapshot in the Prometheus text exposition format.
+ * Counters and gauges are prefixed with "vws_". Stage latency histograms are
+ * rendered as summaries in seconds.
+ *
+ * @param m The snapshot
+ * @return A new buffer holding the text. Caller must free.
+ */
+vws_buffer* vws_svr_metrics_prometheus(vws_svr_metrics* m);
+
 /**
  * @brief Add a peer
  *
+ * The server keeps the peer connected, reconnecting whenever it drops. If fn
+ * is given, it is called on a worker thread to make the connection. If fn is
+ * NULL, the server makes a websocket connection itself without blocking: name
+ * resolution, connect and handshake all run on the server loop, so any number
+ * of unreachable peers costs no worker threads.
+ *
  * @param s The server
  * @param h The host name or IP address
  * @param p The host port
+ * @param fn Connect function, or NULL for the built-in connect
  * @param d User-defined data
  *
  * @return Returns pointer to peer on success was added, NULL otherwise.
@@ -795,7 +1237,13 @@ typedef void
 typedef int (*vws_svr_http_read)(vws_svr_cnx* c);
 
 /**
- * @brief Callback to process a complete HTTP request on connection
+ * @brief Callback to process a complete HTTP request on connection. Runs in a
+ *   worker thread. The response may be sent before or after this returns, from
+ *   any thread. The next request pipelined on the connection is held until the
+ *   request is complete: vws_svr_http_reply() completes it, as does data sent
+ *   with vws_tcp_svr_send() flagged VWS_SVR_STATE_HTTP, or a call to
+ *   vws_svr_http_done(). A request which is never completed stalls the
+ *   connection.
  * @param s The server
  * @param c The connection ID
  * @param m The message
@@ -808,6 +1256,90 @@ typedef bool (*vws_svr_process_http_req)( struct vws_svr* s,
                                   vws_http_msg* msg,
                                   void* x );
 
+/**
+ * @brief Callback to answer a complete HTTP request on the network thread,
+ *   skipping the round trip through the worker queues. Meant for simple routes
+ *   whose response is cheap to build. It must not block. Headers may be
+ *   borrowed from the read buffer (see vws_http_msg_header()) and are only
+ *   valid during the call. Called from uv_thread().
+ * @param s The server
+ * @param m The request
+ * @param out The buffer to write the response to, e.g. with
+ *   vws_http_response()
+ * @return Returns true if the request was answered, false to pass it on to
+ *   process_http.
+ */
+typedef bool (*vws_svr_inline_http)( struct vws_svr* s,
+                                     vws_http_msg* m,
+                                     vws_buffer* out );
+
+/**
+ * @brief An open file in the static file cache.
+ */
+typedef struct vws_svr_file
+{
+    /**< Path relative to the root. The cache key. */
+    char* path;
+
+    /**< Open file descriptor */
+    uv_file fd;
+
+    /**< Size in bytes */
+    uint64_t size;
+
+    /**< Modification time in nanoseconds */
+    uint64_t mtime;
+
+    /**< Inode, to tell when the file is replaced */
+    uint64_t ino;
+
+    /**< Entity tag, quoted */
+    char etag[40];
+
+    /**< Content type */
+    cstr type;
+
+    /**< Responses using the file. It is closed once unused and stale. */
+    int refs;
+
+    /**< Loop time of the last check against the file system, msec */
+    uint64_t checked;
+
+    /** Flag set once the file is no longer in the cache */
+    bool stale;
+
+} vws_svr_file;
+
+/**
+ * @brief Static file serving for a vws_svr. See vws_svr_static(). Only used by
+ * uv_thread().
+ */
+typedef struct vws_svr_files
+{
+    /**< URL path prefix, without trailing slash */
+    char* prefix;
+
+    /**< Length of prefix */
+    size_t prefix_size;
+
+    /**< Directory files are served from, without trailing slash */
+    char* root;
+
+    /**< File served for paths ending in a slash. Default "index.html". */
+    cstr index;
+
+    /**< Open files by path */
+    vws_kvs* cache;
+
+    /**< Maximum number of open files in the cache. Default 256. */
+    size_t cache_size;
+
+    /**< Milliseconds a cached file is served before its metadata is checked
+     *   again. Default 1000. */
+    uint32_t ttl;
+
+} vws_svr_files;
+
 /**
  * @brief Struct representing a WebSocket server. It speaks the WebSocket
  * protocol and processes both WebSocket frames and messages.
@@ -826,9 +1358,17 @@ typedef struct vws_svr
     /**< Callback function HTTP read (not websocket upgrade) */
     vws_svr_http_read on_http_read;
 
-    /**< Callback function HTTP request (not websocket upgrade) */
+    /**< Callback function HTTP request (not websocket upgrade). Its final
+     *   response completes the request, see vws_svr_process_http_req. */
     vws_svr_process_http_req process_http;
 
+    /**< Optional callback answering HTTP requests on the network thread.
+     *   Requests it declines go to process_http. */
+    vws_svr_inline_http inline_http;
+
+    /**< Static file serving, NULL if none. See vws_svr_static(). */
+    vws_svr_files* files;
+
     /**< Function for processing an incoming message */
     vws_svr_process_msg on_msg_in;
 
@@ -872,6 +1412,72 @@ void vws_svr_free(vws_svr* s);
  */
 int vws_svr_run(vws_svr* server, cstr host, int port);
 
+/**
+ * @brief Sends the response to an HTTP request, adding "Connection: close" if
+ * the request did not ask for keep-alive. The server closes such connections
+ * once the response is written. This completes the request. Called from
+ * process_http or, for a deferred response, any other thread.
+ *
+ * @param s The server
+ * @param c The connection ID
+ * @param m The HTTP request
+ * @param status The status code
+ * @param headers Additional header lines, each terminated by CRLF, or NULL
+ * @param body The body, or NULL
+ * @param size The size of the body
+ */
+void vws_svr_http_reply( vws_svr* s,
+                         vws_cid_t c,
+                         vws_http_msg* m,
+                         uint16_t status,
+                         cstr headers,
+                         ucstr body,
+                         size_t size );
+
+/**
+ * @brief Completes the HTTP request being processed on a connection, once all
+ * of its response has been sent with vws_tcp_svr_send(). Releases the next
+ * pipelined request, or closes the connection if the request did not ask for
+ * keep-alive. Not needed after vws_svr_http_reply() or when the final data is
+ * flagged VWS_SVR_STATE_HTTP. May be called from any thread.
+ *
+ * @param s The server
+ * @param c The connection ID
+ */
+void vws_svr_http_done(vws_svr* s, vws_cid_t c);
+
+/**
+ * @brief Serves the files under a directory over HTTP.
+ *
+ * GET and HEAD requests whose path starts with prefix are answered on the
+ * network thread and never reach the worker pool. The file is sent with
+ * sendfile() from the libuv thread pool, so its data is not copied through the
+ * server. Open files and their metadata are cached. Responses carry an ETag,
+ * and requests whose If-None-Match matches it get 304 Not Modified. Paths
+ * containing ".." are rejected. Call before running the server. Not available
+ * on Windows.
+ *
+ * @param s The server
+ * @param prefix The URL path prefix, e.g. "/static". "/" serves all paths.
+ * @param root The directory to serve
+ * @return Returns true on success, false if root is not a directory or on
+ *   Windows.
+ */
+bool vws_svr_static(vws_svr* s, cstr prefix, cstr root);
+
+/**
+ * @brief HTTP request handler serving server metrics to Prometheus. Assign it
+ * to process_http to expose GET /metrics, or call it from an application
+ * handler. Other requests are answered with 404 Not Found.
+ *
+ * @param s The server
+ * @param c The connection ID
+ * @param m The HTTP request
+ * @param x The user-defined context
+ * @return Returns true (the connection remains open).
+ */
+bool vws_svr_metrics_http(vws_svr* s, vws_cid_t c, vws_http_msg* m, void* x);
+
 //------------------------------------------------------------------------------
 // Messaging Server
 //------------------------------------------------------------------------------
@@ -911,6 +1517,36 @@ typedef struct vrtql_msg_svr
     /**< Derived: does all that send() does but does NOT clean up message. */
     vrtql_svr_process_msg dispatch;
 
+    /**< Outgoing message batching. If non-zero, MessagePack messages sent by
+     * send()/dispatch() are accumulated per connection and written as a single
+     * batch envelope (see vrtql_msg_batch) once batch_size bytes are pending or
+     * the oldest message is batch_delay microseconds old. Default 0 (off). */
+    size_t batch_size;
+
+    /**< Maximum time in microseconds a message waits in a batch. The deadline
+     * timer has millisecond resolution so it is rounded up. */
+    uint32_t batch_delay;
+
+    /**< Routing: points each peer has on the consistent hash ring. More points
+     * spread keys more evenly. Default 64. */
+    uint16_t route_replicas;
+
+    /**< Routing: batch_size used for peer connections in place of batch_size.
+     * Default 65536. */
+    size_t route_batch_size;
+
+    /**< Routing: batch_delay used for peer connections in place of
+     * batch_delay. Default 1000. */
+    uint32_t route_batch_delay;
+
+    /**< Routing: maximum bytes held for a disconnected peer until it
+     * reconnects. Routed messages beyond this are passed to data_lost_cb().
+     * Default 1 MB. */
+    size_t route_backlog;
+
+    /**< Routing state. Internal, only used in uv_thread(). */
+    struct vrtql_msg_route* route;
+
     /**< User-defined data */
     void* data;
 
@@ -977,6 +1613,157 @@ void vrtql_msg_svr_dtor(vrtql_msg_svr* s);
  */
 int vrtql_msg_svr_run(vrtql_msg_svr* server, cstr host, int port);
 
+/**
+ * @brief Routes a message to a peer by routing key.
+ *
+ * The peer is chosen by consistent hashing of the key over the server's peers
+ * (see vws_tcp_svr_peer_add()), so all messages with the same key go to the
+ * same peer, and adding or removing a peer only moves the keys of that peer.
+ * Messages are batched per peer (see route_batch_size). While the peer is
+ * disconnected, messages are held in a backlog of up to route_backlog bytes
+ * and sent once it reconnects. Messages which cannot be held, or for which
+ * there is no peer, are passed to data_lost_cb() with VWS_SVR_STATE_ROUTE set.
+ *
+ * This is thread-safe and is normally called from process(). JSON messages are
+ * sent as MessagePack.
+ *
+ * @param s The server
+ * @param key The routing key
+ * @param m The message. The function takes ownership.
+ * @return True if the message was queued, false if it could not be serialized.
+ *
+ * @ingroup ServerFunctions
+ */
+bool vrtql_msg_svr_route(vrtql_msg_svr* s, cstr key, vrtql_msg* m);
+
+//------------------------------------------------------------------------------
+// RPC Server
+//------------------------------------------------------------------------------
+
+/**
+ * @brief Per-worker state of an RPC server. One is constructed for each worker
+ * thread (via the worker_ctor) and passed as the context to process().
+ */
+struct vrtql_rpc_svr;
+
+typedef struct vrtql_rpc_svr_worker
+{
+    /**< The server the worker belongs to */
+    struct vrtql_rpc_svr* server;
+
+    /**< The RPC environment passed to every call run by this worker. Its data
+     *   member holds the result of the server's env_ctor, and its reply member
+     *   is reused for every reply built with vrtql_rpc_env_reply(). */
+    vrtql_rpc_env env;
+
+    /**< Call latency in microseconds, indexed by vrtql_rpc_entry slot. Entries
+     *   are NULL until a call has run. */
+    vws_hist** latency;
+
+    /**< Number of elements in latency */
+    uint32_t slots;
+
+    /**< Protects latency. Only contended while statistics are collected. */
+    uv_mutex_t lock;
+
+} vrtql_rpc_svr_worker;
+
+/**
+ * @brief Struct representing an RPC server. It is derived from the message
+ * server and dispatches each incoming message to a vrtql_rpc_system by its "id"
+ * header, sending back the reply. Unknown calls are answered with "rc" and
+ * "msg" headers describing the error. Call latency is recorded per method.
+ *
+ * The system must be fully built before the server is started. It is read by
+ * worker threads without locking.
+ */
+typedef struct vrtql_rpc_svr
+{
+    /**< Base class */
+    struct vrtql_msg_svr base;
+
+    /**< The RPC system calls are dispatched to. Not owned by the server. */
+    vrtql_rpc_system* system;
+
+    /**< Environment constructor: called in each worker thread on startup. Its
+     *   return value is stored in the worker's env.data. Optional. */
+    vws_thread_ctx_ctor env_ctor;
+
+    /**< Environment constructor data passed to env_ctor */
+    void* env_ctor_data;
+
+    /**< Environment destructor: called with env.data on worker exit */
+    vws_thread_ctx_dtor env_dtor;
+
+    /**< Worker states. Kept after workers exit so statistics survive stop. */
+    struct sc_queue_ptr workers;
+
+    /**< Protects workers */
+    uv_mutex_t lock;
+
+    /**< User-defined data */
+    void* data;
+
+} vrtql_rpc_svr;
+
+/**
+ * @brief Creates a new RPC server.
+ *
+ * @param system The RPC system to dispatch calls to
+ * @param pool_size The number of threads to run in the worker pool
+ * @param backlog The connection backlog for listen(). If this is set to 0, it
+ *   will use the default (128).
+ * @param queue_size The maximum queue size for requests and responses. If this
+ *   is set to 0, it will use the default (1024).
+ * @return A new RPC server.
+ */
+vrtql_rpc_svr* vrtql_rpc_svr_new( vrtql_rpc_system* system,
+                                  int pool_size,
+                                  int backlog,
+                                  int queue_size );
+
+/**
+ * @brief Frees the resources allocated to an RPC server. The RPC system is not
+ * freed.
+ *
+ * @param s The server to free.
+ */
+void vrtql_rpc_svr_free(vrtql_rpc_svr* s);
+
+/**
+ * @brief RPC server instance constructor
+ *
+ * @param server The server instance to be initialized
+ * @return The initialized server instance
+ *
+ * @ingroup ServerFunctions
+ */
+vrtql_rpc_svr* vrtql_rpc_svr_ctor( vrtql_rpc_svr* server,
+                                   vrtql_rpc_system* system,
+                                   int num_threads,
+                                   int backlog,
+                                   int queue_size );
+
+/**
+ * @brief RPC server instance destructor
+ *
+ * @param server The RPC server instance to be destructed
+ *
+ * @ingroup ServerFunctions
+ */
+void vrtql_rpc_svr_dtor(vrtql_rpc_svr* s);
+
+/**
+ * @brief Collects the latency histogram of a call across all workers. This may
+ * be called while the server is running.
+ *
+ * @param s The RPC server
+ * @param id The call name in the form "module.function"
+ * @return A new histogram of call latency in microseconds, or NULL if the call
+ *         does not exist. Caller must free with vws_hist_free().
+ */
+vws_hist* vrtql_rpc_svr_latency(vrtql_rpc_svr* s, cstr id);
+
 #ifdef __cplusplus
 }
 #endif
@@ -5,6 +5,7 @@
 #include <poll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #endif
 
 #if defined(__windows__)
@@ -60,6 +61,18 @@ static bool socket_set_timeout(int fd, int sec);
  */
 static void socket_abnormal_close(vws_socket* c);
 
+/**
+ * @brief Sends data directly to the socket, bypassing the cork buffer.
+ *
+ * @param c The socket
+ * @param data The data to send
+ * @param size The size of data
+ * @return The number of bytes sent, or -1 on error.
+ *
+ * @ingroup SocketFunctions
+ */
+static ssize_t socket_send(vws_socket* c, ucstr data, size_t size);
+
 //------------------------------------------------------------------------------
 //> Socket API
 //------------------------------------------------------------------------------
@@ -82,6 +95,9 @@ vws_socket* vws_socket_ctor(vws_socket* s)
     s->hs         = NULL;
     s->disconnect = NULL;
     s->flush      = true;
+    s->out        = NULL;
+    s->cork       = 0;
+    s->rsize      = VWS_SOCKET_READ_SIZE;
 
     return s;
 }
@@ -103,6 +119,12 @@ void vws_socket_dtor(vws_socket* s)
     // Free receive buffer
     vws_buffer_free(s->buffer);
 
+    // Free cork buffer
+    if (s->out != NULL)
+    {
+        vws_buffer_free(s->out);
+    }
+
     if (s->sockfd >= 0)
     {
         close(s->sockfd);
@@ -267,6 +289,30 @@ bool vws_socket_is_connected(vws_socket* c)
     return c->sockfd > -1;
 }
 
+bool vws_socket_ssl_init()
+{
+    if (vws_is_flag(&vws.state, CNX_SSL_INIT) == false)
+    {
+        SSL_library_init();
+        RAND_poll();
+        SSL_load_error_strings();
+
+        vws_ssl_ctx = SSL_CTX_new(TLS_method());
+
+        if (vws_ssl_ctx == NULL)
+        {
+            vws.error(VE_SYS, "Failed to create new SSL context");
+            return false;
+        }
+
+        SSL_CTX_set_options(vws_ssl_ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
+
+        vws_set_flag(&vws.state, CNX_SSL_INIT);
+    }
+
+    return true;
+}
+
 bool vws_socket_connect(vws_socket* c, cstr host, int port, bool ssl)
 {
     if (c == NULL)
@@ -281,21 +327,10 @@ bool vws_socket_connect(vws_socket* c, cstr host, int port, bool ssl)
 
     if (ssl == true)
     {
-        if (vws_is_flag(&vws.state, CNX_SSL_INIT) == false)
+        if (vws_socket_ssl_init() == false)
         {
-            SSL_library_init();
-            RAND_poll();
-            SSL_load_error_strings();
-
-            vws_ssl_ctx = SSL_CTX_new(TLS_method());
-
-            if (vws_ssl_ctx == NULL)
-            {
-                vws.error(VE_SYS, "Failed to create new SSL context");
-                return false;
-            }
-
-            SSL_CTX_set_options(vws_ssl_ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
+            // Error already set
+            return false;
         }
 
         c->ssl = SSL_new(vws_ssl_ctx);
@@ -306,8 +341,6 @@ bool vws_socket_connect(vws_socket* c, cstr host, int port, bool ssl)
             vws_socket_close(c);
             return false;
         }
-
-        vws_set_flag(&vws.state, CNX_SSL_INIT);
     }
 
     char port_str[20];
@@ -381,6 +414,9 @@ void vws_socket_disconnect(vws_socket* c)
         return;
     }
 
+    // Send anything still corked
+    vws_socket_flush(c);
+
     vws_socket_close(c);
 
     vws.success();
@@ -404,9 +440,21 @@ ssize_t vws_socket_read(vws_socket* c)
         return -1;
     }
 
+    // Corked data must go out before waiting on a reply to it
+    if ((c->out != NULL) && (c->out->size > 0))
+    {
+        if (vws_socket_flush(c) < 0)
+        {
+            return -1;
+        }
+    }
+
     struct pollfd fds;
     int poll_events = POLLIN;
 
+    // Running total, as we may make multiple reads
+    ssize_t total = 0;
+
 openssl_reread:
 
     #if defined(__linux__) || defined(__bsd__) || defined(__sunos__)
@@ -451,158 +499,234 @@ openssl_reread:
 
     if (rc == 0)
     {
-        vws.error(VE_TIMEOUT, "poll()");
-        return 0;
+        if (total == 0)
+        {
+            vws.error(VE_TIMEOUT, "poll()");
+        }
+
+        return total;
     }
 
-    ssize_t      n = 0;
-    ucstr data   = &vws.sslbuf[0];
-    ssize_t size = sizeof(vws.sslbuf);
+    ssize_t n     = 0;
+    vws_buffer* b = c->buffer;
 
     if (fds.revents & poll_events)
     {
         if (c->ssl != NULL)
         {
-            // We need running total bc we may make multiple SSL_read() calls.
-            int total = 0;
-
-            // Drain all data from SSL buffer
-            while ((n = SSL_read(c->ssl, data, size)) > 0)
+            // Drain all data from SSL buffer, reading directly into the
+            // connection buffer.
+            while (true)
             {
-                // Process received data stored in buf
-                total += n;
-                vws_buffer_append(c->buffer, data, n);
+                unsigned char* space = vws_buffer_reserve(b, c->rsize);
 
-                if (n < size)
+                if ((n = SSL_read(c->ssl, space, (int)c->rsize)) <= 0)
                 {
-                    // All available data has been read, break the loop.
                     break;
                 }
+
+                b->size += n;
+                total   += n;
             }
 
             // Check for error conditions
-            if (n <= 0)
+            int err = SSL_get_error(c->ssl, n);
+
+            if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ)
             {
-                int err = SSL_get_error(c->ssl, n);
+                // SSL needs to do something on socket in order to continue.
 
-                if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ)
+                // If it wants to read data
+                if (err == SSL_ERROR_WANT_READ)
                 {
-                    // SSL needs to do something on socket in order to continue.
-
-                    // If it wants to read data
-                    if (err == SSL_ERROR_WANT_READ)
+                    // We are done. We have emptied the read buffer.
+                    if (total == 0)
                     {
-                        // We are done. We have emptied the read buffer.
-                        return total;
+                        vws.error(VE_TIMEOUT, "SSL_read()");
                     }
 
-                    // If it wants to write data
-                    if (err == SSL_ERROR_WANT_WRITE)
-                    {
-                        // It's doing some internal negotiation and we need to
-                        // help it along by running poll() for writes. Then we
-                        // will return to SSL_read() in which SSL will send out
-                        // the data it needs to.
-                        poll_events = POLLOUT;
-                        goto openssl_reread;
-                    }
+                    return total;
                 }
-                else if (err == SSL_ERROR_SYSCALL)
+
+                // If it wants to write data
+                if (err == SSL_ERROR_WANT_WRITE)
                 {
-                    #if defined(__windows__)
+                    // It's doing some internal negotiation and we need to
+                    // help it along by running poll() for writes. Then we
+                    // will return to SSL_read() in which SSL will send out
+                    // the data it needs to.
+                    poll_events = POLLOUT;
+                    goto openssl_reread;
+                }
+            }
+            else if (err == SSL_ERROR_SYSCALL)
+            {
+                #if defined(__windows__)
 
-                    int err = WSAGetLastError();
+                int err = WSAGetLastError();
 
-                    if (err == WSAEWOULDBLOCK || err == WSAEINPROGRESS)
+                if (err == WSAEWOULDBLOCK || err == WSAEINPROGRESS)
+                {
+                    if (total == 0)
                     {
                         vws.error(VE_TIMEOUT, "SSL_read()");
-                        return 0;
                     }
 
-                    #else
+                    return total;
+                }
+
+                #else
 
-                    if ((errno == EWOULDBLOCK) || (errno == EAGAIN))
+                if ((errno == EWOULDBLOCK) || (errno == EAGAIN))
+                {
+                    if (total == 0)
                     {
                         vws.error(VE_TIMEOUT, "SSL_read()");
-                        return 0;
                     }
 
-                    #endif
+                    return total;
                 }
 
-                // Get the latest OpenSSL error
-                char buf[256];
-                unsigned long ssl_err = ERR_get_error();
-                ERR_error_string_n(ssl_err, buf, sizeof(buf));
-                vws.error(VE_SOCKET, "SSL_read() failed: %s", buf);
-
-                // Close socket
-                socket_abnormal_close(c);
+                #endif
+            }
 
-                return -1;
+            // Hand over what was read. The error recurs on the next read.
+            if (total > 0)
+            {
+                return total;
             }
+
+            // Get the latest OpenSSL error
+            char buf[256];
+            unsigned long ssl_err = ERR_get_error();
+            ERR_error_string_n(ssl_err, buf, sizeof(buf));
+            vws.error(VE_SOCKET, "SSL_read() failed: %s", buf);
+
+            // Close socket
+            socket_abnormal_close(c);
+
+            return -1;
         }
         else
         {
-            // Non-SSL socket is readable, perform recv() operation
-            #if defined(__linux__) || defined(__sunos__)
-            n = recv(c->sockfd, data, size, MSG_NOSIGNAL);
-            #else
-            n = recv(c->sockfd, data, size, 0);
-            #endif
-
-            if (n == 0)
+            // Drain the socket: read until it would block, directly into the
+            // free space of the connection buffer.
+            while (true)
             {
-                vws.error(VE_SOCKET, "disconnect");
+                unsigned char* space = vws_buffer_reserve(b, c->rsize);
+                size_t room          = b->allocated - b->size;
+                size_t want          = room;
 
-                // Close socket
-                socket_abnormal_close(c);
+                #if defined(__windows__)
 
-                return -1;
-            }
+                n = recv(c->sockfd, space, room, 0);
+
+                #else
+
+                // Anything beyond the free space overflows into the thread
+                // buffer, so a short read reliably means the socket is empty
+                // and we can skip the final EAGAIN call.
+                struct iovec iov[2];
+                iov[0].iov_base = space;
+                iov[0].iov_len  = room;
+                iov[1].iov_base = vws.sslbuf;
+                iov[1].iov_len  = sizeof(vws.sslbuf);
+                want           += sizeof(vws.sslbuf);
+
+                n = readv(c->sockfd, iov, 2);
+
+                #endif
+
+                if (n > 0)
+                {
+                    total += n;
+
+                    if ((size_t)n <= room)
+                    {
+                        b->size += n;
+                    }
+                    else
+                    {
+                        b->size += room;
+                        vws_buffer_append(b, vws.sslbuf, n - room);
+                    }
+
+                    if ((size_t)n < want)
+                    {
+                        // Drained
+                        break;
+                    }
+
+                    continue;
+                }
+
+                if (n == 0)
+                {
+                    // Hand over what was read. EOF recurs on the next read.
+                    if (total > 0)
+                    {
+                        break;
+                    }
+
+                    vws.error(VE_SOCKET, "disconnect");
+
+                    // Close socket
+                    socket_abnormal_close(c);
+
+                    return -1;
+                }
 
-            if (n <= -1)
-            {
                 #if defined(__windows__)
+
                 int err = WSAGetLastError();
 
                 if (err == WSAEWOULDBLOCK || err == WSAEINPROGRESS)
                 {
-                    vws.error(VE_TIMEOUT, "recv()");
-                    return 0;
+                    break;
                 }
 
+                char buf[256];
+                snprintf(buf, sizeof(buf), "WSA error %i", err);
+
                 #else
 
-                if ((errno == EWOULDBLOCK) || (errno == EAGAIN))
+                if (errno == EINTR)
                 {
-                    vws.error(VE_TIMEOUT, "recv()");
-                    return 0;
+                    continue;
                 }
-                else
+
+                if ((errno == EWOULDBLOCK) || (errno == EAGAIN))
                 {
-                    // Error
-                    char buf[256];
-                    strerror_r(errno, buf, sizeof(buf));
-                    vws.error(VE_WARN, "recv() failed: %s", buf);
+                    break;
+                }
 
-                    // Close socket
-                    socket_abnormal_close(c);
+                char buf[256];
+                strerror_r(errno, buf, sizeof(buf));
 
-                    return -1;
-                }
                 #endif
+
+                // Hand over what was read. The error recurs on the next read.
+                if (total > 0)
+                {
+                    break;
+                }
+
+                vws.error(VE_WARN, "recv() failed: %s", buf);
+
+                // Close socket
+                socket_abnormal_close(c);
+
+                return -1;
             }
 
-            // Should always be true if we get here
-            if (n > 0)
+            if (total == 0)
             {
-                vws_buffer_append(c->buffer, data, n);
+                vws.error(VE_TIMEOUT, "recv()");
             }
         }
     }
 
-    return n;
+    return total;
 }
 
 ssize_t vws_socket_write(vws_socket* c, const ucstr data, size_t size)
@@ -623,6 +747,79 @@ ssize_t vws_socket_write(vws_socket* c, const ucstr data, size_t size)
         return -1;
     }
 
+    if (c->cork == 0)
+    {
+        return socket_send(c, data, size);
+    }
+
+    vws_buffer_append(c->out, data, size);
+
+    if (c->out->size >= c->cork)
+    {
+        if (vws_socket_flush(c) < 0)
+        {
+            return -1;
+        }
+    }
+
+    // All buffered data is accepted
+    return size;
+}
+
+bool vws_socket_cork(vws_socket* c, size_t threshold)
+{
+    c->cork = threshold;
+
+    if (threshold > 0)
+    {
+        if (c->out == NULL)
+        {
+            c->out = vws_buffer_new();
+        }
+
+        return true;
+    }
+
+    // Uncorked: send what is left
+    if (vws_socket_is_connected(c) == false)
+    {
+        return true;
+    }
+
+    return vws_socket_flush(c) >= 0;
+}
+
+ssize_t vws_socket_flush(vws_socket* c)
+{
+    if ((c->out == NULL) || (c->out->size == 0))
+    {
+        return 0;
+    }
+
+    // Sends are all or nothing while flushing, regardless of c->flush
+    bool flush = c->flush;
+    c->flush   = true;
+    ssize_t n  = socket_send(c, c->out->data, c->out->size);
+    c->flush   = flush;
+
+    if (n < 0)
+    {
+        return -1;
+    }
+
+    vws_buffer_drain(c->out, n);
+
+    return n;
+}
+
+ssize_t socket_send(vws_socket* c, ucstr data, size_t size)
+{
+    if (vws_socket_is_connected(c) == false)
+    {
+        vws.error(VE_SOCKET, "vws_socket_write()");
+        return -1;
+    }
+
     // But default we will keep looping until we have sent all the data
     size_t sent     = 0;
     int poll_events = POLLOUT;
@@ -844,6 +1041,12 @@ void vws_socket_close(vws_socket* c)
 
         c->sockfd = -1;
     }
+
+    // Corked data has nowhere to go
+    if (c->out != NULL)
+    {
+        vws_buffer_clear(c->out);
+    }
 }
 
 int connect_to_host(const char* host, const char* port)
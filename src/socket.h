@@ -18,6 +18,9 @@ extern "C" {
 
 struct vws_socket;
 
+/** Default socket read size (vws_socket.rsize) */
+#define VWS_SOCKET_READ_SIZE 65536
+
 /**
  * @brief Callback for handshake on connect. This is called after socket
  * connection but before set to non-blocking. This provides a way to do basic
@@ -71,6 +74,19 @@ typedef struct vws_socket
     /** Flag to force writes to poll() until all data flushed. Default true. */
     bool flush;
 
+    /**< Minimum free space to read into per read call. Default
+     *   VWS_SOCKET_READ_SIZE. Larger values mean fewer calls for large
+     *   messages, at the cost of buffer memory per connection. */
+    size_t rsize;
+
+    /**< Output buffer used when corked. NULL until corked. */
+    vws_buffer* out;
+
+    /**< Cork threshold. When non-zero, writes are buffered in out and sent
+     *   when it reaches this size, on vws_socket_flush() or before a read.
+     *   Default 0 (writes go straight to the socket). */
+    size_t cork;
+
 } vws_socket;
 
 /**
@@ -133,6 +149,16 @@ void vws_socket_dtor(vws_socket* s);
  */
 bool vws_socket_connect(vws_socket* s, cstr host, int port, bool ssl);
 
+/**
+ * @brief Initializes OpenSSL and the client SSL context (vws_ssl_ctx) for the
+ *        calling thread if not already done.
+ *
+ * @return True if successful, false otherwise.
+ *
+ * @ingroup SocketFunctions
+ */
+bool vws_socket_ssl_init();
+
 /**
  * @brief Sets a timeout on a socket read/write operations. The default
  *        timeout is 10 seconds.
@@ -184,7 +210,9 @@ bool vws_socket_is_connected(vws_socket* s);
 void vws_socket_close(vws_socket* c);
 
 /**
- * @brief Reads data from a socket connection into a buffer
+ * @brief Reads data from a socket connection into the socket buffer. Waits
+ *        up to the socket timeout for data, then reads until the socket would
+ *        block.
  *
  * @param s The vws_socket representing the Socket connection.
  * @param data The buffer to read data into.
@@ -196,7 +224,8 @@ void vws_socket_close(vws_socket* c);
 ssize_t vws_socket_read(vws_socket* s);
 
 /**
- * @brief Writes data from a buffer to a socket
+ * @brief Writes data from a buffer to a socket. If the socket is corked (see
+ *        vws_socket_cork()), data is buffered and size is returned.
  *
  * @param s The vws_socket representing the socket
  * @param data The buffer containing the data to write.
@@ -207,6 +236,32 @@ ssize_t vws_socket_read(vws_socket* s);
  */
 ssize_t vws_socket_write(vws_socket* s, ucstr data, size_t size);
 
+/**
+ * @brief Sets corked mode. While corked, vws_socket_write() appends to an
+ *        internal buffer rather than sending, so that bursts of small writes
+ *        go out as a few large writes (and TLS records). The buffer is sent
+ *        when it reaches threshold bytes, when vws_socket_flush() is called and
+ *        before each vws_socket_read().
+ *
+ * @param s The socket
+ * @param threshold Buffered size at which data is sent. 0 uncorks the socket,
+ *        flushing anything buffered.
+ * @return True on success, false if a flush failed.
+ *
+ * @ingroup SocketFunctions
+ */
+bool vws_socket_cork(vws_socket* s, size_t threshold);
+
+/**
+ * @brief Sends all data buffered by corked mode. Does nothing if there is none.
+ *
+ * @param s The socket
+ * @return The number of bytes sent, or -1 on error.
+ *
+ * @ingroup SocketFunctions
+ */
+ssize_t vws_socket_flush(vws_socket* s);
+
 struct sockaddr;
 
 /**
@@ -0,0 +1,573 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vws.h"
+#include "websocket.h"
+#include "message.h"
+#include "rpc.h"
+
+//------------------------------------------------------------------------------
+// Codec microbenchmarks
+//
+// Measures hot primitives in isolation: websocket frame codec, VRTQL message
+// codec in each format, kvs, buffers, the handshake accept key and RPC
+// dispatch. Each case is calibrated to run for at least the minimum time, then repeated. The median is
+// reported as ns/op and, where a case has a payload, MB/s. Results print as a
+// table and can be appended to a file as JSON lines for regression tracking.
+//------------------------------------------------------------------------------
+
+#define BENCH_REPEAT 5
+
+// A benchmark case
+typedef struct bench_case
+{
+    /**< Case name */
+    cstr name;
+
+    /**< Payload bytes per operation, or 0 */
+    size_t size;
+
+    /**< Runs n operations */
+    void (*run)(struct bench_case* c, uint64_t n);
+
+    /**< Case state */
+    void* data;
+
+    /**< Prebuilt input */
+    vws_buffer* input;
+
+} bench_case;
+
+static uint64_t bench_min_time = 200000;
+static cstr bench_filter       = NULL;
+static FILE* bench_out         = NULL;
+
+// Prevents the compiler from discarding results
+static volatile uintptr_t bench_sink;
+
+//------------------------------------------------------------------------------
+// Frame codec
+//------------------------------------------------------------------------------
+
+static void bench_frame_serialize(bench_case* c, uint64_t n)
+{
+    ucstr data = (ucstr)c->data;
+
+    for (uint64_t i = 0; i < n; i++)
+    {
+        vws_frame* f  = vws_frame_new(data, c->size, BINARY_FRAME);
+        vws_buffer* b = vws_serialize(f);
+        bench_sink   += b->size;
+        vws_buffer_free(b);
+    }
+}
+
+static void bench_frame_deserialize(bench_case* c, uint64_t n)
+{
+    vws_buffer* in = c->input;
+
+    for (uint64_t i = 0; i < n; i++)
+    {
+        size_t consumed = 0;
+        vws_frame* f    = vws_frame_new(NULL, 0, BINARY_FRAME);
+        vws_deserialize(in->data, in->size, f, &consumed);
+        bench_sink     += consumed;
+        vws_frame_free(f);
+    }
+}
+
+//------------------------------------------------------------------------------
+// Message codec
+//------------------------------------------------------------------------------
+
+static vrtql_msg* bench_msg_new(size_t size, vrtql_msg_format_t format)
+{
+    vrtql_msg* m = vrtql_msg_new();
+    m->format    = format;
+
+    vrtql_msg_set_routing(m, "id", "module.call");
+    vrtql_msg_set_routing(m, "tag", "abcdefg");
+    vrtql_msg_set_header(m, "rc", "0");
+    vrtql_msg_set_header(m, "user", "bench");
+
+    // Printable content so that it is valid JSON string data
+    char* content = vws.malloc(size);
+    memset(content, 'x', size);
+    vrtql_msg_set_content_binary(m, content, size);
+    vws.free(content);
+
+    return m;
+}
+
+static void bench_msg_serialize(bench_case* c, uint64_t n)
+{
+    vrtql_msg* m = (vrtql_msg*)c->data;
+
+    for (uint64_t i = 0; i < n; i++)
+    {
+        vws_buffer* b = vrtql_msg_serialize(m);
+        bench_sink   += b->size;
+        vws_buffer_free(b);
+    }
+}
+
+static void bench_msg_deserialize(bench_case* c, uint64_t n)
+{
+    vws_buffer* in = c->input;
+
+    for (uint64_t i = 0; i < n; i++)
+    {
+        vrtql_msg* m = vrtql_msg_new();
+        bench_sink  += vrtql_msg_deserialize(m, in->data, in->size);
+        vrtql_msg_free(m);
+    }
+}
+
+//------------------------------------------------------------------------------
+// KVS
+//------------------------------------------------------------------------------
+
+#define BENCH_KEYS 8
+
+static cstr bench_keys[BENCH_KEYS] =
+{
+    "id", "tag", "rc", "msg", "user", "timestamp", "session", "trace"
+};
+
+static void bench_kvs_set(bench_case* c, uint64_t n)
+{
+    vws_kvs* kvs = (vws_kvs*)c->data;
+
+    for (uint64_t i = 0; i < n; i++)
+    {
+        if ((i % BENCH_KEYS) == 0)
+        {
+            vws_kvs_clear(kvs);
+        }
+
+        vws_kvs_set_cstring(kvs, bench_keys[i % BENCH_KEYS], "value");
+    }
+}
+
+static void bench_kvs_get(bench_case* c, uint64_t n)
+{
+    vws_kvs* kvs = (vws_kvs*)c->data;
+
+    for (uint64_t i = 0; i < n; i++)
+    {
+        bench_sink += (uintptr_t)vws_kvs_get(kvs, bench_keys[i % BENCH_KEYS]);
+    }
+}
+
+//------------------------------------------------------------------------------
+// Buffer
+//------------------------------------------------------------------------------
+
+// Append then drain, as a socket receive buffer does
+static void bench_buffer_append_drain(bench_case* c, uint64_t n)
+{
+    vws_buffer* b = vws_buffer_new();
+    ucstr data    = (ucstr)c->data;
+
+    for (uint64_t i = 0; i < n; i++)
+    {
+        vws_buffer_append(b, data, c->size);
+        vws_buffer_drain(b, c->size);
+    }
+
+    vws_buffer_free(b);
+}
+
+// Append in chunks to a fresh buffer, as when building a message
+static void bench_buffer_grow(bench_case* c, uint64_t n)
+{
+    ucstr data = (ucstr)c->data;
+
+    for (uint64_t i = 0; i < n; i++)
+    {
+        vws_buffer* b = vws_buffer_new();
+
+        for (int j = 0; j < 16; j++)
+        {
+            vws_buffer_append(b, data, c->size / 16);
+        }
+
+        bench_sink += b->size;
+        vws_buffer_free(b);
+    }
+}
+
+//------------------------------------------------------------------------------
+// Handshake
+//------------------------------------------------------------------------------
+
+static void bench_accept_key(bench_case* c, uint64_t n)
+{
+    char out[VWS_ACCEPT_KEY_SIZE + 1];
+
+    for (uint64_t i = 0; i < n; i++)
+    {
+        vws_accept_key_r((cstr)c->data, out);
+        bench_sink += out[0];
+    }
+}
+
+//------------------------------------------------------------------------------
+// RPC dispatch
+//------------------------------------------------------------------------------
+
+static vrtql_msg* bench_rpc_echo(vrtql_rpc_env* e, vrtql_msg* m)
+{
+    vrtql_msg* reply = vrtql_rpc_reply(m);
+    vws_buffer_append(reply->content, m->content->data, m->content->size);
+
+    return reply;
+}
+
+static void bench_rpc_service(bench_case* c, uint64_t n)
+{
+    vrtql_rpc_system* system = (vrtql_rpc_system*)c->data;
+    vrtql_rpc_env env;
+
+    for (uint64_t i = 0; i < n; i++)
+    {
+        vrtql_msg* req = vrtql_msg_new();
+        vrtql_msg_set_header(req, "id", "echo.content");
+        vrtql_msg_set_content(req, "ping");
+
+        vrtql_msg* reply = vrtql_rpc_service(system, &env, req);
+        bench_sink      += reply->content->size;
+        vrtql_msg_free(reply);
+    }
+}
+
+//------------------------------------------------------------------------------
+// Runner
+//------------------------------------------------------------------------------
+
+// Returns elapsed microseconds for n operations
+static uint64_t bench_time(bench_case* c, uint64_t n)
+{
+    uint64_t start = vws_clock_usec();
+    c->run(c, n);
+
+    return vws_clock_usec() - start;
+}
+
+static int bench_cmp(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+
+    return (x > y) - (x < y);
+}
+
+static void bench_measure(bench_case* c)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "%s/%zu", c->name, c->size);
+
+    if ((bench_filter != NULL) && (strstr(name, bench_filter) == NULL))
+    {
+        return;
+    }
+
+    // Warm up and calibrate
+    uint64_t n = 1;
+
+    while (bench_time(c, n) < bench_min_time / 10)
+    {
+        n *= 2;
+    }
+
+    n = n * 10;
+
+    double ns[BENCH_REPEAT];
+
+    for (int i = 0; i < BENCH_REPEAT; i++)
+    {
+        ns[i] = bench_time(c, n) * 1000.0 / n;
+    }
+
+    qsort(ns, BENCH_REPEAT, sizeof(double), bench_cmp);
+
+    double median = ns[BENCH_REPEAT / 2];
+    double mbps   = (c->size > 0) ? c->size * 1000.0 / median : 0;
+
+    printf( "%-28s %12lu %10.1f %10.1f %10.1f %10.1f\n",
+            name, n, median, ns[0], ns[BENCH_REPEAT - 1], mbps );
+
+    fflush(stdout);
+
+    if (bench_out != NULL)
+    {
+        fprintf( bench_out,
+                 "{\"case\":\"%s\",\"size\":%zu,\"iterations\":%lu,"
+                 "\"ns_per_op\":%.2f,\"ns_min\":%.2f,\"ns_max\":%.2f,"
+                 "\"mb_per_sec\":%.2f}\n",
+                 c->name, c->size, n, median, ns[0], ns[BENCH_REPEAT - 1],
+                 mbps );
+
+        fflush(bench_out);
+    }
+}
+
+static void bench_frames()
+{
+    size_t sizes[] = { 16, 125, 1024, 65536 };
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        size_t size = sizes[i];
+        char* data  = vws.malloc(size);
+        memset(data, 'x', size);
+
+        bench_case c =
+        {
+            "frame_serialize", size, bench_frame_serialize, data, NULL
+        };
+
+        bench_measure(&c);
+
+        // Client frames are masked, so this includes unmasking
+        vws_frame* f = vws_frame_new((ucstr)data, size, BINARY_FRAME);
+        c.name       = "frame_deserialize";
+        c.run        = bench_frame_deserialize;
+        c.input      = vws_serialize(f);
+        bench_measure(&c);
+
+        vws_buffer_free(c.input);
+        vws.free(data);
+    }
+}
+
+static void bench_messages()
+{
+    size_t sizes[] = { 64, 1024, 16384 };
+
+    struct
+    {
+        vrtql_msg_format_t format;
+        cstr serialize;
+        cstr deserialize;
+    } formats[] =
+    {
+        { VM_MPACK_FORMAT,        "msg_serialize_mpack",
+                                  "msg_deserialize_mpack"  },
+        { VM_MPACK_SCHEMA_FORMAT, "msg_serialize_schema",
+                                  "msg_deserialize_schema" },
+        { VM_JSON_FORMAT,         "msg_serialize_json",
+                                  "msg_deserialize_json"   }
+    };
+
+    for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++)
+    {
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+        {
+            vrtql_msg* m = bench_msg_new(sizes[i], formats[f].format);
+
+            bench_case c =
+            {
+                formats[f].serialize, sizes[i], bench_msg_serialize, m, NULL
+            };
+
+            bench_measure(&c);
+
+            c.name  = formats[f].deserialize;
+            c.run   = bench_msg_deserialize;
+            c.input = vrtql_msg_serialize(m);
+            bench_measure(&c);
+
+            vws_buffer_free(c.input);
+            vrtql_msg_free(m);
+        }
+    }
+}
+
+// Header-only messages, where schema ids replace most of the key bytes. The
+// size column is the encoded size, so the two formats can be compared.
+static void bench_schema()
+{
+    vrtql_msg_format_t formats[] = { VM_MPACK_FORMAT, VM_MPACK_SCHEMA_FORMAT };
+    cstr names[][2]              =
+    {
+        { "msg_headers_mpack",  "msg_headers_mpack_decode"  },
+        { "msg_headers_schema", "msg_headers_schema_decode" }
+    };
+
+    for (int f = 0; f < 2; f++)
+    {
+        vrtql_msg* m = vrtql_msg_new();
+        m->format    = formats[f];
+
+        vrtql_msg_set_routing(m, "tag", "a1b2c3d4");
+        vrtql_msg_set_header(m, "id", "session.login");
+        vrtql_msg_set_header(m, "rc", "0");
+        vrtql_msg_set_header(m, "msg", "ok");
+        vrtql_msg_set_header(m, "timestamp", "1700000000");
+
+        vws_buffer* input = vrtql_msg_serialize(m);
+
+        bench_case c =
+        {
+            names[f][0], input->size, bench_msg_serialize, m, NULL
+        };
+
+        bench_measure(&c);
+
+        c.name  = names[f][1];
+        c.run   = bench_msg_deserialize;
+        c.input = input;
+        bench_measure(&c);
+
+        vws_buffer_free(input);
+        vrtql_msg_free(m);
+    }
+}
+
+static void bench_kvs()
+{
+    vws_kvs* kvs = vws_kvs_new(BENCH_KEYS, true);
+
+    bench_case c = { "kvs_set", 0, bench_kvs_set, kvs, NULL };
+    bench_measure(&c);
+
+    for (int i = 0; i < BENCH_KEYS; i++)
+    {
+        vws_kvs_set_cstring(kvs, bench_keys[i], "value");
+    }
+
+    c.name = "kvs_get";
+    c.run  = bench_kvs_get;
+    bench_measure(&c);
+
+    vws_kvs_free(kvs);
+}
+
+static void bench_buffers()
+{
+    size_t sizes[] = { 64, 1024, 16384 };
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        size_t size = sizes[i];
+        char* data  = vws.malloc(size);
+        memset(data, 'x', size);
+
+        bench_case c =
+        {
+            "buffer_append_drain", size, bench_buffer_append_drain, data, NULL
+        };
+
+        bench_measure(&c);
+
+        c.name = "buffer_grow";
+        c.run  = bench_buffer_grow;
+        bench_measure(&c);
+
+        vws.free(data);
+    }
+}
+
+static void bench_handshake()
+{
+    bench_case c =
+    {
+        "accept_key", 0, bench_accept_key, "dGhlIHNhbXBsZSBub25jZQ==", NULL
+    };
+
+    bench_measure(&c);
+}
+
+static void bench_rpc()
+{
+    vrtql_rpc_system* system = vrtql_rpc_system_new();
+
+    // Several modules, so lookups are not trivially small
+    cstr names[] = { "session", "echo", "admin", "data", "user" };
+    cstr calls[] = { "login", "logout", "info", "content" };
+
+    for (int i = 0; i < 5; i++)
+    {
+        vrtql_rpc_module* module = vrtql_rpc_module_new(names[i]);
+
+        for (int j = 0; j < 4; j++)
+        {
+            vrtql_rpc_module_set(module, calls[j], bench_rpc_echo);
+        }
+
+        vrtql_rpc_system_set(system, module);
+    }
+
+    bench_case c = { "rpc_dispatch", 0, bench_rpc_service, system, NULL };
+    bench_measure(&c);
+
+    vrtql_rpc_system_free(system);
+}
+
+static void usage()
+{
+    fprintf( stderr,
+             "usage: bench_codec [options]\n"
+             "  -t msec     Minimum time per measurement (default 200)\n"
+             "  -f filter   Only run cases whose name/size contains filter\n"
+             "  -o file     Append results as JSON lines to file\n" );
+}
+
+int main(int argc, char* argv[])
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:f:o:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'f': bench_filter = optarg; break;
+
+            case 't':
+            {
+                bench_min_time = strtoull(optarg, NULL, 10) * 1000;
+                break;
+            }
+
+            case 'o':
+            {
+                if ((bench_out = fopen(optarg, "a")) == NULL)
+                {
+                    fprintf(stderr, "cannot open %s\n", optarg);
+                    return 1;
+                }
+
+                break;
+            }
+
+            default:
+            {
+                usage();
+                return 1;
+            }
+        }
+    }
+
+    printf( "%-28s %12s %10s %10s %10s %10s\n",
+            "case/size", "iterations", "ns/op", "min", "max", "MB/s" );
+
+    bench_frames();
+    bench_messages();
+    bench_schema();
+    bench_kvs();
+    bench_buffers();
+    bench_handshake();
+    bench_rpc();
+
+    if (bench_out != NULL)
+    {
+        fclose(bench_out);
+    }
+
+    vws_cleanup();
+
+    return 0;
+}
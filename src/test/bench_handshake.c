@@ -0,0 +1,397 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "server.h"
+
+//------------------------------------------------------------------------------
+// Handshake benchmark
+//
+// Measures how many WebSocket upgrades one server loop completes per second,
+// as in a reconnect storm. Client threads each connect, send the upgrade
+// request, read the 101 response and disconnect, in a loop. Heap allocations
+// made by the server loop thread are counted through the vws allocator hooks
+// and reported per handshake. These include the connection itself, not just
+// the upgrade.
+//------------------------------------------------------------------------------
+
+// Benchmark parameters
+typedef struct
+{
+    cstr host;
+    int port;
+    int clients;
+    int handshakes;
+} bench_config;
+
+// Per client state
+typedef struct
+{
+    bench_config* config;
+    uv_barrier_t* ready;
+    uint64_t completed;
+    uint64_t errors;
+    vws_hist latency;
+} bench_client;
+
+typedef struct
+{
+    vws_tcp_svr* server;
+    bench_config* config;
+} bench_server_args;
+
+static cstr bench_request =
+    "GET /websocket HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "Upgrade: websocket\r\n"
+    "Connection: Upgrade\r\n"
+    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+    "Sec-WebSocket-Version: 13\r\n"
+    "\r\n";
+
+// Server loop thread allocations. Only written by that thread.
+static uint64_t bench_allocs = 0;
+
+// Allocators the counting hooks forward to
+static vws_malloc_cb bench_next_malloc;
+static vws_calloc_cb bench_next_calloc;
+static vws_realloc_cb bench_next_realloc;
+static vws_strdup_cb bench_next_strdup;
+
+//------------------------------------------------------------------------------
+// Server side
+//------------------------------------------------------------------------------
+
+static void* bench_malloc(size_t size)
+{
+    bench_allocs++;
+    return bench_next_malloc(size);
+}
+
+static void* bench_calloc(size_t n, size_t size)
+{
+    bench_allocs++;
+    return bench_next_calloc(n, size);
+}
+
+static void* bench_realloc(void* ptr, size_t size)
+{
+    bench_allocs++;
+    return bench_next_realloc(ptr, size);
+}
+
+static void* bench_strdup(cstr s)
+{
+    bench_allocs++;
+    return bench_next_strdup(s);
+}
+
+static void bench_process(vws_svr* s, vws_cid_t cid, vws_msg* m, void* x)
+{
+    vws_msg_free(m);
+}
+
+static void bench_run_server(void* arg)
+{
+    bench_server_args* args = (bench_server_args*)arg;
+
+    // The allocator is per thread, so this only counts the loop thread
+    bench_next_malloc  = vws.malloc;
+    bench_next_calloc  = vws.calloc;
+    bench_next_realloc = vws.realloc;
+    bench_next_strdup  = vws.strdup;
+
+    vws.malloc  = bench_malloc;
+    vws.calloc  = bench_calloc;
+    vws.realloc = bench_realloc;
+    vws.strdup  = bench_strdup;
+
+    vws_tcp_svr_run(args->server, args->config->host, args->config->port);
+    vws_cleanup();
+}
+
+//------------------------------------------------------------------------------
+// Client side
+//------------------------------------------------------------------------------
+
+// Performs one upgrade. Returns false on any failure.
+static bool bench_handshake(struct sockaddr_in* addr)
+{
+    char buf[512];
+    size_t total = 0;
+    bool ok      = false;
+    int fd       = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    if (connect(fd, (struct sockaddr*)addr, sizeof(*addr)) != 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    size_t size = strlen(bench_request);
+
+    if (send(fd, bench_request, size, 0) != (ssize_t)size)
+    {
+        close(fd);
+        return false;
+    }
+
+    while (total < sizeof(buf) - 1)
+    {
+        ssize_t n = recv(fd, buf + total, sizeof(buf) - 1 - total, 0);
+
+        if (n <= 0)
+        {
+            break;
+        }
+
+        total      += n;
+        buf[total]  = 0;
+
+        if (strstr(buf, "\r\n\r\n") != NULL)
+        {
+            ok = (strncmp(buf, "HTTP/1.1 101 ", 13) == 0);
+            break;
+        }
+    }
+
+    close(fd);
+
+    return ok;
+}
+
+static void bench_run_client(void* arg)
+{
+    bench_client* client = (bench_client*)arg;
+    bench_config* config = client->config;
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port   = htons(config->port);
+    inet_pton(AF_INET, config->host, &addr.sin_addr);
+
+    int count = config->handshakes / config->clients;
+
+    uv_barrier_wait(client->ready);
+
+    for (int i = 0; i < count; i++)
+    {
+        uint64_t start = vws_clock_usec();
+
+        if (bench_handshake(&addr) == false)
+        {
+            client->errors++;
+            continue;
+        }
+
+        vws_hist_add(&client->latency, vws_clock_usec() - start);
+        client->completed++;
+    }
+}
+
+//------------------------------------------------------------------------------
+// Runner
+//------------------------------------------------------------------------------
+
+static bool bench_run(bench_config* config, FILE* out)
+{
+    vws_svr* server        = vws_svr_new(1, 0, 0);
+    server->process_ws     = bench_process;
+    vws_tcp_svr* base      = (vws_tcp_svr*)server;
+    bench_server_args args = { base, config };
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, bench_run_server, &args);
+
+    while (vws_tcp_svr_state(base) != VS_RUNNING)
+    {
+        vws_msleep(10);
+    }
+
+    int n                 = config->clients;
+    bench_client* clients = vws.calloc(n, sizeof(bench_client));
+    uv_thread_t* tids     = vws.malloc(n * sizeof(uv_thread_t));
+    uv_barrier_t ready;
+
+    uv_barrier_init(&ready, n + 1);
+
+    for (int i = 0; i < n; i++)
+    {
+        clients[i].config = config;
+        clients[i].ready  = &ready;
+        vws_hist_clear(&clients[i].latency);
+        uv_thread_create(&tids[i], bench_run_client, &clients[i]);
+    }
+
+    // The loop is idle here, so server setup is left out of the count
+    uint64_t allocs = bench_allocs;
+
+    // Release all clients at once
+    uv_barrier_wait(&ready);
+
+    uint64_t start = vws_clock_usec();
+
+    for (int i = 0; i < n; i++)
+    {
+        uv_thread_join(&tids[i]);
+    }
+
+    uint64_t elapsed = vws_clock_usec() - start;
+
+    // Wait for the server to see every disconnect
+    uint64_t expected = 0;
+    uint64_t errors   = 0;
+    vws_hist latency;
+    vws_hist_clear(&latency);
+
+    for (int i = 0; i < n; i++)
+    {
+        expected += clients[i].completed + clients[i].errors;
+        errors   += clients[i].errors;
+        vws_hist_merge(&latency, &clients[i].latency);
+    }
+
+    for (int i = 0; i < 500; i++)
+    {
+        vws_svr_metrics* m = vws_tcp_svr_metrics(base);
+        uint64_t closed    = m->counters[VWS_METRIC_CNX_CLOSED];
+        vws_svr_metrics_free(m);
+
+        if (closed >= expected)
+        {
+            break;
+        }
+
+        vws_msleep(10);
+    }
+
+    allocs = bench_allocs - allocs;
+
+    vws_tcp_svr_stop(base);
+    uv_thread_join(&server_tid);
+    vws_svr_free(server);
+
+    uv_barrier_destroy(&ready);
+    vws.free(tids);
+    vws.free(clients);
+
+    uint64_t completed = latency.count;
+    double seconds     = elapsed / 1e6;
+    double rate        = (seconds > 0) ? completed / seconds : 0;
+    double per_hs      = (completed > 0) ? (double)allocs / completed : 0;
+    uint64_t p50       = vws_hist_percentile(&latency, 50);
+    uint64_t p99       = vws_hist_percentile(&latency, 99);
+
+    printf( "%8i %10lu %8lu %12.0f %10lu %10lu %12.1f\n",
+            config->clients, completed, errors, rate, p50, p99, per_hs );
+
+    fflush(stdout);
+
+    if (out != NULL)
+    {
+        fprintf( out,
+                 "{\"clients\":%i,\"handshakes\":%lu,\"errors\":%lu,"
+                 "\"per_sec\":%.0f,\"p50_usec\":%lu,\"p99_usec\":%lu,"
+                 "\"allocs_per_handshake\":%.1f}\n",
+                 config->clients, completed, errors, rate, p50, p99,
+                 per_hs );
+
+        fflush(out);
+    }
+
+    return errors == 0;
+}
+
+static void usage()
+{
+    fprintf( stderr,
+             "usage: bench_handshake [options]\n"
+             "  -c clients    Client threads (default 8)\n"
+             "  -n count      Total handshakes (default 20000)\n"
+             "  -p port       Server port (default 8191)\n"
+             "  -o file       Append results as JSON lines to file\n" );
+}
+
+int main(int argc, char* argv[])
+{
+    bench_config config =
+    {
+        .host       = "127.0.0.1",
+        .port       = 8191,
+        .clients    = 8,
+        .handshakes = 20000
+    };
+
+    FILE* out = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:n:p:o:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'c': config.clients    = atoi(optarg); break;
+            case 'n': config.handshakes = atoi(optarg); break;
+            case 'p': config.port       = atoi(optarg); break;
+
+            case 'o':
+            {
+                if ((out = fopen(optarg, "a")) == NULL)
+                {
+                    fprintf(stderr, "cannot open %s\n", optarg);
+                    return 1;
+                }
+
+                break;
+            }
+
+            default:
+            {
+                usage();
+                return 1;
+            }
+        }
+    }
+
+    if ((config.clients < 1) || (config.handshakes < config.clients))
+    {
+        usage();
+        return 1;
+    }
+
+    // Each handshake leaves a socket in TIME_WAIT on the client side
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    printf( "%8s %10s %8s %12s %10s %10s %12s\n",
+            "clients", "handshakes", "errors", "per sec", "p50 us",
+            "p99 us", "allocs/hs" );
+
+    int rc = (bench_run(&config, out) == true) ? 0 : 1;
+
+    if (out != NULL)
+    {
+        fclose(out);
+    }
+
+    vws_cleanup();
+
+    return rc;
+}
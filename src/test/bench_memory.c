@@ -0,0 +1,420 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "server.h"
+
+//------------------------------------------------------------------------------
+// Connection memory benchmark
+//
+// Measures the heap memory a vws_svr holds per open connection. A child process
+// opens the connections so that only server allocations land in this process's
+// heap. All threads share one malloc arena, so mallinfo2() accounts for the
+// server loop and workers alike. Kernel socket buffers are not included.
+//
+// States:
+//
+//   tcp   Connected, nothing sent
+//   ws    Upgraded, after one message echoed, then idle
+//------------------------------------------------------------------------------
+
+typedef enum
+{
+    BENCH_TCP,
+    BENCH_WS,
+    BENCH_STATE_COUNT
+} bench_state_t;
+
+static cstr bench_state_names[BENCH_STATE_COUNT] = { "tcp", "ws" };
+
+// Benchmark parameters
+typedef struct
+{
+    cstr host;
+    int port;
+    int clients;
+    bench_state_t state;
+} bench_config;
+
+static cstr bench_handshake =
+    "GET /websocket HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "Upgrade: websocket\r\n"
+    "Connection: Upgrade\r\n"
+    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+    "Sec-WebSocket-Version: 13\r\n"
+    "\r\n";
+
+// Masked text frame with a zero mask and a four byte payload
+static unsigned char bench_frame[] =
+{
+    0x81, 0x84, 0x00, 0x00, 0x00, 0x00, 'p', 'i', 'n', 'g'
+};
+
+//------------------------------------------------------------------------------
+// Server side
+//------------------------------------------------------------------------------
+
+static void bench_process(vws_svr* s, vws_cid_t cid, vws_msg* m, void* x)
+{
+    vws_msg* reply = vws_msg_new();
+    reply->opcode  = m->opcode;
+    vws_buffer_append(reply->data, m->data->data, m->data->size);
+
+    s->send(s, cid, reply, NULL);
+    vws_msg_free(m);
+}
+
+typedef struct
+{
+    vws_tcp_svr* server;
+    bench_config* config;
+} bench_server_args;
+
+static void bench_run_server(void* arg)
+{
+    bench_server_args* args = (bench_server_args*)arg;
+
+    vws_tcp_svr_run(args->server, args->config->host, args->config->port);
+    vws_cleanup();
+}
+
+static uint64_t bench_counter(vws_tcp_svr* server, vws_svr_metric_t metric)
+{
+    vws_svr_metrics* m = vws_tcp_svr_metrics(server);
+    uint64_t value     = m->counters[metric];
+    vws_svr_metrics_free(m);
+
+    return value;
+}
+
+static size_t bench_heap()
+{
+    return mallinfo2().uordblks;
+}
+
+//------------------------------------------------------------------------------
+// Client side
+//------------------------------------------------------------------------------
+
+// Reads until the buffer holds at least size bytes or until the marker if
+// given. Returns false on error or disconnect.
+static bool bench_read(int fd, char* buf, size_t max, size_t size, cstr marker)
+{
+    size_t total = 0;
+
+    while (total < max - 1)
+    {
+        ssize_t n = recv(fd, buf + total, max - 1 - total, 0);
+
+        if (n <= 0)
+        {
+            return false;
+        }
+
+        total      += n;
+        buf[total]  = 0;
+
+        if ((marker != NULL) && (strstr(buf, marker) != NULL))
+        {
+            return true;
+        }
+
+        if ((marker == NULL) && (total >= size))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Opens the connections, reports readiness on ready and holds them until go is
+// closed. Runs in the child process.
+static int bench_clients(bench_config* config, int go, int ready)
+{
+    int* fds = malloc(sizeof(int) * config->clients);
+    char buf[1024];
+    char c;
+
+    // Wait for server
+    if (read(go, &c, 1) != 1)
+    {
+        return 1;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port   = htons(config->port);
+    inet_pton(AF_INET, config->host, &addr.sin_addr);
+
+    for (int i = 0; i < config->clients; i++)
+    {
+        fds[i] = socket(AF_INET, SOCK_STREAM, 0);
+
+        if (connect(fds[i], (struct sockaddr*)&addr, sizeof(addr)) != 0)
+        {
+            perror("connect");
+            return 1;
+        }
+
+        if (config->state == BENCH_TCP)
+        {
+            continue;
+        }
+
+        size_t size = strlen(bench_handshake);
+
+        if ( (send(fds[i], bench_handshake, size, 0) != (ssize_t)size) ||
+             (bench_read(fds[i], buf, sizeof(buf), 0, "\r\n\r\n") == false) )
+        {
+            fprintf(stderr, "handshake failed\n");
+            return 1;
+        }
+
+        size = sizeof(bench_frame);
+
+        if ( (send(fds[i], bench_frame, size, 0) != (ssize_t)size) ||
+             (bench_read(fds[i], buf, sizeof(buf), 6, NULL) == false) )
+        {
+            fprintf(stderr, "echo failed\n");
+            return 1;
+        }
+    }
+
+    // Report and hold until parent is done
+    c = 1;
+
+    if (write(ready, &c, 1) != 1)
+    {
+        return 1;
+    }
+
+    while (read(go, &c, 1) > 0)
+    {
+    }
+
+    for (int i = 0; i < config->clients; i++)
+    {
+        close(fds[i]);
+    }
+
+    free(fds);
+
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+// Runner
+//------------------------------------------------------------------------------
+
+static bool bench_run(bench_config* config, FILE* out)
+{
+    int go[2];
+    int ready[2];
+
+    if ((pipe(go) != 0) || (pipe(ready) != 0))
+    {
+        perror("pipe");
+        return false;
+    }
+
+    // Fork before any threads are started
+    pid_t pid = fork();
+
+    if (pid == 0)
+    {
+        close(go[1]);
+        close(ready[0]);
+        _exit(bench_clients(config, go[0], ready[1]));
+    }
+
+    close(go[0]);
+    close(ready[1]);
+
+    vws_svr* server        = vws_svr_new(1, 0, 0);
+    server->process_ws     = bench_process;
+    vws_tcp_svr* base      = (vws_tcp_svr*)server;
+    bench_server_args args = { base, config };
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, bench_run_server, &args);
+
+    while (vws_tcp_svr_state(base) != VS_RUNNING)
+    {
+        vws_msleep(10);
+    }
+
+    vws_msleep(100);
+    size_t before = bench_heap();
+
+    // Start clients and wait until all are open
+    char c  = 1;
+    bool ok = (write(go[1], &c, 1) == 1) && (read(ready[0], &c, 1) == 1);
+
+    while ( ok &&
+            (bench_counter(base, VWS_METRIC_CNX_OPENED) <
+             (uint64_t)config->clients) )
+    {
+        vws_msleep(10);
+    }
+
+    // Let the server settle
+    vws_msleep(200);
+    size_t after = bench_heap();
+
+    // Release clients
+    close(go[1]);
+    close(ready[0]);
+
+    int status;
+    waitpid(pid, &status, 0);
+    ok = ok && WIFEXITED(status) && (WEXITSTATUS(status) == 0);
+
+    vws_tcp_svr_stop(base);
+    uv_thread_join(&server_tid);
+    vws_svr_free(server);
+
+    if (ok == false)
+    {
+        fprintf( stderr, "%s: clients failed\n",
+                 bench_state_names[config->state] );
+
+        return false;
+    }
+
+    double total   = (after > before) ? (double)(after - before) : 0;
+    double per_cnx = total / config->clients;
+
+    printf( "%-6s %8i %12.0f %12.1f\n",
+            bench_state_names[config->state],
+            config->clients,
+            per_cnx,
+            total / 1024 );
+
+    fflush(stdout);
+
+    if (out != NULL)
+    {
+        fprintf( out,
+                 "{\"state\":\"%s\",\"clients\":%i,"
+                 "\"bytes_per_cnx\":%.0f,\"total_bytes\":%.0f}\n",
+                 bench_state_names[config->state],
+                 config->clients,
+                 per_cnx,
+                 total );
+
+        fflush(out);
+    }
+
+    return true;
+}
+
+static void usage()
+{
+    fprintf( stderr,
+             "usage: bench_memory [options]\n"
+             "  -c clients    Client connections (default 1000)\n"
+             "  -S state      tcp, ws or all (default all)\n"
+             "  -p port       Server port (default 8190)\n"
+             "  -o file       Append results as JSON lines to file\n" );
+}
+
+int main(int argc, char* argv[])
+{
+    bench_config config =
+    {
+        .host    = "127.0.0.1",
+        .port    = 8190,
+        .clients = 1000
+    };
+
+    cstr state = "all";
+    FILE* out  = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:S:p:o:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'c': config.clients = atoi(optarg); break;
+            case 'S': state          = optarg;       break;
+            case 'p': config.port    = atoi(optarg); break;
+
+            case 'o':
+            {
+                if ((out = fopen(optarg, "a")) == NULL)
+                {
+                    fprintf(stderr, "cannot open %s\n", optarg);
+                    return 1;
+                }
+
+                break;
+            }
+
+            default:
+            {
+                usage();
+                return 1;
+            }
+        }
+    }
+
+    if (config.clients < 1)
+    {
+        usage();
+        return 1;
+    }
+
+    // Keep every allocation in the main arena where mallinfo2() sees it
+    mallopt(M_ARENA_MAX, 1);
+
+    // Server and clients each hold one descriptor per connection
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    printf( "%-6s %8s %12s %12s\n",
+            "state", "clients", "bytes/cnx", "total KB" );
+
+    int rc = 0;
+
+    for (int s = 0; s < BENCH_STATE_COUNT; s++)
+    {
+        if ( (strcmp(state, "all") != 0) &&
+             (strcmp(state, bench_state_names[s]) != 0) )
+        {
+            continue;
+        }
+
+        config.state = (bench_state_t)s;
+
+        if (bench_run(&config, out) == false)
+        {
+            rc = 1;
+        }
+    }
+
+    if (out != NULL)
+    {
+        fclose(out);
+    }
+
+    vws_cleanup();
+
+    return rc;
+}
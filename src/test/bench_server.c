@@ -0,0 +1,683 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "server.h"
+#include "message.h"
+#include "rpc.h"
+
+//------------------------------------------------------------------------------
+// Server benchmark
+//
+// Runs a server in-process on loopback and drives it with client threads, one
+// connection each. Each client keeps a window of messages in flight. Every
+// payload carries its send time, so latency is measured on each message
+// received. Results are printed as a table and optionally appended to a file as
+// JSON lines for regression tracking.
+//
+// Workloads:
+//
+//   ws_echo    vws_svr echoes websocket messages
+//   msg_echo   vrtql_msg_svr echoes VRTQL messages
+//   rpc        vrtql_rpc_svr dispatches to an echo call
+//   broadcast  vrtql_msg_svr sends each message to every client. Each client
+//              sends messages / clients, so each receives about as many
+//              messages as in the other workloads.
+//
+// CPU time is that of the whole process (clients and server) per message
+// received.
+//------------------------------------------------------------------------------
+
+typedef enum
+{
+    BENCH_WS_ECHO,
+    BENCH_MSG_ECHO,
+    BENCH_RPC,
+    BENCH_BROADCAST,
+    BENCH_COUNT
+} bench_workload_t;
+
+static cstr bench_workload_names[BENCH_COUNT] =
+{
+    "ws_echo", "msg_echo", "rpc", "broadcast"
+};
+
+// Prefix of every payload
+typedef struct
+{
+    uint64_t sent;
+    uint32_t client;
+    uint32_t seq;
+} bench_stamp;
+
+// Benchmark parameters
+typedef struct
+{
+    cstr host;
+    int port;
+    int clients;
+    int workers;
+    int messages;
+    int window;
+    size_t size;
+    bool nodelay;
+    vws_svr_backend_t backend;
+    bench_workload_t workload;
+} bench_config;
+
+// Per client state
+typedef struct
+{
+    bench_config* config;
+    uint32_t index;
+    uv_barrier_t* ready;
+    uint64_t received;
+    uint64_t errors;
+    vws_hist latency;
+} bench_client;
+
+// Broadcast group membership
+static vws_cid_t* bench_members = NULL;
+static int bench_member_count   = 0;
+static uv_mutex_t bench_lock;
+
+//------------------------------------------------------------------------------
+// Server side
+//------------------------------------------------------------------------------
+
+static void bench_ws_process(vws_svr* s, vws_cid_t cid, vws_msg* m, void* x)
+{
+    vws_msg* reply = vws_msg_new();
+    reply->opcode  = m->opcode;
+    vws_buffer_append(reply->data, m->data->data, m->data->size);
+
+    s->send(s, cid, reply, NULL);
+    vws_msg_free(m);
+}
+
+static void bench_msg_process(vws_svr* s, vws_cid_t cid, vrtql_msg* m, void* x)
+{
+    vrtql_msg_svr* server = (vrtql_msg_svr*)s;
+
+    vrtql_msg* reply = vrtql_msg_new();
+    reply->format    = m->format;
+    vws_buffer_append(reply->content, m->content->data, m->content->size);
+
+    server->send(s, cid, reply, NULL);
+    vrtql_msg_free(m);
+}
+
+static void bench_broadcast_process( vws_svr* s,
+                                     vws_cid_t cid,
+                                     vrtql_msg* m,
+                                     void* x )
+{
+    vrtql_msg_svr* server = (vrtql_msg_svr*)s;
+
+    uv_mutex_lock(&bench_lock);
+
+    if (vrtql_msg_get_header(m, "join") != NULL)
+    {
+        // Join group and acknowledge
+        bench_members[bench_member_count++] = cid;
+        uv_mutex_unlock(&bench_lock);
+
+        vrtql_msg* reply = vrtql_msg_new();
+        reply->format    = m->format;
+        server->send(s, cid, reply, NULL);
+        vrtql_msg_free(m);
+
+        return;
+    }
+
+    for (int i = 0; i < bench_member_count; i++)
+    {
+        vrtql_msg* copy = vrtql_msg_new();
+        copy->format    = m->format;
+        vws_buffer_append(copy->content, m->content->data, m->content->size);
+
+        server->send(s, bench_members[i], copy, NULL);
+    }
+
+    uv_mutex_unlock(&bench_lock);
+
+    vrtql_msg_free(m);
+}
+
+static vrtql_msg* bench_rpc_echo(vrtql_rpc_env* e, vrtql_msg* m)
+{
+    vrtql_msg* reply = vrtql_rpc_env_reply(e, m);
+    vws_buffer_append(reply->content, m->content->data, m->content->size);
+
+    return reply;
+}
+
+typedef struct
+{
+    vws_tcp_svr* server;
+    bench_config* config;
+} bench_server_args;
+
+static void bench_run_server(void* arg)
+{
+    bench_server_args* args = (bench_server_args*)arg;
+
+    vws_tcp_svr_run(args->server, args->config->host, args->config->port);
+    vws_cleanup();
+}
+
+//------------------------------------------------------------------------------
+// Client side
+//------------------------------------------------------------------------------
+
+// Sends one payload. Returns false on disconnect.
+static bool bench_send(vws_cnx* cnx, bench_client* c, ucstr data, size_t size)
+{
+    if (c->config->workload == BENCH_WS_ECHO)
+    {
+        return vws_msg_send_binary(cnx, data, size) >= 0;
+    }
+
+    vrtql_msg* m = vrtql_msg_new();
+    vrtql_msg_set_content_binary(m, (cstr)data, size);
+
+    if (c->config->workload == BENCH_RPC)
+    {
+        vrtql_msg_set_header(m, "id", "bench.echo");
+    }
+
+    bool rc = vrtql_msg_send(cnx, m) >= 0;
+    vrtql_msg_free(m);
+
+    return rc;
+}
+
+// Receives one payload and records its latency. Returns the client index of
+// the sender, or -1 on disconnect.
+static int bench_recv(vws_cnx* cnx, bench_client* c)
+{
+    while (vws_socket_is_connected((vws_socket*)cnx))
+    {
+        bench_stamp stamp;
+        size_t size = 0;
+
+        if (c->config->workload == BENCH_WS_ECHO)
+        {
+            vws_msg* m = vws_msg_recv(cnx);
+
+            if (m == NULL)
+            {
+                continue;
+            }
+
+            size = m->data->size;
+
+            if (size >= sizeof(stamp))
+            {
+                memcpy(&stamp, m->data->data, sizeof(stamp));
+            }
+
+            vws_msg_free(m);
+        }
+        else
+        {
+            vrtql_msg* m = vrtql_msg_recv(cnx);
+
+            if (m == NULL)
+            {
+                continue;
+            }
+
+            size = m->content->size;
+
+            if (size >= sizeof(stamp))
+            {
+                memcpy(&stamp, m->content->data, sizeof(stamp));
+            }
+
+            vrtql_msg_free(m);
+        }
+
+        if (size < sizeof(stamp))
+        {
+            c->errors++;
+            return c->index;
+        }
+
+        vws_hist_add(&c->latency, vws_clock_usec() - stamp.sent);
+        c->received++;
+
+        return stamp.client;
+    }
+
+    return -1;
+}
+
+static void bench_client_thread(void* arg)
+{
+    bench_client* c      = (bench_client*)arg;
+    bench_config* config = c->config;
+    vws_cnx* cnx         = vws_cnx_new();
+
+    char uri[256];
+    snprintf( uri, sizeof(uri), "ws://%s:%i/websocket",
+              config->host, config->port );
+
+    while (vws_connect(cnx, uri) == false)
+    {
+        vws_msleep(10);
+    }
+
+    uint32_t messages = config->messages;
+    uint64_t expected = messages;
+
+    if (config->workload == BENCH_BROADCAST)
+    {
+        messages = (messages + config->clients - 1) / config->clients;
+        expected = (uint64_t)messages * config->clients;
+
+        // Join group and wait for acknowledgement
+        vrtql_msg* join = vrtql_msg_new();
+        vrtql_msg_set_header(join, "join", "1");
+        vrtql_msg_send(cnx, join);
+        vrtql_msg_free(join);
+
+        vrtql_msg* ack = NULL;
+
+        while ((ack == NULL) && vws_socket_is_connected((vws_socket*)cnx))
+        {
+            ack = vrtql_msg_recv(cnx);
+        }
+
+        if (ack != NULL)
+        {
+            vrtql_msg_free(ack);
+        }
+    }
+
+    // Start all clients together
+    uv_barrier_wait(c->ready);
+
+    size_t size        = (config->size < sizeof(bench_stamp))
+                       ? sizeof(bench_stamp) : config->size;
+    unsigned char* buf = vws.malloc(size);
+    memset(buf, 'x', size);
+
+    uint32_t sent    = 0;
+    int  outstanding = 0;
+
+    while (c->received + c->errors < expected)
+    {
+        if ((sent < messages) && (outstanding < config->window))
+        {
+            bench_stamp stamp = { vws_clock_usec(), c->index, sent++ };
+            memcpy(buf, &stamp, sizeof(stamp));
+
+            if (bench_send(cnx, c, buf, size) == false)
+            {
+                break;
+            }
+
+            outstanding++;
+
+            continue;
+        }
+
+        int from = bench_recv(cnx, c);
+
+        if (from < 0)
+        {
+            break;
+        }
+
+        if (from == (int)c->index)
+        {
+            outstanding--;
+        }
+    }
+
+    vws.free(buf);
+    vws_disconnect(cnx);
+    vws_cnx_free(cnx);
+    vws_cleanup();
+}
+
+//------------------------------------------------------------------------------
+// Runner
+//------------------------------------------------------------------------------
+
+static uint64_t bench_cpu_usec()
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+
+    return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000
+         + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static vws_tcp_svr* bench_server_new(bench_config* config)
+{
+    switch (config->workload)
+    {
+        case BENCH_WS_ECHO:
+        {
+            vws_svr* server   = vws_svr_new(config->workers, 0, 0);
+            server->process_ws = bench_ws_process;
+
+            return (vws_tcp_svr*)server;
+        }
+
+        case BENCH_MSG_ECHO:
+        {
+            vrtql_msg_svr* server = vrtql_msg_svr_new(config->workers, 0, 0);
+            server->process       = bench_msg_process;
+
+            return (vws_tcp_svr*)server;
+        }
+
+        case BENCH_BROADCAST:
+        {
+            vrtql_msg_svr* server = vrtql_msg_svr_new(config->workers, 0, 0);
+            server->process       = bench_broadcast_process;
+
+            return (vws_tcp_svr*)server;
+        }
+
+        default:
+        {
+            vrtql_rpc_system* system = vrtql_rpc_system_new();
+            vrtql_rpc_module* module = vrtql_rpc_module_new("bench");
+            vrtql_rpc_module_set(module, "echo", bench_rpc_echo);
+            vrtql_rpc_system_set(system, module);
+
+            vrtql_rpc_svr* server;
+            server = vrtql_rpc_svr_new(system, config->workers, 0, 0);
+
+            return (vws_tcp_svr*)server;
+        }
+    }
+}
+
+static void bench_server_free(bench_config* config, vws_tcp_svr* server)
+{
+    switch (config->workload)
+    {
+        case BENCH_WS_ECHO:
+        {
+            vws_svr_free((vws_svr*)server);
+            break;
+        }
+
+        case BENCH_RPC:
+        {
+            vrtql_rpc_svr* s         = (vrtql_rpc_svr*)server;
+            vrtql_rpc_system* system = s->system;
+            vrtql_rpc_svr_free(s);
+            vrtql_rpc_system_free(system);
+            break;
+        }
+
+        default:
+        {
+            vrtql_msg_svr_free((vrtql_msg_svr*)server);
+        }
+    }
+}
+
+static void bench_run(bench_config* config, FILE* out)
+{
+    vws_tcp_svr* server    = bench_server_new(config);
+    bench_server_args args = { server, config };
+
+    server->sockopts.nodelay = config->nodelay;
+    server->backend          = config->backend;
+
+    bench_member_count = 0;
+    bench_members      = vws.malloc(sizeof(vws_cid_t) * config->clients);
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, bench_run_server, &args);
+
+    while (vws_tcp_svr_state(server) != VS_RUNNING)
+    {
+        vws_msleep(10);
+    }
+
+    uv_barrier_t ready;
+    uv_barrier_init(&ready, config->clients + 1);
+
+    bench_client* clients = vws.malloc(sizeof(bench_client) * config->clients);
+    uv_thread_t* threads  = vws.malloc(sizeof(uv_thread_t) * config->clients);
+
+    for (int i = 0; i < config->clients; i++)
+    {
+        clients[i].config   = config;
+        clients[i].index    = i;
+        clients[i].ready    = &ready;
+        clients[i].received = 0;
+        clients[i].errors   = 0;
+        vws_hist_clear(&clients[i].latency);
+
+        uv_thread_create(&threads[i], bench_client_thread, &clients[i]);
+    }
+
+    // Measure from when all clients are connected
+    uv_barrier_wait(&ready);
+    uint64_t cpu   = bench_cpu_usec();
+    uint64_t start = vws_clock_usec();
+
+    for (int i = 0; i < config->clients; i++)
+    {
+        uv_thread_join(&threads[i]);
+    }
+
+    uint64_t elapsed = vws_clock_usec() - start;
+    cpu              = bench_cpu_usec() - cpu;
+
+    // The server falls back to libuv where io_uring is not available
+    cstr backend = (server->backend == VWS_SVR_BACKEND_URING) ? "uring" : "uv";
+
+    vws_tcp_svr_stop(server);
+    uv_thread_join(&server_tid);
+    bench_server_free(config, server);
+
+    // Aggregate
+    vws_hist latency;
+    vws_hist_clear(&latency);
+    uint64_t errors = 0;
+
+    for (int i = 0; i < config->clients; i++)
+    {
+        vws_hist_merge(&latency, &clients[i].latency);
+        errors += clients[i].errors;
+    }
+
+    double seconds = elapsed / 1000000.0;
+    double rate    = (seconds > 0) ? latency.count / seconds : 0;
+    double cpu_msg = (latency.count > 0) ? (double)cpu / latency.count : 0;
+
+    printf( "%-10s %7zu %7i %9lu %12.0f %8lu %8lu %8lu %10.2f %6lu\n",
+            bench_workload_names[config->workload],
+            config->size,
+            config->clients,
+            latency.count,
+            rate,
+            vws_hist_percentile(&latency, 50),
+            vws_hist_percentile(&latency, 99),
+            vws_hist_percentile(&latency, 99.9),
+            cpu_msg,
+            errors );
+
+    fflush(stdout);
+
+    if (out != NULL)
+    {
+        fprintf( out,
+                 "{\"workload\":\"%s\",\"size\":%zu,\"clients\":%i,"
+                 "\"workers\":%i,\"window\":%i,\"nodelay\":%s,"
+                 "\"backend\":\"%s\",\"messages\":%lu,"
+                 "\"errors\":%lu,\"seconds\":%.6f,\"msgs_per_sec\":%.1f,"
+                 "\"p50_us\":%lu,\"p99_us\":%lu,\"p999_us\":%lu,"
+                 "\"max_us\":%lu,\"cpu_us_per_msg\":%.3f}\n",
+                 bench_workload_names[config->workload],
+                 config->size,
+                 config->clients,
+                 config->workers,
+                 config->window,
+                 config->nodelay ? "true" : "false",
+                 backend,
+                 latency.count,
+                 errors,
+                 seconds,
+                 rate,
+                 vws_hist_percentile(&latency, 50),
+                 vws_hist_percentile(&latency, 99),
+                 vws_hist_percentile(&latency, 99.9),
+                 latency.max,
+                 cpu_msg );
+
+        fflush(out);
+    }
+
+    uv_barrier_destroy(&ready);
+    vws.free(clients);
+    vws.free(threads);
+    vws.free(bench_members);
+    bench_members = NULL;
+}
+
+static void usage()
+{
+    fprintf( stderr,
+             "usage: bench_server [options]\n"
+             "  -c clients    Client connections (default 8)\n"
+             "  -w workers    Server worker threads (default 4)\n"
+             "  -n messages   Messages sent per client (default 10000)\n"
+             "  -d window     Messages in flight per client (default 1)\n"
+             "  -s sizes      Payload sizes, comma-separated\n"
+             "                (default 64,1024,16384)\n"
+             "  -W workload   ws_echo, msg_echo, rpc, broadcast or all\n"
+             "                (default all)\n"
+             "  -p port       Server port (default 8189)\n"
+             "  -N            Leave Nagle's algorithm on for server\n"
+             "                connections (no TCP_NODELAY)\n"
+             "  -B backend    Server I/O backend, uv or uring (default uv)\n"
+             "  -o file       Append results as JSON lines to file\n" );
+}
+
+int main(int argc, char* argv[])
+{
+    bench_config config =
+    {
+        .host     = "127.0.0.1",
+        .port     = 8189,
+        .clients  = 8,
+        .workers  = 4,
+        .messages = 10000,
+        .window   = 1,
+        .nodelay  = true,
+        .backend  = VWS_SVR_BACKEND_UV
+    };
+
+    cstr sizes    = "64,1024,16384";
+    cstr workload = "all";
+    FILE* out     = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:w:n:d:s:W:p:o:B:Nh")) != -1)
+    {
+        switch (opt)
+        {
+            case 'c': config.clients  = atoi(optarg); break;
+            case 'w': config.workers  = atoi(optarg); break;
+            case 'n': config.messages = atoi(optarg); break;
+            case 'd': config.window   = atoi(optarg); break;
+            case 's': sizes           = optarg;       break;
+            case 'W': workload        = optarg;       break;
+            case 'p': config.port     = atoi(optarg); break;
+            case 'N': config.nodelay  = false;        break;
+
+            case 'B':
+            {
+                if (strcmp(optarg, "uring") == 0)
+                {
+                    config.backend = VWS_SVR_BACKEND_URING;
+                }
+                else if (strcmp(optarg, "uv") != 0)
+                {
+                    usage();
+                    return 1;
+                }
+
+                break;
+            }
+
+            case 'o':
+            {
+                if ((out = fopen(optarg, "a")) == NULL)
+                {
+                    fprintf(stderr, "cannot open %s\n", optarg);
+                    return 1;
+                }
+
+                break;
+            }
+
+            default:
+            {
+                usage();
+                return 1;
+            }
+        }
+    }
+
+    if ((config.clients < 1) || (config.window < 1) || (config.messages < 1))
+    {
+        usage();
+        return 1;
+    }
+
+    uv_mutex_init(&bench_lock);
+
+    printf( "%-10s %7s %7s %9s %12s %8s %8s %8s %10s %6s\n",
+            "workload", "size", "clients", "msgs", "msgs/sec",
+            "p50 us", "p99 us", "p999 us", "cpu us/msg", "errors" );
+
+    for (int w = 0; w < BENCH_COUNT; w++)
+    {
+        cstr name = bench_workload_names[w];
+
+        if ((strcmp(workload, "all") != 0) && (strcmp(workload, name) != 0))
+        {
+            continue;
+        }
+
+        config.workload = (bench_workload_t)w;
+
+        // Run each payload size
+        char* list = strdup(sizes);
+        char* save = NULL;
+
+        char* s    = strtok_r(list, ",", &save);
+
+        for (; s != NULL; s = strtok_r(NULL, ",", &save))
+        {
+            config.size = strtoul(s, NULL, 10);
+            bench_run(&config, out);
+        }
+
+        free(list);
+    }
+
+    if (out != NULL)
+    {
+        fclose(out);
+    }
+
+    uv_mutex_destroy(&bench_lock);
+    vws_cleanup();
+
+    return 0;
+}
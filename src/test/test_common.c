@@ -3,6 +3,8 @@
 #define CTEST_MAIN
 #include "ctest.h"
 
+#include <pthread.h>
+
 #include "vws.h"
 #include "url.h"
 #include "util/sc_map.h"
@@ -252,6 +254,14 @@ CTEST2(test, buffer)
     printf("%s\n", buffer->data);
     ASSERT_STR((cstr)buffer->data, "world!");
 
+    // Reserve space and write directly into it, as socket reads do
+    unsigned char* space = vws_buffer_reserve(buffer, 4096);
+    ASSERT_TRUE(buffer->allocated - buffer->size >= 4096);
+    ASSERT_TRUE(space == buffer->data + buffer->size);
+    memcpy(space, " Bye", 5);
+    buffer->size += 4;
+    ASSERT_STR((cstr)buffer->data, "world! Bye");
+
     // Free the buffer
     vws_buffer_free(buffer);
 }
@@ -274,6 +284,143 @@ CTEST2(test, queue)
     sc_queue_term(&queue);
 }
 
+CTEST(test, histogram)
+{
+    vws_hist* h = vws_hist_new();
+
+    ASSERT_EQUAL(0, vws_hist_percentile(h, 50));
+
+    // Small values are recorded exactly
+    for (uint64_t i = 1; i <= 10; i++)
+    {
+        vws_hist_add(h, i);
+    }
+
+    ASSERT_EQUAL(10, h->count);
+    ASSERT_EQUAL(1,  h->min);
+    ASSERT_EQUAL(10, h->max);
+    ASSERT_EQUAL(5,  vws_hist_percentile(h, 50));
+    ASSERT_EQUAL(10, vws_hist_percentile(h, 100));
+    ASSERT_TRUE(vws_hist_mean(h) == 5.5);
+
+    // Large values are within 1/16 relative error
+    vws_hist_clear(h);
+
+    for (uint64_t i = 1; i <= 100000; i++)
+    {
+        vws_hist_add(h, i);
+    }
+
+    uint64_t p99 = vws_hist_percentile(h, 99);
+    ASSERT_TRUE(p99 >= 99000);
+    ASSERT_TRUE(p99 <= 99000 + 99000 / 16);
+
+    // Merge
+    vws_hist* other = vws_hist_new();
+    vws_hist_add(other, 1000000);
+    vws_hist_merge(h, other);
+
+    ASSERT_EQUAL(100001,  h->count);
+    ASSERT_EQUAL(1000000, h->max);
+    ASSERT_EQUAL(1000000, vws_hist_percentile(h, 100));
+
+    vws_hist_free(other);
+    vws_hist_free(h);
+}
+
+#define TRACE_THREADS 4
+#define TRACE_EVENTS  5000
+
+static void* trace_thread(void* arg)
+{
+    for (uint64_t i = 0; i < TRACE_EVENTS; i++)
+    {
+        vws_tev_emit(VTE_USER + 1, (uintptr_t)arg, i, 0);
+    }
+
+    return NULL;
+}
+
+CTEST(test, trace_ring)
+{
+    cstr path = "trace_ring.bin";
+
+    // A small ring so that some events are dropped
+    ASSERT_TRUE(vws_tracer_start(path, 256, 1));
+    ASSERT_TRUE(vws_tracer_active());
+    ASSERT_FALSE(vws_tracer_start(path, 0, 0));
+
+    pthread_t threads[TRACE_THREADS];
+
+    for (uintptr_t i = 0; i < TRACE_THREADS; i++)
+    {
+        pthread_create(&threads[i], NULL, trace_thread, (void*)i);
+    }
+
+    for (int i = 0; i < TRACE_THREADS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    vws_tracer_stop();
+    ASSERT_FALSE(vws_tracer_active());
+
+    // Ignored when stopped
+    vws_tev_emit(VTE_USER + 1, 0, 0, 0);
+
+    // Every event is either recorded, in order, or counted as dropped
+    FILE* in = fopen(path, "rb");
+    ASSERT_NOT_NULL(in);
+    fseek(in, 16, SEEK_SET);
+
+    vws_tev e;
+    uint64_t total              = 0;
+    uint64_t recorded           = 0;
+    uint64_t dropped            = 0;
+    uint64_t threads_seen       = 0;
+    int64_t last[TRACE_THREADS] = { -1, -1, -1, -1 };
+
+    while (fread(&e, sizeof(e), 1, in) == 1)
+    {
+        total++;
+
+        switch (e.id)
+        {
+            case VTE_USER + 1:
+            {
+                ASSERT_TRUE((int64_t)e.arg[1] > last[e.arg[0]]);
+                last[e.arg[0]] = e.arg[1];
+                recorded++;
+                break;
+            }
+
+            case VTE_DROPPED:
+            {
+                dropped += e.arg[0];
+                break;
+            }
+
+            case VTE_THREAD:
+            {
+                threads_seen++;
+                break;
+            }
+        }
+    }
+
+    ASSERT_EQUAL(TRACE_THREADS, threads_seen);
+    ASSERT_EQUAL(TRACE_THREADS * TRACE_EVENTS, recorded + dropped);
+
+    // Decode
+    rewind(in);
+    FILE* out = tmpfile();
+    ASSERT_EQUAL(total, vws_tracer_decode(in, out));
+    fclose(out);
+    fclose(in);
+
+    remove(path);
+}
+
 CTEST(test, map)
 {
     ASSERT_EQUAL(1, 1);
@@ -31,6 +31,164 @@ CTEST(test_rpc, call)
     vws_http_msg_free(req);
 }
 
+CTEST(test_http, borrow)
+{
+    char data[] = "GET /hello HTTP/1.1\r\n"
+                  "Host: example.com\r\n"
+                  "X-Empty:\r\n"
+                  "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                  "\r\n";
+
+    vws_http_msg* req = vws_http_msg_new(HTTP_REQUEST);
+    req->borrow       = true;
+
+    // Feed in pieces, splitting names and values, keeping data in place
+    size_t size   = strlen(data);
+    size_t cuts[] = { 7, 24, 30, 50, size };
+    size_t at     = 0;
+
+    for (size_t i = 0; i < sizeof(cuts) / sizeof(cuts[0]); i++)
+    {
+        ASSERT_FALSE(req->headers_complete);
+        vws_http_msg_parse(req, data + at, cuts[i] - at);
+        at = cuts[i];
+    }
+
+    ASSERT_TRUE(req->done);
+    ASSERT_EQUAL(size, req->consumed);
+    ASSERT_EQUAL(0, vws_kvs_size(req->headers));
+
+    ASSERT_STR("example.com", vws_http_msg_header(req, "host"));
+    ASSERT_STR("", vws_http_msg_header(req, "x-empty"));
+    ASSERT_STR( "dGhlIHNhbXBsZSBub25jZQ==",
+                vws_http_msg_header(req, "Sec-WebSocket-Key") );
+    ASSERT_NULL(vws_http_msg_header(req, "upgrade"));
+
+    // Detached headers survive the data
+    vws_http_msg_detach(req);
+    memset(data, 0, size);
+
+    ASSERT_STR("example.com", vws_http_msg_header(req, "host"));
+    ASSERT_EQUAL(3, vws_kvs_size(req->headers));
+
+    // Reset for reuse
+    vws_http_msg_reset(req);
+    ASSERT_FALSE(req->done);
+    ASSERT_EQUAL(0, vws_kvs_size(req->headers));
+
+    cstr next = "GET /next HTTP/1.1\r\nHost: other\r\n\r\n";
+    vws_http_msg_parse(req, next, strlen(next));
+    ASSERT_TRUE(req->done);
+    ASSERT_STR("other", vws_http_msg_header(req, "host"));
+
+    vws_http_msg_free(req);
+}
+
+CTEST(test_http, response)
+{
+    vws_buffer* b = vws_buffer_new();
+    cstr body     = "Hello world";
+
+    vws_http_response( b, 200, "Content-Type: text/plain\r\n",
+                       (ucstr)body, strlen(body), false );
+
+    vws_http_response(b, 404, NULL, NULL, 0, true);
+
+    cstr expect = "HTTP/1.1 200 OK\r\n"
+                  "Content-Length: 11\r\n"
+                  "Content-Type: text/plain\r\n"
+                  "\r\n"
+                  "Hello world"
+                  "HTTP/1.1 404 Not Found\r\n"
+                  "Content-Length: 0\r\n"
+                  "Connection: close\r\n"
+                  "\r\n";
+
+    ASSERT_EQUAL(strlen(expect), b->size);
+    ASSERT_TRUE(strncmp(expect, (cstr)b->data, b->size) == 0);
+
+    // Both parse back
+    vws_http_msg* m = vws_http_msg_new(HTTP_RESPONSE);
+    int n           = vws_http_msg_parse(m, (cstr)b->data, b->size);
+    ASSERT_TRUE(m->done);
+    ASSERT_EQUAL(200, vws_http_msg_status_code(m));
+    ASSERT_EQUAL(11, m->body->size);
+    ASSERT_TRUE(vws_http_msg_keep_alive(m));
+
+    vws_http_msg_reset(m);
+    vws_http_msg_parse(m, (cstr)b->data + n, b->size - n);
+    ASSERT_TRUE(m->done);
+    ASSERT_EQUAL(404, vws_http_msg_status_code(m));
+    ASSERT_FALSE(vws_http_msg_keep_alive(m));
+
+    vws_http_msg_free(m);
+    vws_buffer_free(b);
+}
+
+CTEST(test_http, response_no_content)
+{
+    vws_buffer* b = vws_buffer_new();
+
+    // No Content-Length and no body, even if one is passed
+    vws_http_response(b, 204, NULL, (ucstr)"ignored", 7, false);
+
+    cstr expect = "HTTP/1.1 204 No Content\r\n"
+                  "\r\n";
+
+    ASSERT_EQUAL(strlen(expect), b->size);
+    ASSERT_TRUE(strncmp(expect, (cstr)b->data, b->size) == 0);
+
+    vws_http_msg* m = vws_http_msg_new(HTTP_RESPONSE);
+    vws_http_msg_parse(m, (cstr)b->data, b->size);
+    ASSERT_TRUE(m->done);
+    ASSERT_EQUAL(204, vws_http_msg_status_code(m));
+    ASSERT_EQUAL(0, m->body->size);
+
+    vws_http_msg_free(m);
+    vws_buffer_free(b);
+}
+
+CTEST(test_http, response_informational)
+{
+    vws_buffer* b = vws_buffer_new();
+
+    vws_http_response(b, 100, NULL, NULL, 0, false);
+    vws_http_response(b, 101, "Upgrade: websocket\r\n", NULL, 0, false);
+
+    cstr expect = "HTTP/1.1 100 Continue\r\n"
+                  "\r\n"
+                  "HTTP/1.1 101 Switching Protocols\r\n"
+                  "Upgrade: websocket\r\n"
+                  "\r\n";
+
+    ASSERT_EQUAL(strlen(expect), b->size);
+    ASSERT_TRUE(strncmp(expect, (cstr)b->data, b->size) == 0);
+
+    vws_buffer_free(b);
+}
+
+CTEST(test_http, keep_alive)
+{
+    cstr requests[] =
+    {
+        "GET / HTTP/1.1\r\n\r\n",
+        "GET / HTTP/1.1\r\nConnection: close\r\n\r\n",
+        "GET / HTTP/1.0\r\n\r\n",
+        "GET / HTTP/1.0\r\nConnection: keep-alive\r\n\r\n"
+    };
+
+    bool expect[] = { true, false, false, true };
+
+    for (int i = 0; i < 4; i++)
+    {
+        vws_http_msg* m = vws_http_msg_new(HTTP_REQUEST);
+        vws_http_msg_parse(m, requests[i], strlen(requests[i]));
+        ASSERT_TRUE(m->done);
+        ASSERT_EQUAL(expect[i], vws_http_msg_keep_alive(m));
+        vws_http_msg_free(m);
+    }
+}
+
 int main(int argc, const char* argv[])
 {
     return ctest_main(argc, argv);
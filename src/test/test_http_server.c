@@ -1,3 +1,6 @@
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
 #include "server.h"
 #include "message.h"
 
@@ -30,6 +33,9 @@ bool process(vws_svr* s, vws_cid_t cid, vws_http_msg* msg, void* ctx)
     // Create response
     vws_svr_data* reply = vws_svr_data_own(server, cid, (ucstr)data, strlen(data));
 
+    // Final response to the request
+    vws_set_flag(&reply->flags, VWS_SVR_STATE_HTTP);
+
     // Send reply. This will wakeup network thread.
     vws_tcp_svr_send(reply);
 
@@ -169,6 +175,901 @@ CTEST(test_http_server, http)
     vws_svr_free(server);
 }
 
+void metrics_server_thread(void* arg)
+{
+    vws_svr* server      = (vws_svr*)arg;
+    server->process_http = vws_svr_metrics_http;
+
+    vws_tcp_svr_run((vws_tcp_svr*)server, server_host, server_port);
+
+    vws_cleanup();
+}
+
+static vws_http_msg* metrics_get(vws_socket* s, cstr path)
+{
+    char request[128];
+    snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: x\r\n\r\n", path);
+
+    vws_buffer_clear(s->buffer);
+    ASSERT_TRUE(vws_socket_write(s, (ucstr)request, strlen(request)) > 0);
+
+    vws_http_msg* reply = vws_http_msg_new(HTTP_RESPONSE);
+
+    while (reply->done == false)
+    {
+        ASSERT_TRUE(vws_socket_read(s) > 0);
+        ssize_t n = vws_http_msg_parse(reply, s->buffer->data, s->buffer->size);
+        vws_buffer_drain(s->buffer, n);
+    }
+
+    return reply;
+}
+
+CTEST(test_http_server, metrics)
+{
+    vws_svr* server = vws_svr_new(2, 0, 0);
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, metrics_server_thread, server);
+
+    // Wait for server to start up
+    while (vws_tcp_svr_state((vws_tcp_svr*)server) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    vws_socket* s = vws_socket_new();
+    ASSERT_TRUE(vws_socket_connect(s, server_host, server_port, false));
+
+    vws_http_msg* reply = metrics_get(s, "/metrics");
+    ASSERT_EQUAL(200, vws_http_msg_status_code(reply));
+
+    cstr body = (cstr)reply->body->data;
+    ASSERT_TRUE(strstr(body, "vws_connections_opened_total 1\n") != NULL);
+    ASSERT_TRUE(strstr(body, "# TYPE vws_request_wait_seconds summary") != NULL);
+    vws_http_msg_free(reply);
+
+    vws_socket_free(s);
+
+    s = vws_socket_new();
+    ASSERT_TRUE(vws_socket_connect(s, server_host, server_port, false));
+
+    reply = metrics_get(s, "/other");
+    ASSERT_EQUAL(404, vws_http_msg_status_code(reply));
+    vws_http_msg_free(reply);
+
+    vws_socket_free(s);
+
+    sleep(1);
+
+    vws_svr_metrics* m = vws_tcp_svr_metrics((vws_tcp_svr*)server);
+    ASSERT_EQUAL(2, m->counters[VWS_METRIC_CNX_OPENED]);
+    ASSERT_EQUAL(2, m->counters[VWS_METRIC_CNX_CLOSED]);
+    ASSERT_EQUAL(2, m->counters[VWS_METRIC_REQUESTS]);
+    ASSERT_EQUAL(2, m->counters[VWS_METRIC_RESPONSES]);
+    ASSERT_EQUAL(0, m->counters[VWS_METRIC_WRITE_BACKLOG]);
+    ASSERT_TRUE(m->counters[VWS_METRIC_BYTES_IN] > 0);
+    ASSERT_TRUE(m->counters[VWS_METRIC_BYTES_OUT] > 0);
+    ASSERT_EQUAL(2, m->stages[VWS_STAGE_REQUEST_WAIT].count);
+    ASSERT_EQUAL(2, m->stages[VWS_STAGE_HANDLER].count);
+    ASSERT_EQUAL(2, m->stages[VWS_STAGE_RESPONSE_WAIT].count);
+    ASSERT_EQUAL(2, m->stages[VWS_STAGE_WRITE].count);
+    ASSERT_EQUAL(2, m->stages[VWS_STAGE_TOTAL].count);
+
+    // End to end covers the stages before it
+    vws_hist* total = &m->stages[VWS_STAGE_TOTAL];
+    vws_hist* wait  = &m->stages[VWS_STAGE_REQUEST_WAIT];
+    ASSERT_TRUE(total->sum >= wait->sum);
+    vws_svr_metrics_free(m);
+
+    // Shutdown server
+    vws_tcp_svr_stop((vws_tcp_svr*)server);
+    uv_thread_join(&server_tid);
+    vws_svr_free(server);
+}
+
+// Replies 200 if the request carried the expected host header
+bool split_process(vws_svr* s, vws_cid_t cid, vws_http_msg* msg, void* ctx)
+{
+    cstr host   = vws_http_msg_header(msg, "host");
+    bool found  = (host != NULL) && (strcmp(host, "example.com") == 0);
+    cstr status = found ? "200 OK" : "400 Bad Request";
+
+    vws_buffer* b = vws_buffer_new();
+    vws_buffer_printf(b, "HTTP/1.1 %s\r\nContent-Length: 0\r\n\r\n", status);
+
+    vws_svr_data* reply = vws_svr_data_new((vws_tcp_svr*)s, cid, &b);
+    vws_set_flag(&reply->flags, VWS_SVR_STATE_HTTP);
+    vws_tcp_svr_send(reply);
+    vws_buffer_free(b);
+
+    return true;
+}
+
+void split_server_thread(void* arg)
+{
+    vws_svr* server      = (vws_svr*)arg;
+    server->process_http = split_process;
+
+    vws_tcp_svr_run((vws_tcp_svr*)server, server_host, server_port);
+
+    vws_cleanup();
+}
+
+CTEST(test_http_server, split)
+{
+    vws_svr* server = vws_svr_new(2, 0, 0);
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, split_server_thread, server);
+
+    while (vws_tcp_svr_state((vws_tcp_svr*)server) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    vws_socket* s = vws_socket_new();
+    ASSERT_TRUE(vws_socket_connect(s, server_host, server_port, false));
+
+    // Request headers arrive over several reads, splitting a header name and
+    // value. The second request reuses a pooled parser.
+    cstr parts[] = { "GET / HTTP/1.1\r\nHo", "st: exam", "ple.com\r\n\r\n" };
+
+    for (int r = 0; r < 2; r++)
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            size_t size = strlen(parts[i]);
+            ASSERT_TRUE(vws_socket_write(s, (ucstr)parts[i], size) > 0);
+            vws_msleep(50);
+        }
+
+        vws_http_msg* reply = vws_http_msg_new(HTTP_RESPONSE);
+
+        while (reply->done == false)
+        {
+            ASSERT_TRUE(vws_socket_read(s) > 0);
+            ssize_t n = vws_http_msg_parse(reply, s->buffer->data, s->buffer->size);
+            vws_buffer_drain(s->buffer, n);
+        }
+
+        ASSERT_EQUAL(200, vws_http_msg_status_code(reply));
+        vws_http_msg_free(reply);
+    }
+
+    vws_socket_free(s);
+
+    vws_tcp_svr_stop((vws_tcp_svr*)server);
+    uv_thread_join(&server_tid);
+    vws_svr_free(server);
+}
+
+// Replies with the path as body, the first requests taking the longest
+bool pipeline_process(vws_svr* s, vws_cid_t cid, vws_http_msg* msg, void* ctx)
+{
+    cstr path = (cstr)msg->url->data;
+    size_t n  = msg->url->size;
+
+    if ((n == 2) && (path[1] >= '1') && (path[1] <= '3'))
+    {
+        vws_msleep(('4' - path[1]) * 50);
+    }
+
+    vws_svr_http_reply(s, cid, msg, 200, NULL, (ucstr)path, n);
+
+    return true;
+}
+
+// Answers /inline on the network thread and declines the rest
+bool pipeline_inline(vws_svr* s, vws_http_msg* msg, vws_buffer* out)
+{
+    cstr path = (cstr)msg->url->data;
+
+    if ((msg->url->size != 7) || (strncmp(path, "/inline", 7) != 0))
+    {
+        return false;
+    }
+
+    bool close = (vws_http_msg_keep_alive(msg) == false);
+    vws_http_response(out, 200, NULL, (ucstr)"inline", 6, close);
+
+    return true;
+}
+
+void pipeline_server_thread(void* arg)
+{
+    vws_svr* server      = (vws_svr*)arg;
+    server->process_http = pipeline_process;
+    server->inline_http  = pipeline_inline;
+
+    vws_tcp_svr_run((vws_tcp_svr*)server, server_host, server_port);
+
+    vws_cleanup();
+}
+
+static void pipeline_test(vws_svr_backend_t backend)
+{
+    vws_svr* server = vws_svr_new(4, 0, 0);
+
+    ((vws_tcp_svr*)server)->backend = backend;
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, pipeline_server_thread, server);
+
+    while (vws_tcp_svr_state((vws_tcp_svr*)server) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    // The server falls back to libuv where io_uring is not available
+    if ( (backend == VWS_SVR_BACKEND_URING) &&
+         (((vws_tcp_svr*)server)->ring == NULL) )
+    {
+        vws_tcp_svr_stop((vws_tcp_svr*)server);
+        uv_thread_join(&server_tid);
+        vws_svr_free(server);
+
+        CTEST_LOG("io_uring not available, skipped");
+        return;
+    }
+
+    vws_socket* s = vws_socket_new();
+    ASSERT_TRUE(vws_socket_connect(s, server_host, server_port, false));
+
+    // All requests in one write. Workers finish them in reverse order, but
+    // responses must follow request order. The last closes the connection.
+    cstr requests = "GET /1 HTTP/1.1\r\nHost: x\r\n\r\n"
+                    "GET /inline HTTP/1.1\r\nHost: x\r\n\r\n"
+                    "GET /2 HTTP/1.1\r\nHost: x\r\n\r\n"
+                    "GET /3 HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n"
+                    "GET /inline HTTP/1.1\r\nHost: x\r\n\r\n";
+
+    ASSERT_TRUE(vws_socket_write(s, (ucstr)requests, strlen(requests)) > 0);
+
+    cstr bodies[] = { "/1", "inline", "/2", "/3" };
+
+    for (int i = 0; i < 4; i++)
+    {
+        vws_http_msg* reply = vws_http_msg_new(HTTP_RESPONSE);
+
+        while (true)
+        {
+            ssize_t n = vws_http_msg_parse( reply,
+                                            (cstr)s->buffer->data,
+                                            s->buffer->size );
+            vws_buffer_drain(s->buffer, n);
+
+            if (reply->done == true)
+            {
+                break;
+            }
+
+            ASSERT_TRUE(vws_socket_read(s) > 0);
+        }
+
+        ASSERT_EQUAL(200, vws_http_msg_status_code(reply));
+        cstr body = (cstr)reply->body->data;
+        ASSERT_EQUAL(strlen(bodies[i]), reply->body->size);
+        ASSERT_TRUE(strncmp(bodies[i], body, reply->body->size) == 0);
+        ASSERT_EQUAL(i < 3, vws_http_msg_keep_alive(reply));
+        vws_http_msg_free(reply);
+    }
+
+    // The server closes after the last response, ignoring the request after
+    ASSERT_EQUAL(0, s->buffer->size);
+    ASSERT_TRUE(vws_socket_read(s) <= 0);
+
+    vws_socket_free(s);
+
+    sleep(1);
+
+    // Only worker requests go through the queues
+    vws_svr_metrics* m = vws_tcp_svr_metrics((vws_tcp_svr*)server);
+    ASSERT_EQUAL(1, m->counters[VWS_METRIC_CNX_CLOSED]);
+    ASSERT_EQUAL(3, m->counters[VWS_METRIC_REQUESTS]);
+    ASSERT_EQUAL(3, m->counters[VWS_METRIC_RESPONSES]);
+    vws_svr_metrics_free(m);
+
+    vws_tcp_svr_stop((vws_tcp_svr*)server);
+    uv_thread_join(&server_tid);
+    vws_svr_free(server);
+}
+
+CTEST(test_http_server, pipeline)
+{
+    pipeline_test(VWS_SVR_BACKEND_UV);
+}
+
+// Same over io_uring. Logs and returns early where it is not available.
+CTEST(test_http_server, pipeline_uring)
+{
+    pipeline_test(VWS_SVR_BACKEND_URING);
+}
+
+// Requests answered from deferred_thread() after process_http has returned
+typedef struct
+{
+    uv_mutex_t lock;
+    vws_svr* server;
+    vws_cid_t cids[8];
+    char paths[8][8];
+    bool close[8];
+    int count;
+    bool stop;
+} deferred_ctx;
+
+static deferred_ctx deferred;
+
+bool deferred_process(vws_svr* s, vws_cid_t cid, vws_http_msg* msg, void* ctx)
+{
+    uv_mutex_lock(&deferred.lock);
+
+    int i = deferred.count++;
+    snprintf( deferred.paths[i], sizeof(deferred.paths[i]), "%.*s",
+              (int)msg->url->size, (cstr)msg->url->data );
+    deferred.cids[i]  = cid;
+    deferred.close[i] = (vws_http_msg_keep_alive(msg) == false);
+
+    uv_mutex_unlock(&deferred.lock);
+
+    return true;
+}
+
+// Replies to each request in turn. /2 is completed with vws_svr_http_done(),
+// the others by the flag on their response.
+void deferred_thread(void* arg)
+{
+    int next = 0;
+
+    while (true)
+    {
+        uv_mutex_lock(&deferred.lock);
+        bool stop  = deferred.stop;
+        bool ready = (next < deferred.count);
+        uv_mutex_unlock(&deferred.lock);
+
+        if (stop == true)
+        {
+            break;
+        }
+
+        if (ready == false)
+        {
+            vws_msleep(10);
+            continue;
+        }
+
+        vws_msleep(50);
+
+        cstr path           = deferred.paths[next];
+        vws_cid_t c         = deferred.cids[next];
+        vws_tcp_svr* server = (vws_tcp_svr*)deferred.server;
+
+        vws_buffer* b = vws_buffer_new();
+        vws_http_response( b, 200, NULL, (ucstr)path, strlen(path),
+                           deferred.close[next] );
+
+        vws_svr_data* reply = vws_svr_data_new(server, c, &b);
+        bool done           = (strcmp(path, "/2") == 0);
+
+        if (done == false)
+        {
+            vws_set_flag(&reply->flags, VWS_SVR_STATE_HTTP);
+        }
+
+        vws_tcp_svr_send(reply);
+        vws_buffer_free(b);
+
+        if (done == true)
+        {
+            vws_svr_http_done(deferred.server, c);
+        }
+
+        next++;
+    }
+}
+
+void deferred_server_thread(void* arg)
+{
+    vws_svr* server      = (vws_svr*)arg;
+    server->process_http = deferred_process;
+
+    vws_tcp_svr_run((vws_tcp_svr*)server, server_host, server_port);
+
+    vws_cleanup();
+}
+
+CTEST(test_http_server, deferred)
+{
+    vws_svr* server = vws_svr_new(2, 0, 0);
+
+    memset(&deferred, 0, sizeof(deferred));
+    uv_mutex_init(&deferred.lock);
+    deferred.server = server;
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, deferred_server_thread, server);
+
+    while (vws_tcp_svr_state((vws_tcp_svr*)server) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    uv_thread_t reply_tid;
+    uv_thread_create(&reply_tid, deferred_thread, NULL);
+
+    vws_socket* s = vws_socket_new();
+    ASSERT_TRUE(vws_socket_connect(s, server_host, server_port, false));
+
+    // Responses come from another thread after process_http returns. Each
+    // request waits for the response to the one before it, and the
+    // connection closes only once the response to /3 is written.
+    cstr requests = "GET /1 HTTP/1.1\r\nHost: x\r\n\r\n"
+                    "GET /2 HTTP/1.1\r\nHost: x\r\n\r\n"
+                    "GET /3 HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n"
+                    "GET /4 HTTP/1.1\r\nHost: x\r\n\r\n";
+
+    ASSERT_TRUE(vws_socket_write(s, (ucstr)requests, strlen(requests)) > 0);
+
+    cstr bodies[] = { "/1", "/2", "/3" };
+
+    for (int i = 0; i < 3; i++)
+    {
+        vws_http_msg* reply = vws_http_msg_new(HTTP_RESPONSE);
+
+        while (true)
+        {
+            ssize_t n = vws_http_msg_parse( reply,
+                                            (cstr)s->buffer->data,
+                                            s->buffer->size );
+            vws_buffer_drain(s->buffer, n);
+
+            if (reply->done == true)
+            {
+                break;
+            }
+
+            ASSERT_TRUE(vws_socket_read(s) > 0);
+        }
+
+        ASSERT_EQUAL(200, vws_http_msg_status_code(reply));
+        cstr body = (cstr)reply->body->data;
+        ASSERT_EQUAL(strlen(bodies[i]), reply->body->size);
+        ASSERT_TRUE(strncmp(bodies[i], body, reply->body->size) == 0);
+        vws_http_msg_free(reply);
+    }
+
+    ASSERT_EQUAL(0, s->buffer->size);
+    ASSERT_TRUE(vws_socket_read(s) <= 0);
+
+    vws_socket_free(s);
+
+    // /4 never reached a worker
+    uv_mutex_lock(&deferred.lock);
+    ASSERT_EQUAL(3, deferred.count);
+    deferred.stop = true;
+    uv_mutex_unlock(&deferred.lock);
+
+    uv_thread_join(&reply_tid);
+
+    vws_tcp_svr_stop((vws_tcp_svr*)server);
+    uv_thread_join(&server_tid);
+    vws_svr_free(server);
+    uv_mutex_destroy(&deferred.lock);
+}
+
+void files_server_thread(void* arg)
+{
+    vws_svr* server = (vws_svr*)arg;
+
+    vws_tcp_svr_run((vws_tcp_svr*)server, server_host, server_port);
+
+    vws_cleanup();
+}
+
+// Sends a request, if any, and parses the next response
+static vws_http_msg* files_request(vws_socket* s, cstr request)
+{
+    size_t size = strlen(request);
+    ASSERT_TRUE((size == 0) || (vws_socket_write(s, (ucstr)request, size) > 0));
+
+    vws_http_msg* reply = vws_http_msg_new(HTTP_RESPONSE);
+
+    while (true)
+    {
+        ssize_t n = vws_http_msg_parse( reply,
+                                        (cstr)s->buffer->data,
+                                        s->buffer->size );
+        vws_buffer_drain(s->buffer, n);
+
+        if (reply->done == true)
+        {
+            return reply;
+        }
+
+        ASSERT_TRUE(vws_socket_read(s) > 0);
+    }
+}
+
+static void files_write(cstr dir, cstr name, ucstr data, size_t size)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+    FILE* f = fopen(path, "wb");
+    ASSERT_NOT_NULL(f);
+    ASSERT_EQUAL(size, fwrite(data, 1, size, f));
+    fclose(f);
+}
+
+static void files_remove(cstr dir)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/index.html", dir);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/big.bin", dir);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/new.txt", dir);
+    unlink(path);
+    rmdir(dir);
+}
+
+static void files_test(vws_svr_backend_t backend)
+{
+    // Files to serve
+    char dir[] = "/tmp/vws_files_XXXXXX";
+    ASSERT_NOT_NULL(mkdtemp(dir));
+
+    cstr index = "<html>index</html>";
+    files_write(dir, "index.html", (ucstr)index, strlen(index));
+
+    // Large enough to fill the socket buffer
+    size_t size = 8 * 1024 * 1024;
+    unsigned char* big = vws.malloc(size);
+
+    for (size_t i = 0; i < size; i++)
+    {
+        big[i] = (unsigned char)(i * 7);
+    }
+
+    files_write(dir, "big.bin", big, size);
+
+    vws_svr* server = vws_svr_new(2, 0, 0);
+
+    ((vws_tcp_svr*)server)->backend = backend;
+    ASSERT_TRUE(vws_svr_static(server, "/static/", dir));
+    ASSERT_FALSE(vws_svr_static(server, "/", "/nonexistent"));
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, files_server_thread, server);
+
+    while (vws_tcp_svr_state((vws_tcp_svr*)server) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    // The server falls back to libuv where io_uring is not available
+    if ( (backend == VWS_SVR_BACKEND_URING) &&
+         (((vws_tcp_svr*)server)->ring == NULL) )
+    {
+        vws_tcp_svr_stop((vws_tcp_svr*)server);
+        uv_thread_join(&server_tid);
+        vws_svr_free(server);
+        files_remove(dir);
+        vws.free(big);
+
+        CTEST_LOG("io_uring not available, skipped");
+        return;
+    }
+
+    vws_socket* s = vws_socket_new();
+    ASSERT_TRUE(vws_socket_connect(s, server_host, server_port, false));
+
+    // Directory index
+    vws_http_msg* reply = files_request(s, "GET /static/ HTTP/1.1\r\n\r\n");
+    ASSERT_EQUAL(200, vws_http_msg_status_code(reply));
+    ASSERT_EQUAL(strlen(index), reply->body->size);
+    ASSERT_TRUE(strncmp(index, (cstr)reply->body->data, strlen(index)) == 0);
+    ASSERT_STR( "text/html; charset=utf-8",
+                vws_http_msg_header(reply, "content-type") );
+
+    char etag[64];
+    cstr tag = vws_http_msg_header(reply, "etag");
+    ASSERT_NOT_NULL(tag);
+    snprintf(etag, sizeof(etag), "%s", tag);
+    vws_http_msg_free(reply);
+
+    // Large file, pipelined behind a conditional request
+    char request[256];
+    snprintf( request, sizeof(request),
+              "GET /static/index.html HTTP/1.1\r\n"
+              "If-None-Match: %s\r\n\r\n"
+              "GET /static/big.bin?v=1 HTTP/1.1\r\n\r\n", etag );
+
+    // Not reading for a while, with a small receive buffer, makes the server
+    // wait for the socket
+    int rcvbuf = 64 * 1024;
+    setsockopt(s->sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    ASSERT_TRUE(vws_socket_write(s, (ucstr)request, strlen(request)) > 0);
+    vws_msleep(200);
+
+    reply = files_request(s, "");
+    ASSERT_EQUAL(304, vws_http_msg_status_code(reply));
+    ASSERT_STR(etag, vws_http_msg_header(reply, "etag"));
+    vws_http_msg_free(reply);
+
+    reply = files_request(s, "");
+    ASSERT_EQUAL(200, vws_http_msg_status_code(reply));
+    ASSERT_EQUAL(size, reply->body->size);
+    ASSERT_TRUE(memcmp(big, reply->body->data, size) == 0);
+    ASSERT_STR( "application/octet-stream",
+                vws_http_msg_header(reply, "content-type") );
+    vws_http_msg_free(reply);
+
+    // Errors
+    reply = files_request(s, "GET /static/missing HTTP/1.1\r\n\r\n");
+    ASSERT_EQUAL(404, vws_http_msg_status_code(reply));
+    vws_http_msg_free(reply);
+
+    reply = files_request(s, "GET /static/%2e%2e/etc HTTP/1.1\r\n\r\n");
+    ASSERT_EQUAL(404, vws_http_msg_status_code(reply));
+    vws_http_msg_free(reply);
+
+    cstr post = "POST /static/index.html HTTP/1.1\r\n"
+                "Content-Length: 0\r\n\r\n";
+    reply     = files_request(s, post);
+    ASSERT_EQUAL(405, vws_http_msg_status_code(reply));
+    vws_http_msg_free(reply);
+
+    // A file not yet cached holds back the cached one requested after it
+    cstr text = "new";
+    files_write(dir, "new.txt", (ucstr)text, strlen(text));
+
+    cstr pair = "GET /static/new.txt HTTP/1.1\r\n\r\n"
+                "GET /static/index.html HTTP/1.1\r\n\r\n";
+    ASSERT_TRUE(vws_socket_write(s, (ucstr)pair, strlen(pair)) > 0);
+
+    reply = files_request(s, "");
+    ASSERT_EQUAL(200, vws_http_msg_status_code(reply));
+    ASSERT_EQUAL(strlen(text), reply->body->size);
+    ASSERT_TRUE(strncmp(text, (cstr)reply->body->data, strlen(text)) == 0);
+    ASSERT_STR( "text/plain; charset=utf-8",
+                vws_http_msg_header(reply, "content-type") );
+    vws_http_msg_free(reply);
+
+    reply = files_request(s, "");
+    ASSERT_EQUAL(200, vws_http_msg_status_code(reply));
+    ASSERT_EQUAL(strlen(index), reply->body->size);
+    vws_http_msg_free(reply);
+
+    // Checked again once the ttl is up, and served anew when changed
+    cstr changed = "<html>changed</html>";
+    files_write(dir, "index.html", (ucstr)changed, strlen(changed));
+    vws_msleep(1100);
+
+    reply = files_request(s, "GET /static/index.html HTTP/1.1\r\n\r\n");
+    ASSERT_EQUAL(200, vws_http_msg_status_code(reply));
+    ASSERT_EQUAL(strlen(changed), reply->body->size);
+    ASSERT_TRUE(strncmp(changed, (cstr)reply->body->data, strlen(changed)) == 0);
+    ASSERT_TRUE(strcmp(etag, vws_http_msg_header(reply, "etag")) != 0);
+    vws_http_msg_free(reply);
+
+    // HEAD has no body. The connection closes after it.
+    cstr head = "HEAD /static/big.bin HTTP/1.1\r\nConnection: close\r\n\r\n";
+    ASSERT_TRUE(vws_socket_write(s, (ucstr)head, strlen(head)) > 0);
+
+    while (vws_socket_read(s) > 0)
+    {
+    }
+
+    vws_buffer_append(s->buffer, (ucstr)"", 1);
+    cstr data = (cstr)s->buffer->data;
+    ASSERT_TRUE(strstr(data, "Content-Length: 8388608\r\n") != NULL);
+    ASSERT_TRUE(strstr(data, "\r\n\r\n")[4] == 0);
+
+    vws_socket_free(s);
+
+    sleep(1);
+
+    // Nothing went through the worker pool
+    vws_svr_metrics* m = vws_tcp_svr_metrics((vws_tcp_svr*)server);
+    ASSERT_EQUAL(0, m->counters[VWS_METRIC_REQUESTS]);
+    ASSERT_EQUAL(1, m->counters[VWS_METRIC_CNX_CLOSED]);
+    vws_svr_metrics_free(m);
+
+    vws_tcp_svr_stop((vws_tcp_svr*)server);
+    uv_thread_join(&server_tid);
+    vws_svr_free(server);
+
+    files_remove(dir);
+    vws.free(big);
+}
+
+CTEST(test_http_server, files)
+{
+    files_test(VWS_SVR_BACKEND_UV);
+}
+
+// Same over io_uring. Logs and returns early where it is not available.
+CTEST(test_http_server, files_uring)
+{
+    files_test(VWS_SVR_BACKEND_URING);
+}
+
+CTEST(test_http_server, upgrade)
+{
+    vws_svr* server = vws_svr_new(1, 0, 0);
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, split_server_thread, server);
+
+    while (vws_tcp_svr_state((vws_tcp_svr*)server) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    // The second protocol list is too long for the stack response buffer
+    char longer[400];
+    memset(longer, 'p', sizeof(longer) - 1);
+    longer[sizeof(longer) - 1] = 0;
+
+    cstr protos[] = { NULL, "chat", longer };
+    char request[1024];
+
+    for (int i = 0; i < 3; i++)
+    {
+        vws_socket* s = vws_socket_new();
+        ASSERT_TRUE(vws_socket_connect(s, server_host, server_port, false));
+
+        int size = snprintf( request, sizeof(request),
+                             "GET /websocket HTTP/1.1\r\n"
+                             "Host: localhost\r\n"
+                             "Upgrade: websocket\r\n"
+                             "Connection: Upgrade\r\n"
+                             "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                             "%s%s%s"
+                             "Sec-WebSocket-Version: 13\r\n"
+                             "\r\n",
+                             protos[i] ? "Sec-WebSocket-Protocol: " : "",
+                             protos[i] ? protos[i] : "",
+                             protos[i] ? "\r\n" : "" );
+
+        ASSERT_TRUE(vws_socket_write(s, (ucstr)request, size) > 0);
+
+        vws_http_msg* reply = vws_http_msg_new(HTTP_RESPONSE);
+
+        while (reply->done == false)
+        {
+            ASSERT_TRUE(vws_socket_read(s) > 0);
+            ssize_t n = vws_http_msg_parse(reply, s->buffer->data, s->buffer->size);
+            vws_buffer_drain(s->buffer, n);
+        }
+
+        cstr accept = vws_http_msg_header(reply, "sec-websocket-accept");
+        cstr proto  = vws_http_msg_header(reply, "sec-websocket-protocol");
+
+        ASSERT_EQUAL(101, vws_http_msg_status_code(reply));
+        ASSERT_STR("s3pPLMBiTxaQ9kYGzzhZRbK+xOo=", accept);
+        ASSERT_STR(protos[i] ? protos[i] : "vrtql", proto);
+
+        vws_http_msg_free(reply);
+        vws_socket_free(s);
+    }
+
+    vws_tcp_svr_stop((vws_tcp_svr*)server);
+    uv_thread_join(&server_tid);
+    vws_svr_free(server);
+}
+
+// Options seen on the last accepted socket. Written by the loop thread.
+static int sockopts_nodelay   = -1;
+static int sockopts_keepalive = -1;
+static vws_tcp_svr_connect sockopts_next;
+
+static void sockopts_connect(vws_svr_cnx* c)
+{
+    uv_os_fd_t fd;
+    socklen_t size = sizeof(int);
+
+    if (uv_fileno((uv_handle_t*)c->handle, &fd) == 0)
+    {
+        getsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &sockopts_nodelay, &size);
+        getsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &sockopts_keepalive, &size);
+    }
+
+    sockopts_next(c);
+}
+
+void sockopts_server_thread(void* arg)
+{
+    vws_svr* server      = (vws_svr*)arg;
+    server->process_http = split_process;
+
+    // Dual-stack, so IPv4 clients get in as well
+    vws_tcp_svr_run((vws_tcp_svr*)server, "::", server_port);
+
+    vws_cleanup();
+}
+
+static void sockopts_request(cstr host)
+{
+    cstr request  = "GET / HTTP/1.1\r\nHost: example.com\r\n\r\n";
+    vws_socket* s = vws_socket_new();
+    ASSERT_TRUE(vws_socket_connect(s, host, server_port, false));
+
+    // Deferred accept holds the connection until this arrives
+    ASSERT_TRUE(vws_socket_write(s, (ucstr)request, strlen(request)) > 0);
+
+    vws_http_msg* reply = vws_http_msg_new(HTTP_RESPONSE);
+
+    while (reply->done == false)
+    {
+        ASSERT_TRUE(vws_socket_read(s) > 0);
+        ssize_t n = vws_http_msg_parse(reply, s->buffer->data, s->buffer->size);
+        vws_buffer_drain(s->buffer, n);
+    }
+
+    ASSERT_EQUAL(200, vws_http_msg_status_code(reply));
+
+    vws_http_msg_free(reply);
+    vws_socket_free(s);
+}
+
+CTEST(test_http_server, sockopts)
+{
+    vws_svr* server   = vws_svr_new(1, 0, 0);
+    vws_tcp_svr* base = (vws_tcp_svr*)server;
+    sockopts_next     = base->on_connect;
+    base->on_connect  = sockopts_connect;
+
+    base->sockopts.keepalive    = 30;
+    base->sockopts.rcvbuf       = 64 * 1024;
+    base->sockopts.sndbuf       = 64 * 1024;
+    base->sockopts.defer_accept = 1;
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, sockopts_server_thread, server);
+
+    while (vws_tcp_svr_state(base) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    sockopts_request("127.0.0.1");
+    ASSERT_TRUE(sockopts_nodelay > 0);
+    ASSERT_TRUE(sockopts_keepalive > 0);
+
+    sockopts_request("::1");
+    ASSERT_TRUE(sockopts_nodelay > 0);
+
+    vws_tcp_svr_stop(base);
+    uv_thread_join(&server_tid);
+    vws_svr_free(server);
+
+    // Options off
+    server           = vws_svr_new(1, 0, 0);
+    base             = (vws_tcp_svr*)server;
+    sockopts_next    = base->on_connect;
+    base->on_connect = sockopts_connect;
+
+    base->sockopts.nodelay = false;
+
+    uv_thread_create(&server_tid, sockopts_server_thread, server);
+
+    while (vws_tcp_svr_state(base) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    sockopts_request("127.0.0.1");
+    ASSERT_EQUAL(0, sockopts_nodelay);
+    ASSERT_EQUAL(0, sockopts_keepalive);
+
+    vws_tcp_svr_stop(base);
+    uv_thread_join(&server_tid);
+    vws_svr_free(server);
+}
+
 int main(int argc, const char* argv[])
 {
     return ctest_main(argc, argv);
@@ -98,6 +98,172 @@ CTEST(test_message, json_serialization)
     vrtql_msg_free(receive);
 }
 
+CTEST(test_message, schema_serialization)
+{
+    vrtql_msg* send    = vrtql_msg_new();
+    vrtql_msg* receive = vrtql_msg_new();
+
+    vrtql_msg_set_routing(send, "tag", "a1b2c3d4");
+    vrtql_msg_set_header(send, "id", "session.login");
+    vrtql_msg_set_header(send, "timestamp", "1700000000");
+    vrtql_msg_set_header(send, "custom", "value");
+    vrtql_msg_set_content(send, "content");
+
+    send->format = VM_MPACK_SCHEMA_FORMAT;
+    vws_buffer* binary = vrtql_msg_serialize(send);
+    ASSERT_TRUE(binary != NULL);
+
+    bool rc = vrtql_msg_deserialize(receive, binary->data, binary->size);
+    ASSERT_TRUE(rc == true);
+    vws_buffer_free(binary);
+
+    // Decoder records the format so replies are encoded the same way
+    ASSERT_TRUE(receive->format == VM_MPACK_SCHEMA_FORMAT);
+
+    ASSERT_STR(vrtql_msg_get_routing(receive, "tag"), "a1b2c3d4");
+    ASSERT_STR(vrtql_msg_get_header(receive, "id"), "session.login");
+    ASSERT_STR(vrtql_msg_get_header(receive, "timestamp"), "1700000000");
+    ASSERT_STR(vrtql_msg_get_header(receive, "custom"), "value");
+    ASSERT_EQUAL(7, receive->content->size);
+    ASSERT_TRUE(strncmp((cstr)receive->content->data, "content", 7) == 0);
+
+    // Keys outside the schema map to no id, and ids outside it to no key
+
+    ASSERT_TRUE(vrtql_msg_schema_id("custom") == 0);
+    ASSERT_TRUE(vrtql_msg_schema_key(0) == NULL);
+    ASSERT_TRUE(vrtql_msg_schema_key(100) == NULL);
+    ASSERT_TRUE(vrtql_msg_schema_key(1000) == NULL);
+
+    vrtql_msg_free(send);
+    vrtql_msg_free(receive);
+}
+
+CTEST(test_message, schema_unknown_id)
+{
+    // A message whose routing map has a key id the schema does not define
+    vws_buffer* binary = vws_buffer_new();
+    mpack_writer_t writer;
+    mpack_writer_init_growable(&writer, (char**)&binary->data, &binary->size);
+
+    mpack_start_array(&writer, 3);
+    mpack_start_map(&writer, 1);
+    mpack_write_uint(&writer, 100);
+    mpack_write_cstr(&writer, "value");
+    mpack_finish_map(&writer);
+    mpack_start_map(&writer, 0);
+    mpack_finish_map(&writer);
+    mpack_write_bin(&writer, "", 0);
+    mpack_finish_array(&writer);
+    ASSERT_TRUE(mpack_writer_destroy(&writer) == mpack_ok);
+
+    vrtql_msg* receive = vrtql_msg_new();
+    bool rc = vrtql_msg_deserialize(receive, binary->data, binary->size);
+    ASSERT_FALSE(rc);
+
+    vrtql_msg_free(receive);
+    vws_buffer_free(binary);
+}
+
+static void batch_collect(ucstr data, size_t size, void* x)
+{
+    vrtql_msg* m = vrtql_msg_new();
+    ASSERT_TRUE(vrtql_msg_deserialize(m, data, size) == true);
+
+    int* count = (int*)x;
+    char expected[32];
+    snprintf(expected, sizeof(expected), "content %i", (*count)++);
+
+    // Content is not NUL-terminated
+    size_t n = vrtql_msg_get_content_size(m);
+    ASSERT_EQUAL(strlen(expected), n);
+    ASSERT_TRUE(strncmp(vrtql_msg_get_content(m), expected, n) == 0);
+
+    vrtql_msg_free(m);
+}
+
+static void batch_count(ucstr data, size_t size, void* x)
+{
+    (*(int*)x)++;
+}
+
+CTEST(test_message, batch)
+{
+    vrtql_msg_batch* batch = vrtql_msg_batch_new(0, 1000000);
+
+    // Empty batch has nothing to send
+    ASSERT_TRUE(vrtql_msg_batch_finish(batch) == NULL);
+
+    // Single message is sent without an envelope
+
+    vrtql_msg* msg = vrtql_msg_new();
+    vrtql_msg_set_content(msg, "content 0");
+    ASSERT_TRUE(vrtql_msg_batch_add(batch, msg) == false);
+
+    vws_buffer* binary = vrtql_msg_batch_finish(batch);
+    ASSERT_TRUE(vrtql_msg_is_batch(binary->data, binary->size) == false);
+    vws_buffer_free(binary);
+
+    // Multiple messages, including JSON which is encoded as MessagePack
+
+    for (int i = 0; i < 10; i++)
+    {
+        char content[32];
+        snprintf(content, sizeof(content), "content %i", i);
+        vrtql_msg_set_content(msg, content);
+        msg->format = (i % 2) ? VM_JSON_FORMAT : VM_MPACK_FORMAT;
+        vrtql_msg_batch_add(batch, msg);
+    }
+
+    ASSERT_TRUE(batch->count == 10);
+
+    binary = vrtql_msg_batch_finish(batch);
+    ASSERT_TRUE(batch->count == 0);
+    ASSERT_TRUE(vrtql_msg_is_batch(binary->data, binary->size) == true);
+
+    // Envelope is not a message
+    vrtql_msg* receive = vrtql_msg_new();
+    ASSERT_TRUE(vrtql_msg_deserialize(receive, binary->data, binary->size) == false);
+    vrtql_msg_free(receive);
+
+    int count = 0;
+    int rc    = vrtql_msg_batch_unpack( binary->data,
+                                        binary->size,
+                                        batch_collect,
+                                        &count );
+    ASSERT_EQUAL(10, rc);
+    ASSERT_EQUAL(10, count);
+
+    // Truncated envelope is rejected
+    count = 0;
+    rc    = vrtql_msg_batch_unpack(binary->data, binary->size - 1, batch_count, &count);
+    ASSERT_TRUE(rc < 0);
+    ASSERT_TRUE(count < 10);
+
+    vws_buffer_free(binary);
+
+    // Size limit makes batch due
+
+    vrtql_msg_batch_free(batch);
+    batch = vrtql_msg_batch_new(64, 1000000);
+
+    vrtql_msg_set_content(msg, "content");
+    ASSERT_TRUE(vrtql_msg_batch_add(batch, msg) == false);
+    vrtql_msg_set_content(msg, "content content content content content content");
+    ASSERT_TRUE(vrtql_msg_batch_add(batch, msg) == true);
+
+    // Time limit makes batch due
+
+    vrtql_msg_batch_free(batch);
+    batch = vrtql_msg_batch_new(0, 1000);
+
+    ASSERT_TRUE(vrtql_msg_batch_add(batch, msg) == false);
+    vws_msleep(2);
+    ASSERT_TRUE(vrtql_msg_batch_due(batch) == true);
+
+    vrtql_msg_free(msg);
+    vrtql_msg_batch_free(batch);
+}
+
 int main(int argc, const char* argv[])
 {
     return ctest_main(argc, argv);
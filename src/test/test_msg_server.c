@@ -1,5 +1,6 @@
 #include "server.h"
 #include "message.h"
+#include "rpc.h"
 
 #define CTEST_MAIN
 #include "ctest.h"
@@ -163,6 +164,442 @@ CTEST(test_msg_server, echo)
     vrtql_msg_svr_free(server);
 }
 
+void batch_client_thread(void* arg)
+{
+    int messages = 20;
+    vws_cnx* cnx = vws_cnx_new();
+
+    while (vws_connect(cnx, uri) == false)
+    {
+        vws.trace(VL_ERROR, "[client]: connecting %s", uri);
+    }
+
+    // Send all requests in a single frame
+    vrtql_msg_batch* batch = vrtql_msg_batch_new(0, 0);
+
+    for (int i = 0; i < messages; i++)
+    {
+        char payload[32];
+        snprintf(payload, sizeof(payload), "payload %i", i);
+
+        vrtql_msg* request = vrtql_msg_new();
+        vrtql_msg_set_content(request, payload);
+        vrtql_msg_batch_add(batch, request);
+        vrtql_msg_free(request);
+    }
+
+    ASSERT_TRUE(vrtql_msg_batch_send(cnx, batch) > 0);
+    vrtql_msg_batch_free(batch);
+
+    // Replies arrive batched by server and are returned one at a time in order
+    for (int i = 0; i < messages; i++)
+    {
+        vrtql_msg* reply = vrtql_msg_recv(cnx);
+        ASSERT_TRUE(reply != NULL);
+
+        char payload[32];
+        snprintf(payload, sizeof(payload), "payload %i", i);
+
+        ucstr content = reply->content->data;
+        size_t size   = reply->content->size;
+        ASSERT_TRUE(size == strlen(payload));
+        ASSERT_TRUE(strncmp(payload, (cstr)content, size) == 0);
+        vrtql_msg_free(reply);
+    }
+
+    vws_disconnect(cnx);
+    vws_cnx_free(cnx);
+
+    vws_cleanup();
+}
+
+CTEST(test_msg_server, batch)
+{
+    // Single worker thread so that replies are generated in order
+    vrtql_msg_svr* server = vrtql_msg_svr_new(1, 0, 0);
+    server->process       = process;
+    server->batch_size    = 4096;
+    server->batch_delay   = 2000;
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    // Wait for server to start up
+    while (vws_tcp_svr_state((vws_tcp_svr*)server) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    uv_thread_t client_tid;
+    uv_thread_create(&client_tid, batch_client_thread, NULL);
+    uv_thread_join(&client_tid);
+
+    sleep(1);
+
+    // Shutdown server
+    vws_tcp_svr_stop((vws_tcp_svr*)server);
+    uv_thread_join(&server_tid);
+    vrtql_msg_svr_free(server);
+}
+
+// Server function to answer RPC calls. Replies carry the request tag.
+// Requests with id "drop" are never answered.
+void rpc_process(vws_svr* s, vws_cid_t cid, vrtql_msg* m, void* ctx)
+{
+    vrtql_msg_svr* server = (vrtql_msg_svr*)s;
+
+    cstr id = vrtql_msg_get_header(m, "id");
+
+    if ((id != NULL) && (strcmp(id, "drop") == 0))
+    {
+        vrtql_msg_free(m);
+        return;
+    }
+
+    vrtql_msg* reply = vrtql_rpc_reply(m);
+    vws_buffer_append(reply->content, m->content->data, m->content->size);
+    server->send(s, cid, reply, NULL);
+
+    vrtql_msg_free(m);
+}
+
+typedef struct rpc_call_state
+{
+    int index;
+    int replies;
+    int timeouts;
+} rpc_call_state;
+
+void rpc_client_cb(vrtql_rpc* rpc, vrtql_msg* reply, void* data)
+{
+    rpc_call_state* state = (rpc_call_state*)data;
+
+    if (reply == NULL)
+    {
+        ASSERT_TRUE(vws.e.code == VE_TIMEOUT);
+        state->timeouts++;
+        return;
+    }
+
+    char payload[32];
+    snprintf(payload, sizeof(payload), "call %i", state->index);
+
+    ucstr content = reply->content->data;
+    size_t size   = reply->content->size;
+    ASSERT_TRUE(size == strlen(payload));
+    ASSERT_TRUE(strncmp(payload, (cstr)content, size) == 0);
+
+    state->replies++;
+    vrtql_msg_free(reply);
+}
+
+void rpc_client_thread(void* arg)
+{
+    int calls    = 200;
+    vws_cnx* cnx = vws_cnx_new();
+
+    while (vws_connect(cnx, uri) == false)
+    {
+        vws.trace(VL_ERROR, "[client]: connecting %s", uri);
+    }
+
+    vrtql_rpc* rpc         = vrtql_rpc_new(cnx);
+    rpc_call_state* states = vws.malloc(sizeof(rpc_call_state) * (calls + 1));
+
+    // Pipeline all calls before reading any response
+    for (int i = 0; i < calls; i++)
+    {
+        states[i].index    = i;
+        states[i].replies  = 0;
+        states[i].timeouts = 0;
+
+        char payload[32];
+        snprintf(payload, sizeof(payload), "call %i", i);
+
+        vrtql_msg* request = vrtql_msg_new();
+        vrtql_msg_set_header(request, "id", "echo");
+        vrtql_msg_set_content(request, payload);
+        ASSERT_TRUE(vrtql_rpc_send(rpc, request, 5000, rpc_client_cb, &states[i]));
+        vrtql_msg_free(request);
+    }
+
+    // One call the server never answers
+    rpc_call_state* dropped = &states[calls];
+    dropped->index          = calls;
+    dropped->replies        = 0;
+    dropped->timeouts       = 0;
+
+    vrtql_msg* request = vrtql_msg_new();
+    vrtql_msg_set_header(request, "id", "drop");
+    ASSERT_TRUE(vrtql_rpc_send(rpc, request, 200, rpc_client_cb, dropped));
+    vrtql_msg_free(request);
+
+    ASSERT_EQUAL(calls + 1, vrtql_rpc_pending(rpc));
+    ASSERT_TRUE(vrtql_rpc_wait(rpc));
+    ASSERT_EQUAL(0, vrtql_rpc_pending(rpc));
+
+    // Every call completed exactly once
+    for (int i = 0; i < calls; i++)
+    {
+        ASSERT_EQUAL(1, states[i].replies);
+        ASSERT_EQUAL(0, states[i].timeouts);
+    }
+
+    ASSERT_EQUAL(0, dropped->replies);
+    ASSERT_EQUAL(1, dropped->timeouts);
+
+    vws.free(states);
+    vrtql_rpc_free(rpc);
+
+    vws_disconnect(cnx);
+    vws_cnx_free(cnx);
+
+    vws_cleanup();
+}
+
+CTEST(test_msg_server, rpc_async)
+{
+    // Several workers so that replies may return out of order
+    vrtql_msg_svr* server = vrtql_msg_svr_new(4, 0, 0);
+    server->process       = rpc_process;
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    // Wait for server to start up
+    while (vws_tcp_svr_state((vws_tcp_svr*)server) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    uv_thread_t client_tid;
+    uv_thread_create(&client_tid, rpc_client_thread, NULL);
+    uv_thread_join(&client_tid);
+
+    sleep(1);
+
+    // Shutdown server
+    vws_tcp_svr_stop((vws_tcp_svr*)server);
+    uv_thread_join(&server_tid);
+    vrtql_msg_svr_free(server);
+}
+
+void rpc_lost_cb(vrtql_rpc* rpc, vrtql_msg* reply, void* data)
+{
+    ASSERT_TRUE(reply == NULL);
+    ASSERT_EQUAL(VE_SOCKET | VE_RECV, vws.e.code);
+
+    (*(int*)data)++;
+}
+
+void rpc_reconnect_client_thread(void* arg)
+{
+    vws_cnx* cnx = vws_cnx_new();
+
+    while (vws_connect(cnx, uri) == false)
+    {
+        vws.trace(VL_ERROR, "[client]: connecting %s", uri);
+    }
+
+    vrtql_rpc* rpc = vrtql_rpc_new(cnx);
+
+    // Calls without a deadline that the server never answers
+    int lost = 0;
+    for (int i = 0; i < 3; i++)
+    {
+        vrtql_msg* request = vrtql_msg_new();
+        vrtql_msg_set_header(request, "id", "drop");
+        ASSERT_TRUE(vrtql_rpc_send(rpc, request, 0, rpc_lost_cb, &lost));
+        vrtql_msg_free(request);
+    }
+
+    ASSERT_EQUAL(3, vrtql_rpc_pending(rpc));
+
+    // Drop the connection under the client
+    vws_socket_disconnect((vws_socket*)cnx);
+
+    // The next call reconnects. Calls in flight on the old connection fail.
+    rpc_call_state state = { 0, 0, 0 };
+    vrtql_msg* request   = vrtql_msg_new();
+    vrtql_msg_set_header(request, "id", "echo");
+    vrtql_msg_set_content(request, "call 0");
+    ASSERT_TRUE(vrtql_rpc_send(rpc, request, 5000, rpc_client_cb, &state));
+    vrtql_msg_free(request);
+
+    ASSERT_EQUAL(3, lost);
+    ASSERT_EQUAL(1, vrtql_rpc_pending(rpc));
+
+    // Would never return if the lost calls were still pending
+    ASSERT_TRUE(vrtql_rpc_wait(rpc));
+    ASSERT_EQUAL(1, state.replies);
+
+    vrtql_rpc_free(rpc);
+
+    vws_disconnect(cnx);
+    vws_cnx_free(cnx);
+
+    vws_cleanup();
+}
+
+CTEST(test_msg_server, rpc_reconnect)
+{
+    vrtql_msg_svr* server = vrtql_msg_svr_new(2, 0, 0);
+    server->process       = rpc_process;
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    // Wait for server to start up
+    while (vws_tcp_svr_state((vws_tcp_svr*)server) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    uv_thread_t client_tid;
+    uv_thread_create(&client_tid, rpc_reconnect_client_thread, NULL);
+    uv_thread_join(&client_tid);
+
+    // Shutdown server
+    vws_tcp_svr_stop((vws_tcp_svr*)server);
+    uv_thread_join(&server_tid);
+    vrtql_msg_svr_free(server);
+}
+
+// RPC Call: echo.content. Runs in worker thread.
+vrtql_msg* rpc_echo_content(vrtql_rpc_env* e, vrtql_msg* m)
+{
+    // Each worker has its own environment built by env_ctor
+    ASSERT_TRUE(e->data != NULL);
+    ASSERT_EQUAL(0xABCD, *(int*)e->data);
+
+    vrtql_msg* reply = vrtql_rpc_env_reply(e, m);
+    vws_buffer_append(reply->content, m->content->data, m->content->size);
+
+    return reply;
+}
+
+void* rpc_env_ctor(void* data)
+{
+    int* value = vws.malloc(sizeof(int));
+    *value     = *(int*)data;
+
+    return value;
+}
+
+void rpc_env_dtor(void* data)
+{
+    vws.free(data);
+}
+
+void rpc_unknown_cb(vrtql_rpc* rpc, vrtql_msg* reply, void* data)
+{
+    ASSERT_TRUE(reply != NULL);
+
+    char rc[16];
+    snprintf(rc, sizeof(rc), "%i", VE_RT);
+    ASSERT_STR(vrtql_msg_get_header(reply, "rc"), rc);
+
+    (*(int*)data)++;
+    vrtql_msg_free(reply);
+}
+
+void rpc_server_client_thread(void* arg)
+{
+    int calls    = 100;
+    vws_cnx* cnx = vws_cnx_new();
+
+    while (vws_connect(cnx, uri) == false)
+    {
+        vws.trace(VL_ERROR, "[client]: connecting %s", uri);
+    }
+
+    vrtql_rpc* rpc         = vrtql_rpc_new(cnx);
+    rpc_call_state* states = vws.malloc(sizeof(rpc_call_state) * calls);
+
+    for (int i = 0; i < calls; i++)
+    {
+        states[i].index    = i;
+        states[i].replies  = 0;
+        states[i].timeouts = 0;
+
+        char payload[32];
+        snprintf(payload, sizeof(payload), "call %i", i);
+
+        vrtql_msg* request = vrtql_msg_new();
+        vrtql_msg_set_header(request, "id", "echo.content");
+        vrtql_msg_set_content(request, payload);
+        ASSERT_TRUE(vrtql_rpc_send(rpc, request, 5000, rpc_client_cb, &states[i]));
+        vrtql_msg_free(request);
+    }
+
+    int unknown        = 0;
+    vrtql_msg* request = vrtql_msg_new();
+    vrtql_msg_set_header(request, "id", "echo.nothing");
+    ASSERT_TRUE(vrtql_rpc_send(rpc, request, 5000, rpc_unknown_cb, &unknown));
+    vrtql_msg_free(request);
+
+    ASSERT_TRUE(vrtql_rpc_wait(rpc));
+
+    for (int i = 0; i < calls; i++)
+    {
+        ASSERT_EQUAL(1, states[i].replies);
+    }
+
+    ASSERT_EQUAL(1, unknown);
+
+    vws.free(states);
+    vrtql_rpc_free(rpc);
+
+    vws_disconnect(cnx);
+    vws_cnx_free(cnx);
+
+    vws_cleanup();
+}
+
+CTEST(test_msg_server, rpc_server)
+{
+    vrtql_rpc_system* system = vrtql_rpc_system_new();
+    vrtql_rpc_module* module = vrtql_rpc_module_new("echo");
+    vrtql_rpc_module_set(module, "content", rpc_echo_content);
+    vrtql_rpc_system_set(system, module);
+
+    int env_value         = 0xABCD;
+    vrtql_rpc_svr* server = vrtql_rpc_svr_new(system, 4, 0, 0);
+    server->env_ctor      = rpc_env_ctor;
+    server->env_ctor_data = &env_value;
+    server->env_dtor      = rpc_env_dtor;
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    // Wait for server to start up
+    while (vws_tcp_svr_state((vws_tcp_svr*)server) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    uv_thread_t client_tid;
+    uv_thread_create(&client_tid, rpc_server_client_thread, NULL);
+    uv_thread_join(&client_tid);
+
+    sleep(1);
+
+    // Shutdown server
+    vws_tcp_svr_stop((vws_tcp_svr*)server);
+    uv_thread_join(&server_tid);
+
+    // Statistics survive shutdown
+    vws_hist* latency = vrtql_rpc_svr_latency(server, "echo.content");
+    ASSERT_TRUE(latency != NULL);
+    ASSERT_EQUAL(100, latency->count);
+    vws_hist_free(latency);
+
+    ASSERT_TRUE(vrtql_rpc_svr_latency(server, "echo.nothing") == NULL);
+
+    vrtql_rpc_svr_free(server);
+    vrtql_rpc_system_free(system);
+}
+
 int main(int argc, const char* argv[])
 {
     return ctest_main(argc, argv);
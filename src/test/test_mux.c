@@ -0,0 +1,228 @@
+#include "server.h"
+#include "mux.h"
+
+#define CTEST_MAIN
+#include "ctest.h"
+#include "common.h"
+
+cstr server_host = "127.0.0.1";
+int  server_port = 8181;
+cstr uri         = "ws://localhost:8181/websocket";
+cstr payload     = "payload";
+
+#define CONNECTIONS 200
+#define MESSAGES    5
+
+// Per-connection test state
+typedef struct
+{
+    int sent;
+    int received;
+} client_state;
+
+static int opened   = 0;
+static int closed   = 0;
+static int received = 0;
+
+// Server function to process messages. Runs in context of worker thread.
+void process(vws_svr* s, vws_cid_t cid, vws_msg* m, void* ctx)
+{
+    // Echo back
+    vws_msg* reply = vws_msg_new();
+    reply->opcode  = m->opcode;
+    vws_buffer_append(reply->data, m->data->data, m->data->size);
+
+    s->send(s, cid, reply, NULL);
+
+    vws_msg_free(m);
+}
+
+void server_thread(void* arg)
+{
+    vws_tcp_svr* server = (vws_tcp_svr*)arg;
+    vws_tcp_svr_run(server, server_host, server_port);
+    vws_cleanup();
+}
+
+void send_next(vws_mux_cnx* c)
+{
+    client_state* state = (client_state*)c->data;
+    state->sent++;
+
+    ASSERT_TRUE(vws_mux_send(c, (ucstr)payload, strlen(payload), TEXT_FRAME));
+}
+
+void on_open(vws_mux_cnx* c)
+{
+    opened++;
+    send_next(c);
+}
+
+void on_msg(vws_mux_cnx* c, vws_msg* m)
+{
+    client_state* state = (client_state*)c->data;
+
+    ASSERT_EQUAL(strlen(payload), m->data->size);
+    ASSERT_TRUE(strncmp(payload, (cstr)m->data->data, m->data->size) == 0);
+    vws_msg_free(m);
+
+    state->received++;
+    received++;
+
+    if (state->sent < MESSAGES)
+    {
+        send_next(c);
+    }
+    else
+    {
+        vws_mux_close(c);
+    }
+}
+
+void on_close(vws_mux_cnx* c)
+{
+    client_state* state = (client_state*)c->data;
+    ASSERT_EQUAL(MESSAGES, state->received);
+
+    closed++;
+}
+
+CTEST(test_mux, echo)
+{
+    opened   = 0;
+    closed   = 0;
+    received = 0;
+
+    vws_svr* server    = vws_svr_new(4, 0, 0);
+    server->process_ws = process;
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    while (vws_tcp_svr_state((vws_tcp_svr*)server) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    vws_mux* mux  = vws_mux_new();
+    mux->on_open  = on_open;
+    mux->on_msg   = on_msg;
+    mux->on_close = on_close;
+
+    client_state states[CONNECTIONS];
+    memset(states, 0, sizeof(states));
+
+    // All connections are driven by this one thread
+    for (int i = 0; i < CONNECTIONS; i++)
+    {
+        ASSERT_NOT_NULL(vws_mux_connect(mux, uri, &states[i]));
+    }
+
+    ASSERT_EQUAL(CONNECTIONS, mux->count);
+
+    vws_mux_run(mux);
+
+    ASSERT_EQUAL(0, mux->count);
+    ASSERT_EQUAL(CONNECTIONS, opened);
+    ASSERT_EQUAL(CONNECTIONS, closed);
+    ASSERT_EQUAL(CONNECTIONS * MESSAGES, received);
+
+    vws_mux_free(mux);
+
+    vws_tcp_svr_stop((vws_tcp_svr*)server);
+    uv_thread_join(&server_tid);
+    vws_svr_free(server);
+}
+
+void on_refused(vws_mux_cnx* c)
+{
+    closed++;
+}
+
+CTEST(test_mux, refused)
+{
+    vws_mux* mux  = vws_mux_new();
+    mux->on_open  = on_open;
+    mux->on_close = on_refused;
+
+    opened = 0;
+    closed = 0;
+
+    client_state state;
+    memset(&state, 0, sizeof(state));
+
+    // Nothing is listening, so on_close must be called without on_open
+    cstr refused = "ws://localhost:8199/websocket";
+    ASSERT_NOT_NULL(vws_mux_connect(mux, refused, &state));
+    ASSERT_NULL(vws_mux_connect(mux, "not a url", NULL));
+
+    vws_mux_run(mux);
+
+    ASSERT_EQUAL(0, mux->count);
+    ASSERT_EQUAL(0, opened);
+    ASSERT_EQUAL(1, closed);
+
+    vws_mux_free(mux);
+}
+
+CTEST(test_mux, fallback)
+{
+    opened   = 0;
+    closed   = 0;
+    received = 0;
+
+    // The server only listens on 127.0.0.1. Where localhost resolves to ::1
+    // first, that connect is refused and the next address must be tried.
+    struct addrinfo hints;
+    struct addrinfo* res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = PF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    ASSERT_EQUAL(0, getaddrinfo("localhost", "8181", &hints, &res));
+
+    if (res->ai_family != AF_INET6)
+    {
+        CTEST_LOG("localhost does not resolve to ::1 first, not exercised");
+    }
+
+    freeaddrinfo(res);
+
+    vws_svr* server    = vws_svr_new(1, 0, 0);
+    server->process_ws = process;
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    while (vws_tcp_svr_state((vws_tcp_svr*)server) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    vws_mux* mux  = vws_mux_new();
+    mux->on_open  = on_open;
+    mux->on_msg   = on_msg;
+    mux->on_close = on_close;
+
+    client_state state;
+    memset(&state, 0, sizeof(state));
+
+    ASSERT_NOT_NULL(vws_mux_connect(mux, uri, &state));
+
+    vws_mux_run(mux);
+
+    ASSERT_EQUAL(0, mux->count);
+    ASSERT_EQUAL(1, opened);
+    ASSERT_EQUAL(1, closed);
+    ASSERT_EQUAL(MESSAGES, received);
+
+    vws_mux_free(mux);
+
+    vws_tcp_svr_stop((vws_tcp_svr*)server);
+    uv_thread_join(&server_tid);
+    vws_svr_free(server);
+}
+
+int main(int argc, const char* argv[])
+{
+    return ctest_main(argc, argv);
+}
@@ -8,6 +8,7 @@
 cstr server_host = "127.0.0.1";
 int  server_port = 8181;
 int  peer_port   = 8182;
+int  dead_port   = 8199;
 cstr server_uri  = "ws://localhost:8181/websocket";
 cstr peer_uri    = "ws://localhost:8182/websocket";
 
@@ -101,6 +102,38 @@ void server_thread(void* arg)
     vws_cleanup();
 }
 
+// Peer connections made by the async test, counted from the connect callback
+// in uv_thread()
+static vws_tcp_svr_peer async_connect_base = NULL;
+static int              async_connected    = 0;
+static int              async_port         = 0;
+
+void async_peer_connect(vws_svr_cnx* c, vws_peer* p)
+{
+    async_connect_base(c, p);
+
+    __atomic_store_n(&async_port, p->port, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&async_connected, 1, __ATOMIC_RELEASE);
+}
+
+void async_server_thread(void* arg)
+{
+    vws_tcp_svr* server = (vws_tcp_svr*)arg;
+    vws.tracelevel      = trace_level;
+    server->trace       = vws.tracelevel;
+
+    // Add peers using the built-in connect. The second one is not listening
+    // and must not hold up the first or tie up the only worker thread.
+    vws_peer* peer;
+    peer = vws_tcp_svr_peer_add(server, server_host, peer_port, NULL, NULL);
+    peer->path = "/websocket";
+
+    vws_tcp_svr_peer_add(server, server_host, dead_port, NULL, NULL);
+
+    vws_tcp_svr_run(server, server_host, server_port);
+    vws_cleanup();
+}
+
 void client_thread(void* arg)
 {
     int requests = 1;
@@ -260,6 +293,372 @@ CTEST(test_peering, basic)
     vrtql_msg_svr_free(peer);
 }
 
+CTEST(test_peering, async)
+{
+    vws.tracelevel = trace_level;
+
+    vrtql_msg_svr* peer = vrtql_msg_svr_new(1, 0, 0);
+    peer->process       = peer_process;
+
+    vrtql_msg_svr* server = vrtql_msg_svr_new(1, 0, 0);
+    server->process       = server_process;
+
+    // Count peer connections from the callback instead of reading peer state
+    // uv_thread() writes
+    vws_tcp_svr* base     = (vws_tcp_svr*)server;
+    async_connect_base    = base->on_peer_connect;
+    base->on_peer_connect = async_peer_connect;
+
+    uv_thread_t peer_tid;
+    uv_thread_create(&peer_tid, peer_thread, peer);
+
+    while (vws_tcp_svr_state((vws_tcp_svr*)peer) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, async_server_thread, server);
+
+    while (vws_tcp_svr_state((vws_tcp_svr*)server) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    // Wait for peer connection
+    for (int i = 0; i < 50; i++)
+    {
+        if (__atomic_load_n(&async_connected, __ATOMIC_ACQUIRE) > 0)
+        {
+            break;
+        }
+
+        vws_msleep(100);
+    }
+
+    // Only the live peer connects, the dead one does not hold it up
+    ASSERT_EQUAL(1, __atomic_load_n(&async_connected, __ATOMIC_ACQUIRE));
+    ASSERT_EQUAL(peer_port, __atomic_load_n(&async_port, __ATOMIC_RELAXED));
+
+    // Give CLOSE frames time to go out (see basic)
+    sleep(1);
+
+    ASSERT_EQUAL(1, __atomic_load_n(&async_connected, __ATOMIC_ACQUIRE));
+
+    vws_tcp_svr_stop((vws_tcp_svr*)server);
+    uv_thread_join(&server_tid);
+    vrtql_msg_svr_free(server);
+
+    vws_tcp_svr_stop((vws_tcp_svr*)peer);
+    uv_thread_join(&peer_tid);
+    vrtql_msg_svr_free(peer);
+}
+
+//------------------------------------------------------------------------------
+// Routing
+//------------------------------------------------------------------------------
+
+int  route_port  = 8183;
+
+// Messages received by a routing target
+typedef struct
+{
+    uv_mutex_t lock;
+    int count;
+    int sticky;
+} route_counter;
+
+void route_process(vws_svr* s, vws_cid_t cid, vrtql_msg* m, void* ctx)
+{
+    route_counter* counter = (route_counter*)((vrtql_msg_svr*)s)->data;
+    cstr content           = (cstr)m->content->data;
+
+    uv_mutex_lock(&counter->lock);
+    counter->count++;
+
+    if (strncmp(content, "sticky", m->content->size) == 0)
+    {
+        counter->sticky++;
+    }
+    uv_mutex_unlock(&counter->lock);
+
+    vrtql_msg_free(m);
+}
+
+int route_count(route_counter* counter)
+{
+    uv_mutex_lock(&counter->lock);
+    int count = counter->count;
+    uv_mutex_unlock(&counter->lock);
+
+    return count;
+}
+
+int route_sticky(route_counter* counter)
+{
+    uv_mutex_lock(&counter->lock);
+    int sticky = counter->sticky;
+    uv_mutex_unlock(&counter->lock);
+
+    return sticky;
+}
+
+// Context for starting servers
+typedef struct
+{
+    vws_tcp_svr* server;
+    int port;
+    int peers[2];
+} route_ctx;
+
+void route_thread(void* arg)
+{
+    route_ctx* ctx = (route_ctx*)arg;
+
+    for (int i = 0; i < 2; i++)
+    {
+        if (ctx->peers[i] != 0)
+        {
+            vws_peer* peer;
+            peer = vws_tcp_svr_peer_add( ctx->server, server_host,
+                                         ctx->peers[i], NULL, NULL );
+            peer->path = "/websocket";
+        }
+    }
+
+    vws_tcp_svr_run(ctx->server, server_host, ctx->port);
+    vws_cleanup();
+}
+
+void route_counter_init(route_counter* counter)
+{
+    memset(counter, 0, sizeof(route_counter));
+    uv_mutex_init(&counter->lock);
+}
+
+// Counter is initialized once by the caller. A restarted target reuses it.
+vrtql_msg_svr* route_target(route_counter* counter)
+{
+    vrtql_msg_svr* server = vrtql_msg_svr_new(1, 0, 0);
+    server->process       = route_process;
+    server->data          = counter;
+
+    return server;
+}
+
+void route_start(route_ctx* ctx, uv_thread_t* tid)
+{
+    uv_thread_create(tid, route_thread, ctx);
+
+    while (vws_tcp_svr_state(ctx->server) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+}
+
+void route_stop(vrtql_msg_svr* server, uv_thread_t* tid)
+{
+    vws_tcp_svr_stop((vws_tcp_svr*)server);
+    uv_thread_join(tid);
+    vrtql_msg_svr_free(server);
+}
+
+void route_send(vrtql_msg_svr* server, cstr key, cstr content)
+{
+    vrtql_msg* m = vrtql_msg_new();
+    vrtql_msg_set_content(m, content);
+    ASSERT_TRUE(vrtql_msg_svr_route(server, key, m));
+}
+
+CTEST(test_peering, route)
+{
+    vws.tracelevel = 0;
+
+    route_counter counters[2];
+    vrtql_msg_svr* targets[2];
+    route_ctx target_ctx[2];
+    uv_thread_t target_tids[2];
+
+    int ports[2] = { peer_port, route_port };
+
+    for (int i = 0; i < 2; i++)
+    {
+        route_counter_init(&counters[i]);
+        targets[i]    = route_target(&counters[i]);
+        target_ctx[i] = (route_ctx){ (vws_tcp_svr*)targets[i], ports[i], {0} };
+        route_start(&target_ctx[i], &target_tids[i]);
+    }
+
+    // The router holds peer connections to both targets
+    vrtql_msg_svr* router = vrtql_msg_svr_new(1, 0, 0);
+    route_ctx ctx         = { (vws_tcp_svr*)router, server_port, {0} };
+    ctx.peers[0]          = peer_port;
+    ctx.peers[1]          = route_port;
+
+    uv_thread_t router_tid;
+    route_start(&ctx, &router_tid);
+
+    // Messages are routed from the start, held until peers connect
+    int n = 100;
+    char key[32];
+
+    for (int i = 0; i < n; i++)
+    {
+        snprintf(key, sizeof(key), "key-%i", i);
+        route_send(router, key, "payload");
+    }
+
+    for (int i = 0; i < 10; i++)
+    {
+        route_send(router, "same-key", "sticky");
+    }
+
+    n += 10;
+
+    for (int i = 0; i < 100; i++)
+    {
+        if (route_count(&counters[0]) + route_count(&counters[1]) == n)
+        {
+            break;
+        }
+
+        vws_msleep(100);
+    }
+
+    // All delivered, spread over both peers, same key to same peer
+    ASSERT_EQUAL(n, counters[0].count + counters[1].count);
+    ASSERT_TRUE(counters[0].count > 10);
+    ASSERT_TRUE(counters[1].count > 10);
+    ASSERT_TRUE((counters[0].sticky == 10) || (counters[1].sticky == 10));
+
+    route_stop(router, &router_tid);
+
+    for (int i = 0; i < 2; i++)
+    {
+        route_stop(targets[i], &target_tids[i]);
+        uv_mutex_destroy(&counters[i].lock);
+    }
+}
+
+CTEST(test_peering, route_reconnect)
+{
+    vws.tracelevel = 0;
+
+    route_counter counter;
+    route_counter_init(&counter);
+
+    vrtql_msg_svr* target = route_target(&counter);
+    route_ctx target_ctx  = { (vws_tcp_svr*)target, peer_port, {0} };
+    uv_thread_t target_tid;
+
+    vrtql_msg_svr* router = vrtql_msg_svr_new(1, 0, 0);
+    route_ctx ctx         = { (vws_tcp_svr*)router, server_port, {0} };
+    ctx.peers[0]          = peer_port;
+
+    uv_thread_t router_tid;
+    route_start(&ctx, &router_tid);
+    route_start(&target_ctx, &target_tid);
+
+    for (int i = 0; (i < 100) && (route_count(&counter) < 1); i++)
+    {
+        route_send(router, "key", "payload");
+        vws_msleep(100);
+    }
+
+    ASSERT_TRUE(route_count(&counter) >= 1);
+
+    // Take the peer down and wait for the router to notice. Messages routed
+    // meanwhile are held.
+    route_stop(target, &target_tid);
+
+    vws_tcp_svr* s = (vws_tcp_svr*)router;
+    vws_peer* peer = (vws_peer*)s->peers->array[0].value.data;
+
+    for (int i = 0; (i < 100) && (peer->state == VWS_PEER_CONNECTED); i++)
+    {
+        vws_msleep(100);
+    }
+
+    ASSERT_TRUE(peer->state != VWS_PEER_CONNECTED);
+
+    for (int i = 0; i < 10; i++)
+    {
+        route_send(router, "key", "sticky");
+    }
+
+    // Bring it back up. Its backlog is sent on reconnect.
+    target            = route_target(&counter);
+    target_ctx.server = (vws_tcp_svr*)target;
+    route_start(&target_ctx, &target_tid);
+
+    for (int i = 0; (i < 100) && (route_sticky(&counter) < 10); i++)
+    {
+        vws_msleep(100);
+    }
+
+    ASSERT_EQUAL(10, route_sticky(&counter));
+
+    route_stop(router, &router_tid);
+    route_stop(target, &target_tid);
+    uv_mutex_destroy(&counter.lock);
+}
+
+CTEST(test_peering, route_batch_requeue)
+{
+    vws.tracelevel = 0;
+
+    route_counter counter;
+    route_counter_init(&counter);
+
+    vrtql_msg_svr* target = route_target(&counter);
+    route_ctx target_ctx  = { (vws_tcp_svr*)target, peer_port, {0} };
+    uv_thread_t target_tid;
+
+    // Routed messages stay in the connection's batch until the peer drops
+    vrtql_msg_svr* router     = vrtql_msg_svr_new(1, 0, 0);
+    router->route_batch_delay = 60 * 1000000;
+    route_ctx ctx             = { (vws_tcp_svr*)router, server_port, {0} };
+    ctx.peers[0]              = peer_port;
+
+    uv_thread_t router_tid;
+    route_start(&target_ctx, &target_tid);
+    route_start(&ctx, &router_tid);
+
+    vws_tcp_svr* s = (vws_tcp_svr*)router;
+    vws_peer* peer = (vws_peer*)s->peers->array[0].value.data;
+
+    for (int i = 0; (i < 100) && (peer->state != VWS_PEER_CONNECTED); i++)
+    {
+        vws_msleep(100);
+    }
+
+    ASSERT_TRUE(peer->state == VWS_PEER_CONNECTED);
+
+    for (int i = 0; i < 10; i++)
+    {
+        route_send(router, "key", "sticky");
+    }
+
+    vws_msleep(500);
+    ASSERT_EQUAL(0, route_sticky(&counter));
+
+    // Drop the peer connection on the router's side. The target stays up, so
+    // nothing is flushed by a close handshake.
+    vws_tcp_svr_close(s, peer->info.cid);
+
+    // Batch was moved to the backlog and goes out on reconnect
+    for (int i = 0; (i < 100) && (route_sticky(&counter) < 10); i++)
+    {
+        vws_msleep(100);
+    }
+
+    ASSERT_EQUAL(10, route_sticky(&counter));
+
+    route_stop(router, &router_tid);
+    route_stop(target, &target_tid);
+    uv_mutex_destroy(&counter.lock);
+}
+
 int main(int argc, const char* argv[])
 {
     return ctest_main(argc, argv);
@@ -76,6 +76,133 @@ CTEST(test_rpc, server_side_service)
     vrtql_rpc_system_free(system);
 }
 
+// RPC Call: session.urgent. Replies in the priority lane if asked to.
+vrtql_msg* session_urgent(vrtql_rpc_env* e, vrtql_msg* m)
+{
+    vrtql_msg* reply = vrtql_rpc_env_reply(e, m);
+
+    if (vrtql_msg_get_header(m, "urgent") != NULL)
+    {
+        vws_set_flag(&reply->flags, VM_MSG_PRIORITY);
+    }
+
+    return reply;
+}
+
+static int service_rc(vrtql_rpc_system* system, cstr id)
+{
+    vrtql_rpc_env env;
+    vrtql_msg* req = vrtql_msg_new();
+    vrtql_msg_set_header(req, "id", id);
+
+    vrtql_msg* reply = vrtql_rpc_service(system, &env, req);
+
+    if (reply == NULL)
+    {
+        return -1;
+    }
+
+    vrtql_msg_free(reply);
+
+    return 0;
+}
+
+CTEST(test_rpc, server_side_index)
+{
+    vrtql_rpc_system* system = vrtql_rpc_system_new();
+
+    vrtql_rpc_module* module = vrtql_rpc_module_new("session");
+    vrtql_rpc_module_set(module, "login", session_login);
+    vrtql_rpc_system_set(system, module);
+
+    // Calls added after registration are indexed
+    vrtql_rpc_module_set(module, "logout", session_logout);
+
+    vrtql_rpc_entry* entry = vrtql_rpc_system_lookup(system, "session.logout");
+    ASSERT_TRUE(entry != NULL);
+    ASSERT_TRUE(entry->module == module);
+    ASSERT_TRUE(entry->call == session_logout);
+
+    ASSERT_EQUAL(0,  service_rc(system, "session.login"));
+    ASSERT_EQUAL(0,  service_rc(system, "session.logout"));
+    ASSERT_EQUAL(-1, service_rc(system, "session.info"));
+    ASSERT_EQUAL(-1, service_rc(system, "session"));
+    ASSERT_EQUAL(-1, service_rc(system, "nothing.login"));
+
+    // Replacing a module removes calls it no longer provides
+    vrtql_rpc_module* replacement = vrtql_rpc_module_new("session");
+    vrtql_rpc_module_set(replacement, "info", session_info);
+    vrtql_rpc_system_set(system, replacement);
+
+    ASSERT_EQUAL(-1, service_rc(system, "session.login"));
+    ASSERT_EQUAL(0,  service_rc(system, "session.info"));
+
+    // The replaced module was freed by the system
+    vrtql_rpc_system_free(system);
+}
+
+CTEST(test_rpc, server_side_replace)
+{
+    vrtql_rpc_system* system = vrtql_rpc_system_new();
+
+    vrtql_rpc_module* module = vrtql_rpc_module_new("session");
+    vrtql_rpc_module_set(module, "login", session_login);
+
+    // Registering the same module again keeps it
+    vrtql_rpc_system_set(system, module);
+    vrtql_rpc_system_set(system, module);
+
+    ASSERT_TRUE(vrtql_rpc_system_get(system, "session") == module);
+    ASSERT_EQUAL(0, service_rc(system, "session.login"));
+
+    // A new module under the same name frees the old one (checked by ASAN
+    // and valgrind builds)
+    vrtql_rpc_module* replacement = vrtql_rpc_module_new("session");
+    vrtql_rpc_module_set(replacement, "login", session_login);
+    vrtql_rpc_system_set(system, replacement);
+
+    ASSERT_TRUE(vrtql_rpc_system_get(system, "session") == replacement);
+    vrtql_rpc_entry* entry = vrtql_rpc_system_lookup(system, "session.login");
+    ASSERT_TRUE(entry != NULL);
+    ASSERT_TRUE(entry->module == replacement);
+    ASSERT_EQUAL(0, service_rc(system, "session.login"));
+
+    vrtql_rpc_system_free(system);
+}
+
+CTEST(test_rpc, server_side_reply_reuse)
+{
+    vrtql_rpc_system* system = vrtql_rpc_system_new();
+    vrtql_rpc_module* module = vrtql_rpc_module_new("session");
+    vrtql_rpc_module_set(module, "urgent", session_urgent);
+    vrtql_rpc_system_set(system, module);
+
+    vrtql_rpc_env env;
+    env.data   = NULL;
+    env.module = NULL;
+    env.reply  = vrtql_msg_new();
+
+    // Only the first call asks for the priority lane
+    vrtql_msg* req = vrtql_msg_new();
+    vrtql_msg_set_header(req, "id", "session.urgent");
+    vrtql_msg_set_header(req, "urgent", "1");
+
+    vrtql_msg* reply = vrtql_rpc_service(system, &env, req);
+    ASSERT_TRUE(reply == env.reply);
+    ASSERT_TRUE(vws_is_flag(&reply->flags, VM_MSG_PRIORITY));
+
+    req = vrtql_msg_new();
+    vrtql_msg_set_header(req, "id", "session.urgent");
+
+    reply = vrtql_rpc_service(system, &env, req);
+    ASSERT_TRUE(reply == env.reply);
+    ASSERT_FALSE(vws_is_flag(&reply->flags, VM_MSG_PRIORITY));
+    ASSERT_TRUE(vws_is_flag(&reply->flags, VM_MSG_VALID));
+
+    vrtql_msg_free(env.reply);
+    vrtql_rpc_system_free(system);
+}
+
 int main(int argc, const char* argv[])
 {
     return ctest_main(argc, argv);
@@ -0,0 +1,59 @@
+#include "uring.h"
+
+#define CTEST_MAIN
+#include "ctest.h"
+
+CTEST(test_uring, overflow)
+{
+    vws_uring r;
+
+    if (vws_uring_init(&r, 4, 8) == false)
+    {
+        CTEST_LOG("io_uring not available, skipped");
+        return;
+    }
+
+    ASSERT_EQUAL(8, r.cq_entries);
+
+    // Many more completions than the queue holds, none reaped in between
+    int total = 64;
+
+    for (int i = 0; i < total; i++)
+    {
+        struct io_uring_sqe* sqe = vws_uring_sqe(&r);
+
+        if (sqe == NULL)
+        {
+            ASSERT_TRUE(vws_uring_submit(&r) > 0);
+            sqe = vws_uring_sqe(&r);
+        }
+
+        ASSERT_NOT_NULL(sqe);
+        sqe->opcode    = IORING_OP_NOP;
+        sqe->user_data = i + 1;
+    }
+
+    ASSERT_TRUE(vws_uring_submit(&r) > 0);
+    ASSERT_TRUE((*r.sq_flags & IORING_SQ_CQ_OVERFLOW) != 0);
+
+    // Every completion is delivered, the overflowed ones after the others
+    struct io_uring_cqe* cqe;
+    int n = 0;
+
+    while ((cqe = vws_uring_cqe(&r)) != NULL)
+    {
+        ASSERT_EQUAL(n + 1, cqe->user_data);
+        vws_uring_cqe_seen(&r);
+        n++;
+    }
+
+    ASSERT_EQUAL(total, n);
+    ASSERT_TRUE((*r.sq_flags & IORING_SQ_CQ_OVERFLOW) == 0);
+
+    vws_uring_destroy(&r);
+}
+
+int main(int argc, const char* argv[])
+{
+    return ctest_main(argc, argv);
+}
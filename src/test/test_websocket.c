@@ -10,6 +10,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <openssl/sha.h>
+
 #include "websocket.h"
 #include "message.h"
 
@@ -94,6 +96,118 @@ CTEST2(test, message)
     vrtql_msg_free(reply);
 }
 
+CTEST(test_frames, reassembly)
+{
+    // No connection needed: frames are pushed as the parser would
+    vws_cnx* c = vws_cnx_new();
+
+    // Single frame message
+    vws_frame* f = vws_frame_new((ucstr)content, strlen(content), TEXT_FRAME);
+    vws_cnx_frame_push(c, f);
+
+    // Fragmented message: one binary frame then continuations
+    for (int i = 0; i < 1000; i++)
+    {
+        unsigned char oc = (i == 0) ? BINARY_FRAME : CONTINUATION_FRAME;
+        f                = vws_frame_new((ucstr)content, strlen(content), oc);
+        f->fin           = 0;
+
+        vws_cnx_frame_push(c, f);
+    }
+
+    // First message is complete, second is not
+    vws_msg* m = vws_msg_pop(c);
+    ASSERT_NOT_NULL(m);
+    ASSERT_EQUAL(TEXT_FRAME, m->opcode);
+    ASSERT_EQUAL(strlen(content), m->data->size);
+    ASSERT_TRUE(strncmp(content, (cstr)m->data->data, m->data->size) == 0);
+    vws_msg_free(m);
+
+    ASSERT_NULL(vws_msg_pop(c));
+
+    // Final fragment completes it
+    vws_cnx_frame_push(c, vws_frame_new((ucstr)"end", 3, CONTINUATION_FRAME));
+
+    m = vws_msg_pop(c);
+    ASSERT_NOT_NULL(m);
+    ASSERT_EQUAL(BINARY_FRAME, m->opcode);
+    ASSERT_EQUAL(1000 * strlen(content) + 3, m->data->size);
+    ASSERT_EQUAL(m->data->size, m->data->allocated);
+    cstr tail = (cstr)m->data->data + m->data->size - 3;
+    ASSERT_TRUE(strncmp("end", tail, 3) == 0);
+    vws_msg_free(m);
+
+    ASSERT_NULL(vws_msg_pop(c));
+    ASSERT_EQUAL(0, sc_queue_size(&c->queue));
+
+    vws_cnx_free(c);
+}
+
+CTEST(test_frames, trim)
+{
+    // Nothing is allocated until data arrives
+    vws_cnx* c = vws_cnx_new();
+    ASSERT_NULL(c->key);
+    ASSERT_NULL(c->queue.elems);
+
+    vws_buffer_append(c->base.buffer, (ucstr)content, strlen(content));
+    vws_cnx_frame_push(c, vws_frame_new((ucstr)content, 3, TEXT_FRAME));
+    ASSERT_NOT_NULL(c->queue.elems);
+
+    // Pending data is kept
+    vws_cnx_trim(c);
+    ASSERT_NOT_NULL(c->base.buffer->data);
+    ASSERT_NOT_NULL(c->queue.elems);
+
+    vws_buffer_drain(c->base.buffer, c->base.buffer->size);
+    vws_msg_free(vws_msg_pop(c));
+
+    // Consumed data is released
+    vws_cnx_trim(c);
+    ASSERT_NULL(c->base.buffer->data);
+    ASSERT_NULL(c->queue.elems);
+
+    // And allocated again on demand
+    vws_cnx_frame_push(c, vws_frame_new((ucstr)content, 3, TEXT_FRAME));
+    vws_msg* m = vws_msg_pop(c);
+    ASSERT_NOT_NULL(m);
+    ASSERT_EQUAL(3, m->data->size);
+    vws_msg_free(m);
+
+    vws_cnx_free(c);
+}
+
+CTEST(test_handshake, accept_key)
+{
+    // Example from RFC 6455
+    char out[VWS_ACCEPT_KEY_SIZE + 1];
+    vws_accept_key_r("dGhlIHNhbXBsZSBub25jZQ==", out);
+    ASSERT_STR("s3pPLMBiTxaQ9kYGzzhZRbK+xOo=", out);
+
+    cstr key = vws_accept_key("dGhlIHNhbXBsZSBub25jZQ==");
+    ASSERT_STR(out, key);
+    vws.free((char*)key);
+
+    // Keys of any length, across SHA-1 block boundaries, match OpenSSL
+    cstr guid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    char input[256];
+
+    for (size_t size = 0; size < 160; size++)
+    {
+        memset(input, 'a' + (size % 26), size);
+        strcpy(input + size, guid);
+
+        unsigned char hash[SHA_DIGEST_LENGTH];
+        SHA1((ucstr)input, strlen(input), hash);
+        char* expected = vws_base64_encode(hash, sizeof(hash));
+
+        input[size] = 0;
+        vws_accept_key_r(input, out);
+        ASSERT_STR(expected, out);
+        vws.free(expected);
+    }
+}
+
 int main(int argc, const char* argv[])
 {
     return ctest_main(argc, argv);
@@ -159,6 +159,402 @@ CTEST(test_msg_server, echo)
     vws_svr_free(server);
 }
 
+CTEST(test_msg_server, cork)
+{
+    vws_svr* server    = vws_svr_new(2, 0, 0);
+    server->process_ws = process;
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    while (vws_tcp_svr_state((vws_tcp_svr*)server) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    vws_cnx* cnx = vws_cnx_new();
+    ASSERT_TRUE(vws_connect(cnx, uri));
+
+    vws_socket* s = (vws_socket*)cnx;
+    ASSERT_TRUE(vws_socket_cork(s, 16384));
+
+    // A burst of small messages is held in the cork buffer
+    int count = 100;
+    for (int i = 0; i < count; i++)
+    {
+        ASSERT_TRUE(vws_msg_send_text(cnx, "payload") > 0);
+    }
+
+    ASSERT_TRUE(s->out->size > 0);
+
+    // Receiving flushes it
+    for (int i = 0; i < count; i++)
+    {
+        vws_msg* reply = vws_msg_recv(cnx);
+        ASSERT_NOT_NULL(reply);
+        ASSERT_EQUAL(7, reply->data->size);
+        vws_msg_free(reply);
+    }
+
+    ASSERT_EQUAL(0, s->out->size);
+
+    // Crossing the threshold sends without an explicit flush
+    ASSERT_TRUE(vws_socket_cork(s, 1));
+    ASSERT_TRUE(vws_msg_send_text(cnx, "payload") > 0);
+    ASSERT_EQUAL(0, s->out->size);
+
+    vws_msg* reply = vws_msg_recv(cnx);
+    ASSERT_NOT_NULL(reply);
+    vws_msg_free(reply);
+
+    // Uncorking flushes
+    ASSERT_TRUE(vws_socket_cork(s, 16384));
+    ASSERT_TRUE(vws_msg_send_text(cnx, "payload") > 0);
+    ASSERT_TRUE(s->out->size > 0);
+    ASSERT_TRUE(vws_socket_cork(s, 0));
+    ASSERT_EQUAL(0, s->out->size);
+
+    reply = vws_msg_recv(cnx);
+    ASSERT_NOT_NULL(reply);
+    vws_msg_free(reply);
+
+    vws_disconnect(cnx);
+    vws_cnx_free(cnx);
+
+    vws_msleep(100);
+
+    vws_tcp_svr_stop((vws_tcp_svr*)server);
+    uv_thread_join(&server_tid);
+    vws_svr_free(server);
+}
+
+// Runs the server without protocol tracing, which is too slow for large frames
+void quiet_server_thread(void* arg)
+{
+    vws_tcp_svr_run((vws_tcp_svr*)arg, server_host, server_port);
+    vws_cleanup();
+}
+
+static void large_test(vws_svr_backend_t backend)
+{
+    vws_svr* server    = vws_svr_new(2, 0, 0);
+    server->process_ws = process;
+
+    ((vws_tcp_svr*)server)->backend = backend;
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, quiet_server_thread, server);
+
+    while (vws_tcp_svr_state((vws_tcp_svr*)server) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    // The server falls back to libuv where io_uring is not available
+    if ( (backend == VWS_SVR_BACKEND_URING) &&
+         (((vws_tcp_svr*)server)->ring == NULL) )
+    {
+        vws_tcp_svr_stop((vws_tcp_svr*)server);
+        uv_thread_join(&server_tid);
+        vws_svr_free(server);
+
+        CTEST_LOG("io_uring not available, skipped");
+        return;
+    }
+
+    vws_cnx* cnx = vws_cnx_new();
+    ASSERT_TRUE(vws_connect(cnx, uri));
+
+    // Echo a message many times the read size
+    size_t size        = 4 * 1024 * 1024;
+    unsigned char* msg = vws.malloc(size);
+
+    for (size_t i = 0; i < size; i++)
+    {
+        msg[i] = i % 251;
+    }
+
+    ASSERT_TRUE(vws_msg_send_binary(cnx, msg, size) > 0);
+
+    vws_msg* reply = vws_msg_recv(cnx);
+    ASSERT_NOT_NULL(reply);
+    ASSERT_EQUAL(size, reply->data->size);
+    ASSERT_TRUE(memcmp(msg, reply->data->data, size) == 0);
+    vws_msg_free(reply);
+    vws.free(msg);
+
+    vws_disconnect(cnx);
+    vws_cnx_free(cnx);
+
+    vws_msleep(100);
+
+    vws_tcp_svr_stop((vws_tcp_svr*)server);
+    uv_thread_join(&server_tid);
+    vws_svr_free(server);
+}
+
+CTEST(test_msg_server, large)
+{
+    large_test(VWS_SVR_BACKEND_UV);
+}
+
+// Same over io_uring. Logs and returns early where it is not available.
+CTEST(test_msg_server, large_uring)
+{
+    large_test(VWS_SVR_BACKEND_URING);
+}
+
+//------------------------------------------------------------------------------
+// Priority lanes
+//------------------------------------------------------------------------------
+
+static int  lanes_opened    = 0;
+static int  lanes_processed = 0;
+static char lanes_order[64][16];
+
+// Single worker: blocks on the first message so that the others queue up
+void lanes_process(vws_svr* s, vws_cid_t cid, vws_msg* m, void* ctx)
+{
+    size_t n = m->data->size < 15 ? m->data->size : 15;
+    memcpy(lanes_order[lanes_processed], m->data->data, n);
+    lanes_order[lanes_processed][n] = 0;
+
+    if (strcmp(lanes_order[lanes_processed], "block") == 0)
+    {
+        vws_msleep(300);
+    }
+
+    lanes_processed++;
+    vws_msg_free(m);
+}
+
+// Second connection is a priority connection, third an IRQ connection
+bool lanes_open(vws_svr_cnx* cnx)
+{
+    lanes_opened++;
+
+    if (lanes_opened == 2)
+    {
+        vws_set_flag(&cnx->cid.flags, VWS_SVR_STATE_PRIORITY);
+    }
+
+    if (lanes_opened == 3)
+    {
+        vws_set_flag(&cnx->cid.flags, VWS_SVR_STATE_IRQ);
+    }
+
+    return true;
+}
+
+CTEST(test_msg_server, lanes)
+{
+    vws_svr* server          = vws_svr_new(1, 0, 0);
+    server->process_ws       = lanes_process;
+    server->base.cnx_open_cb = lanes_open;
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, quiet_server_thread, server);
+
+    while (vws_tcp_svr_state((vws_tcp_svr*)server) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    vws_cnx* bulk = vws_cnx_new();
+    ASSERT_TRUE(vws_connect(bulk, uri));
+
+    vws_cnx* urgent = vws_cnx_new();
+    ASSERT_TRUE(vws_connect(urgent, uri));
+
+    // Queue bulk traffic behind a blocked worker, then an urgent message
+    ASSERT_TRUE(vws_msg_send_text(bulk, "block") > 0);
+
+    for (int i = 0; i < 10; i++)
+    {
+        ASSERT_TRUE(vws_msg_send_text(bulk, "bulk") > 0);
+    }
+
+    vws_msleep(100);
+    ASSERT_TRUE(vws_msg_send_text(urgent, "urgent") > 0);
+
+    for (int i = 0; (i < 50) && (lanes_processed < 12); i++)
+    {
+        vws_msleep(100);
+    }
+
+    // Urgent message overtakes the bulk backlog
+    ASSERT_EQUAL(12, lanes_processed);
+    ASSERT_STR("block", lanes_order[0]);
+    ASSERT_STR("urgent", lanes_order[1]);
+
+    vws_disconnect(bulk);
+    vws_cnx_free(bulk);
+    vws_disconnect(urgent);
+    vws_cnx_free(urgent);
+
+    vws_msleep(100);
+
+    vws_tcp_svr_stop((vws_tcp_svr*)server);
+    uv_thread_join(&server_tid);
+    vws_svr_free(server);
+}
+
+CTEST(test_msg_server, lanes_aging)
+{
+    lanes_opened    = 0;
+    lanes_processed = 0;
+
+    vws_svr* server          = vws_svr_new(1, 0, 0);
+    server->process_ws       = lanes_process;
+    server->base.cnx_open_cb = lanes_open;
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, quiet_server_thread, server);
+
+    while (vws_tcp_svr_state((vws_tcp_svr*)server) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    vws_cnx* bulk = vws_cnx_new();
+    ASSERT_TRUE(vws_connect(bulk, uri));
+
+    vws_cnx* urgent = vws_cnx_new();
+    ASSERT_TRUE(vws_connect(urgent, uri));
+
+    vws_cnx* irq = vws_cnx_new();
+    ASSERT_TRUE(vws_connect(irq, uri));
+
+    // Load all three lanes behind a blocked worker
+    ASSERT_TRUE(vws_msg_send_text(bulk, "block") > 0);
+    vws_msleep(100);
+
+    for (int i = 0; i < 5; i++)
+    {
+        ASSERT_TRUE(vws_msg_send_text(bulk, "bulk") > 0);
+        ASSERT_TRUE(vws_msg_send_text(urgent, "urgent") > 0);
+    }
+
+    for (int i = 0; i < 40; i++)
+    {
+        ASSERT_TRUE(vws_msg_send_text(irq, "irq") > 0);
+    }
+
+    for (int i = 0; (i < 50) && (lanes_processed < 51); i++)
+    {
+        vws_msleep(100);
+    }
+
+    ASSERT_EQUAL(51, lanes_processed);
+    ASSERT_STR("block", lanes_order[0]);
+
+    // IRQ goes first until the lower lanes have waited out the quota. Then
+    // priority gets its turn ahead of bulk, and bulk is not starved either.
+    for (int i = 1; i <= 16; i++)
+    {
+        ASSERT_STR("irq", lanes_order[i]);
+    }
+
+    ASSERT_STR("urgent", lanes_order[17]);
+    ASSERT_STR("bulk", lanes_order[18]);
+    ASSERT_STR("irq", lanes_order[19]);
+
+    vws_disconnect(bulk);
+    vws_cnx_free(bulk);
+    vws_disconnect(urgent);
+    vws_cnx_free(urgent);
+    vws_disconnect(irq);
+    vws_cnx_free(irq);
+
+    vws_msleep(100);
+
+    vws_tcp_svr_stop((vws_tcp_svr*)server);
+    uv_thread_join(&server_tid);
+    vws_svr_free(server);
+}
+
+static uint64_t timeouts_counter(vws_svr* server, vws_svr_metric_t metric)
+{
+    vws_svr_metrics* m = vws_tcp_svr_metrics((vws_tcp_svr*)server);
+    uint64_t value     = m->counters[metric];
+    vws_svr_metrics_free(m);
+
+    return value;
+}
+
+CTEST(test_msg_server, timeouts)
+{
+    vws_svr* server    = vws_svr_new(2, 0, 0);
+    server->process_ws = process;
+
+    vws_tcp_svr* base       = (vws_tcp_svr*)server;
+    base->handshake_timeout = 300;
+    base->idle_timeout      = 600;
+    base->ping_interval     = 200;
+    base->wheel.tick        = 50;
+
+    uv_thread_t server_tid;
+    uv_thread_create(&server_tid, server_thread, server);
+
+    while (vws_tcp_svr_state(base) != VS_RUNNING)
+    {
+        vws_msleep(100);
+    }
+
+    // Never sends a request
+    vws_socket* silent = vws_socket_new();
+    ASSERT_TRUE(vws_socket_connect(silent, server_host, server_port, false));
+
+    // Upgraded and answers pings while it reads
+    vws_cnx* live = vws_cnx_new();
+    ASSERT_TRUE(vws_connect(live, uri));
+    live->base.timeout = 100;
+
+    // Upgraded but never reads, so never answers
+    vws_cnx* dead = vws_cnx_new();
+    ASSERT_TRUE(vws_connect(dead, uri));
+
+    // Past the handshake timeout, before the idle timeout
+    for (int i = 0; i < 4; i++)
+    {
+        ASSERT_NULL(vws_msg_recv(live));
+    }
+
+    ASSERT_EQUAL(1, timeouts_counter(server, VWS_METRIC_CNX_TIMEOUTS));
+    ASSERT_TRUE(vws_socket_read(silent) <= 0);
+    ASSERT_FALSE(vws_socket_is_connected(silent));
+
+    // Well past the idle timeout
+    for (int i = 0; i < 8; i++)
+    {
+        ASSERT_NULL(vws_msg_recv(live));
+    }
+
+    ASSERT_EQUAL(2, timeouts_counter(server, VWS_METRIC_CNX_TIMEOUTS));
+    ASSERT_TRUE(timeouts_counter(server, VWS_METRIC_PINGS) >= 4);
+
+    // The live connection kept going
+    ASSERT_TRUE(vws_cnx_is_connected(live));
+    ASSERT_TRUE(vws_msg_send_text(live, content) > 0);
+
+    live->base.timeout = 5000;
+    vws_msg* reply     = vws_msg_recv(live);
+    ASSERT_NOT_NULL(reply);
+    ASSERT_TRUE(strncmp(content, (cstr)reply->data->data, reply->data->size) == 0);
+    vws_msg_free(reply);
+
+    vws_socket_free(silent);
+    vws_disconnect(live);
+    vws_cnx_free(live);
+    vws_cnx_free(dead);
+
+    vws_msleep(100);
+
+    vws_tcp_svr_stop(base);
+    uv_thread_join(&server_tid);
+    vws_svr_free(server);
+}
+
 int main(int argc, const char* argv[])
 {
     return ctest_main(argc, argv);
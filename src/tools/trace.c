@@ -0,0 +1,51 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "vws.h"
+
+//------------------------------------------------------------------------------
+// vws-trace: decodes binary trace files written by vws_tracer_start()
+//------------------------------------------------------------------------------
+
+static void usage()
+{
+    fprintf(stderr, "usage: vws-trace <file>\n");
+    fprintf(stderr, "       vws-trace -   (read from stdin)\n");
+}
+
+int main(int argc, const char* argv[])
+{
+    if (argc != 2)
+    {
+        usage();
+        return 1;
+    }
+
+    FILE* in = stdin;
+
+    if (strcmp(argv[1], "-") != 0)
+    {
+        in = fopen(argv[1], "rb");
+
+        if (in == NULL)
+        {
+            fprintf(stderr, "vws-trace: cannot open %s\n", argv[1]);
+            return 1;
+        }
+    }
+
+    ssize_t n = vws_tracer_decode(in, stdout);
+
+    if (in != stdin)
+    {
+        fclose(in);
+    }
+
+    if (n < 0)
+    {
+        fprintf(stderr, "vws-trace: %s is not a trace file\n", argv[1]);
+        return 1;
+    }
+
+    return 0;
+}
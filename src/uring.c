@@ -0,0 +1,414 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+//------------------------------------------------------------------------------
+// Internal functions
+//------------------------------------------------------------------------------
+
+/**
+ * @brief The io_uring_setup() system call
+ *
+ * @param entries The submission queue size
+ * @param p The parameters, filled in by the kernel
+ * @return The ring file descriptor, -1 on error (errno is set)
+ *
+ * @ingroup UringFunctions
+ */
+static int uring_setup(uint32_t entries, struct io_uring_params* p);
+
+/**
+ * @brief The io_uring_enter() system call
+ *
+ * @param fd The ring
+ * @param submit The number of entries to submit
+ * @param wait The number of completions to wait for
+ * @param flags IORING_ENTER_* flags
+ * @return The number submitted, -1 on error (errno is set)
+ *
+ * @ingroup UringFunctions
+ */
+static int uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags);
+
+/**
+ * @brief The io_uring_register() system call
+ *
+ * @param fd The ring
+ * @param op The IORING_REGISTER_* operation
+ * @param arg The argument of the operation
+ * @param n The number of arguments
+ * @return 0 or a positive value, -1 on error (errno is set)
+ *
+ * @ingroup UringFunctions
+ */
+static int uring_register(int fd, unsigned op, void* arg, unsigned n);
+
+//------------------------------------------------------------------------------
+// System calls
+//------------------------------------------------------------------------------
+
+int uring_setup(uint32_t entries, struct io_uring_params* p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+int uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+int uring_register(int fd, unsigned op, void* arg, unsigned n)
+{
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+//------------------------------------------------------------------------------
+// Ring
+//------------------------------------------------------------------------------
+
+bool vws_uring_init(vws_uring* r, uint32_t entries, uint32_t cq_entries)
+{
+    memset(r, 0, sizeof(vws_uring));
+    r->fd = -1;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    // Keep going past a failed entry, as each one completes on its own
+    p.flags = IORING_SETUP_SUBMIT_ALL;
+
+    if (cq_entries > 0)
+    {
+        p.flags     |= IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+        p.cq_entries = cq_entries;
+    }
+
+    int fd = uring_setup(entries, &p);
+
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    r->fd           = fd;
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = p.cq_off.cqes
+                    + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_size    = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (r->cq_ring_size > r->sq_ring_size)
+        {
+            r->sq_ring_size = r->cq_ring_size;
+        }
+
+        r->cq_ring_size = r->sq_ring_size;
+    }
+
+    r->sq_ring = mmap( NULL, r->sq_ring_size,
+                       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       fd, IORING_OFF_SQ_RING );
+
+    if (r->sq_ring == MAP_FAILED)
+    {
+        r->sq_ring = NULL;
+        goto error;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        r->cq_ring = r->sq_ring;
+    }
+    else
+    {
+        r->cq_ring = mmap( NULL, r->cq_ring_size,
+                           PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           fd, IORING_OFF_CQ_RING );
+
+        if (r->cq_ring == MAP_FAILED)
+        {
+            r->cq_ring = NULL;
+            goto error;
+        }
+    }
+
+    r->sqes = mmap( NULL, r->sqes_size,
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    fd, IORING_OFF_SQES );
+
+    if (r->sqes == MAP_FAILED)
+    {
+        r->sqes = NULL;
+        goto error;
+    }
+
+    char* sq        = (char*)r->sq_ring;
+    char* cq        = (char*)r->cq_ring;
+    r->sq_head      = (unsigned*)(sq + p.sq_off.head);
+    r->sq_tail      = (unsigned*)(sq + p.sq_off.tail);
+    r->sq_flags     = (unsigned*)(sq + p.sq_off.flags);
+    r->sq_mask      = *(unsigned*)(sq + p.sq_off.ring_mask);
+    r->sq_entries   = *(unsigned*)(sq + p.sq_off.ring_entries);
+    r->sqe_tail     = *r->sq_tail;
+    r->cq_head      = (unsigned*)(cq + p.cq_off.head);
+    r->cq_tail      = (unsigned*)(cq + p.cq_off.tail);
+    r->cq_mask      = *(unsigned*)(cq + p.cq_off.ring_mask);
+    r->cq_entries   = *(unsigned*)(cq + p.cq_off.ring_entries);
+    r->cqes         = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    // Entry i of the index array always points at submission entry i, so the
+    // array is filled in once rather than on every submission.
+    unsigned* array = (unsigned*)(sq + p.sq_off.array);
+
+    for (unsigned i = 0; i < r->sq_entries; i++)
+    {
+        array[i] = i;
+    }
+
+    return true;
+
+error:
+
+    {
+        int e = errno;
+        vws_uring_destroy(r);
+        errno = e;
+    }
+
+    return false;
+}
+
+void vws_uring_destroy(vws_uring* r)
+{
+    if (r->sqes != NULL)
+    {
+        munmap(r->sqes, r->sqes_size);
+    }
+
+    if ((r->cq_ring != NULL) && (r->cq_ring != r->sq_ring))
+    {
+        munmap(r->cq_ring, r->cq_ring_size);
+    }
+
+    if (r->sq_ring != NULL)
+    {
+        munmap(r->sq_ring, r->sq_ring_size);
+    }
+
+    if (r->fd >= 0)
+    {
+        close(r->fd);
+    }
+
+    memset(r, 0, sizeof(vws_uring));
+    r->fd = -1;
+}
+
+struct io_uring_sqe* vws_uring_sqe(vws_uring* r)
+{
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+
+    if (r->sqe_tail - head >= r->sq_entries)
+    {
+        return NULL;
+    }
+
+    struct io_uring_sqe* sqe = &r->sqes[r->sqe_tail & r->sq_mask];
+    r->sqe_tail++;
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+    return sqe;
+}
+
+int vws_uring_submit(vws_uring* r)
+{
+    // Counted from the kernel's head, so entries it left in the queue last
+    // time go again
+    unsigned head   = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    unsigned submit = r->sqe_tail - head;
+
+    if (submit == 0)
+    {
+        return 0;
+    }
+
+    // The entries must be visible before the kernel sees the new tail
+    __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+
+    int rc;
+
+    do
+    {
+        rc = uring_enter(r->fd, submit, 0, 0);
+    }
+    while ((rc < 0) && (errno == EINTR));
+
+    return (rc < 0) ? -errno : rc;
+}
+
+bool vws_uring_pending(vws_uring* r)
+{
+    return r->sqe_tail != __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+}
+
+struct io_uring_cqe* vws_uring_cqe(vws_uring* r)
+{
+    unsigned head = *r->cq_head;
+    unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+    if (head == tail)
+    {
+        // Completions which did not fit are held by the kernel until asked
+        // for. Among them may be the last completion of a multishot request,
+        // which nothing else would ever deliver.
+        if ((__atomic_load_n(r->sq_flags, __ATOMIC_ACQUIRE) &
+             IORING_SQ_CQ_OVERFLOW) == 0)
+        {
+            return NULL;
+        }
+
+        int rc;
+
+        do
+        {
+            rc = uring_enter(r->fd, 0, 0, IORING_ENTER_GETEVENTS);
+        }
+        while ((rc < 0) && (errno == EINTR));
+
+        tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+        if (head == tail)
+        {
+            return NULL;
+        }
+    }
+
+    return &r->cqes[head & r->cq_mask];
+}
+
+void vws_uring_cqe_seen(vws_uring* r)
+{
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+bool vws_uring_eventfd(vws_uring* r, int fd)
+{
+    return uring_register(r->fd, IORING_REGISTER_EVENTFD, &fd, 1) == 0;
+}
+
+//------------------------------------------------------------------------------
+// Provided buffers
+//------------------------------------------------------------------------------
+
+bool vws_uring_bufs_init( vws_uring* r,
+                          vws_uring_bufs* b,
+                          uint16_t bgid,
+                          uint32_t count,
+                          uint32_t size )
+{
+    memset(b, 0, sizeof(vws_uring_bufs));
+
+    size_t ring_size = count * sizeof(struct io_uring_buf);
+    size_t data_size = (size_t)count * size;
+
+    // The descriptor ring must be page aligned. The buffers are only touched
+    // as the kernel fills them.
+    void* ring = mmap( NULL, ring_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+
+    if (ring == MAP_FAILED)
+    {
+        return false;
+    }
+
+    void* base = mmap( NULL, data_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+
+    if (base == MAP_FAILED)
+    {
+        munmap(ring, ring_size);
+        return false;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr    = (uint64_t)(uintptr_t)ring;
+    reg.ring_entries = count;
+    reg.bgid         = bgid;
+
+    if (uring_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+    {
+        int e = errno;
+        munmap(base, data_size);
+        munmap(ring, ring_size);
+        errno = e;
+
+        return false;
+    }
+
+    b->ring  = (struct io_uring_buf_ring*)ring;
+    b->base  = (char*)base;
+    b->count = count;
+    b->size  = size;
+    b->bgid  = bgid;
+    b->tail  = 0;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        struct io_uring_buf* buf = &b->ring->bufs[i];
+        buf->addr                = (uint64_t)(uintptr_t)(b->base + i * size);
+        buf->len                 = size;
+        buf->bid                 = (uint16_t)i;
+    }
+
+    b->tail = (uint16_t)count;
+    __atomic_store_n(&b->ring->tail, b->tail, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+void vws_uring_bufs_free(vws_uring* r, vws_uring_bufs* b)
+{
+    if (b->ring == NULL)
+    {
+        return;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = b->bgid;
+
+    if (r->fd >= 0)
+    {
+        uring_register(r->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    }
+
+    munmap(b->base, (size_t)b->count * b->size);
+    munmap(b->ring, b->count * sizeof(struct io_uring_buf));
+
+    memset(b, 0, sizeof(vws_uring_bufs));
+}
+
+char* vws_uring_buf(vws_uring_bufs* b, uint16_t bid)
+{
+    return b->base + (size_t)bid * b->size;
+}
+
+void vws_uring_buf_return(vws_uring_bufs* b, uint16_t bid)
+{
+    struct io_uring_buf* buf = &b->ring->bufs[b->tail & (b->count - 1)];
+    buf->addr                = (uint64_t)(uintptr_t)vws_uring_buf(b, bid);
+    buf->len                 = b->size;
+    buf->bid                 = bid;
+
+    b->tail++;
+
+    // The descriptor must be visible before the kernel sees the new tail
+    __atomic_store_n(&b->ring->tail, b->tail, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,257 @@
+#ifndef VWS_URING_DECLARE
+#define VWS_URING_DECLARE
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <linux/io_uring.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//------------------------------------------------------------------------------
+// io_uring
+//------------------------------------------------------------------------------
+
+/**
+ * @defgroup UringFunctions
+ *
+ * @brief A minimal io_uring ring over the raw system calls, with a provided
+ * buffer ring for multishot receive. Linux only.
+ *
+ * Submission entries are taken with vws_uring_sqe(), filled in and handed to
+ * the kernel in one system call by vws_uring_submit(). Completions are read
+ * with vws_uring_cqe() and released with vws_uring_cqe_seen(). Completions the
+ * kernel could not fit in the completion queue are held on its overflow list
+ * and read in turn once the queue is drained. A ring is not thread-safe; one
+ * thread owns it.
+ */
+
+/**
+ * @brief An io_uring instance with its mapped submission and completion queues
+ */
+typedef struct
+{
+    /**< The ring file descriptor, -1 if not set up */
+    int fd;
+
+    /**< Submission queue head, written by the kernel */
+    unsigned* sq_head;
+
+    /**< Submission queue tail, written by us */
+    unsigned* sq_tail;
+
+    /**< Submission queue flags, written by the kernel */
+    unsigned* sq_flags;
+
+    /**< Submission queue index mask */
+    unsigned sq_mask;
+
+    /**< Submission queue entries */
+    unsigned sq_entries;
+
+    /**< Submission entries */
+    struct io_uring_sqe* sqes;
+
+    /**< Tail including entries taken but not yet submitted */
+    unsigned sqe_tail;
+
+    /**< Completion queue head, written by us */
+    unsigned* cq_head;
+
+    /**< Completion queue tail, written by the kernel */
+    unsigned* cq_tail;
+
+    /**< Completion queue index mask */
+    unsigned cq_mask;
+
+    /**< Completion queue entries */
+    unsigned cq_entries;
+
+    /**< Completion entries */
+    struct io_uring_cqe* cqes;
+
+    /**< Mapped queue rings. They are the same mapping if the kernel has
+     *   IORING_FEAT_SINGLE_MMAP. */
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+
+    /**< Size of the mapped submission entries */
+    size_t sqes_size;
+
+} vws_uring;
+
+/**
+ * @brief A provided buffer ring. The kernel picks a buffer from it for each
+ * receive and reports its ID in the completion. The buffer belongs to us until
+ * it is given back with vws_uring_buf_return().
+ */
+typedef struct
+{
+    /**< The shared ring of buffer descriptors */
+    struct io_uring_buf_ring* ring;
+
+    /**< The buffers, one block */
+    char* base;
+
+    /**< Number of buffers, a power of two */
+    uint32_t count;
+
+    /**< Size of each buffer */
+    uint32_t size;
+
+    /**< Buffer group ID used in submissions */
+    uint16_t bgid;
+
+    /**< Local copy of the ring tail */
+    uint16_t tail;
+
+} vws_uring_bufs;
+
+/**
+ * @brief Sets up a ring.
+ *
+ * @param r The ring
+ * @param entries The submission queue size
+ * @param cq_entries The completion queue size, larger than entries. The kernel
+ *        rounds it up to a power of two and caps it at its limit. If 0, it is
+ *        twice entries.
+ * @return true if successful, false otherwise (errno is set).
+ *
+ * @ingroup UringFunctions
+ */
+bool vws_uring_init(vws_uring* r, uint32_t entries, uint32_t cq_entries);
+
+/**
+ * @brief Tears down a ring. The kernel cancels what is still in flight.
+ *
+ * @param r The ring
+ *
+ * @ingroup UringFunctions
+ */
+void vws_uring_destroy(vws_uring* r);
+
+/**
+ * @brief Takes the next free submission entry, zeroed.
+ *
+ * @param r The ring
+ * @return The entry, or NULL if the submission queue is full. Submitting frees
+ *         it up.
+ *
+ * @ingroup UringFunctions
+ */
+struct io_uring_sqe* vws_uring_sqe(vws_uring* r);
+
+/**
+ * @brief Submits all entries taken since the last call, in one system call.
+ *
+ * @param r The ring
+ * @return The number submitted, or -errno on error.
+ *
+ * @ingroup UringFunctions
+ */
+int vws_uring_submit(vws_uring* r);
+
+/**
+ * @brief Checks for submission entries taken and not yet submitted.
+ *
+ * @param r The ring
+ * @return true if there are any
+ *
+ * @ingroup UringFunctions
+ */
+bool vws_uring_pending(vws_uring* r);
+
+/**
+ * @brief Returns the next completion without waiting. Once the completion
+ * queue is drained, completions held on the kernel's overflow list are moved
+ * into it.
+ *
+ * @param r The ring
+ * @return The completion, or NULL if there is none. It stays valid until
+ *         vws_uring_cqe_seen().
+ *
+ * @ingroup UringFunctions
+ */
+struct io_uring_cqe* vws_uring_cqe(vws_uring* r);
+
+/**
+ * @brief Releases the completion returned by vws_uring_cqe().
+ *
+ * @param r The ring
+ *
+ * @ingroup UringFunctions
+ */
+void vws_uring_cqe_seen(vws_uring* r);
+
+/**
+ * @brief Has the kernel signal an eventfd on every completion, so the ring can
+ * be watched by another event loop.
+ *
+ * @param r The ring
+ * @param fd The eventfd
+ * @return true if successful, false otherwise (errno is set).
+ *
+ * @ingroup UringFunctions
+ */
+bool vws_uring_eventfd(vws_uring* r, int fd);
+
+/**
+ * @brief Allocates a provided buffer ring, registers it with the ring and
+ * hands the kernel all of its buffers.
+ *
+ * @param r The ring
+ * @param b The buffer ring
+ * @param bgid The buffer group ID
+ * @param count The number of buffers, a power of two no larger than 32768
+ * @param size The size of each buffer
+ * @return true if successful, false otherwise (errno is set).
+ *
+ * @ingroup UringFunctions
+ */
+bool vws_uring_bufs_init( vws_uring* r,
+                          vws_uring_bufs* b,
+                          uint16_t bgid,
+                          uint32_t count,
+                          uint32_t size );
+
+/**
+ * @brief Unregisters and frees a provided buffer ring.
+ *
+ * @param r The ring
+ * @param b The buffer ring
+ *
+ * @ingroup UringFunctions
+ */
+void vws_uring_bufs_free(vws_uring* r, vws_uring_bufs* b);
+
+/**
+ * @brief Returns the memory of a buffer.
+ *
+ * @param b The buffer ring
+ * @param bid The buffer ID from the completion flags
+ * @return The buffer
+ *
+ * @ingroup UringFunctions
+ */
+char* vws_uring_buf(vws_uring_bufs* b, uint16_t bid);
+
+/**
+ * @brief Gives a buffer back to the kernel.
+ *
+ * @param b The buffer ring
+ * @param bid The buffer ID
+ *
+ * @ingroup UringFunctions
+ */
+void vws_uring_buf_return(vws_uring_bufs* b, uint16_t bid);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* VWS_URING_DECLARE */
@@ -491,6 +491,7 @@ void vws_cleanup()
     if (vws.e.text != NULL)
     {
         free(vws.e.text);
+        vws.e.text = NULL;
     }
 }
 
@@ -588,6 +589,28 @@ void vws_buffer_append(vws_buffer* buffer, ucstr data, size_t size)
     buffer->size = total_size;
 }
 
+unsigned char* vws_buffer_reserve(vws_buffer* buffer, size_t size)
+{
+    size_t total_size = buffer->size + size;
+
+    if (total_size > buffer->allocated)
+    {
+        buffer->allocated = total_size * 1.5;
+
+        if (buffer->data == NULL)
+        {
+            buffer->data = (unsigned char*)vws.malloc(buffer->allocated);
+        }
+        else
+        {
+            buffer->data = (unsigned char*)vws.realloc( buffer->data,
+                                                        buffer->allocated );
+        }
+    }
+
+    return buffer->data + buffer->size;
+}
+
 void vws_buffer_drain(vws_buffer* buffer, size_t size)
 {
     if (buffer == NULL || buffer->data == NULL)
@@ -909,6 +932,569 @@ unsigned char* vws_base64_decode(const char* data, size_t* size)
     return decoded_data;
 }
 
+//------------------------------------------------------------------------------
+// Histogram
+//------------------------------------------------------------------------------
+
+#define HIST_SUB_COUNT (1u << VWS_HIST_SUB_BITS)
+#define HIST_MAX_VALUE ((UINT64_C(1) << VWS_HIST_MAX_BITS) - 1)
+
+// Returns the index of the most significant set bit (value must be non-zero)
+static uint32_t hist_msb(uint64_t value)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return (uint32_t)index;
+#else
+    return 63 - __builtin_clzll(value);
+#endif
+}
+
+// Maps a value to its bucket. Values below HIST_SUB_COUNT map to themselves.
+// Above that, each power of two is split into HIST_SUB_COUNT linear buckets.
+static uint32_t hist_bucket(uint64_t value)
+{
+    if (value < HIST_SUB_COUNT)
+    {
+        return (uint32_t)value;
+    }
+
+    uint32_t msb   = hist_msb(value);
+    uint32_t shift = msb - VWS_HIST_SUB_BITS;
+    uint32_t sub   = (uint32_t)(value >> shift) & (HIST_SUB_COUNT - 1);
+
+    return ((shift + 1) << VWS_HIST_SUB_BITS) + sub;
+}
+
+// Returns the largest value that maps to a bucket
+static uint64_t hist_bucket_max(uint32_t bucket)
+{
+    if (bucket < HIST_SUB_COUNT)
+    {
+        return bucket;
+    }
+
+    uint32_t shift = (bucket >> VWS_HIST_SUB_BITS) - 1;
+    uint64_t sub   = (bucket & (HIST_SUB_COUNT - 1)) | HIST_SUB_COUNT;
+
+    return ((sub + 1) << shift) - 1;
+}
+
+vws_hist* vws_hist_new()
+{
+    vws_hist* h = (vws_hist*)vws.malloc(sizeof(vws_hist));
+    vws_hist_clear(h);
+
+    return h;
+}
+
+void vws_hist_free(vws_hist* h)
+{
+    if (h != NULL)
+    {
+        vws.free(h);
+    }
+}
+
+void vws_hist_clear(vws_hist* h)
+{
+    memset(h, 0, sizeof(vws_hist));
+    h->min = UINT64_MAX;
+}
+
+void vws_hist_add(vws_hist* h, uint64_t value)
+{
+    if (value > HIST_MAX_VALUE)
+    {
+        value = HIST_MAX_VALUE;
+    }
+
+    h->buckets[hist_bucket(value)]++;
+    h->count++;
+    h->sum += value;
+
+    if (value < h->min)
+    {
+        h->min = value;
+    }
+
+    if (value > h->max)
+    {
+        h->max = value;
+    }
+}
+
+void vws_hist_merge(vws_hist* h, const vws_hist* from)
+{
+    if (from->count == 0)
+    {
+        return;
+    }
+
+    for (uint32_t i = 0; i < VWS_HIST_BUCKETS; i++)
+    {
+        h->buckets[i] += from->buckets[i];
+    }
+
+    h->count += from->count;
+    h->sum   += from->sum;
+
+    if (from->min < h->min)
+    {
+        h->min = from->min;
+    }
+
+    if (from->max > h->max)
+    {
+        h->max = from->max;
+    }
+}
+
+uint64_t vws_hist_percentile(const vws_hist* h, double p)
+{
+    if (h->count == 0)
+    {
+        return 0;
+    }
+
+    if (p <= 0)
+    {
+        return h->min;
+    }
+
+    // Rank of the value sought (1-based, rounded up)
+    uint64_t rank = (uint64_t)((p / 100.0) * h->count + 0.999999);
+
+    if (rank > h->count)
+    {
+        rank = h->count;
+    }
+
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < VWS_HIST_BUCKETS; i++)
+    {
+        seen += h->buckets[i];
+
+        if (seen >= rank)
+        {
+            uint64_t value = hist_bucket_max(i);
+            return (value > h->max) ? h->max : value;
+        }
+    }
+
+    return h->max;
+}
+
+double vws_hist_mean(const vws_hist* h)
+{
+    if (h->count == 0)
+    {
+        return 0;
+    }
+
+    return (double)h->sum / h->count;
+}
+
+//------------------------------------------------------------------------------
+// Trace Ring
+//------------------------------------------------------------------------------
+
+#define TRACER_RING_SIZE 8192
+#define TRACER_INTERVAL  100
+#define TRACER_MAGIC     "VWSTRACE"
+#define TRACER_VERSION   1
+
+// Single producer, single consumer ring of events. The owning thread is the
+// only writer of head, the flusher is the only writer of tail.
+typedef struct tracer_ring
+{
+    vws_tev* events;          // Event slots
+    uint64_t mask;            // Slot count - 1
+    uint64_t head;            // Next slot to write
+    uint64_t tail;            // Next slot to read
+    uint64_t dropped;         // Events dropped since last drain
+    uint32_t thread;          // Trace thread number
+    int closed;               // Owning thread has exited
+    struct tracer_ring* next; // Next ring in tracer list
+} tracer_ring;
+
+// File header
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t size;
+} tracer_header;
+
+static struct
+{
+    int active;                // Events are being recorded
+    int stop;                  // Flusher should exit
+    FILE* file;                // Output file
+    size_t ring_size;          // Slots in new rings
+    uint32_t interval;         // Flush interval (msec)
+    uint32_t threads;          // Thread numbers assigned
+    tracer_ring* rings;        // All rings
+    pthread_t flusher;         // Flusher thread
+    pthread_mutex_t lock;      // Protects all of the above
+    pthread_cond_t wake;       // Wakes flusher on stop
+    pthread_once_t once;       // Initializes key
+    pthread_key_t key;         // Closes rings on thread exit
+
+} tracer =
+{
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .once = PTHREAD_ONCE_INIT
+};
+
+// The ring of the calling thread
+static __thread tracer_ring* tracer_thread_ring = NULL;
+
+// Marks a ring closed when its thread exits. The flusher frees it once drained.
+static void tracer_ring_close(void* arg)
+{
+    tracer_ring* ring = (tracer_ring*)arg;
+    __atomic_store_n(&ring->closed, 1, __ATOMIC_RELEASE);
+}
+
+static void tracer_init()
+{
+    pthread_key_create(&tracer.key, tracer_ring_close);
+}
+
+// Allocates and registers the calling thread's ring
+static tracer_ring* tracer_ring_new()
+{
+    pthread_once(&tracer.once, tracer_init);
+
+    tracer_ring* ring = (tracer_ring*)vws.malloc(sizeof(tracer_ring));
+
+    pthread_mutex_lock(&tracer.lock);
+
+    ring->events  = (vws_tev*)vws.malloc(tracer.ring_size * sizeof(vws_tev));
+    ring->mask    = tracer.ring_size - 1;
+    ring->head    = 0;
+    ring->tail    = 0;
+    ring->dropped = 0;
+    ring->closed  = 0;
+    ring->thread  = ++tracer.threads;
+    ring->next    = tracer.rings;
+    tracer.rings  = ring;
+
+    pthread_mutex_unlock(&tracer.lock);
+
+    pthread_setspecific(tracer.key, ring);
+    tracer_thread_ring = ring;
+
+    vws_tev_emit(VTE_THREAD, (uint64_t)pthread_self(), 0, 0);
+
+    return ring;
+}
+
+// Writes events to the trace file
+static void tracer_write(vws_tev* e, size_t n)
+{
+    if ((n > 0) && (fwrite(e, sizeof(vws_tev), n, tracer.file) != n))
+    {
+        vws.error(VE_SYS, "tracer write failed");
+    }
+}
+
+// Moves all pending events to the file, or discards them. Frees rings of
+// exited threads. Caller must hold tracer.lock.
+static void tracer_drain(bool discard)
+{
+    tracer_ring** link = &tracer.rings;
+
+    while (*link != NULL)
+    {
+        tracer_ring* ring = *link;
+
+        // Read closed before head so that a closed ring is fully drained
+        int closed       = __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE);
+        uint64_t head    = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t tail    = ring->tail;
+        uint64_t dropped = __atomic_exchange_n( &ring->dropped, 0,
+                                                __ATOMIC_RELAXED );
+
+        if ((discard == false) && (head != tail))
+        {
+            size_t start = tail & ring->mask;
+            size_t count = head - tail;
+            size_t first = ring->mask + 1 - start;
+
+            if (first > count)
+            {
+                first = count;
+            }
+
+            tracer_write(&ring->events[start], first);
+            tracer_write(&ring->events[0], count - first);
+        }
+
+        if ((discard == false) && (dropped > 0))
+        {
+            vws_tev e = {0};
+            e.time    = vws_clock_usec();
+            e.thread  = ring->thread;
+            e.id      = VTE_DROPPED;
+            e.arg[0]  = dropped;
+
+            tracer_write(&e, 1);
+        }
+
+        __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+
+        if (closed)
+        {
+            *link = ring->next;
+            vws.free(ring->events);
+            vws.free(ring);
+
+            continue;
+        }
+
+        link = &ring->next;
+    }
+
+    if (tracer.file != NULL)
+    {
+        fflush(tracer.file);
+    }
+}
+
+static void* tracer_flusher(void* arg)
+{
+    pthread_mutex_lock(&tracer.lock);
+
+    while (tracer.stop == 0)
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+
+        uint64_t ns = ts.tv_nsec + (uint64_t)tracer.interval * 1000000;
+        ts.tv_sec  += ns / 1000000000;
+        ts.tv_nsec  = ns % 1000000000;
+
+        pthread_cond_timedwait(&tracer.wake, &tracer.lock, &ts);
+        tracer_drain(false);
+    }
+
+    pthread_mutex_unlock(&tracer.lock);
+
+    return NULL;
+}
+
+bool vws_tracer_start(cstr path, size_t ring_size, uint32_t interval)
+{
+    pthread_mutex_lock(&tracer.lock);
+
+    if (tracer.file != NULL)
+    {
+        pthread_mutex_unlock(&tracer.lock);
+        vws.error(VE_RT, "tracer already running");
+
+        return false;
+    }
+
+    FILE* file = fopen(path, "wb");
+
+    if (file == NULL)
+    {
+        pthread_mutex_unlock(&tracer.lock);
+        vws.error(VE_SYS, "tracer cannot open %s", path);
+
+        return false;
+    }
+
+    tracer_header header = { TRACER_MAGIC, TRACER_VERSION, sizeof(vws_tev) };
+    fwrite(&header, sizeof(header), 1, file);
+
+    // Round ring size up to power of two. This only applies to new rings.
+    size_t size = 16;
+
+    while (size < ((ring_size == 0) ? TRACER_RING_SIZE : ring_size))
+    {
+        size <<= 1;
+    }
+
+    tracer.file      = file;
+    tracer.stop      = 0;
+    tracer.ring_size = size;
+    tracer.interval  = (interval == 0) ? TRACER_INTERVAL : interval;
+
+    // Discard events left over from a previous run
+    tracer_drain(true);
+
+    pthread_mutex_unlock(&tracer.lock);
+
+    pthread_create(&tracer.flusher, NULL, tracer_flusher, NULL);
+    __atomic_store_n(&tracer.active, 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+void vws_tracer_stop()
+{
+    pthread_mutex_lock(&tracer.lock);
+
+    if (tracer.file == NULL)
+    {
+        pthread_mutex_unlock(&tracer.lock);
+        return;
+    }
+
+    __atomic_store_n(&tracer.active, 0, __ATOMIC_RELEASE);
+    tracer.stop = 1;
+    pthread_cond_signal(&tracer.wake);
+    pthread_mutex_unlock(&tracer.lock);
+
+    pthread_join(tracer.flusher, NULL);
+
+    pthread_mutex_lock(&tracer.lock);
+    tracer_drain(false);
+    fclose(tracer.file);
+    tracer.file = NULL;
+    pthread_mutex_unlock(&tracer.lock);
+}
+
+bool vws_tracer_active()
+{
+    return __atomic_load_n(&tracer.active, __ATOMIC_ACQUIRE) != 0;
+}
+
+void vws_tev_emit(uint32_t id, uint64_t a, uint64_t b, uint64_t c)
+{
+    if (__atomic_load_n(&tracer.active, __ATOMIC_RELAXED) == 0)
+    {
+        return;
+    }
+
+    tracer_ring* ring = tracer_thread_ring;
+
+    if (ring == NULL)
+    {
+        ring = tracer_ring_new();
+    }
+
+    uint64_t head = ring->head;
+
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > ring->mask)
+    {
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    vws_tev* e = &ring->events[head & ring->mask];
+    e->time    = vws_clock_usec();
+    e->thread  = ring->thread;
+    e->id      = id;
+    e->arg[0]  = a;
+    e->arg[1]  = b;
+    e->arg[2]  = c;
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Event names, for decoding
+static cstr tracer_event_name(uint32_t id)
+{
+    switch (id)
+    {
+        case VTE_THREAD:    return "THREAD";
+        case VTE_DROPPED:   return "DROPPED";
+        case VTE_CNX_OPEN:  return "CNX_OPEN";
+        case VTE_CNX_CLOSE: return "CNX_CLOSE";
+        case VTE_FRAME_IN:  return "FRAME_IN";
+        case VTE_FRAME_OUT: return "FRAME_OUT";
+        case VTE_MSG_IN:    return "MSG_IN";
+        case VTE_MSG_OUT:   return "MSG_OUT";
+        default:            return NULL;
+    }
+}
+
+// Orders events by time, then thread. Each ring is written in order, but rings
+// are interleaved in the file.
+static int tracer_event_cmp(const void* a, const void* b)
+{
+    const vws_tev* x = (const vws_tev*)a;
+    const vws_tev* y = (const vws_tev*)b;
+
+    if (x->time != y->time)
+    {
+        return (x->time < y->time) ? -1 : 1;
+    }
+
+    if (x->thread != y->thread)
+    {
+        return (x->thread < y->thread) ? -1 : 1;
+    }
+
+    return 0;
+}
+
+ssize_t vws_tracer_decode(FILE* in, FILE* out)
+{
+    tracer_header header;
+
+    if ( (fread(&header, sizeof(header), 1, in) != 1)                 ||
+         (memcmp(header.magic, TRACER_MAGIC, sizeof(header.magic)) != 0) ||
+         (header.version != TRACER_VERSION)                            ||
+         (header.size != sizeof(vws_tev)) )
+    {
+        vws.error(VE_RT, "not a trace file");
+        return -1;
+    }
+
+    size_t allocated = 1024;
+    size_t n         = 0;
+    vws_tev* events  = (vws_tev*)vws.malloc(allocated * sizeof(vws_tev));
+
+    while (fread(&events[n], sizeof(vws_tev), 1, in) == 1)
+    {
+        if (++n == allocated)
+        {
+            allocated *= 2;
+            events = (vws_tev*)vws.realloc(events, allocated * sizeof(vws_tev));
+        }
+    }
+
+    qsort(events, n, sizeof(vws_tev), tracer_event_cmp);
+
+    for (size_t i = 0; i < n; i++)
+    {
+        vws_tev* e   = &events[i];
+        cstr name    = tracer_event_name(e->id);
+        double time  = (e->time - events[0].time) / 1000000.0;
+
+        fprintf(out, "%12.6f %4u ", time, e->thread);
+
+        if (name != NULL)
+        {
+            fprintf(out, "%-10s", name);
+        }
+        else if (e->id >= VTE_USER)
+        {
+            fprintf(out, "USER+%-5u", e->id - VTE_USER);
+        }
+        else
+        {
+            fprintf(out, "%-10u", e->id);
+        }
+
+        fprintf( out, " %lu %lu %lu\n",
+                 (unsigned long)e->arg[0],
+                 (unsigned long)e->arg[1],
+                 (unsigned long)e->arg[2] );
+    }
+
+    vws.free(events);
+
+    return (ssize_t)n;
+}
+
 //------------------------------------------------------------------------------
 // Utilities
 //------------------------------------------------------------------------------
@@ -954,6 +1540,30 @@ void vws_msleep(unsigned int ms)
 #endif
 }
 
+uint64_t vws_clock_usec()
+{
+#if defined(__windows__) || defined(_WIN64)
+
+    LARGE_INTEGER count, frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+
+    // Split so that count * 1000000 cannot overflow after days of uptime
+    uint64_t c = (uint64_t)count.QuadPart;
+    uint64_t f = (uint64_t)frequency.QuadPart;
+
+    return (c / f) * 1000000 + (c % f) * 1000000 / f;
+
+#else
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+#endif
+}
+
 uint8_t vws_is_flag(const uint64_t* flags, uint64_t flag)
 {
     return (*flags & flag) == flag;
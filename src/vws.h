@@ -3,6 +3,7 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #include <openssl/ssl.h>
 
@@ -342,6 +343,17 @@ void vws_buffer_printf(vws_buffer* buffer, cstr format, ...);
  */
 void vws_buffer_append(vws_buffer* buffer, ucstr data, size_t size);
 
+/**
+ * @brief Ensures a vrtql buffer has room for at least size more bytes, so they
+ * can be written directly after its data (e.g. by recv()). The caller adds what
+ * it writes to buffer->size.
+ *
+ * @param buffer The buffer
+ * @param size The number of free bytes required
+ * @return Pointer to the free space (buffer->data + buffer->size)
+ */
+unsigned char* vws_buffer_reserve(vws_buffer* buffer, size_t size);
+
 /**
  * @brief Drains a vrtql buffer by a given size.
  *
@@ -553,6 +565,195 @@ vws_url vws_url_new();
  */
 void vws_url_free(vws_url parts);
 
+//------------------------------------------------------------------------------
+// Histogram
+//------------------------------------------------------------------------------
+
+/** Linear sub-buckets per power of two, as bits. 4 bits gives 16 sub-buckets
+ *  per octave, which bounds the relative error of any recorded value to 1/16
+ *  (about 6%). */
+#define VWS_HIST_SUB_BITS 4
+
+/** Largest recordable value, as bits. Larger values are clamped. In
+ *  microseconds, 36 bits is about 19 hours. */
+#define VWS_HIST_MAX_BITS 36
+
+/** Total number of buckets */
+#define VWS_HIST_BUCKETS \
+    ((VWS_HIST_MAX_BITS - VWS_HIST_SUB_BITS + 1) << VWS_HIST_SUB_BITS)
+
+/**
+ * @brief A log-linear (HDR-style) histogram of unsigned integer values, such as
+ * latencies in microseconds. Recording is O(1) and allocation free. Histograms
+ * are not synchronized: use one per thread and merge them for reporting.
+ */
+typedef struct
+{
+    /**< Number of values recorded */
+    uint64_t count;
+
+    /**< Sum of values recorded */
+    uint64_t sum;
+
+    /**< Smallest value recorded */
+    uint64_t min;
+
+    /**< Largest value recorded */
+    uint64_t max;
+
+    /**< Value counts by bucket */
+    uint64_t buckets[VWS_HIST_BUCKETS];
+
+} vws_hist;
+
+/**
+ * @brief Allocates a new, empty histogram.
+ *
+ * @return A new histogram
+ */
+vws_hist* vws_hist_new();
+
+/**
+ * @brief Frees a histogram.
+ *
+ * @param h The histogram
+ */
+void vws_hist_free(vws_hist* h);
+
+/**
+ * @brief Resets a histogram to empty.
+ *
+ * @param h The histogram
+ */
+void vws_hist_clear(vws_hist* h);
+
+/**
+ * @brief Records a value.
+ *
+ * @param h The histogram
+ * @param value The value to record
+ */
+void vws_hist_add(vws_hist* h, uint64_t value);
+
+/**
+ * @brief Adds all values recorded in one histogram to another.
+ *
+ * @param h The histogram to add to
+ * @param from The histogram to add
+ */
+void vws_hist_merge(vws_hist* h, const vws_hist* from);
+
+/**
+ * @brief Returns the value at the given percentile. The result is the upper
+ * bound of the bucket containing the percentile, capped at the maximum value
+ * recorded.
+ *
+ * @param h The histogram
+ * @param p The percentile (0-100)
+ * @return The value, or 0 if the histogram is empty
+ */
+uint64_t vws_hist_percentile(const vws_hist* h, double p);
+
+/**
+ * @brief Returns the mean of values recorded.
+ *
+ * @param h The histogram
+ * @return The mean, or 0 if the histogram is empty
+ */
+double vws_hist_mean(const vws_hist* h);
+
+//------------------------------------------------------------------------------
+// Trace Ring
+//------------------------------------------------------------------------------
+
+/**
+ * @brief Trace event identifiers. Applications may define their own starting
+ * at VTE_USER. The connection argument (cnx) is the socket descriptor for
+ * clients and the connection ID key for servers.
+ */
+typedef enum
+{
+    VTE_NONE      = 0,    /**< Unused                                  */
+    VTE_THREAD    = 1,    /**< Thread registered (a: OS thread id)     */
+    VTE_DROPPED   = 2,    /**< Ring overflow (a: events dropped)       */
+    VTE_CNX_OPEN  = 10,   /**< Connection opened (a: cnx)              */
+    VTE_CNX_CLOSE = 11,   /**< Connection closed (a: cnx)              */
+    VTE_FRAME_IN  = 20,   /**< Frame received (a: cnx, b: op, c: size) */
+    VTE_FRAME_OUT = 21,   /**< Frame sent (a: cnx, b: op, c: size)     */
+    VTE_MSG_IN    = 30,   /**< Message received (a: cnx, b: size)      */
+    VTE_MSG_OUT   = 31,   /**< Message sent (a: cnx, b: size)          */
+    VTE_USER      = 1000  /**< First application-defined event         */
+} vws_tev_t;
+
+/**
+ * @brief A binary trace event. This is also the on-disk record format, in host
+ * byte order.
+ */
+typedef struct
+{
+    /**< Time of event (vws_clock_usec()) */
+    uint64_t time;
+
+    /**< Trace thread number, assigned on the first event in each thread */
+    uint32_t thread;
+
+    /**< Event identifier (vws_tev_t or application-defined) */
+    uint32_t id;
+
+    /**< Event arguments */
+    uint64_t arg[3];
+
+} vws_tev;
+
+/**
+ * @brief Starts binary event tracing to a file. Each thread records events into
+ * its own lock-free ring buffer, allocated on its first event. A background
+ * thread drains the rings to the file. If a ring fills before it is drained,
+ * events are dropped and the drop count is recorded in a VTE_DROPPED event.
+ *
+ * This is independent of vws.tracelevel and is cheap enough to leave on under
+ * load. Use vws_tracer_decode() to render the file as text.
+ *
+ * @param path The trace file to write
+ * @param ring_size Events per thread ring, rounded up to a power of two. Zero
+ *        uses the default (8192).
+ * @param interval Flush interval in milliseconds. Zero uses the default (100).
+ * @return Returns true on success, false otherwise
+ */
+bool vws_tracer_start(cstr path, size_t ring_size, uint32_t interval);
+
+/**
+ * @brief Stops tracing, flushing all pending events and closing the file.
+ */
+void vws_tracer_stop();
+
+/**
+ * @brief Returns true if the tracer is running.
+ */
+bool vws_tracer_active();
+
+/**
+ * @brief Records a trace event in the calling thread's ring. Does nothing if
+ * the tracer is not running. Never blocks or allocates, except on the first
+ * event in a thread.
+ *
+ * @param id The event identifier
+ * @param a First argument
+ * @param b Second argument
+ * @param c Third argument
+ */
+void vws_tev_emit(uint32_t id, uint64_t a, uint64_t b, uint64_t c);
+
+/**
+ * @brief Decodes a binary trace file to text, one event per line:
+ * seconds since the first event, thread, event name and arguments.
+ *
+ * @param in The trace file
+ * @param out The output stream
+ * @return The number of events decoded, or -1 if the input is not a trace file
+ */
+ssize_t vws_tracer_decode(FILE* in, FILE* out);
+
 //------------------------------------------------------------------------------
 // Utilities
 //------------------------------------------------------------------------------
@@ -572,6 +773,17 @@ void vws_url_free(vws_url parts);
  */
 void vws_msleep(unsigned int ms);
 
+/**
+ * @brief Returns a monotonic timestamp in microseconds.
+ *
+ * The value has no relation to wall-clock time and is only meaningful when
+ * compared against other values returned by this function. It is used to
+ * measure intervals and compute deadlines.
+ *
+ * @return Microseconds from an arbitrary fixed point in the past.
+ */
+uint64_t vws_clock_usec();
+
 /**
  * @brief Checks if a specific flag is set.
  *
@@ -128,15 +128,6 @@ typedef enum
  */
 static bool cnx_connect();
 
-/**
- * @brief Generates a new, random WebSocket key for the handshake process.
- *
- * @return A pointer to the generated WebSocket key.
- *
- * @ingroup ConnectionFunctions
- */
-static char* generate_websocket_key();
-
 /**
  * @brief Extracts the WebSocket accept key from a server's handshake response.
  *
@@ -159,6 +150,73 @@ static char* extract_websocket_accept_key(const char* response);
  */
 static int verify_handshake(const char* key, const char* response);
 
+/**
+ * @brief SHA-1 state for the handshake accept key. Lives on the stack.
+ */
+typedef struct
+{
+    /**< Intermediate hash */
+    uint32_t h[5];
+
+    /**< Total bytes hashed */
+    uint64_t size;
+
+    /**< Partial block */
+    unsigned char block[64];
+
+} ws_sha1_ctx;
+
+/**
+ * @brief Initializes a SHA-1 context.
+ *
+ * @param ctx The context
+ *
+ * @ingroup ConnectionFunctions
+ */
+static void ws_sha1_init(ws_sha1_ctx* ctx);
+
+/**
+ * @brief Adds data to a SHA-1 context.
+ *
+ * @param ctx The context
+ * @param data The data
+ * @param size The size of data in bytes
+ *
+ * @ingroup ConnectionFunctions
+ */
+static void ws_sha1_update(ws_sha1_ctx* ctx, ucstr data, size_t size);
+
+/**
+ * @brief Completes a SHA-1 hash.
+ *
+ * @param ctx The context
+ * @param digest Receives the 20 byte digest
+ *
+ * @ingroup ConnectionFunctions
+ */
+static void ws_sha1_final(ws_sha1_ctx* ctx, unsigned char* digest);
+
+/**
+ * @brief Hashes one 64 byte block into the intermediate hash.
+ *
+ * @param h The intermediate hash
+ * @param block The block
+ *
+ * @ingroup ConnectionFunctions
+ */
+static void ws_sha1_block(uint32_t* h, ucstr block);
+
+/**
+ * @brief Base64-encodes data into a caller buffer.
+ *
+ * @param data The data
+ * @param size The size of data in bytes
+ * @param out Receives 4 * ((size + 2) / 3) characters plus a NUL
+ *
+ * @ingroup ConnectionFunctions
+ */
+static void ws_base64_encode(ucstr data, size_t size, char* out);
+
 
 
 
@@ -232,6 +290,15 @@ static void process_frame(vws_cnx* c, vws_frame* frame);
  */
 static bool has_complete_message(vws_cnx* c);
 
+/**
+ * @brief Allocates the connection's receive queues if not yet allocated.
+ *
+ * @param c The vws_cnx representing the WebSocket connection.
+ *
+ * @ingroup MessageFunctions
+ */
+static void cnx_queue_init(vws_cnx* c);
+
 
 
 
@@ -301,12 +368,13 @@ vws_cnx* vws_cnx_new()
     c->base.hs    = socket_handshake;
     c->flags      = CNX_CLOSED;
     c->url        = NULL;
-    c->key        = generate_websocket_key();
+    c->key        = NULL;
     c->process    = process_frame;
     c->disconnect = NULL;
     c->data       = NULL;
 
-    sc_queue_init(&c->queue);
+    // The receive queues are allocated when the first frame arrives
+    c->partial = 0;
 
     return c;
 }
@@ -329,6 +397,7 @@ void vws_cnx_free(vws_cnx* c)
 
     // Free receive queue
     sc_queue_term(&c->queue);
+    sc_queue_term(&c->sizes);
 
     // Free URL
     if (c->url != NULL)
@@ -377,7 +446,7 @@ bool vws_reconnect(vws_cnx* c)
 
     if (c->url != NULL)
     {
-        cnx_connect(c);
+        return cnx_connect(c);
     }
 
     return false;
@@ -397,6 +466,12 @@ bool socket_handshake(vws_socket* s)
 {
     vws_cnx* c = (vws_cnx*)s;
 
+    // Only client connections need a key, so it is generated on first use
+    if (c->key == NULL)
+    {
+        c->key = vws_generate_key();
+    }
+
     // Send the WebSocket handshake request
     const char* rt =
         "GET %s HTTP/1.1\r\n"
@@ -611,6 +686,8 @@ ssize_t vws_frame_send(vws_cnx* c, vws_frame* frame)
 {
     if (vws_cnx_is_connected(c) == false)
     {
+        vws_frame_free(frame);
+        vws.error(VE_SOCKET, "Not connected");
         return -1;
     }
 
@@ -621,7 +698,10 @@ ssize_t vws_frame_send(vws_cnx* c, vws_frame* frame)
         frame->mask = 0;
     }
 
-    vws_buffer* binary = vws_serialize(frame);
+    unsigned char opcode = frame->opcode;
+    vws_buffer* binary   = vws_serialize(frame);
+
+    vws_tev_emit(VTE_FRAME_OUT, c->base.sockfd, opcode, binary->size);
 
     if (vws.tracelevel >= VT_PROTOCOL)
     {
@@ -760,7 +840,20 @@ vws_frame* vws_frame_recv(vws_cnx* c)
     {
         if (sc_queue_size(&c->queue) > 0)
         {
-            return sc_queue_del_last(&c->queue);
+            vws_frame* f = sc_queue_del_last(&c->queue);
+
+            // Keep message tracking in step. Sizes only presize reassembly, so
+            // a fragment taken from a complete message needs no adjustment.
+            if (f->fin == 1)
+            {
+                sc_queue_del_last(&c->sizes);
+            }
+            else if (sc_queue_size(&c->sizes) == 0)
+            {
+                c->partial -= f->size;
+            }
+
+            return f;
         }
 
         if (socket_wait_for_frame(c) <= 0)
@@ -1024,7 +1117,7 @@ void process_frame(vws_cnx* c, vws_frame* f)
         case CONTINUATION_FRAME:
         {
             // Add to queue
-            sc_queue_add_first(&c->queue, f);
+            vws_cnx_frame_push(c, f);
 
             break;
         }
@@ -1063,7 +1156,7 @@ void process_frame(vws_cnx* c, vws_frame* f)
     vws.success();
 }
 
-char* generate_websocket_key()
+char* vws_generate_key()
 {
     // Generate a random 16-byte value
     unsigned char random_bytes[16];
@@ -1085,36 +1178,218 @@ char* generate_websocket_key()
 
 cstr vws_accept_key(cstr key)
 {
-    // Concatenate the key and WebSocket GUID
-    const char* websocket_guid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
-    size_t key_length          = strlen(key);
-    size_t guid_length         = strlen(websocket_guid);
-    size_t input_length        = key_length + guid_length;
-    char* input                = (char*)vws.malloc(input_length + 1);
+    char* encoded_hash = (char*)vws.malloc(VWS_ACCEPT_KEY_SIZE + 1);
+    vws_accept_key_r(key, encoded_hash);
 
-    strncpy(input, key, key_length);
-    strncpy(input + key_length, websocket_guid, guid_length);
-    input[input_length] = '\0';
+    return encoded_hash;
+}
 
-    // Compute the SHA-1 hash of the concatenated value
-    unsigned char hash[SHA_DIGEST_LENGTH];
-    SHA1((const unsigned char*)input, input_length, hash);
+void vws_accept_key_r(cstr key, char* out)
+{
+    static const char guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+    // SHA-1 of the key followed by the WebSocket GUID
+    unsigned char hash[20];
+    ws_sha1_ctx ctx;
+    ws_sha1_init(&ctx);
+    ws_sha1_update(&ctx, (ucstr)key, strlen(key));
+    ws_sha1_update(&ctx, (ucstr)guid, sizeof(guid) - 1);
+    ws_sha1_final(&ctx, hash);
 
     // Base64-encode the hash
-    char* encoded_hash = vws_base64_encode(hash, sizeof(hash));
+    ws_base64_encode(hash, sizeof(hash), out);
+}
 
-    vws.free(input);
+int verify_handshake(const char* key, const char* response)
+{
+    char hash[VWS_ACCEPT_KEY_SIZE + 1];
+    vws_accept_key_r(key, hash);
 
-    return encoded_hash;
+    return strcmp(hash, response) == 0;
 }
 
-int verify_handshake(const char* key, const char* response)
+//------------------------------------------------------------------------------
+// SHA-1 and base64
+//
+// The handshake needs SHA-1 and base64 of a few dozen bytes. OpenSSL's SHA1()
+// and BIO based base64 allocate on every call, which adds up in reconnect
+// storms. These run on the stack.
+//------------------------------------------------------------------------------
+
+#define WS_ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+void ws_sha1_init(ws_sha1_ctx* ctx)
+{
+    ctx->h[0] = 0x67452301;
+    ctx->h[1] = 0xEFCDAB89;
+    ctx->h[2] = 0x98BADCFE;
+    ctx->h[3] = 0x10325476;
+    ctx->h[4] = 0xC3D2E1F0;
+    ctx->size = 0;
+}
+
+void ws_sha1_update(ws_sha1_ctx* ctx, ucstr data, size_t size)
+{
+    size_t used  = ctx->size % 64;
+    ctx->size   += size;
+
+    // Fill a partial block first
+    if (used > 0)
+    {
+        size_t n = 64 - used;
+
+        if (size < n)
+        {
+            memcpy(ctx->block + used, data, size);
+            return;
+        }
+
+        memcpy(ctx->block + used, data, n);
+        ws_sha1_block(ctx->h, ctx->block);
+        data += n;
+        size -= n;
+    }
+
+    while (size >= 64)
+    {
+        ws_sha1_block(ctx->h, data);
+        data += 64;
+        size -= 64;
+    }
+
+    memcpy(ctx->block, data, size);
+}
+
+void ws_sha1_final(ws_sha1_ctx* ctx, unsigned char* digest)
 {
-    char* hash = vws_accept_key(key);
-    int result = strcmp(hash, response);
-    vws.free(hash);
+    uint64_t bits = ctx->size * 8;
+    size_t used   = ctx->size % 64;
+
+    // Pad with 0x80, zeros and the length in bits, big-endian
+    ctx->block[used++] = 0x80;
+
+    if (used > 56)
+    {
+        memset(ctx->block + used, 0, 64 - used);
+        ws_sha1_block(ctx->h, ctx->block);
+        used = 0;
+    }
+
+    memset(ctx->block + used, 0, 56 - used);
+
+    for (int i = 0; i < 8; i++)
+    {
+        ctx->block[63 - i] = (unsigned char)(bits >> (i * 8));
+    }
+
+    ws_sha1_block(ctx->h, ctx->block);
+
+    for (int i = 0; i < 5; i++)
+    {
+        digest[i * 4]     = (unsigned char)(ctx->h[i] >> 24);
+        digest[i * 4 + 1] = (unsigned char)(ctx->h[i] >> 16);
+        digest[i * 4 + 2] = (unsigned char)(ctx->h[i] >> 8);
+        digest[i * 4 + 3] = (unsigned char)(ctx->h[i]);
+    }
+}
+
+void ws_sha1_block(uint32_t* h, ucstr block)
+{
+    uint32_t w[80];
+
+    for (int i = 0; i < 16; i++)
+    {
+        w[i] = ((uint32_t)block[i * 4] << 24)     |
+               ((uint32_t)block[i * 4 + 1] << 16) |
+               ((uint32_t)block[i * 4 + 2] << 8)  |
+               ((uint32_t)block[i * 4 + 3]);
+    }
+
+    for (int i = 16; i < 80; i++)
+    {
+        w[i] = WS_ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+
+    uint32_t a = h[0];
+    uint32_t b = h[1];
+    uint32_t c = h[2];
+    uint32_t d = h[3];
+    uint32_t e = h[4];
 
-    return result == 0;
+    for (int i = 0; i < 80; i++)
+    {
+        uint32_t f;
+        uint32_t k;
+
+        if (i < 20)
+        {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        }
+        else if (i < 40)
+        {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        }
+        else if (i < 60)
+        {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        }
+        else
+        {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+
+        uint32_t t = WS_ROL(a, 5) + f + e + k + w[i];
+        e          = d;
+        d          = c;
+        c          = WS_ROL(b, 30);
+        b          = a;
+        a          = t;
+    }
+
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+}
+
+void ws_base64_encode(ucstr data, size_t size, char* out)
+{
+    static const char table[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    size_t i = 0;
+
+    for (; i + 2 < size; i += 3)
+    {
+        uint32_t v = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
+
+        *out++ = table[(v >> 18) & 0x3F];
+        *out++ = table[(v >> 12) & 0x3F];
+        *out++ = table[(v >> 6) & 0x3F];
+        *out++ = table[v & 0x3F];
+    }
+
+    if (i < size)
+    {
+        uint32_t v = data[i] << 16;
+
+        if (i + 1 < size)
+        {
+            v |= data[i + 1] << 8;
+        }
+
+        *out++ = table[(v >> 18) & 0x3F];
+        *out++ = table[(v >> 12) & 0x3F];
+        *out++ = (i + 1 < size) ? table[(v >> 6) & 0x3F] : '=';
+        *out++ = '=';
+    }
+
+    *out = '\0';
 }
 
 ssize_t socket_wait_for_frame(vws_cnx* c)
@@ -1201,6 +1476,12 @@ ssize_t vws_cnx_ingress(vws_cnx* c)
         // Update
         total_consumed += consumed;
 
+        // Server connections trace frames with their connection ID
+        if (vws_is_flag(&c->flags, CNX_SERVER) == false)
+        {
+            vws_tev_emit(VTE_FRAME_IN, c->base.sockfd, frame->opcode, consumed);
+        }
+
         // We have a frame. Process it.
         c->process(c, frame);
 
@@ -1244,22 +1525,33 @@ vws_msg* vws_msg_pop(vws_cnx* c)
     }
 
     // Create new message
-    vws_msg* m = vws_msg_new();
+    vws_msg* m   = vws_msg_new();
+    size_t size  = (size_t)sc_queue_del_last(&c->sizes);
+    vws_frame* f = sc_queue_del_last(&c->queue);
+    m->opcode    = f->opcode;
 
-    // Set to sentinel value to detect first frame
-    m->opcode = 100;
-
-    do
+    if (f->fin == 1)
     {
-        vws_frame* f = sc_queue_del_last(&c->queue);
+        // Single frame: take over its data rather than copy it
+        m->data->data      = f->data;
+        m->data->size      = f->size;
+        m->data->allocated = f->size;
+        f->data            = NULL;
 
-        // If this is first frame, opcode is sentinel value. We take the opcode
-        // from the first frame only
-        if (m->opcode == 100)
-        {
-            m->opcode = f->opcode;
-        }
+        vws_frame_free(f);
+
+        return m;
+    }
+
+    // Fragmented: reassemble into a buffer sized for the whole message
+    if (size > 0)
+    {
+        m->data->data      = vws.malloc(size);
+        m->data->allocated = size;
+    }
 
+    while (true)
+    {
         // Copy frame data into message buffer
         vws_buffer_append(m->data, f->data, f->size);
 
@@ -1273,24 +1565,60 @@ vws_msg* vws_msg_pop(vws_cnx* c)
         {
             break;
         }
+
+        f = sc_queue_del_last(&c->queue);
     }
-    while (true);
 
     return m;
 }
 
+void vws_cnx_frame_push(vws_cnx* c, vws_frame* f)
+{
+    cnx_queue_init(c);
+    sc_queue_add_first(&c->queue, f);
+    c->partial += f->size;
+
+    if (f->fin == 1)
+    {
+        // Message complete
+        sc_queue_add_first(&c->sizes, c->partial);
+        c->partial = 0;
+    }
+}
+
+void vws_cnx_frame_return(vws_cnx* c, vws_frame* f)
+{
+    cnx_queue_init(c);
+    sc_queue_add_last(&c->queue, f);
+    sc_queue_add_last(&c->sizes, f->size);
+}
+
 bool has_complete_message(vws_cnx* c)
 {
-    vws_frame* f;
-    sc_queue_foreach (&c->queue, f)
+    return (sc_queue_size(&c->sizes) > 0);
+}
+
+void vws_cnx_trim(vws_cnx* c)
+{
+    if (c->base.buffer->size == 0)
     {
-        if (f->fin == 1)
-        {
-            return true;
-        }
+        vws_buffer_clear(c->base.buffer);
     }
 
-    return false;
+    if ((c->queue.elems != NULL) && (sc_queue_size(&c->queue) == 0))
+    {
+        sc_queue_term(&c->queue);
+        sc_queue_term(&c->sizes);
+    }
+}
+
+void cnx_queue_init(vws_cnx* c)
+{
+    if (c->queue.elems == NULL)
+    {
+        sc_queue_init(&c->queue);
+        sc_queue_init(&c->sizes);
+    }
 }
 
 void dump_websocket_header(const ws_header* header)
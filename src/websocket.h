@@ -248,12 +248,19 @@ typedef struct vws_cnx
     /**< The URL of the websocket server. */
     vws_url_data* url;
 
-    /**< The websocket key. */
+    /**< The websocket key. Generated by the first client handshake. */
     char* key;
 
-    /**< Queue for incoming frames. */
+    /**< Queue for incoming frames. Allocated when the first frame arrives. */
     struct sc_queue_ptr queue;
 
+    /**< Payload size of each complete message in queue, oldest last. Its
+     *   size is the number of complete messages. */
+    struct sc_queue_64 sizes;
+
+    /**< Payload bytes queued so far of the message still in progress */
+    size_t partial;
+
     /**< Frame processing callback. */
     vws_process_frame process;
 
@@ -265,6 +272,18 @@ typedef struct vws_cnx
 
 } vws_cnx;
 
+/**
+ * @brief Generates a new, random WebSocket key for the handshake process.
+ *
+ * @return The key, or NULL on error. Caller must free with vws.free().
+ *
+ * @ingroup ConnectionFunctions
+ */
+char* vws_generate_key();
+
+/** Length of a Sec-WebSocket-Accept value, not counting the NUL */
+#define VWS_ACCEPT_KEY_SIZE 28
+
 /**
  * @brief Generates a WebSocket accept key from input.
  *
@@ -276,6 +295,17 @@ typedef struct vws_cnx
  */
 cstr vws_accept_key(cstr key);
 
+/**
+ * @brief Generates a WebSocket accept key from input without allocating.
+ *
+ * @param key The input key
+ * @param out Receives the NUL-terminated accept key. Must hold at least
+ *        VWS_ACCEPT_KEY_SIZE + 1 bytes.
+ *
+ * @ingroup ConnectionFunctions
+ */
+void vws_accept_key_r(cstr key, char* out);
+
 /**
  * @brief Connects to a specified host URL.
  *
@@ -468,6 +498,42 @@ vws_msg* vws_msg_recv(vws_cnx* c);
  */
 vws_msg* vws_msg_pop(vws_cnx* c);
 
+/**
+ * @brief Adds a received data frame (text, binary or continuation) to the back
+ *        of the connection's message queue, keeping track of message
+ *        boundaries. Frame processing callbacks use this in place of adding to
+ *        c->queue directly.
+ *
+ * @param c The vws_cnx representing the WebSocket connection.
+ * @param f The frame. The connection takes ownership.
+ *
+ * @ingroup MessageFunctions
+ */
+void vws_cnx_frame_push(vws_cnx* c, vws_frame* f);
+
+/**
+ * @brief Puts a complete single-frame message back at the front of the
+ *        connection's message queue, so it is the next popped.
+ *
+ * @param c The vws_cnx representing the WebSocket connection.
+ * @param f The frame, which must have fin set. The connection takes ownership.
+ *
+ * @ingroup MessageFunctions
+ */
+void vws_cnx_frame_return(vws_cnx* c, vws_frame* f);
+
+/**
+ * @brief Releases the storage of the connection's receive buffer and frame
+ *        queue when they hold no data. Servers call this once input has been
+ *        processed so idle connections hold no buffer memory. Storage is
+ *        allocated again as data arrives.
+ *
+ * @param c The vws_cnx representing the WebSocket connection.
+ *
+ * @ingroup MessageFunctions
+ */
+void vws_cnx_trim(vws_cnx* c);
+
 /**
  * @brief Receives a websocket frame from the connection. If there are no
  *        frames in queue, it will call socket_wait_for_frame().